@@ -0,0 +1,117 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <arith_uint256.h>
+#include <bench/bench.h>
+#include <chain.h>
+#include <chainparams.h>
+#include <coins.h>
+#include <consensus/validation.h>
+#include <key.h>
+#include <keystore.h>
+#include <pubkey.h>
+#include <scheduler.h>
+#include <script/sigcache.h>
+#include <script/sign.h>
+#include <script/standard.h>
+#include <txmempool.h>
+#include <util.h>
+#include <validation.h>
+#include <validationinterface.h>
+
+#include <thread>
+#include <vector>
+
+//! Transactions accepted per iteration, so accepted tx/s is this many times the iterations per second
+static const int ACCEPT_BATCH_SIZE = 100;
+
+// Accepts batches of signed transactions with two inputs each into an empty
+// mempool, from several threads at once. The transactions spend coins of a
+// chain that is just the genesis block, and the signature cache is as small
+// as it gets, so that every batch verifies all its signatures again.
+static void MempoolAccept(benchmark::State& state, int nThreads)
+{
+    ECCVerifyHandle verifyHandle;
+    SelectParams(CBaseChainParams::REGTEST);
+    gArgs.ForceSetArg("-maxsigcachesize", "0");
+    InitSignatureCache();
+    InitScriptExecutionCache();
+    CScheduler scheduler;
+    GetMainSignals().RegisterBackgroundSignalScheduler(scheduler);
+
+    const CBlock& genesis = Params().GenesisBlock();
+    const uint256 hashGenesis = genesis.GetHash();
+    CBlockIndex tip(genesis);
+    tip.phashBlock = &hashGenesis;
+    CCoinsView coinsDummy;
+
+    CKey key;
+    key.MakeNewKey(true);
+    CBasicKeyStore keystore;
+    keystore.AddKey(key);
+    const CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+    std::vector<CTransactionRef> txs;
+    {
+        LOCK(cs_main);
+        mapBlockIndex.emplace(hashGenesis, &tip);
+        chainActive.SetTip(&tip);
+        pcoinsTip.reset(new CCoinsViewCache(&coinsDummy));
+        pcoinsTip->SetBestBlock(hashGenesis);
+
+        for (int i = 0; i < ACCEPT_BATCH_SIZE; i++) {
+            CMutableTransaction mtx;
+            mtx.vin.resize(2);
+            mtx.vout.resize(1);
+            mtx.vout[0].scriptPubKey = scriptPubKey;
+            mtx.vout[0].nValue = 2 * COIN - 10000;
+            for (unsigned int j = 0; j < mtx.vin.size(); j++) {
+                mtx.vin[j].prevout = COutPoint(ArithToUint256(arith_uint256(2 * i + j + 1)), 0);
+                pcoinsTip->AddCoin(mtx.vin[j].prevout, Coin(CTxOut(COIN, scriptPubKey), 0, false), false);
+            }
+            for (unsigned int j = 0; j < mtx.vin.size(); j++) {
+                assert(SignSignature(keystore, scriptPubKey, mtx, j, COIN, SIGHASH_ALL));
+            }
+            txs.push_back(MakeTransactionRef(std::move(mtx)));
+        }
+    }
+
+    while (state.KeepRunning()) {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < nThreads; t++) {
+            threads.emplace_back([&txs, nThreads, t] {
+                for (size_t i = t; i < txs.size(); i += nThreads) {
+                    CValidationState validationState;
+                    assert(AcceptToMemoryPool(mempool, validationState, txs[i], nullptr /* pfMissingInputs */,
+                                              nullptr /* plTxnReplaced */, false /* bypass_limits */, 0 /* nAbsurdFee */));
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        mempool.clear();
+    }
+
+    GetMainSignals().FlushBackgroundCallbacks();
+    GetMainSignals().UnregisterBackgroundSignalScheduler();
+    LOCK(cs_main);
+    chainActive.SetTip(nullptr);
+    mapBlockIndex.erase(hashGenesis);
+    pcoinsTip.reset();
+    gArgs.ForceSetArg("-maxsigcachesize", std::to_string(DEFAULT_MAX_SIG_CACHE_SIZE));
+}
+
+static void MempoolAcceptOneThread(benchmark::State& state)
+{
+    MempoolAccept(state, 1);
+}
+
+static void MempoolAcceptFourThreads(benchmark::State& state)
+{
+    MempoolAccept(state, 4);
+}
+
+BENCHMARK(MempoolAcceptOneThread, 10);
+BENCHMARK(MempoolAcceptFourThreads, 30);
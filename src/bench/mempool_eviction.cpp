@@ -21,9 +21,8 @@ static void AddTx(const CTransaction& tx, const CAmount& nFee, CTxMemPool& pool)
                                         spendsCoinbase, sigOpCost, lp));
 }
 
-// Right now this is only testing eviction performance in an extremely small
-// mempool. Code needs to be written to generate a much wider variety of
-// unique transactions for a more meaningful performance measurement.
+// Eviction in an extremely small mempool, with a fixed set of seven
+// transactions.
 static void MempoolEviction(benchmark::State& state)
 {
     CMutableTransaction tx1 = CMutableTransaction();
@@ -111,4 +110,50 @@ static void MempoolEviction(benchmark::State& state)
     }
 }
 
+//! Transactions in the mempool of MempoolEvictionLarge
+static const int LARGE_POOL_TX = 5000;
+//! Length of the chains of unconfirmed transactions in it
+static const int LARGE_POOL_CHAIN = 5;
+
+// Fills a mempool with thousands of unique transactions, in chains of
+// children with one or two parents and fees that vary along the chain, and
+// evicts half of it by size.
+static void MempoolEvictionLarge(benchmark::State& state)
+{
+    std::vector<CTransactionRef> txs;
+    std::vector<CAmount> fees;
+    txs.reserve(LARGE_POOL_TX);
+    for (int i = 0; i < LARGE_POOL_TX; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << i;
+        if (i % LARGE_POOL_CHAIN != 0) {
+            tx.vin[0].prevout = COutPoint(txs.back()->GetHash(), 0);
+            if (i % LARGE_POOL_CHAIN == LARGE_POOL_CHAIN - 1) {
+                // The last one of a chain also spends the second output of
+                // its grandparent.
+                tx.vin.emplace_back(COutPoint(txs[i - 2]->GetHash(), 1), CScript() << i);
+            }
+        }
+        tx.vout.resize(2);
+        tx.vout[0].scriptPubKey = CScript() << i << OP_EQUAL;
+        tx.vout[0].nValue = 10 * COIN;
+        tx.vout[1].scriptPubKey = CScript() << i << OP_EQUAL;
+        tx.vout[1].nValue = 10 * COIN;
+        txs.push_back(MakeTransactionRef(std::move(tx)));
+        fees.push_back(1000 + (i * 7919) % 20000);
+    }
+
+    CTxMemPool pool;
+
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < txs.size(); i++) {
+            AddTx(*txs[i], fees[i], pool);
+        }
+        pool.TrimToSize(pool.DynamicMemoryUsage() / 2);
+        pool.clear();
+    }
+}
+
 BENCHMARK(MempoolEviction, 41000);
+BENCHMARK(MempoolEvictionLarge, 20);
@@ -0,0 +1,115 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockcache.h>
+
+#include <chain.h>
+#include <mappedfile.h>
+#include <primitives/block.h>
+#include <streams.h>
+#include <util.h>
+#include <validation.h>
+#include <version.h>
+
+CSerializedBlockCache g_serialized_block_cache(DEFAULT_BLOCK_SERVE_CACHE << 20);
+
+void CSerializedBlockCache::Trim()
+{
+    while (m_bytes > m_max_bytes) {
+        const List::value_type& oldest = m_lru.back();
+        m_bytes -= oldest.second->data.size();
+        m_entries.erase(oldest.first);
+        m_lru.pop_back();
+    }
+}
+
+void CSerializedBlockCache::SetMaxBytes(size_t max_bytes)
+{
+    LOCK(cs);
+    m_max_bytes = max_bytes;
+    Trim();
+}
+
+CSerializedBlockRef CSerializedBlockCache::Get(const uint256& hash, bool witness)
+{
+    LOCK(cs);
+    auto it = m_entries.find(Key(hash, witness));
+    if (it == m_entries.end()) {
+        ++m_misses;
+        return nullptr;
+    }
+    ++m_hits;
+    m_lru.splice(m_lru.begin(), m_lru, it->second);
+    return it->second->second;
+}
+
+void CSerializedBlockCache::Insert(const uint256& hash, bool witness, CSerializedBlockRef block)
+{
+    LOCK(cs);
+    if (block->data.size() > m_max_bytes) {
+        return;
+    }
+    const Key key(hash, witness);
+    if (m_entries.count(key)) {
+        // Another thread read the same block at the same time.
+        return;
+    }
+    m_lru.emplace_front(key, std::move(block));
+    m_entries.emplace(key, m_lru.begin());
+    m_bytes += m_lru.front().second->data.size();
+    Trim();
+}
+
+void CSerializedBlockCache::Clear()
+{
+    LOCK(cs);
+    m_entries.clear();
+    m_lru.clear();
+    m_bytes = 0;
+}
+
+CSerializedBlockCache::Stats CSerializedBlockCache::GetStats() const
+{
+    LOCK(cs);
+    return Stats{m_entries.size(), m_bytes, m_max_bytes, m_hits, m_misses};
+}
+
+CSerializedBlockRef GetSerializedBlock(const uint256& hash, const CDiskBlockPos& pos, bool witness, const Consensus::Params& consensusParams)
+{
+    CSerializedBlockRef block = g_serialized_block_cache.Get(hash, witness);
+    if (block) {
+        return block;
+    }
+
+    std::vector<unsigned char> data;
+    CMappedSpan raw_block;
+    if (witness && ReadRawBlockFromDisk(raw_block, pos, hash)) {
+        // Block files hold the witness serialization already
+        data.assign(raw_block.begin(), raw_block.end());
+    } else {
+        CBlock block_read;
+        if (!ReadBlockFromDisk(block_read, pos, consensusParams)) {
+            return nullptr;
+        }
+        if (block_read.GetHash() != hash) {
+            error("GetSerializedBlock(): block at %s doesn't match %s", pos.ToString(), hash.ToString());
+            return nullptr;
+        }
+        CVectorWriter(SER_NETWORK, PROTOCOL_VERSION | (witness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS), data, 0, block_read);
+    }
+
+    block = std::make_shared<const CSerializedBlock>(std::move(data));
+    g_serialized_block_cache.Insert(hash, witness, block);
+    return block;
+}
+
+CSerializedBlockRef GetSerializedBlock(const CBlockIndex* pindex, bool witness, const Consensus::Params& consensusParams)
+{
+    CDiskBlockPos pos;
+    {
+        LOCK(cs_main);
+        pos = pindex->GetBlockPos();
+    }
+    return GetSerializedBlock(pindex->GetBlockHash(), pos, witness, consensusParams);
+}
@@ -0,0 +1,105 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKCACHE_H
+#define BITCOIN_BLOCKCACHE_H
+
+#include <sync.h>
+#include <uint256.h>
+
+#include <list>
+#include <map>
+#include <memory>
+#include <vector>
+
+class CBlockIndex;
+struct CDiskBlockPos;
+namespace Consensus { struct Params; }
+
+/** Default for -blockservecache, the size in MiB of the cache of serialized blocks */
+static const unsigned int DEFAULT_BLOCK_SERVE_CACHE = 32;
+
+/**
+ * A block serialized for the network, with or without witness data.
+ * Serializes as its bytes, so it can be sent as a message payload as is.
+ */
+class CSerializedBlock
+{
+public:
+    const std::vector<unsigned char> data;
+
+    explicit CSerializedBlock(std::vector<unsigned char> data_) : data(std::move(data_)) {}
+
+    template<typename Stream>
+    void Serialize(Stream& s) const
+    {
+        s.write((const char*)data.data(), data.size());
+    }
+};
+
+typedef std::shared_ptr<const CSerializedBlock> CSerializedBlockRef;
+
+/**
+ * Byte-budgeted LRU cache of serialized blocks, shared between P2P block
+ * serving, getblock and REST. Peers catching up after a network hiccup tend
+ * to all request the same recent blocks; this makes every request after the
+ * first a lookup instead of a disk read and a reserialization.
+ */
+class CSerializedBlockCache
+{
+public:
+    struct Stats
+    {
+        size_t entries;
+        size_t bytes;
+        size_t max_bytes;
+        uint64_t hits;
+        uint64_t misses;
+    };
+
+private:
+    typedef std::pair<uint256, bool> Key;
+    typedef std::list<std::pair<Key, CSerializedBlockRef>> List;
+
+    mutable CCriticalSection cs;
+    size_t m_max_bytes;
+    size_t m_bytes = 0;
+    uint64_t m_hits = 0;
+    uint64_t m_misses = 0;
+    //! Most recently used first
+    List m_lru;
+    std::map<Key, List::iterator> m_entries;
+
+    void Trim();
+
+public:
+    explicit CSerializedBlockCache(size_t max_bytes) : m_max_bytes(max_bytes) {}
+
+    /** Set the budget, evicting blocks if needed. A budget of 0 disables the cache. */
+    void SetMaxBytes(size_t max_bytes);
+
+    /** Look up a block serialized with or without witness data, counting a hit or a miss. */
+    CSerializedBlockRef Get(const uint256& hash, bool witness);
+
+    /** Add a block. Blocks larger than the whole budget are not cached. */
+    void Insert(const uint256& hash, bool witness, CSerializedBlockRef block);
+
+    void Clear();
+
+    Stats GetStats() const;
+};
+
+/** The cache used for serving blocks to peers, getblock and REST */
+extern CSerializedBlockCache g_serialized_block_cache;
+
+/**
+ * Get a block serialized for the network, with or without witness data, from
+ * the cache or else from disk, adding it to the cache. Returns null if the
+ * block cannot be read from disk.
+ */
+CSerializedBlockRef GetSerializedBlock(const CBlockIndex* pindex, bool witness, const Consensus::Params& consensusParams);
+/** GetSerializedBlock for a block position copied under cs_main, checked against the hash of the block */
+CSerializedBlockRef GetSerializedBlock(const uint256& hash, const CDiskBlockPos& pos, bool witness, const Consensus::Params& consensusParams);
+
+#endif // BITCOIN_BLOCKCACHE_H
@@ -8,6 +8,10 @@
 #include <sync.h>
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 #include <boost/thread/condition_variable.hpp>
@@ -16,6 +20,12 @@
 template <typename T>
 class CCheckQueueControl;
 
+/**
+ * Maximum number of threads (including the master) that get a queue of their
+ * own in a CCheckQueue. Further threads only steal work from the others.
+ */
+static const int MAX_CHECKQUEUE_SLOTS = 257;
+
 /** 
  * Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
@@ -25,12 +35,33 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every thread owns a deque of verifications. The master deals the checks
+  * it is given out over the deques of the workers, each worker takes from
+  * the back of its own deque and, once that runs dry, steals from the front
+  * of the others. Every deque has its own lock, so the master and the
+  * workers only contend when they touch the same deque, instead of all of
+  * them serialising on one queue mutex.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
-    //! Mutex to protect the inner state
+    //! A deque of verifications owned by one thread.
+    struct Slot {
+        boost::mutex mutex;
+        std::deque<T> checks;
+        //! Whether a worker thread currently owns this slot.
+        std::atomic<bool> in_use{false};
+    };
+
+    //! Slots of the master (index 0) and the workers. Allocated on first use and only released on destruction.
+    std::unique_ptr<Slot> slots[MAX_CHECKQUEUE_SLOTS];
+
+    //! Number of allocated slots. Slots below this index can be accessed without holding mutex.
+    std::atomic<int> nSlots;
+
+    //! Mutex to protect slot allocation and to pair with the condition variables
     boost::mutex mutex;
 
     //! Worker threads block on this when out of work
@@ -39,88 +70,103 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
-
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
-
-    //! The total number of workers (including the master).
-    int nTotal;
+    //! The number of workers that are idle, or about to become idle.
+    std::atomic<int> nIdle;
 
     //! The temporary evaluation result.
-    bool fAllOk;
+    std::atomic<bool> fAllOk;
+
+    //! Number of verifications waiting in the deques.
+    std::atomic<int64_t> nQueued;
 
     /**
      * Number of verifications that haven't completed yet.
      * This includes elements that are no longer queued, but still in the
      * worker's own batches.
      */
-    unsigned int nTodo;
+    std::atomic<int64_t> nTodo;
 
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
-    /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    //! Slot the next batch added by the master goes to. Only used by the master.
+    int nNextSlot;
+
+    //! Move up to nBatchSize checks, about half of those queued in a slot, into vChecks.
+    unsigned int TakeFrom(Slot& slot, std::vector<T>& vChecks, bool fOwn)
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
-        std::vector<T> vChecks;
-        vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
-        do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if (fMaster && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+        boost::unique_lock<boost::mutex> lock(slot.mutex);
+        if (slot.checks.empty()) return 0;
+        unsigned int nNow = std::max(1U, std::min(nBatchSize, (unsigned int)(slot.checks.size() / 2)));
+        vChecks.resize(nNow);
+        for (unsigned int i = 0; i < nNow; i++) {
+            // The owner takes the most recently added checks and thieves
+            // the oldest ones, so they rarely fight over the same end.
+            T& check = fOwn ? slot.checks.back() : slot.checks.front();
+            vChecks[i].swap(check);
+            if (fOwn) {
+                slot.checks.pop_back();
+            } else {
+                slot.checks.pop_front();
             }
-            // execute work
-            for (T& check : vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
-        } while (true);
+        }
+        nQueued -= nNow;
+        return nNow;
+    }
+
+    /** Take a batch from the deque of slot nOwn, or steal one from another deque. */
+    unsigned int Take(int nOwn, std::vector<T>& vChecks)
+    {
+        if (nQueued <= 0) return 0;
+        int nCount = nSlots.load(std::memory_order_acquire);
+        if (nOwn >= 0) {
+            unsigned int nNow = TakeFrom(*slots[nOwn], vChecks, true);
+            if (nNow) return nNow;
+        }
+        for (int i = 1; i <= nCount; i++) {
+            int nVictim = (std::max(nOwn, 0) + i) % nCount;
+            if (nVictim == nOwn) continue;
+            unsigned int nNow = TakeFrom(*slots[nVictim], vChecks, false);
+            if (nNow) return nNow;
+        }
+        return 0;
+    }
+
+    /** Run a batch of checks, and destroy them before marking them as done. */
+    void Execute(std::vector<T>& vChecks, bool fMaster)
+    {
+        // Check whether we need to do work at all
+        bool fOk = fAllOk;
+        for (T& check : vChecks)
+            if (fOk)
+                fOk = check();
+        if (!fOk)
+            fAllOk = false;
+        int64_t nNow = vChecks.size();
+        vChecks.clear();
+        if (nTodo.fetch_sub(nNow) == nNow && !fMaster) {
+            // We processed the last element; inform the master it can exit and return the result
+            boost::unique_lock<boost::mutex> lock(mutex);
+            condMaster.notify_one();
+        }
+    }
+
+    /** Claim a slot for a worker thread, or return -1 if all slots are taken. */
+    int ClaimSlot()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        int nCount = nSlots.load(std::memory_order_relaxed);
+        for (int i = 1; i < nCount; i++) {
+            if (!slots[i]->in_use) {
+                slots[i]->in_use = true;
+                return i;
+            }
+        }
+        if (nCount == MAX_CHECKQUEUE_SLOTS) return -1;
+        slots[nCount].reset(new Slot());
+        slots[nCount]->in_use = true;
+        nSlots.store(nCount + 1, std::memory_order_release);
+        return nCount;
     }
 
 public:
@@ -128,33 +174,102 @@ public:
     boost::mutex ControlMutex;
 
     //! Create a new check queue
-    explicit CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), nBatchSize(nBatchSizeIn) {}
+    explicit CCheckQueue(unsigned int nBatchSizeIn) : nSlots(1), nIdle(0), fAllOk(true), nQueued(0), nTodo(0), nBatchSize(nBatchSizeIn), nNextSlot(0)
+    {
+        slots[0].reset(new Slot());
+    }
 
     //! Worker thread
     void Thread()
     {
-        Loop();
+        const int nOwn = ClaimSlot();
+        // Release the slot however the thread exits, including by interruption.
+        struct SlotRelease {
+            Slot* slot;
+            ~SlotRelease() { if (slot) slot->in_use = false; }
+        } release{nOwn >= 0 ? slots[nOwn].get() : nullptr};
+
+        std::vector<T> vChecks;
+        vChecks.reserve(nBatchSize);
+        while (true) {
+            if (Take(nOwn, vChecks)) {
+                Execute(vChecks, false);
+                continue;
+            }
+            boost::unique_lock<boost::mutex> lock(mutex);
+            // Announce idleness before checking for work, so that Add either
+            // sees us idle and notifies, or we see its queued checks.
+            nIdle++;
+            try {
+                while (nQueued <= 0)
+                    condWorker.wait(lock); // wait
+            } catch (...) {
+                nIdle--;
+                throw;
+            }
+            nIdle--;
+        }
     }
 
     //! Wait until execution finishes, and return whether all evaluations were successful.
     bool Wait()
     {
-        return Loop(true);
+        std::vector<T> vChecks;
+        vChecks.reserve(nBatchSize);
+        // Help the workers until nothing is left to take, then wait for the
+        // batches they are still working on.
+        while (Take(0, vChecks))
+            Execute(vChecks, true);
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (nTodo != 0)
+                condMaster.wait(lock);
+        }
+        bool fRet = fAllOk;
+        // reset the status for new work later
+        fAllOk = true;
+        return fRet;
     }
 
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        for (T& check : vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
-        }
+        if (vChecks.empty()) return;
         nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            condWorker.notify_one();
-        else if (vChecks.size() > 1)
-            condWorker.notify_all();
+
+        // Deal the checks out over the deques of the active workers, in
+        // chunks so that every worker gets a share of a large batch.
+        int nCount = nSlots.load(std::memory_order_acquire);
+        int nActive = 0;
+        for (int i = 1; i < nCount; i++)
+            if (slots[i]->in_use) nActive++;
+        size_t nChunk = std::max<size_t>(1, std::min<size_t>(nBatchSize, (vChecks.size() + std::max(nActive, 1) - 1) / std::max(nActive, 1)));
+        for (size_t nPos = 0; nPos < vChecks.size(); ) {
+            Slot* slot = slots[0].get();
+            for (int i = 0; nActive && i < nCount; i++) {
+                nNextSlot = nNextSlot % (nCount - 1) + 1;
+                if (slots[nNextSlot]->in_use) {
+                    slot = slots[nNextSlot].get();
+                    break;
+                }
+            }
+            size_t nEnd = std::min(vChecks.size(), nPos + nChunk);
+            boost::unique_lock<boost::mutex> lock(slot->mutex);
+            // Counted under the deque lock, so a thief can never take checks that are not yet counted.
+            nQueued += nEnd - nPos;
+            for (; nPos < nEnd; nPos++) {
+                slot->checks.emplace_back();
+                vChecks[nPos].swap(slot->checks.back());
+            }
+        }
+
+        if (nIdle > 0) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (vChecks.size() == 1)
+                condWorker.notify_one();
+            else
+                condWorker.notify_all();
+        }
     }
 
     ~CCheckQueue()
@@ -174,6 +289,14 @@ private:
     CCheckQueue<T> * const pqueue;
     bool fDone;
 
+    static CCheckQueue<T>* TryControl(CCheckQueue<T>* pqueueIn)
+    {
+        if (pqueueIn == nullptr || !pqueueIn->ControlMutex.try_lock())
+            return nullptr;
+        EnterCritical("pqueue->ControlMutex", __FILE__, __LINE__, (void*)(&pqueueIn->ControlMutex), true);
+        return pqueueIn;
+    }
+
 public:
     CCheckQueueControl() = delete;
     CCheckQueueControl(const CCheckQueueControl&) = delete;
@@ -186,6 +309,13 @@ public:
         }
     }
 
+    //! Take control of the queue only if no one else has it; HasQueue() tells whether that worked.
+    CCheckQueueControl(CCheckQueue<T> * const pqueueIn, std::try_to_lock_t) : pqueue(TryControl(pqueueIn)), fDone(false)
+    {
+    }
+
+    bool HasQueue() const { return pqueue != nullptr; }
+
     bool Wait()
     {
         if (pqueue == nullptr)
@@ -0,0 +1,421 @@
+// Copyright (c) 2010 Satoshi Nakamoto
+// Copyright (c) 2009-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <coinstats.h>
+
+#include <chain.h>
+#include <chainparams.h>
+#include <coins.h>
+#include <hash.h>
+#include <primitives/block.h>
+#include <undo.h>
+#include <util.h>
+#include <validation.h>
+
+#include <map>
+
+#include <boost/thread.hpp>
+
+std::unique_ptr<CCoinStatsIndex> pcoinstatsindex;
+
+static const char DB_BLOCK_STATS = 's';
+static const char DB_BEST_STATS = 'B';
+static const char DB_START_HEIGHT = 'h';
+
+namespace {
+
+/** The running totals of the index, as stored under DB_BEST_STATS */
+struct CBestStats
+{
+    uint256 hashBlock;
+    CUTXOStats stats;
+    MuHash3072 muhash;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(hashBlock);
+        READWRITE(stats);
+        READWRITE(muhash);
+    }
+};
+
+uint64_t GetBogoSize(const CScript& scriptPubKey)
+{
+    return 32 /* txid */ + 4 /* vout index */ + 4 /* height + coinbase */ + 8 /* amount */ +
+           2 /* scriptPubKey len */ + scriptPubKey.size() /* scriptPubKey */;
+}
+
+/** Serialization of a UTXO as a MuHash set element */
+void TxOutSer(CDataStream& ss, const COutPoint& outpoint, const Coin& coin)
+{
+    ss << outpoint;
+    ss << static_cast<uint32_t>(coin.nHeight * 2 + coin.fCoinBase);
+    ss << coin.out;
+}
+
+} // namespace
+
+static void ApplyStats(CCoinsStats &stats, CHashWriter& ss, const uint256& hash, const std::map<uint32_t, Coin>& outputs, MuHash3072* muhash)
+{
+    assert(!outputs.empty());
+    ss << hash;
+    ss << VARINT(outputs.begin()->second.nHeight * 2 + outputs.begin()->second.fCoinBase);
+    stats.nTransactions++;
+    for (const auto output : outputs) {
+        ss << VARINT(output.first + 1);
+        ss << output.second.out.scriptPubKey;
+        ss << VARINT(output.second.out.nValue);
+        stats.nTransactionOutputs++;
+        stats.nTotalAmount += output.second.out.nValue;
+        stats.nBogoSize += GetBogoSize(output.second.out.scriptPubKey);
+        if (muhash) {
+            CDataStream ssElement(SER_DISK, PROTOCOL_VERSION);
+            TxOutSer(ssElement, COutPoint(hash, output.first), output.second);
+            muhash->Insert((const unsigned char*)ssElement.data(), ssElement.size());
+        }
+    }
+    ss << VARINT(0);
+}
+
+//! Calculate statistics about the unspent transaction output set
+bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats, MuHash3072* muhash)
+{
+    std::unique_ptr<CCoinsViewCursor> pcursor(view->Cursor());
+    assert(pcursor);
+
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    stats.hashBlock = pcursor->GetBestBlock();
+    {
+        LOCK(cs_main);
+        stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
+    }
+    ss << stats.hashBlock;
+    uint256 prevkey;
+    std::map<uint32_t, Coin> outputs;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        COutPoint key;
+        Coin coin;
+        if (pcursor->GetKey(key) && pcursor->GetValue(coin)) {
+            if (!outputs.empty() && key.hash != prevkey) {
+                ApplyStats(stats, ss, prevkey, outputs, muhash);
+                outputs.clear();
+            }
+            prevkey = key.hash;
+            outputs[key.n] = std::move(coin);
+        } else {
+            return error("%s: unable to read value", __func__);
+        }
+        pcursor->Next();
+    }
+    if (!outputs.empty()) {
+        ApplyStats(stats, ss, prevkey, outputs, muhash);
+    }
+    stats.hashSerialized = ss.GetHash();
+    if (muhash) {
+        muhash->Finalize(stats.hashMuHash);
+    }
+    stats.nDiskSize = view->EstimateSize();
+    return true;
+}
+
+void CUTXOStatsDelta::AddCoin(const COutPoint& outpoint, const Coin& coin)
+{
+    CDataStream ss(SER_DISK, PROTOCOL_VERSION);
+    TxOutSer(ss, outpoint, coin);
+    muhash.Insert((const unsigned char*)ss.data(), ss.size());
+    nTransactionOutputs++;
+    nBogoSize += GetBogoSize(coin.out.scriptPubKey);
+    nTotalAmount += coin.out.nValue;
+}
+
+void CUTXOStatsDelta::SpendCoin(const COutPoint& outpoint, const Coin& coin)
+{
+    CDataStream ss(SER_DISK, PROTOCOL_VERSION);
+    TxOutSer(ss, outpoint, coin);
+    muhash.Remove((const unsigned char*)ss.data(), ss.size());
+    nTransactionOutputs--;
+    nBogoSize -= GetBogoSize(coin.out.scriptPubKey);
+    nTotalAmount -= coin.out.nValue;
+}
+
+bool ComputeUTXOStatsDelta(const CBlock& block, const CBlockUndo& blockundo, int nHeight, CUTXOStatsDelta& delta)
+{
+    if (blockundo.vtxundo.size() + 1 != block.vtx.size())
+        return false;
+    for (size_t i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = *block.vtx[i];
+        // Mirror AddCoins(): provably unspendable outputs never enter the UTXO set
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable()) {
+                delta.AddCoin(COutPoint(tx.GetHash(), o), Coin(tx.vout[o], nHeight, tx.IsCoinBase()));
+            }
+        }
+        if (i > 0) {
+            const CTxUndo& txundo = blockundo.vtxundo[i - 1];
+            if (txundo.vprevout.size() != tx.vin.size())
+                return false;
+            for (size_t j = 0; j < tx.vin.size(); j++) {
+                delta.SpendCoin(tx.vin[j].prevout, txundo.vprevout[j]);
+            }
+        }
+    }
+    return true;
+}
+
+CCoinStatsIndex::CCoinStatsIndex(size_t nCacheSize, bool fMemory, bool fWipe) :
+    db(GetDataDir() / "indexes" / "coinstats", nCacheSize, fMemory, fWipe), fInSync(false), nStartHeight(0)
+{
+}
+
+void CCoinStatsIndex::Apply(const CBlockIndex* pindex, const CUTXOStatsDelta& delta)
+{
+    stats.nHeight = pindex->nHeight;
+    stats.nTransactionOutputs += delta.nTransactionOutputs;
+    stats.nBogoSize += delta.nBogoSize;
+    stats.nTotalAmount += delta.nTotalAmount;
+    muhash *= delta.muhash;
+    hashBest = pindex->GetBlockHash();
+
+    PendingStats pending;
+    pending.hashBlock = hashBest;
+    pending.stats = stats;
+    pending.muhash = muhash;
+    vPending.push_back(std::move(pending));
+}
+
+void CCoinStatsIndex::Revert(const CBlockIndex* pindex, const CUTXOStatsDelta& delta)
+{
+    stats.nHeight = pindex->nHeight - 1;
+    stats.nTransactionOutputs -= delta.nTransactionOutputs;
+    stats.nBogoSize -= delta.nBogoSize;
+    stats.nTotalAmount -= delta.nTotalAmount;
+    muhash /= delta.muhash;
+    hashBest = pindex->pprev ? pindex->pprev->GetBlockHash() : uint256();
+}
+
+bool CCoinStatsIndex::BuildFromGenesis(const CChainParams& chainparams)
+{
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    LogPrintf("Building coin stats index from the undo data of blocks up to height %d, this may take a while...\n", pindexTip->nHeight);
+    // The outputs of the genesis block are not part of the UTXO set
+    Apply(chainActive.Genesis(), CUTXOStatsDelta());
+    for (int nHeight = 1; nHeight <= pindexTip->nHeight; nHeight++) {
+        boost::this_thread::interruption_point();
+        const CBlockIndex* pindex = chainActive[nHeight];
+        CBlock block;
+        CBlockUndo blockundo;
+        CUTXOStatsDelta delta;
+        if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()) || !UndoReadFromDisk(blockundo, pindex) ||
+            !ComputeUTXOStatsDelta(block, blockundo, pindex->nHeight, delta)) {
+            LogPrintf("%s: unable to read block %s\n", __func__, pindex->GetBlockHash().ToString());
+            return false;
+        }
+        Apply(pindex, delta);
+        if (vPending.size() >= COINSTATS_MAX_PENDING && !Flush()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CCoinStatsIndex::Seed(const CChainParams& chainparams, CCoinsView* view)
+{
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    vPending.clear();
+    stats = CUTXOStats();
+    muhash = MuHash3072();
+    hashBest.SetNull();
+    nStartHeight = 0;
+    if (pindexTip == nullptr) {
+        fInSync = true;
+        return Flush();
+    }
+
+    if (!fHavePruned) {
+        if (BuildFromGenesis(chainparams)) {
+            fInSync = true;
+            return Flush();
+        }
+        vPending.clear();
+        stats = CUTXOStats();
+        muhash = MuHash3072();
+        hashBest.SetNull();
+    }
+
+    LogPrintf("Building coin stats index from the UTXO set at height %d, this may take a while...\n", pindexTip->nHeight);
+    // The scan needs a cursor over the database, so write out everything in the caches first
+    FlushStateToDisk();
+    CCoinsStats scan;
+    if (!GetUTXOStats(view, scan, &muhash)) {
+        return error("%s: unable to read UTXO set", __func__);
+    }
+    if (scan.hashBlock != pindexTip->GetBlockHash()) {
+        return error("%s: UTXO set is at %s, expected %s", __func__, scan.hashBlock.ToString(), pindexTip->GetBlockHash().ToString());
+    }
+    stats.nHeight = pindexTip->nHeight;
+    stats.nTransactionOutputs = scan.nTransactionOutputs;
+    stats.nBogoSize = scan.nBogoSize;
+    stats.nTotalAmount = scan.nTotalAmount;
+    hashBest = pindexTip->GetBlockHash();
+    nStartHeight = pindexTip->nHeight;
+
+    PendingStats pending;
+    pending.hashBlock = hashBest;
+    pending.stats = stats;
+    pending.muhash = muhash;
+    vPending.push_back(std::move(pending));
+    fInSync = true;
+    LogPrintf("Coin stats index available from height %d\n", pindexTip->nHeight);
+    return Flush();
+}
+
+bool CCoinStatsIndex::Init(const CChainParams& chainparams, CCoinsView* view)
+{
+    AssertLockHeld(cs_main);
+    vPending.clear();
+    fInSync = false;
+
+    CBestStats best;
+    if (!db.Read(DB_BEST_STATS, best) || !db.Read(DB_START_HEIGHT, nStartHeight)) {
+        return Seed(chainparams, view);
+    }
+    hashBest = best.hashBlock;
+    stats = best.stats;
+    muhash = best.muhash;
+
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    if (pindexTip == nullptr || hashBest.IsNull()) {
+        return Seed(chainparams, view);
+    }
+    if (hashBest == pindexTip->GetBlockHash()) {
+        fInSync = true;
+        return true;
+    }
+    BlockMap::const_iterator it = mapBlockIndex.find(hashBest);
+    if (it == mapBlockIndex.end()) {
+        LogPrintf("%s: coin stats index is at unknown block %s\n", __func__, hashBest.ToString());
+        return Seed(chainparams, view);
+    }
+
+    // Bring the totals in line with the chainstate, e.g. after an unclean
+    // shutdown or after running without -coinstatsindex for a while.
+    const CBlockIndex* pindex = it->second;
+    const CBlockIndex* pindexFork = chainActive.FindFork(pindex);
+    if (pindexFork == nullptr || pindexFork->nHeight < nStartHeight) {
+        return Seed(chainparams, view);
+    }
+    LogPrintf("Catching up coin stats index from height %d to %d\n", pindex->nHeight, pindexTip->nHeight);
+    while (pindex != pindexFork) {
+        CBlock block;
+        CBlockUndo blockundo;
+        CUTXOStatsDelta delta;
+        if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()) || !UndoReadFromDisk(blockundo, pindex) ||
+            !ComputeUTXOStatsDelta(block, blockundo, pindex->nHeight, delta)) {
+            LogPrintf("%s: unable to read block %s to roll back\n", __func__, pindex->GetBlockHash().ToString());
+            return Seed(chainparams, view);
+        }
+        Revert(pindex, delta);
+        pindex = pindex->pprev;
+    }
+    for (int nHeight = pindexFork->nHeight + 1; nHeight <= pindexTip->nHeight; nHeight++) {
+        boost::this_thread::interruption_point();
+        pindex = chainActive[nHeight];
+        CBlock block;
+        CBlockUndo blockundo;
+        CUTXOStatsDelta delta;
+        if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()) || !UndoReadFromDisk(blockundo, pindex) ||
+            !ComputeUTXOStatsDelta(block, blockundo, pindex->nHeight, delta)) {
+            LogPrintf("%s: unable to read block %s to roll forward\n", __func__, pindex->GetBlockHash().ToString());
+            return Seed(chainparams, view);
+        }
+        Apply(pindex, delta);
+        if (vPending.size() >= COINSTATS_MAX_PENDING && !Flush()) {
+            return false;
+        }
+    }
+    fInSync = true;
+    return Flush();
+}
+
+void CCoinStatsIndex::BlockConnected(const CBlockIndex* pindex, const CUTXOStatsDelta& delta)
+{
+    AssertLockHeld(cs_main);
+    if (!fInSync) return;
+    const uint256 hashPrev = pindex->pprev ? pindex->pprev->GetBlockHash() : uint256();
+    if (hashPrev != hashBest) {
+        LogPrintf("%s: coin stats index is at %s, not at the parent of %s; disabled until restart\n", __func__,
+                  hashBest.ToString(), pindex->GetBlockHash().ToString());
+        fInSync = false;
+        return;
+    }
+    Apply(pindex, delta);
+    if (vPending.size() >= COINSTATS_MAX_PENDING || !IsInitialBlockDownload()) {
+        Flush();
+    }
+}
+
+void CCoinStatsIndex::BlockDisconnected(const CBlockIndex* pindex, const CUTXOStatsDelta& delta)
+{
+    AssertLockHeld(cs_main);
+    if (!fInSync) return;
+    if (pindex->GetBlockHash() != hashBest) {
+        LogPrintf("%s: coin stats index is at %s, not at %s; disabled until restart\n", __func__,
+                  hashBest.ToString(), pindex->GetBlockHash().ToString());
+        fInSync = false;
+        return;
+    }
+    // The snapshot stored for the disconnected block stays valid, as it is keyed by block hash.
+    Revert(pindex, delta);
+}
+
+bool CCoinStatsIndex::Flush()
+{
+    AssertLockHeld(cs_main);
+    CDBBatch batch(db);
+    if (!vPending.empty()) {
+        std::vector<MuHash3072> sets;
+        sets.reserve(vPending.size());
+        for (const PendingStats& pending : vPending) {
+            sets.push_back(pending.muhash);
+        }
+        std::vector<uint256> hashes;
+        MuHash3072::FinalizeBatch(sets, hashes);
+        for (size_t i = 0; i < vPending.size(); i++) {
+            vPending[i].stats.hashMuHash = hashes[i];
+            batch.Write(std::make_pair(DB_BLOCK_STATS, vPending[i].hashBlock), vPending[i].stats);
+        }
+    }
+    // Snapshots of blocks connected while in sync are always valid, but the
+    // running totals are only worth keeping if they still follow the chain.
+    if (fInSync) {
+        CBestStats best;
+        best.hashBlock = hashBest;
+        best.stats = stats;
+        best.muhash = muhash;
+        batch.Write(DB_BEST_STATS, best);
+        batch.Write(DB_START_HEIGHT, nStartHeight);
+    }
+    if (!db.WriteBatch(batch)) {
+        return error("%s: failed to write coin stats index", __func__);
+    }
+    vPending.clear();
+    return true;
+}
+
+bool CCoinStatsIndex::LookupStats(const CBlockIndex* pindex, CUTXOStats& statsOut)
+{
+    AssertLockHeld(cs_main);
+    const uint256 hash = pindex->GetBlockHash();
+    for (const PendingStats& pending : vPending) {
+        if (pending.hashBlock == hash) {
+            if (!Flush()) return false;
+            break;
+        }
+    }
+    return db.Read(std::make_pair(DB_BLOCK_STATS, hash), statsOut);
+}
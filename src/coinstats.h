@@ -0,0 +1,174 @@
+// Copyright (c) 2010 Satoshi Nakamoto
+// Copyright (c) 2009-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSTATS_H
+#define BITCOIN_COINSTATS_H
+
+#include <amount.h>
+#include <crypto/muhash.h>
+#include <dbwrapper.h>
+#include <serialize.h>
+#include <uint256.h>
+
+#include <memory>
+#include <vector>
+
+class CBlock;
+class CBlockIndex;
+class CBlockUndo;
+class CChainParams;
+class CCoinsView;
+class COutPoint;
+class Coin;
+
+//! -coinstatsindex default
+static const bool DEFAULT_COINSTATSINDEX = false;
+//! Max memory allocated to the coin stats index database cache (MiB)
+static const int64_t nCoinStatsIndexDBCache = 8;
+//! Number of blocks whose statistics may be buffered before they are finalized and written
+static const unsigned int COINSTATS_MAX_PENDING = 1000;
+
+struct CCoinsStats
+{
+    int nHeight;
+    uint256 hashBlock;
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+    uint64_t nBogoSize;
+    uint256 hashSerialized;
+    uint256 hashMuHash;
+    uint64_t nDiskSize;
+    CAmount nTotalAmount;
+
+    CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nBogoSize(0), nDiskSize(0), nTotalAmount(0) {}
+};
+
+/** Calculate statistics about the unspent transaction output set by scanning all of it.
+ *  If muhash is given, every coin is also inserted into it. */
+bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats, MuHash3072* muhash = nullptr);
+
+/** Totals of the UTXO set as of one block, as stored per block in the coin stats index. */
+struct CUTXOStats
+{
+    int nHeight;
+    uint64_t nTransactionOutputs;
+    uint64_t nBogoSize;
+    CAmount nTotalAmount;
+    uint256 hashMuHash;
+
+    CUTXOStats() : nHeight(0), nTransactionOutputs(0), nBogoSize(0), nTotalAmount(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(nHeight);
+        READWRITE(nTransactionOutputs);
+        READWRITE(nBogoSize);
+        READWRITE(nTotalAmount);
+        READWRITE(hashMuHash);
+    }
+};
+
+/** The change a single block makes to the UTXO set statistics. */
+struct CUTXOStatsDelta
+{
+    int64_t nTransactionOutputs;
+    int64_t nBogoSize;
+    CAmount nTotalAmount;
+    MuHash3072 muhash;
+
+    CUTXOStatsDelta() : nTransactionOutputs(0), nBogoSize(0), nTotalAmount(0) {}
+
+    void AddCoin(const COutPoint& outpoint, const Coin& coin);
+    void SpendCoin(const COutPoint& outpoint, const Coin& coin);
+};
+
+/** Compute the effect of a block on the UTXO set statistics from the coins it
+ *  creates and the coins it spends (taken from its undo data). Returns false
+ *  if the undo data does not match the block. */
+bool ComputeUTXOStatsDelta(const CBlock& block, const CBlockUndo& blockundo, int nHeight, CUTXOStatsDelta& delta);
+
+/**
+ * Incrementally maintained UTXO set statistics (indexes/coinstats/).
+ *
+ * The running totals for the active chain tip are updated from the coins
+ * spent and created by every block that is connected or disconnected, and a
+ * CUTXOStats snapshot is stored for every connected block, keyed by its hash,
+ * so statistics for the tip and for any earlier block can be looked up
+ * without scanning the chainstate.
+ *
+ * The index is built by replaying the undo data of the active chain from
+ * genesis. Once blocks were pruned that is not possible, and it is built from
+ * a scan of the UTXO set at the tip instead; statistics are then only
+ * available from that height (GetStartHeight()) on.
+ *
+ * Finalizing a MuHash requires a modular inversion, so snapshots are buffered
+ * and finalized in batches with a single inversion (Montgomery's trick).
+ * The buffer is written out whenever the chainstate is flushed, when a
+ * snapshot is requested, and after every block once out of initial block
+ * download.
+ *
+ * All methods require cs_main.
+ */
+class CCoinStatsIndex
+{
+private:
+    struct PendingStats {
+        uint256 hashBlock;
+        CUTXOStats stats;
+        MuHash3072 muhash;
+    };
+
+    CDBWrapper db;
+
+    //! Block the running totals correspond to
+    uint256 hashBest;
+    //! Running totals; hashMuHash is not maintained (see muhash)
+    CUTXOStats stats;
+    MuHash3072 muhash;
+    //! Whether the running totals follow the active chain
+    bool fInSync;
+    //! Lowest height of the active chain with statistics
+    int nStartHeight;
+
+    std::vector<PendingStats> vPending;
+
+    bool BuildFromGenesis(const CChainParams& chainparams);
+    bool Seed(const CChainParams& chainparams, CCoinsView* view);
+    void Apply(const CBlockIndex* pindex, const CUTXOStatsDelta& delta);
+    void Revert(const CBlockIndex* pindex, const CUTXOStatsDelta& delta);
+
+public:
+    explicit CCoinStatsIndex(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+    CCoinStatsIndex(const CCoinStatsIndex&) = delete;
+    CCoinStatsIndex& operator=(const CCoinStatsIndex&) = delete;
+
+    /** Load the running totals and bring them in line with chainActive, by
+     *  replaying blocks from disk or, if that is not possible, by building
+     *  the index again. */
+    bool Init(const CChainParams& chainparams, CCoinsView* view);
+
+    /** Update the running totals for a block that was connected to or
+     *  disconnected from the tip of chainActive. */
+    void BlockConnected(const CBlockIndex* pindex, const CUTXOStatsDelta& delta);
+    void BlockDisconnected(const CBlockIndex* pindex, const CUTXOStatsDelta& delta);
+
+    /** Finalize and write out buffered snapshots and the running totals. */
+    bool Flush();
+
+    /** Look up the statistics as of the given block. Returns false for blocks
+     *  that were never connected while the index was enabled. */
+    bool LookupStats(const CBlockIndex* pindex, CUTXOStats& statsOut);
+
+    bool IsInSync() const { return fInSync; }
+    int GetStartHeight() const { return nStartHeight; }
+};
+
+/** Global coin stats index, only set with -coinstatsindex */
+extern std::unique_ptr<CCoinStatsIndex> pcoinstatsindex;
+
+#endif // BITCOIN_COINSTATS_H
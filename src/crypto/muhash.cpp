@@ -0,0 +1,309 @@
+// Copyright (c) 2017-2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <crypto/muhash.h>
+
+#include <crypto/chacha20.h>
+#include <crypto/common.h>
+#include <crypto/sha256.h>
+#include <uint256.h>
+
+#include <limits>
+
+namespace {
+
+using limb_t = Num3072::limb_t;
+using double_limb_t = Num3072::double_limb_t;
+constexpr int LIMB_SIZE = Num3072::LIMB_SIZE;
+constexpr int LIMBS = Num3072::LIMBS;
+/** 2^3072 - 1103717, the largest 3072-bit safe prime number, is used as the modulus. */
+constexpr limb_t MAX_PRIME_DIFF = 1103717;
+
+/** Scratch numbers in GetInverse() need one extra limb to hold values up to 2p. */
+constexpr int INV_LIMBS = LIMBS + 1;
+
+bool IsOne(const limb_t* a)
+{
+    if (a[0] != 1) return false;
+    for (int i = 1; i < INV_LIMBS; ++i) {
+        if (a[i]) return false;
+    }
+    return true;
+}
+
+int Compare(const limb_t* a, const limb_t* b)
+{
+    for (int i = INV_LIMBS - 1; i >= 0; --i) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+/** a += b */
+void Add(limb_t* a, const limb_t* b)
+{
+    double_limb_t c = 0;
+    for (int i = 0; i < INV_LIMBS; ++i) {
+        c += (double_limb_t)a[i] + b[i];
+        a[i] = (limb_t)c;
+        c >>= LIMB_SIZE;
+    }
+}
+
+/** a -= b, requires a >= b */
+void Sub(limb_t* a, const limb_t* b)
+{
+    limb_t borrow = 0;
+    for (int i = 0; i < INV_LIMBS; ++i) {
+        double_limb_t t = (double_limb_t)a[i] - b[i] - borrow;
+        a[i] = (limb_t)t;
+        borrow = (limb_t)(t >> LIMB_SIZE) & 1;
+    }
+}
+
+void ShiftRight(limb_t* a)
+{
+    for (int i = 0; i < INV_LIMBS - 1; ++i) {
+        a[i] = (a[i] >> 1) | (a[i + 1] << (LIMB_SIZE - 1));
+    }
+    a[INV_LIMBS - 1] >>= 1;
+}
+
+/** a = a / 2 (mod p), for a < p */
+void HalveModP(limb_t* a, const limb_t* p)
+{
+    if (a[0] & 1) Add(a, p);
+    ShiftRight(a);
+}
+
+/** a = a - b (mod p), for a, b < p */
+void SubModP(limb_t* a, const limb_t* b, const limb_t* p)
+{
+    if (Compare(a, b) < 0) Add(a, p);
+    Sub(a, b);
+}
+
+} // namespace
+
+bool Num3072::IsOverflow() const
+{
+    if (limbs[0] <= std::numeric_limits<limb_t>::max() - MAX_PRIME_DIFF) return false;
+    for (int i = 1; i < LIMBS; ++i) {
+        if (limbs[i] != std::numeric_limits<limb_t>::max()) return false;
+    }
+    return true;
+}
+
+void Num3072::FullReduce()
+{
+    // Subtracting p is the same as adding MAX_PRIME_DIFF and dropping the 2^3072 bit.
+    double_limb_t c = MAX_PRIME_DIFF;
+    for (int i = 0; i < LIMBS; ++i) {
+        c += limbs[i];
+        limbs[i] = (limb_t)c;
+        c >>= LIMB_SIZE;
+    }
+}
+
+void Num3072::Multiply(const Num3072& a)
+{
+    limb_t tmp[2 * LIMBS];
+
+    // Schoolbook multiplication into a 6144-bit intermediate.
+    for (int j = 0; j < LIMBS; ++j) tmp[j] = 0;
+    for (int i = 0; i < LIMBS; ++i) {
+        limb_t carry = 0;
+        for (int j = 0; j < LIMBS; ++j) {
+            double_limb_t t = (double_limb_t)limbs[i] * a.limbs[j] + tmp[i + j] + carry;
+            tmp[i + j] = (limb_t)t;
+            carry = (limb_t)(t >> LIMB_SIZE);
+        }
+        tmp[i + LIMBS] = carry;
+    }
+
+    // Fold the upper half back in, using 2^3072 = MAX_PRIME_DIFF (mod p).
+    limb_t carry = 0;
+    for (int i = 0; i < LIMBS; ++i) {
+        double_limb_t t = (double_limb_t)tmp[LIMBS + i] * MAX_PRIME_DIFF + tmp[i] + carry;
+        limbs[i] = (limb_t)t;
+        carry = (limb_t)(t >> LIMB_SIZE);
+    }
+    while (carry) {
+        double_limb_t t = (double_limb_t)carry * MAX_PRIME_DIFF;
+        int i = 0;
+        for (; i < LIMBS && t; ++i) {
+            t += limbs[i];
+            limbs[i] = (limb_t)t;
+            t >>= LIMB_SIZE;
+        }
+        carry = (limb_t)t;
+    }
+
+    if (IsOverflow()) FullReduce();
+}
+
+void Num3072::Square()
+{
+    Num3072 tmp(*this);
+    Multiply(tmp);
+}
+
+void Num3072::SetToOne()
+{
+    limbs[0] = 1;
+    for (int i = 1; i < LIMBS; ++i) limbs[i] = 0;
+}
+
+Num3072 Num3072::GetInverse() const
+{
+    // Binary extended Euclidean algorithm. This is not constant time, which is
+    // fine as MuHash only ever operates on public data, and it is an order of
+    // magnitude faster than exponentiation by p - 2.
+    // Invariants: u = x1 * this (mod p) and v = x2 * this (mod p).
+    limb_t u[INV_LIMBS], v[INV_LIMBS], x1[INV_LIMBS], x2[INV_LIMBS], p[INV_LIMBS];
+    for (int i = 0; i < LIMBS; ++i) {
+        u[i] = limbs[i];
+        v[i] = std::numeric_limits<limb_t>::max();
+        x1[i] = 0;
+        x2[i] = 0;
+    }
+    v[0] -= MAX_PRIME_DIFF - 1;
+    u[LIMBS] = v[LIMBS] = x1[LIMBS] = x2[LIMBS] = 0;
+    x1[0] = 1;
+    for (int i = 0; i < INV_LIMBS; ++i) p[i] = v[i];
+
+    while (!IsOne(u) && !IsOne(v)) {
+        while (!(u[0] & 1)) {
+            ShiftRight(u);
+            HalveModP(x1, p);
+        }
+        while (!(v[0] & 1)) {
+            ShiftRight(v);
+            HalveModP(x2, p);
+        }
+        if (Compare(u, v) >= 0) {
+            Sub(u, v);
+            SubModP(x1, x2, p);
+        } else {
+            Sub(v, u);
+            SubModP(x2, x1, p);
+        }
+    }
+
+    Num3072 ret;
+    const limb_t* result = IsOne(u) ? x1 : x2;
+    for (int i = 0; i < LIMBS; ++i) ret.limbs[i] = result[i];
+    return ret;
+}
+
+void Num3072::Divide(const Num3072& a)
+{
+    Multiply(a.GetInverse());
+}
+
+Num3072::Num3072(const unsigned char (&data)[BYTE_SIZE])
+{
+    for (int i = 0; i < LIMBS; ++i) {
+        if (sizeof(limb_t) == 4) {
+            limbs[i] = ReadLE32(data + 4 * i);
+        } else if (sizeof(limb_t) == 8) {
+            limbs[i] = ReadLE64(data + 8 * i);
+        }
+    }
+    if (IsOverflow()) FullReduce();
+}
+
+void Num3072::ToBytes(unsigned char (&out)[BYTE_SIZE]) const
+{
+    for (int i = 0; i < LIMBS; ++i) {
+        if (sizeof(limb_t) == 4) {
+            WriteLE32(out + i * 4, limbs[i]);
+        } else if (sizeof(limb_t) == 8) {
+            WriteLE64(out + i * 8, limbs[i]);
+        }
+    }
+}
+
+Num3072 MuHash3072::ToNum3072(const unsigned char* data, size_t len)
+{
+    unsigned char tmp[Num3072::BYTE_SIZE];
+    unsigned char hashed_in[CSHA256::OUTPUT_SIZE];
+
+    CSHA256().Write(data, len).Finalize(hashed_in);
+    ChaCha20(hashed_in, sizeof(hashed_in)).Output(tmp, Num3072::BYTE_SIZE);
+    return Num3072(tmp);
+}
+
+MuHash3072::MuHash3072(const unsigned char* data, size_t len)
+{
+    m_numerator = ToNum3072(data, len);
+}
+
+MuHash3072& MuHash3072::Insert(const unsigned char* data, size_t len)
+{
+    m_numerator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::Remove(const unsigned char* data, size_t len)
+{
+    m_denominator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator*=(const MuHash3072& mul)
+{
+    m_numerator.Multiply(mul.m_numerator);
+    m_denominator.Multiply(mul.m_denominator);
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator/=(const MuHash3072& div)
+{
+    m_numerator.Multiply(div.m_denominator);
+    m_denominator.Multiply(div.m_numerator);
+    return *this;
+}
+
+void MuHash3072::Finalize(const Num3072& num, uint256& out)
+{
+    unsigned char data[Num3072::BYTE_SIZE];
+    num.ToBytes(data);
+    CSHA256().Write(data, sizeof(data)).Finalize(out.begin());
+}
+
+void MuHash3072::Finalize(uint256& out) const
+{
+    Num3072 result(m_numerator);
+    result.Divide(m_denominator);
+    Finalize(result, out);
+}
+
+void MuHash3072::FinalizeBatch(const std::vector<MuHash3072>& sets, std::vector<uint256>& out)
+{
+    out.resize(sets.size());
+    if (sets.empty()) return;
+
+    // Montgomery's trick: invert the product of all denominators once, then
+    // peel off the individual inverses with a few multiplications each.
+    std::vector<Num3072> prefix(sets.size());
+    prefix[0] = sets[0].m_denominator;
+    for (size_t i = 1; i < sets.size(); ++i) {
+        prefix[i] = prefix[i - 1];
+        prefix[i].Multiply(sets[i].m_denominator);
+    }
+    Num3072 inv = prefix.back().GetInverse();
+    for (size_t i = sets.size(); i-- > 0;) {
+        Num3072 result(sets[i].m_numerator);
+        if (i > 0) {
+            Num3072 inv_i(inv);
+            inv_i.Multiply(prefix[i - 1]);
+            result.Multiply(inv_i);
+            inv.Multiply(sets[i].m_denominator);
+        } else {
+            result.Multiply(inv);
+        }
+        Finalize(result, out[i]);
+    }
+}
@@ -0,0 +1,331 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chainparams.h>
+#include <coins.h>
+#include <crypto/sha256.h>
+#include <index/addressindex.h>
+#include <undo.h>
+#include <util.h>
+#include <validation.h>
+
+/* The index database stores three kinds of entries per script hash:
+ *
+ * - DB_ADDRESS_OUTPUT entries for every output paying to the script, keyed
+ *   by the height and outpoint that created it, holding its value and the
+ *   transaction that spent it, if any.
+ * - DB_ADDRESS_SPEND entries for every input spending such an output, keyed
+ *   by the height, txid and input index of the spend, holding the outpoint
+ *   and value spent.
+ * - DB_ADDRESS_UNSPENT entries for the outputs paying to the script that are
+ *   still unspent, keyed like DB_ADDRESS_OUTPUT and holding the value. They
+ *   are erased on spend and restored on rewind, so listing the unspent
+ *   outputs of a script does not scan its whole history.
+ *
+ * Heights and indexes are serialized big-endian so that LevelDB orders the
+ * entries of each script by height.
+ */
+constexpr char DB_ADDRESS_OUTPUT = 'o';
+constexpr char DB_ADDRESS_SPEND = 's';
+constexpr char DB_ADDRESS_UNSPENT = 'u';
+
+std::unique_ptr<AddressIndex> g_addressindex;
+
+namespace {
+
+struct AddressEntryKey
+{
+    char prefix;
+    uint256 script_hash;
+    int height;
+    uint256 txid;
+    uint32_t index;
+
+    AddressEntryKey() : prefix(0), height(0), index(0) {}
+    AddressEntryKey(char prefix_in, const uint256& script_hash_in, int height_in, const uint256& txid_in, uint32_t index_in) :
+        prefix(prefix_in), script_hash(script_hash_in), height(height_in), txid(txid_in), index(index_in) {}
+
+    template<typename Stream>
+    void Serialize(Stream& s) const
+    {
+        ser_writedata8(s, prefix);
+        s << script_hash;
+        ser_writedata32be(s, height);
+        s << txid;
+        ser_writedata32be(s, index);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s)
+    {
+        prefix = ser_readdata8(s);
+        s >> script_hash;
+        height = ser_readdata32be(s);
+        s >> txid;
+        index = ser_readdata32be(s);
+    }
+};
+
+struct AddressOutputValue
+{
+    CAmount value;
+    uint256 spent_txid;
+    int spent_height;
+
+    AddressOutputValue() : value(0), spent_height(-1) {}
+    explicit AddressOutputValue(CAmount value_in) : value(value_in), spent_height(-1) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(value);
+        READWRITE(spent_txid);
+        READWRITE(spent_height);
+    }
+};
+
+struct AddressSpendValue
+{
+    COutPoint prevout;
+    CAmount value;
+
+    AddressSpendValue() : value(0) {}
+    AddressSpendValue(const COutPoint& prevout_in, CAmount value_in) : prevout(prevout_in), value(value_in) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(prevout);
+        READWRITE(value);
+    }
+};
+
+uint256 GetScriptHash(const CScript& script)
+{
+    uint256 hash;
+    CSHA256().Write(script.data(), script.size()).Finalize(hash.begin());
+    return hash;
+}
+
+/** Iterates over the entries of one kind for one script hash, in key order. */
+class AddressEntryCursor
+{
+private:
+    std::unique_ptr<CDBIterator> m_iter;
+    char m_prefix;
+    uint256 m_script_hash;
+    bool m_valid;
+    AddressEntryKey m_key;
+
+    void Load()
+    {
+        m_valid = m_iter->Valid() && m_iter->GetKey(m_key) &&
+            m_key.prefix == m_prefix && m_key.script_hash == m_script_hash;
+    }
+
+public:
+    AddressEntryCursor(CDBWrapper& db, char prefix, const uint256& script_hash) :
+        m_iter(db.NewIterator()), m_prefix(prefix), m_script_hash(script_hash)
+    {
+        m_iter->Seek(AddressEntryKey(prefix, script_hash, 0, uint256(), 0));
+        Load();
+    }
+
+    bool Valid() const { return m_valid; }
+    const AddressEntryKey& Key() const { return m_key; }
+    template<typename V> bool GetValue(V& value) { return m_iter->GetValue(value); }
+    void Next() { m_iter->Next(); Load(); }
+};
+
+} // namespace
+
+/** Access to the address index database (indexes/addressindex/) */
+class AddressIndex::DB : public BaseIndex::DB
+{
+public:
+    explicit DB(size_t n_cache_size, bool f_memory = false, bool f_wipe = false);
+};
+
+AddressIndex::DB::DB(size_t n_cache_size, bool f_memory, bool f_wipe) :
+    BaseIndex::DB(GetDataDir() / "indexes" / "addressindex", n_cache_size, f_memory, f_wipe)
+{}
+
+AddressIndex::AddressIndex(size_t n_cache_size, bool f_memory, bool f_wipe)
+    : m_db(MakeUnique<AddressIndex::DB>(n_cache_size, f_memory, f_wipe))
+{}
+
+AddressIndex::~AddressIndex() {}
+
+bool AddressIndex::WriteBlock(const CBlock& block, const CBlockIndex* pindex)
+{
+    // The genesis block outputs are not part of the UTXO set.
+    if (pindex->nHeight == 0) return true;
+
+    CBlockUndo block_undo;
+    if (!UndoReadFromDisk(block_undo, pindex)) {
+        return false;
+    }
+    if (block_undo.vtxundo.size() + 1 != block.vtx.size()) {
+        return error("%s: undo data does not match block %s", __func__, pindex->GetBlockHash().ToString());
+    }
+
+    CDBBatch batch(*m_db);
+    for (size_t i = 0; i < block.vtx.size(); ++i) {
+        const CTransaction& tx = *block.vtx[i];
+        const uint256& txid = tx.GetHash();
+
+        for (uint32_t n = 0; n < tx.vout.size(); ++n) {
+            const CTxOut& out = tx.vout[n];
+            if (out.scriptPubKey.IsUnspendable()) continue;
+            const uint256 script_hash = GetScriptHash(out.scriptPubKey);
+            batch.Write(AddressEntryKey(DB_ADDRESS_OUTPUT, script_hash, pindex->nHeight, txid, n),
+                        AddressOutputValue(out.nValue));
+            batch.Write(AddressEntryKey(DB_ADDRESS_UNSPENT, script_hash, pindex->nHeight, txid, n), out.nValue);
+        }
+
+        if (tx.IsCoinBase()) continue;
+
+        const CTxUndo& tx_undo = block_undo.vtxundo[i - 1];
+        for (uint32_t j = 0; j < tx.vin.size(); ++j) {
+            const COutPoint& prevout = tx.vin[j].prevout;
+            const Coin& coin = tx_undo.vprevout[j];
+            const uint256 script_hash = GetScriptHash(coin.out.scriptPubKey);
+
+            AddressOutputValue spent(coin.out.nValue);
+            spent.spent_txid = txid;
+            spent.spent_height = pindex->nHeight;
+            batch.Write(AddressEntryKey(DB_ADDRESS_OUTPUT, script_hash, coin.nHeight, prevout.hash, prevout.n), spent);
+            batch.Erase(AddressEntryKey(DB_ADDRESS_UNSPENT, script_hash, coin.nHeight, prevout.hash, prevout.n));
+            batch.Write(AddressEntryKey(DB_ADDRESS_SPEND, script_hash, pindex->nHeight, txid, j),
+                        AddressSpendValue(prevout, coin.out.nValue));
+        }
+    }
+    return m_db->WriteBatch(batch);
+}
+
+bool AddressIndex::Rewind(const CBlockIndex* current_tip, const CBlockIndex* new_tip)
+{
+    assert(current_tip->GetAncestor(new_tip->nHeight) == new_tip);
+
+    // Undo the blocks from the tip downwards in a single batch, so an output
+    // created and spent within the rewound range ends up erased.
+    CDBBatch batch(*m_db);
+    for (const CBlockIndex* pindex = current_tip; pindex != new_tip; pindex = pindex->pprev) {
+        if (pindex->nHeight == 0) break;
+
+        CBlock block;
+        CBlockUndo block_undo;
+        if (!ReadBlockFromDisk(block, pindex, Params().GetConsensus()) || !UndoReadFromDisk(block_undo, pindex)) {
+            return error("%s: failed to read block %s from disk", __func__, pindex->GetBlockHash().ToString());
+        }
+        if (block_undo.vtxundo.size() + 1 != block.vtx.size()) {
+            return error("%s: undo data does not match block %s", __func__, pindex->GetBlockHash().ToString());
+        }
+
+        for (size_t i = block.vtx.size(); i-- > 0;) {
+            const CTransaction& tx = *block.vtx[i];
+            const uint256& txid = tx.GetHash();
+
+            if (!tx.IsCoinBase()) {
+                const CTxUndo& tx_undo = block_undo.vtxundo[i - 1];
+                for (uint32_t j = 0; j < tx.vin.size(); ++j) {
+                    const COutPoint& prevout = tx.vin[j].prevout;
+                    const Coin& coin = tx_undo.vprevout[j];
+                    const uint256 script_hash = GetScriptHash(coin.out.scriptPubKey);
+                    batch.Write(AddressEntryKey(DB_ADDRESS_OUTPUT, script_hash, coin.nHeight, prevout.hash, prevout.n),
+                                AddressOutputValue(coin.out.nValue));
+                    batch.Write(AddressEntryKey(DB_ADDRESS_UNSPENT, script_hash, coin.nHeight, prevout.hash, prevout.n),
+                                coin.out.nValue);
+                    batch.Erase(AddressEntryKey(DB_ADDRESS_SPEND, script_hash, pindex->nHeight, txid, j));
+                }
+            }
+
+            for (uint32_t n = 0; n < tx.vout.size(); ++n) {
+                const CTxOut& out = tx.vout[n];
+                if (out.scriptPubKey.IsUnspendable()) continue;
+                const uint256 script_hash = GetScriptHash(out.scriptPubKey);
+                batch.Erase(AddressEntryKey(DB_ADDRESS_OUTPUT, script_hash, pindex->nHeight, txid, n));
+                batch.Erase(AddressEntryKey(DB_ADDRESS_UNSPENT, script_hash, pindex->nHeight, txid, n));
+            }
+        }
+    }
+    if (!m_db->WriteBatch(batch)) {
+        return error("%s: failed to write rewound address index entries", __func__);
+    }
+
+    return BaseIndex::Rewind(current_tip, new_tip);
+}
+
+BaseIndex::DB& AddressIndex::GetDB() const { return *m_db; }
+
+bool AddressIndex::FindUnspent(const CScript& script, size_t skip, size_t count, std::vector<AddressOutput>& outputs) const
+{
+    outputs.clear();
+    AddressEntryCursor cursor(*m_db, DB_ADDRESS_UNSPENT, GetScriptHash(script));
+    for (; cursor.Valid() && skip > 0; cursor.Next()) --skip;
+    for (; cursor.Valid() && outputs.size() < count; cursor.Next()) {
+        AddressOutput output;
+        if (!cursor.GetValue(output.value)) {
+            return error("%s: cannot parse address index record", __func__);
+        }
+        output.height = cursor.Key().height;
+        output.outpoint = COutPoint(cursor.Key().txid, cursor.Key().index);
+        outputs.push_back(output);
+    }
+    return true;
+}
+
+bool AddressIndex::FindHistory(const CScript& script, size_t skip, size_t count, std::vector<AddressHistoryEntry>& history) const
+{
+    history.clear();
+    const uint256 script_hash = GetScriptHash(script);
+    AddressEntryCursor received(*m_db, DB_ADDRESS_OUTPUT, script_hash);
+    AddressEntryCursor spent(*m_db, DB_ADDRESS_SPEND, script_hash);
+
+    // Merge both kinds of entries by (height, txid); within a transaction
+    // its spends come before its receives.
+    while ((received.Valid() || spent.Valid()) && history.size() < count) {
+        bool take_spend = spent.Valid() &&
+            (!received.Valid() ||
+             std::make_pair(spent.Key().height, spent.Key().txid) <= std::make_pair(received.Key().height, received.Key().txid));
+
+        AddressHistoryEntry entry;
+        if (take_spend) {
+            AddressSpendValue value;
+            if (!spent.GetValue(value)) {
+                return error("%s: cannot parse address index record", __func__);
+            }
+            entry.height = spent.Key().height;
+            entry.txid = spent.Key().txid;
+            entry.index = spent.Key().index;
+            entry.spend = true;
+            entry.value = -value.value;
+            entry.spent_height = -1;
+            entry.prevout = value.prevout;
+            spent.Next();
+        } else {
+            AddressOutputValue value;
+            if (!received.GetValue(value)) {
+                return error("%s: cannot parse address index record", __func__);
+            }
+            entry.height = received.Key().height;
+            entry.txid = received.Key().txid;
+            entry.index = received.Key().index;
+            entry.spend = false;
+            entry.value = value.value;
+            entry.spent_txid = value.spent_txid;
+            entry.spent_height = value.spent_height;
+            received.Next();
+        }
+
+        if (skip > 0) {
+            --skip;
+            continue;
+        }
+        history.push_back(entry);
+    }
+    return true;
+}
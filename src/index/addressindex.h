@@ -0,0 +1,92 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_INDEX_ADDRESSINDEX_H
+#define BITCOIN_INDEX_ADDRESSINDEX_H
+
+#include <amount.h>
+#include <index/base.h>
+#include <script/script.h>
+
+#include <vector>
+
+//! -addressindex default
+static const bool DEFAULT_ADDRESSINDEX = false;
+//! Max memory allocated to the address index database cache (MiB)
+static const int64_t nMaxAddressIndexCache = 256;
+//! Max number of entries returned by a single address index query
+static const unsigned int MAX_ADDRESS_QUERY_RESULTS = 10000;
+
+/** An unspent output paying to an indexed script. */
+struct AddressOutput
+{
+    int height;
+    COutPoint outpoint;
+    CAmount value;
+};
+
+/** A change to the balance of an indexed script: an output received or spent. */
+struct AddressHistoryEntry
+{
+    int height;
+    uint256 txid;
+    //! Output index for receives, input index for spends
+    uint32_t index;
+    bool spend;
+    //! Positive for receives, negative for spends
+    CAmount value;
+    //! For receives, the transaction and block height spending the output
+    //! (null and -1 while unspent); for spends, the outpoint spent
+    uint256 spent_txid;
+    int spent_height;
+    COutPoint prevout;
+};
+
+/**
+ * AddressIndex records, for every script that has received coins, the
+ * outputs paying to it and the inputs spending those outputs. Scripts are
+ * keyed by the SHA256 of the scriptPubKey, and entries are ordered by block
+ * height, so UTXO and history queries for one script are a single range scan
+ * that can be paginated.
+ *
+ * Blocks are indexed from their undo data, which provides the scripts and
+ * values of the coins they spend. Entries for blocks that are disconnected
+ * are removed again when the index rewinds.
+ */
+class AddressIndex final : public BaseIndex
+{
+protected:
+    class DB;
+
+private:
+    const std::unique_ptr<DB> m_db;
+
+protected:
+    bool WriteBlock(const CBlock& block, const CBlockIndex* pindex) override;
+
+    bool Rewind(const CBlockIndex* current_tip, const CBlockIndex* new_tip) override;
+
+    BaseIndex::DB& GetDB() const override;
+
+    const char* GetName() const override { return "addressindex"; }
+
+public:
+    explicit AddressIndex(size_t n_cache_size, bool f_memory = false, bool f_wipe = false);
+
+    // Destructor is declared because this class contains a unique_ptr to an incomplete type.
+    virtual ~AddressIndex() override;
+
+    /// Look up the unspent outputs paying to a script, in block height order,
+    /// skipping the first `skip` of them and returning at most `count`.
+    bool FindUnspent(const CScript& script, size_t skip, size_t count, std::vector<AddressOutput>& outputs) const;
+
+    /// Look up the receives and spends of a script, in block height order,
+    /// skipping the first `skip` of them and returning at most `count`.
+    bool FindHistory(const CScript& script, size_t skip, size_t count, std::vector<AddressHistoryEntry>& history) const;
+};
+
+/// The global address index. May be null.
+extern std::unique_ptr<AddressIndex> g_addressindex;
+
+#endif // BITCOIN_INDEX_ADDRESSINDEX_H
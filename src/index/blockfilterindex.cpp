@@ -0,0 +1,181 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <coins.h>
+#include <index/blockfilterindex.h>
+#include <undo.h>
+#include <util.h>
+#include <validation.h>
+
+/* The index database stores one entry per indexed block, keyed by block hash:
+ * the filter, its hash and the filter header committing to all filters of
+ * the chain up to that block. Headers chain through the parent block's entry,
+ * so each block's entry can be computed as soon as its parent's is written.
+ */
+constexpr char DB_BLOCK_HASH = 's';
+
+std::unique_ptr<BlockFilterIndex> g_blockfilterindex;
+
+namespace {
+
+struct DBVal
+{
+    uint256 hash;
+    uint256 header;
+    std::vector<unsigned char> filter;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(hash);
+        READWRITE(header);
+        READWRITE(filter);
+    }
+};
+
+} // namespace
+
+/** Access to the block filter index database (indexes/blockfilter/<filter_type>/) */
+class BlockFilterIndex::DB : public BaseIndex::DB
+{
+public:
+    DB(const fs::path& path, size_t n_cache_size, bool f_memory = false, bool f_wipe = false);
+
+    bool ReadEntry(const uint256& block_hash, DBVal& entry) const;
+};
+
+BlockFilterIndex::DB::DB(const fs::path& path, size_t n_cache_size, bool f_memory, bool f_wipe) :
+    BaseIndex::DB(path, n_cache_size, f_memory, f_wipe)
+{}
+
+bool BlockFilterIndex::DB::ReadEntry(const uint256& block_hash, DBVal& entry) const
+{
+    return Read(std::make_pair(DB_BLOCK_HASH, block_hash), entry);
+}
+
+BlockFilterIndex::BlockFilterIndex(BlockFilterType filter_type,
+                                   size_t n_cache_size, bool f_memory, bool f_wipe)
+    : m_filter_type(filter_type)
+{
+    const std::string& filter_name = BlockFilterTypeName(filter_type);
+    if (filter_name.empty()) throw std::invalid_argument("unknown filter_type");
+
+    m_name = filter_name + " block filter index";
+    m_db = MakeUnique<BlockFilterIndex::DB>(GetDataDir() / "indexes" / "blockfilter" / filter_name,
+                                            n_cache_size, f_memory, f_wipe);
+}
+
+BlockFilterIndex::~BlockFilterIndex() {}
+
+bool BlockFilterIndex::WriteBlock(const CBlock& block, const CBlockIndex* pindex)
+{
+    CBlockUndo block_undo;
+    uint256 prev_header;
+
+    if (pindex->nHeight > 0) {
+        if (!UndoReadFromDisk(block_undo, pindex)) {
+            return false;
+        }
+
+        DBVal prev_entry;
+        if (!m_db->ReadEntry(pindex->pprev->GetBlockHash(), prev_entry)) {
+            return error("%s: cannot read filter header of block %s", __func__,
+                         pindex->pprev->GetBlockHash().ToString());
+        }
+        prev_header = prev_entry.header;
+    }
+
+    BlockFilter filter(m_filter_type, block, block_undo);
+
+    DBVal value;
+    value.hash = filter.GetHash();
+    value.header = filter.ComputeHeader(prev_header);
+    value.filter = filter.GetEncodedFilter();
+    return m_db->Write(std::make_pair(DB_BLOCK_HASH, pindex->GetBlockHash()), value);
+}
+
+BaseIndex::DB& BlockFilterIndex::GetDB() const { return *m_db; }
+
+bool BlockFilterIndex::LookupFilter(const CBlockIndex* block_index, BlockFilter& filter_out) const
+{
+    DBVal entry;
+    if (!m_db->ReadEntry(block_index->GetBlockHash(), entry)) {
+        return false;
+    }
+
+    try {
+        filter_out = BlockFilter(m_filter_type, block_index->GetBlockHash(), std::move(entry.filter));
+    } catch (const std::exception& e) {
+        return error("%s: failed to decode filter of block %s: %s", __func__,
+                     block_index->GetBlockHash().ToString(), e.what());
+    }
+    return true;
+}
+
+bool BlockFilterIndex::LookupFilterHeader(const CBlockIndex* block_index, uint256& header_out) const
+{
+    DBVal entry;
+    if (!m_db->ReadEntry(block_index->GetBlockHash(), entry)) {
+        return false;
+    }
+
+    header_out = entry.header;
+    return true;
+}
+
+bool BlockFilterIndex::LookupEntryRange(int start_height, const CBlockIndex* stop_index,
+                                        std::vector<const CBlockIndex*>& blocks) const
+{
+    if (start_height < 0) {
+        return error("%s: start height (%d) is negative", __func__, start_height);
+    }
+    if (start_height > stop_index->nHeight) {
+        return error("%s: start height (%d) is greater than stop height (%d)",
+                     __func__, start_height, stop_index->nHeight);
+    }
+
+    blocks.resize(stop_index->nHeight - start_height + 1);
+    const CBlockIndex* pindex = stop_index;
+    for (size_t i = blocks.size(); i-- > 0; pindex = pindex->pprev) {
+        blocks[i] = pindex;
+    }
+    return true;
+}
+
+bool BlockFilterIndex::LookupFilterRange(int start_height, const CBlockIndex* stop_index,
+                                         std::vector<BlockFilter>& filters_out) const
+{
+    std::vector<const CBlockIndex*> blocks;
+    if (!LookupEntryRange(start_height, stop_index, blocks)) {
+        return false;
+    }
+
+    filters_out.resize(blocks.size());
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        if (!LookupFilter(blocks[i], filters_out[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BlockFilterIndex::LookupFilterHashRange(int start_height, const CBlockIndex* stop_index,
+                                             std::vector<uint256>& hashes_out) const
+{
+    std::vector<const CBlockIndex*> blocks;
+    if (!LookupEntryRange(start_height, stop_index, blocks)) {
+        return false;
+    }
+
+    hashes_out.resize(blocks.size());
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        DBVal entry;
+        if (!m_db->ReadEntry(blocks[i]->GetBlockHash(), entry)) {
+            return false;
+        }
+        hashes_out[i] = entry.hash;
+    }
+    return true;
+}
@@ -0,0 +1,169 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chainparams.h>
+#include <coins.h>
+#include <consensus/validation.h>
+#include <index/blockstatsindex.h>
+#include <policy/policy.h>
+#include <undo.h>
+#include <util.h>
+#include <validation.h>
+
+#include <algorithm>
+
+constexpr char DB_BLOCK_STATS = 's';
+
+std::unique_ptr<BlockStatsIndex> g_blockstatsindex;
+
+template<typename T>
+static T CalculateTruncatedMedian(std::vector<T>& scores)
+{
+    size_t size = scores.size();
+    if (size == 0) {
+        return 0;
+    }
+
+    std::sort(scores.begin(), scores.end());
+    if (size % 2 == 0) {
+        return (scores[size / 2 - 1] + scores[size / 2]) / 2;
+    } else {
+        return scores[size / 2];
+    }
+}
+
+void CalculatePercentilesByWeight(CAmount result[NUM_GETBLOCKSTATS_PERCENTILES], std::vector<std::pair<CAmount, int64_t>>& scores, int64_t total_weight)
+{
+    if (scores.empty()) {
+        return;
+    }
+
+    std::sort(scores.begin(), scores.end());
+
+    // 10th, 25th, 50th, 75th, and 90th percentile weight units.
+    const double weights[NUM_GETBLOCKSTATS_PERCENTILES] = {
+        total_weight / 10.0, total_weight / 4.0, total_weight / 2.0, (total_weight * 3.0) / 4.0, (total_weight * 9.0) / 10.0
+    };
+
+    int64_t next_percentile_index = 0;
+    int64_t cumulative_weight = 0;
+    for (const auto& element : scores) {
+        cumulative_weight += element.second;
+        while (next_percentile_index < NUM_GETBLOCKSTATS_PERCENTILES && cumulative_weight >= weights[next_percentile_index]) {
+            result[next_percentile_index] = element.first;
+            ++next_percentile_index;
+        }
+    }
+
+    // Fill any remaining percentiles with the last value.
+    for (int64_t i = next_percentile_index; i < NUM_GETBLOCKSTATS_PERCENTILES; i++) {
+        result[i] = scores.back().first;
+    }
+}
+
+void ComputeBlockStats(const CBlock& block, const CBlockUndo& block_undo, const CBlockIndex* pindex, CBlockStats& stats)
+{
+    stats = CBlockStats();
+    stats.height = pindex->nHeight;
+    stats.time = pindex->GetBlockTime();
+    stats.algo = pindex->GetAlgo();
+    stats.auxpow = block.IsAuxpow();
+    // The genesis block has no block before it to compute a subsidy on top
+    // of; its coinbase pays what it was given.
+    stats.subsidy = pindex->pprev ? GetBlockSubsidy(pindex->nHeight, pindex->nBits, Params().GetConsensus(), pindex->pprev) : block.vtx[0]->GetValueOut();
+    stats.txs = block.vtx.size();
+    stats.minfee = MAX_MONEY;
+    stats.minfeerate = MAX_MONEY;
+
+    std::vector<CAmount> fee_array;
+    std::vector<std::pair<CAmount, int64_t>> feerate_array;
+
+    for (size_t i = 0; i < block.vtx.size(); ++i) {
+        const CTransaction& tx = *block.vtx[i];
+        stats.outs += tx.vout.size();
+
+        CAmount tx_total_out = 0;
+        for (const CTxOut& out : tx.vout) {
+            tx_total_out += out.nValue;
+            if (!out.scriptPubKey.IsUnspendable()) ++stats.utxo_increase;
+        }
+
+        if (tx.IsCoinBase()) {
+            continue;
+        }
+
+        stats.ins += tx.vin.size();
+        stats.total_out += tx_total_out;
+        stats.utxo_increase -= tx.vin.size();
+
+        int64_t tx_size = tx.GetTotalSize();
+        int64_t weight = GetTransactionWeight(tx);
+        stats.total_size += tx_size;
+        stats.total_weight += weight;
+        if (tx.HasWitness()) ++stats.swtxs;
+
+        CAmount tx_total_in = 0;
+        for (const Coin& coin : block_undo.vtxundo[i - 1].vprevout) {
+            tx_total_in += coin.out.nValue;
+        }
+
+        CAmount txfee = tx_total_in - tx_total_out;
+        fee_array.push_back(txfee);
+        stats.maxfee = std::max(stats.maxfee, txfee);
+        stats.minfee = std::min(stats.minfee, txfee);
+        stats.totalfee += txfee;
+
+        // New feerate uses satoshis per virtual byte instead of per serialized byte
+        CAmount feerate = weight ? (txfee * WITNESS_SCALE_FACTOR) / weight : 0;
+        feerate_array.emplace_back(feerate, weight);
+        stats.maxfeerate = std::max(stats.maxfeerate, feerate);
+        stats.minfeerate = std::min(stats.minfeerate, feerate);
+    }
+
+    if (fee_array.empty()) {
+        stats.minfee = 0;
+        stats.minfeerate = 0;
+    }
+    stats.medianfee = CalculateTruncatedMedian(fee_array);
+    CalculatePercentilesByWeight(stats.feerate_percentiles, feerate_array, stats.total_weight);
+}
+
+/** Access to the block stats index database (indexes/blockstatsindex/) */
+class BlockStatsIndex::DB : public BaseIndex::DB
+{
+public:
+    explicit DB(size_t n_cache_size, bool f_memory = false, bool f_wipe = false);
+};
+
+BlockStatsIndex::DB::DB(size_t n_cache_size, bool f_memory, bool f_wipe) :
+    BaseIndex::DB(GetDataDir() / "indexes" / "blockstatsindex", n_cache_size, f_memory, f_wipe)
+{}
+
+BlockStatsIndex::BlockStatsIndex(size_t n_cache_size, bool f_memory, bool f_wipe)
+    : m_db(MakeUnique<BlockStatsIndex::DB>(n_cache_size, f_memory, f_wipe))
+{}
+
+BlockStatsIndex::~BlockStatsIndex() {}
+
+bool BlockStatsIndex::WriteBlock(const CBlock& block, const CBlockIndex* pindex)
+{
+    CBlockUndo block_undo;
+    if (pindex->nHeight > 0 && !UndoReadFromDisk(block_undo, pindex)) {
+        return false;
+    }
+    if (block_undo.vtxundo.size() + 1 != block.vtx.size()) {
+        return error("%s: undo data does not match block %s", __func__, pindex->GetBlockHash().ToString());
+    }
+
+    CBlockStats stats;
+    ComputeBlockStats(block, block_undo, pindex, stats);
+    return m_db->Write(std::make_pair(DB_BLOCK_STATS, pindex->GetBlockHash()), stats);
+}
+
+BaseIndex::DB& BlockStatsIndex::GetDB() const { return *m_db; }
+
+bool BlockStatsIndex::LookupStats(const CBlockIndex* block_index, CBlockStats& stats) const
+{
+    return m_db->Read(std::make_pair(DB_BLOCK_STATS, block_index->GetBlockHash()), stats);
+}
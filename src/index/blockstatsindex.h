@@ -0,0 +1,124 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_INDEX_BLOCKSTATSINDEX_H
+#define BITCOIN_INDEX_BLOCKSTATSINDEX_H
+
+#include <amount.h>
+#include <chain.h>
+#include <index/base.h>
+#include <serialize.h>
+
+#include <vector>
+
+class CBlockUndo;
+
+//! -blockstatsindex default
+static const bool DEFAULT_BLOCKSTATSINDEX = false;
+//! Max memory allocated to the block stats index database cache (MiB)
+static const int64_t nMaxBlockStatsIndexCache = 64;
+
+static constexpr int NUM_GETBLOCKSTATS_PERCENTILES = 5;
+
+/** Per-block statistics, as reported by the getblockstats RPC. Fee rates are in satoshis per virtual byte. */
+struct CBlockStats
+{
+    int height = 0;
+    int64_t time = 0;
+    int algo = 0;
+    bool auxpow = false;
+    CAmount subsidy = 0;
+    CAmount totalfee = 0;
+    CAmount minfee = 0;
+    CAmount maxfee = 0;
+    CAmount medianfee = 0;
+    CAmount minfeerate = 0;
+    CAmount maxfeerate = 0;
+    CAmount feerate_percentiles[NUM_GETBLOCKSTATS_PERCENTILES] = {0};
+    CAmount total_out = 0;
+    int64_t txs = 0;
+    int64_t ins = 0;
+    int64_t outs = 0;
+    int64_t total_size = 0;
+    int64_t total_weight = 0;
+    int64_t swtxs = 0;
+    int64_t utxo_increase = 0;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(height);
+        READWRITE(time);
+        READWRITE(algo);
+        READWRITE(auxpow);
+        READWRITE(subsidy);
+        READWRITE(totalfee);
+        READWRITE(minfee);
+        READWRITE(maxfee);
+        READWRITE(medianfee);
+        READWRITE(minfeerate);
+        READWRITE(maxfeerate);
+        for (int i = 0; i < NUM_GETBLOCKSTATS_PERCENTILES; ++i) {
+            READWRITE(feerate_percentiles[i]);
+        }
+        READWRITE(total_out);
+        READWRITE(txs);
+        READWRITE(ins);
+        READWRITE(outs);
+        READWRITE(total_size);
+        READWRITE(total_weight);
+        READWRITE(swtxs);
+        READWRITE(utxo_increase);
+    }
+};
+
+/** Compute the statistics of a block from the block and its undo data. */
+void ComputeBlockStats(const CBlock& block, const CBlockUndo& block_undo, const CBlockIndex* pindex, CBlockStats& stats);
+
+/**
+ * Used by getblockstats to get feerates at different percentiles by weight.
+ *
+ * @param[out] result   Percentile feerates
+ * @param[in]  scores   Pairs of (feerate, weight), sorted in place
+ * @param[in]  total_weight Sum of the weights in scores
+ */
+void CalculatePercentilesByWeight(CAmount result[NUM_GETBLOCKSTATS_PERCENTILES], std::vector<std::pair<CAmount, int64_t>>& scores, int64_t total_weight);
+
+/**
+ * BlockStatsIndex stores the statistics of every block, so getblockstats and
+ * getchainalgostats can answer from one small record per block instead of
+ * reading and deserializing the blocks and their undo data. Records are keyed
+ * by block hash, so those of reorganised blocks stay valid.
+ */
+class BlockStatsIndex final : public BaseIndex
+{
+protected:
+    class DB;
+
+private:
+    const std::unique_ptr<DB> m_db;
+
+protected:
+    bool WriteBlock(const CBlock& block, const CBlockIndex* pindex) override;
+
+    BaseIndex::DB& GetDB() const override;
+
+    const char* GetName() const override { return "blockstatsindex"; }
+
+public:
+    /// Constructs the index, which becomes available to be queried.
+    explicit BlockStatsIndex(size_t n_cache_size, bool f_memory = false, bool f_wipe = false);
+
+    // Destructor is declared because this class contains a unique_ptr to an incomplete type.
+    virtual ~BlockStatsIndex() override;
+
+    /// Look up the statistics of a block. Returns false if it is not indexed.
+    bool LookupStats(const CBlockIndex* block_index, CBlockStats& stats) const;
+};
+
+/// The global block stats index. May be null.
+extern std::unique_ptr<BlockStatsIndex> g_blockstatsindex;
+
+#endif // BITCOIN_INDEX_BLOCKSTATSINDEX_H
@@ -0,0 +1,111 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <mappedfile.h>
+
+#include <compat.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CMappedFile::~CMappedFile()
+{
+#ifndef WIN32
+    if (m_size) {
+        munmap(const_cast<unsigned char*>(m_data), m_size);
+    }
+#endif
+}
+
+std::shared_ptr<const CMappedFile> CMappedFile::Open(const fs::path& path)
+{
+#ifdef WIN32
+    return nullptr;
+#else
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return nullptr;
+    }
+    size_t size = st.st_size;
+    void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps the file referenced, so the descriptor is not needed any more.
+    close(fd);
+    if (data == MAP_FAILED) {
+        return nullptr;
+    }
+    return std::shared_ptr<const CMappedFile>(new CMappedFile((const unsigned char*)data, size));
+#endif
+}
+
+std::shared_ptr<const CMappedFile> CMappedFileCache::Get(const fs::path& path, size_t min_size)
+{
+    if (m_max_mappings == 0) {
+        return nullptr;
+    }
+
+    LOCK(cs);
+    for (auto it = m_mappings.begin(); it != m_mappings.end(); ++it) {
+        if (it->first != path) continue;
+        if (it->second->size() >= min_size) {
+            m_mappings.splice(m_mappings.begin(), m_mappings, it);
+            return it->second;
+        }
+        // The file has been appended to since it was mapped.
+        m_mappings.erase(it);
+        break;
+    }
+
+    std::shared_ptr<const CMappedFile> mapping = CMappedFile::Open(path);
+    if (!mapping) {
+        return nullptr;
+    }
+    m_mappings.emplace_front(path, mapping);
+    m_opened.remove_if([](const std::pair<fs::path, std::weak_ptr<const CMappedFile>>& entry) { return entry.second.expired(); });
+    m_opened.emplace_back(path, mapping);
+    if (m_mappings.size() > m_max_mappings) {
+        m_mappings.pop_back();
+    }
+    if (mapping->size() < min_size) {
+        return nullptr;
+    }
+    return mapping;
+}
+
+void CMappedFileCache::Forget(const fs::path& path)
+{
+    LOCK(cs);
+    m_mappings.remove_if([&path](const std::pair<fs::path, std::shared_ptr<const CMappedFile>>& entry) { return entry.first == path; });
+}
+
+bool CMappedFileCache::InUse(const fs::path& path)
+{
+    LOCK(cs);
+    m_opened.remove_if([](const std::pair<fs::path, std::weak_ptr<const CMappedFile>>& entry) { return entry.second.expired(); });
+    for (const auto& opened : m_opened) {
+        if (opened.first != path) continue;
+        std::shared_ptr<const CMappedFile> mapping = opened.second.lock();
+        if (!mapping) continue;
+        // Owners besides the one just taken and the cache
+        long owners = mapping.use_count() - 1;
+        for (const auto& cached : m_mappings) {
+            if (cached.second == mapping) --owners;
+        }
+        if (owners > 0) return true;
+    }
+    return false;
+}
+
+void CMappedFileCache::Clear()
+{
+    LOCK(cs);
+    m_mappings.clear();
+}
@@ -0,0 +1,111 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MAPPEDFILE_H
+#define BITCOIN_MAPPEDFILE_H
+
+#include <fs.h>
+#include <sync.h>
+
+#include <list>
+#include <memory>
+#include <string>
+
+/** A read-only memory mapping of a whole file. */
+class CMappedFile
+{
+private:
+    const unsigned char* m_data;
+    size_t m_size;
+
+    CMappedFile(const unsigned char* data, size_t size) : m_data(data), m_size(size) {}
+
+public:
+    CMappedFile(const CMappedFile&) = delete;
+    CMappedFile& operator=(const CMappedFile&) = delete;
+    ~CMappedFile();
+
+    /**
+     * Map the file at path. Returns null if the file cannot be mapped, which
+     * is always the case on platforms without mmap; callers then fall back to
+     * reading the file with stdio.
+     */
+    static std::shared_ptr<const CMappedFile> Open(const fs::path& path);
+
+    const unsigned char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+};
+
+/**
+ * A span of bytes in a mapped file. The mapping stays alive for as long as the
+ * span does, even if it is evicted from the cache that handed it out.
+ * Serializes as the raw bytes it covers.
+ */
+class CMappedSpan
+{
+private:
+    std::shared_ptr<const CMappedFile> m_file;
+    const unsigned char* m_begin = nullptr;
+    size_t m_size = 0;
+
+public:
+    CMappedSpan() {}
+    CMappedSpan(std::shared_ptr<const CMappedFile> file, const unsigned char* begin, size_t size)
+        : m_file(std::move(file)), m_begin(begin), m_size(size) {}
+
+    const unsigned char* begin() const { return m_begin; }
+    const unsigned char* end() const { return m_begin + m_size; }
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    template<typename Stream>
+    void Serialize(Stream& s) const
+    {
+        s.write((const char*)m_begin, m_size);
+    }
+};
+
+/**
+ * Cache of the most recently used file mappings. Block and undo files are
+ * read at random positions over and over (serving blocks to peers, rescans,
+ * index building), so keeping their mappings around saves opening, seeking
+ * and copying through a stdio buffer on every read.
+ */
+class CMappedFileCache
+{
+private:
+    const size_t m_max_mappings;
+
+    CCriticalSection cs;
+    //! Most recently used first
+    std::list<std::pair<fs::path, std::shared_ptr<const CMappedFile>>> m_mappings;
+    //! Every mapping handed out that may still be alive, cached or not
+    std::list<std::pair<fs::path, std::weak_ptr<const CMappedFile>>> m_opened;
+
+public:
+    explicit CMappedFileCache(size_t max_mappings) : m_max_mappings(max_mappings) {}
+
+    /**
+     * Get a mapping of the file at path that is at least min_size bytes long,
+     * remapping it if the file has grown since it was mapped. Returns null if
+     * the file cannot be mapped or is shorter than min_size.
+     */
+    std::shared_ptr<const CMappedFile> Get(const fs::path& path, size_t min_size);
+
+    /** Drop the mapping of a file, e.g. because it is about to be deleted or truncated. */
+    void Forget(const fs::path& path);
+
+    /**
+     * Whether a mapping of the file is still used outside the cache, e.g. by
+     * a span being sent to a peer. Such a file should be neither deleted, as
+     * the mapping would keep its disk space, nor truncated, as reading a
+     * mapping past the new end of its file raises SIGBUS.
+     */
+    bool InUse(const fs::path& path);
+
+    /** Drop all mappings. */
+    void Clear();
+};
+
+#endif // BITCOIN_MAPPEDFILE_H
@@ -31,6 +31,8 @@
 #include <queue>
 #include <utility>
 
+#include <boost/bind.hpp>
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // BitcoinMiner
@@ -42,8 +44,8 @@
 // pool, we select by highest fee rate of a transaction combined with all
 // its ancestors.
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockWeight = 0;
+std::atomic<uint64_t> nLastBlockTx{0};
+std::atomic<uint64_t> nLastBlockWeight{0};
 
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
 {
@@ -63,6 +65,23 @@ int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParam
     return nNewTime - nOldTime;
 }
 
+// Create the coinbase transaction of a template, paying the subsidy and the
+// fees of its transactions to scriptPubKeyIn, and commit to their witnesses.
+static void FinishCoinbase(CBlockTemplate& tmpl, const CScript& scriptPubKeyIn, CAmount nSubsidy, CAmount nFees, int nHeight, const CBlockIndex* pindexPrev, const Consensus::Params& consensusParams)
+{
+    CMutableTransaction coinbaseTx;
+    coinbaseTx.vin.resize(1);
+    coinbaseTx.vin[0].prevout.SetNull();
+    coinbaseTx.vout.resize(1);
+    coinbaseTx.vout[0].scriptPubKey = scriptPubKeyIn;
+    coinbaseTx.vout[0].nValue = nFees + nSubsidy;
+    coinbaseTx.vin[0].scriptSig = CScript() << nHeight << OP_0;
+    tmpl.block.vtx[0] = MakeTransactionRef(std::move(coinbaseTx));
+    tmpl.vchCoinbaseCommitment = GenerateCoinbaseCommitment(tmpl.block, pindexPrev, consensusParams);
+    tmpl.vTxFees[0] = -nFees;
+    tmpl.vTxSigOpsCost[0] = WITNESS_SCALE_FACTOR * GetLegacySigOpCount(*tmpl.block.vtx[0]);
+}
+
 BlockAssembler::Options::Options() {
     blockMinFeeRate = CFeeRate(DEFAULT_BLOCK_MIN_TX_FEE);
     nBlockMaxWeight = DEFAULT_BLOCK_MAX_WEIGHT;
@@ -95,8 +114,6 @@ BlockAssembler::BlockAssembler(const CChainParams& params) : BlockAssembler(para
 
 void BlockAssembler::resetBlock()
 {
-    inBlock.clear();
-
     // Reserve space for coinbase tx
     nBlockWeight = 4000;
     nBlockSigOpsCost = 400;
@@ -157,9 +174,8 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     // transaction (which in most cases can be a no-op).
     fIncludeWitness = IsWitnessEnabled(pindexPrev, chainparams.GetConsensus()) && fMineWitnessTx;
 
-    int nPackagesSelected = 0;
-    int nDescendantsUpdated = 0;
-    addPackageTxs(nPackagesSelected, nDescendantsUpdated);
+    int nChunksSelected = 0;
+    addChunkTxs(nChunksSelected);
 
     int64_t nTime1 = GetTimeMicros();
 
@@ -168,17 +184,7 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
 
     int nBits = GetNextWorkRequired(pindexPrev, pblock, algo, chainparams.GetConsensus());
 
-    // Create coinbase transaction.
-    CMutableTransaction coinbaseTx;
-    coinbaseTx.vin.resize(1);
-    coinbaseTx.vin[0].prevout.SetNull();
-    coinbaseTx.vout.resize(1);
-    coinbaseTx.vout[0].scriptPubKey = scriptPubKeyIn;
-    coinbaseTx.vout[0].nValue = nFees + GetBlockSubsidy(nHeight, nBits, chainparams.GetConsensus());
-    coinbaseTx.vin[0].scriptSig = CScript() << nHeight << OP_0;
-    pblock->vtx[0] = MakeTransactionRef(std::move(coinbaseTx));
-    pblocktemplate->vchCoinbaseCommitment = GenerateCoinbaseCommitment(*pblock, pindexPrev, chainparams.GetConsensus());
-    pblocktemplate->vTxFees[0] = -nFees;
+    FinishCoinbase(*pblocktemplate, scriptPubKeyIn, GetBlockSubsidy(nHeight, nBits, chainparams.GetConsensus()), nFees, nHeight, pindexPrev, chainparams.GetConsensus());
 
     LogPrintf("CreateNewBlock(): block weight: %u txs: %u fees: %ld sigops %d\n", GetBlockWeight(*pblock), nBlockTx, nFees, nBlockSigOpsCost);
 
@@ -187,7 +193,6 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev);
     pblock->nBits          = nBits;
     pblock->nNonce         = 0;
-    pblocktemplate->vTxSigOpsCost[0] = WITNESS_SCALE_FACTOR * GetLegacySigOpCount(*pblock->vtx[0]);
 
     CValidationState state;
     if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
@@ -195,24 +200,11 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     }
     int64_t nTime2 = GetTimeMicros();
 
-    LogPrint(BCLog::BENCH, "CreateNewBlock() packages: %.2fms (%d packages, %d updated descendants), validity: %.2fms (total %.2fms)\n", 0.001 * (nTime1 - nTimeStart), nPackagesSelected, nDescendantsUpdated, 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
+    LogPrint(BCLog::BENCH, "CreateNewBlock() chunks: %.2fms (%d chunks), validity: %.2fms (total %.2fms)\n", 0.001 * (nTime1 - nTimeStart), nChunksSelected, 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
 
     return std::move(pblocktemplate);
 }
 
-void BlockAssembler::onlyUnconfirmed(CTxMemPool::setEntries& testSet)
-{
-    for (CTxMemPool::setEntries::iterator iit = testSet.begin(); iit != testSet.end(); ) {
-        // Only test txs not already in the block
-        if (inBlock.count(*iit)) {
-            testSet.erase(iit++);
-        }
-        else {
-            iit++;
-        }
-    }
-}
-
 bool BlockAssembler::TestPackage(uint64_t packageSize, int64_t packageSigOpsCost) const
 {
     // TODO: switch to weight-based accounting for packages instead of vsize-based accounting.
@@ -227,7 +219,7 @@ bool BlockAssembler::TestPackage(uint64_t packageSize, int64_t packageSigOpsCost
 // - transaction finality (locktime)
 // - premature witness (in case segwit transactions are added to mempool before
 //   segwit activation)
-bool BlockAssembler::TestPackageTransactions(const CTxMemPool::setEntries& package)
+bool BlockAssembler::TestPackageTransactions(const std::vector<CTxMemPool::txiter>& package)
 {
     for (const CTxMemPool::txiter it : package) {
         if (!IsFinalTx(it->GetTx(), nHeight, nLockTimeCutoff))
@@ -247,7 +239,6 @@ void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
     ++nBlockTx;
     nBlockSigOpsCost += iter->GetSigOpCost();
     nFees += iter->GetFee();
-    inBlock.insert(iter);
 
     bool fPrintPriority = gArgs.GetBoolArg("-printpriority", DEFAULT_PRINTPRIORITY);
     if (fPrintPriority) {
@@ -257,83 +248,34 @@ void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
     }
 }
 
-int BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded,
-        indexed_modified_transaction_set &mapModifiedTx)
+// This transaction selection algorithm takes the chunks of the mempool's
+// cluster linearizations by feerate. The chunks of a cluster have feerates
+// that never increase, and a chunk only depends on chunks of its cluster
+// that come before it, so taking the best next chunk of any cluster each
+// time gives chunks in feerate order, in an order that is valid for a block.
+// Nothing needs to be updated as transactions get selected.
+void BlockAssembler::addChunkTxs(int &nChunksSelected)
 {
-    int nDescendantsUpdated = 0;
-    for (const CTxMemPool::txiter it : alreadyAdded) {
-        CTxMemPool::setEntries descendants;
-        mempool.CalculateDescendants(it, descendants);
-        // Insert all descendants (not yet in block) into the modified set
-        for (CTxMemPool::txiter desc : descendants) {
-            if (alreadyAdded.count(desc))
-                continue;
-            ++nDescendantsUpdated;
-            modtxiter mit = mapModifiedTx.find(desc);
-            if (mit == mapModifiedTx.end()) {
-                CTxMemPoolModifiedEntry modEntry(desc);
-                modEntry.nSizeWithAncestors -= it->GetTxSize();
-                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
-                modEntry.nSigOpCostWithAncestors -= it->GetSigOpCost();
-                mapModifiedTx.insert(modEntry);
-            } else {
-                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
-            }
-        }
+    // The next chunk of a cluster
+    struct NextChunk {
+        uint64_t nClusterId;
+        const CTxMemPool::TxCluster* pcluster;
+        size_t nChunk;
+        size_t nPos; //!< Position of the chunk's first entry in the linearization
+        const ClusterChunk& Chunk() const { return pcluster->vChunks[nChunk]; }
+    };
+    // Highest feerate on top; ties go to the older cluster
+    auto compare = [](const NextChunk& a, const NextChunk& b) {
+        if (FeeRateLess(a.Chunk(), b.Chunk())) return true;
+        if (FeeRateLess(b.Chunk(), a.Chunk())) return false;
+        return a.nClusterId > b.nClusterId;
+    };
+    std::vector<NextChunk> vNext;
+    vNext.reserve(mempool.GetClusters().size());
+    for (const auto& item : mempool.GetClusters()) {
+        vNext.push_back(NextChunk{item.first, &item.second, 0, 0});
     }
-    return nDescendantsUpdated;
-}
-
-// Skip entries in mapTx that are already in a block or are present
-// in mapModifiedTx (which implies that the mapTx ancestor state is
-// stale due to ancestor inclusion in the block)
-// Also skip transactions that we've already failed to add. This can happen if
-// we consider a transaction in mapModifiedTx and it fails: we can then
-// potentially consider it again while walking mapTx.  It's currently
-// guaranteed to fail again, but as a belt-and-suspenders check we put it in
-// failedTx and avoid re-evaluation, since the re-evaluation would be using
-// cached size/sigops/fee values that are not actually correct.
-bool BlockAssembler::SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set &mapModifiedTx, CTxMemPool::setEntries &failedTx)
-{
-    assert (it != mempool.mapTx.end());
-    return mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it);
-}
-
-void BlockAssembler::SortForBlock(const CTxMemPool::setEntries& package, CTxMemPool::txiter entry, std::vector<CTxMemPool::txiter>& sortedEntries)
-{
-    // Sort package by ancestor count
-    // If a transaction A depends on transaction B, then A's ancestor count
-    // must be greater than B's.  So this is sufficient to validly order the
-    // transactions for block inclusion.
-    sortedEntries.clear();
-    sortedEntries.insert(sortedEntries.begin(), package.begin(), package.end());
-    std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
-}
-
-// This transaction selection algorithm orders the mempool based
-// on feerate of a transaction including all unconfirmed ancestors.
-// Since we don't remove transactions from the mempool as we select them
-// for block inclusion, we need an alternate method of updating the feerate
-// of a transaction with its not-yet-selected ancestors as we go.
-// This is accomplished by walking the in-mempool descendants of selected
-// transactions and storing a temporary modified state in mapModifiedTxs.
-// Each time through the loop, we compare the best transaction in
-// mapModifiedTxs with the next transaction in the mempool to decide what
-// transaction package to work on next.
-void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpdated)
-{
-    // mapModifiedTx will store sorted packages after they are modified
-    // because some of their txs are already in the block
-    indexed_modified_transaction_set mapModifiedTx;
-    // Keep track of entries that failed inclusion, to avoid duplicate work
-    CTxMemPool::setEntries failedTx;
-
-    // Start by adding all descendants of previously added txs to mapModifiedTx
-    // and modifying them for their already included ancestors
-    UpdatePackagesForAdded(inBlock, mapModifiedTx);
-
-    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
-    CTxMemPool::txiter iter;
+    std::priority_queue<NextChunk, std::vector<NextChunk>, decltype(compare)> queue(compare, std::move(vNext));
 
     // Limit the number of attempts to add transactions to the block when it is
     // close to full; this is just a simple heuristic to finish quickly if the
@@ -341,68 +283,26 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
     const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
     int64_t nConsecutiveFailed = 0;
 
-    while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty())
-    {
-        // First try to find a new transaction in mapTx to evaluate.
-        if (mi != mempool.mapTx.get<ancestor_score>().end() &&
-                SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx, failedTx)) {
-            ++mi;
-            continue;
-        }
-
-        // Now that mi is not stale, determine which transaction to evaluate:
-        // the next entry from mapTx, or the best from mapModifiedTx?
-        bool fUsingModified = false;
-
-        modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
-        if (mi == mempool.mapTx.get<ancestor_score>().end()) {
-            // We're out of entries in mapTx; use the entry from mapModifiedTx
-            iter = modit->iter;
-            fUsingModified = true;
-        } else {
-            // Try to compare the mapTx entry to the mapModifiedTx entry
-            iter = mempool.mapTx.project<0>(mi);
-            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
-                    CompareTxMemPoolEntryByAncestorFee()(*modit, CTxMemPoolModifiedEntry(iter))) {
-                // The best entry in mapModifiedTx has higher score
-                // than the one from mapTx.
-                // Switch which transaction (package) to consider
-                iter = modit->iter;
-                fUsingModified = true;
-            } else {
-                // Either no entry in mapModifiedTx, or it's worse than mapTx.
-                // Increment mi for the next loop iteration.
-                ++mi;
-            }
-        }
-
-        // We skip mapTx entries that are inBlock, and mapModifiedTx shouldn't
-        // contain anything that is inBlock.
-        assert(!inBlock.count(iter));
-
-        uint64_t packageSize = iter->GetSizeWithAncestors();
-        CAmount packageFees = iter->GetModFeesWithAncestors();
-        int64_t packageSigOpsCost = iter->GetSigOpCostWithAncestors();
-        if (fUsingModified) {
-            packageSize = modit->nSizeWithAncestors;
-            packageFees = modit->nModFeesWithAncestors;
-            packageSigOpsCost = modit->nSigOpCostWithAncestors;
-        }
+    while (!queue.empty()) {
+        const NextChunk next = queue.top();
+        queue.pop();
+        const ClusterChunk& chunk = next.Chunk();
 
-        if (packageFees < blockMinFeeRate.GetFee(packageSize)) {
+        if (chunk.nFee < blockMinFeeRate.GetFee(chunk.nSize)) {
             // Everything else we might consider has a lower fee rate
             return;
         }
 
-        if (!TestPackage(packageSize, packageSigOpsCost)) {
-            if (fUsingModified) {
-                // Since we always look at the best entry in mapModifiedTx,
-                // we must erase failed entries so that we can consider the
-                // next best entry on the next loop iteration
-                mapModifiedTx.get<ancestor_score>().erase(modit);
-                failedTx.insert(iter);
-            }
+        const std::vector<CTxMemPool::txiter>& vTxs = next.pcluster->vTxs;
+        const std::vector<CTxMemPool::txiter> package(vTxs.begin() + next.nPos, vTxs.begin() + next.nPos + chunk.nTxCount);
+        int64_t packageSigOpsCost = 0;
+        for (const CTxMemPool::txiter it : package) {
+            packageSigOpsCost += it->GetSigOpCost();
+        }
 
+        // The later chunks of the cluster may depend on a chunk that doesn't
+        // make it in, so they stay out as well
+        if (!TestPackage(chunk.nSize, packageSigOpsCost)) {
             ++nConsecutiveFailed;
 
             if (nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockWeight >
@@ -413,43 +313,245 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
             continue;
         }
 
-        CTxMemPool::setEntries ancestors;
-        uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
-        std::string dummy;
-        mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
-
-        onlyUnconfirmed(ancestors);
-        ancestors.insert(iter);
-
         // Test if all tx's are Final
-        if (!TestPackageTransactions(ancestors)) {
-            if (fUsingModified) {
-                mapModifiedTx.get<ancestor_score>().erase(modit);
-                failedTx.insert(iter);
-            }
+        if (!TestPackageTransactions(package)) {
             continue;
         }
 
-        // This transaction will make it in; reset the failed counter.
+        // This chunk will make it in; reset the failed counter.
         nConsecutiveFailed = 0;
 
-        // Package can be added. Sort the entries in a valid order.
-        std::vector<CTxMemPool::txiter> sortedEntries;
-        SortForBlock(ancestors, iter, sortedEntries);
+        // The linearization has parents before their children
+        for (const CTxMemPool::txiter it : package) {
+            AddToBlock(it);
+        }
+        ++nChunksSelected;
+
+        if (next.nChunk + 1 < next.pcluster->vChunks.size()) {
+            queue.push(NextChunk{next.nClusterId, next.pcluster, next.nChunk + 1, next.nPos + chunk.nTxCount});
+        }
+    }
+}
+
+CBlockTemplateCache g_block_template_cache;
+
+std::unique_ptr<CBlockTemplate> CBlockTemplateCache::GetBlockTemplate(const CScript& scriptPubKeyIn, int algo, bool fMineWitnessTx, int64_t nRebuildInterval)
+{
+    LOCK2(cs_main, mempool.cs);
+    LOCK(cs);
+    const CBlockIndex* pindexPrev = chainActive.Tip();
+    CachedTemplate& cached = mapTemplates[std::make_pair(algo, fMineWitnessTx)];
+
+    // Mempool changes that came without a notification (prioritisetransaction,
+    // or a mempool we don't follow) may change the selection
+    if (cached.nTransactionsUpdated != mempool.GetTransactionsUpdated()) {
+        cached.fImprovable = true;
+        cached.nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    }
+
+    if (!cached.pblocktemplate || cached.pindexPrev != pindexPrev || cached.fStale ||
+            (cached.fImprovable && GetTime() - cached.nTimeAssembled >= nRebuildInterval)) {
+        Assemble(cached, scriptPubKeyIn, algo, fMineWitnessTx);
+        if (!cached.pblocktemplate)
+            return nullptr;
+    } else {
+        if (cached.fCoinbaseStale) {
+            const CScript scriptPubKey = cached.pblocktemplate->block.vtx[0]->vout[0].scriptPubKey;
+            FinishCoinbase(*cached.pblocktemplate, scriptPubKey, cached.nSubsidy, cached.nFees, cached.nHeight, pindexPrev, Params().GetConsensus());
+            cached.fCoinbaseStale = false;
+        }
+        nLastBlockTx = cached.pblocktemplate->block.vtx.size() - 1;
+        nLastBlockWeight = cached.nBlockWeight;
+        ++stats.reused;
+    }
+
+    std::unique_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate(*cached.pblocktemplate));
+    CBlock* pblock = &pblocktemplate->block;
+    if (pblock->vtx[0]->vout[0].scriptPubKey != scriptPubKeyIn) {
+        // The witness commitment doesn't cover the coinbase, so only the
+        // output needs to change
+        CMutableTransaction coinbaseTx(*pblock->vtx[0]);
+        coinbaseTx.vout[0].scriptPubKey = scriptPubKeyIn;
+        pblock->vtx[0] = MakeTransactionRef(std::move(coinbaseTx));
+        pblocktemplate->vTxSigOpsCost[0] = WITNESS_SCALE_FACTOR * GetLegacySigOpCount(*pblock->vtx[0]);
+    }
+    UpdateTime(pblock, Params().GetConsensus(), pindexPrev);
+    pblock->nNonce = 0;
+    return pblocktemplate;
+}
+
+void CBlockTemplateCache::Assemble(CachedTemplate& cached, const CScript& scriptPubKeyIn, int algo, bool fMineWitnessTx)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs);
+
+    cached.pblocktemplate.reset();
+    BlockAssembler assembler(Params());
+    std::unique_ptr<CBlockTemplate> pblocktemplate = assembler.CreateNewBlock(scriptPubKeyIn, algo, fMineWitnessTx);
+    if (!pblocktemplate)
+        return;
+
+    const CBlock& block = pblocktemplate->block;
+    cached.pindexPrev = chainActive.Tip();
+    cached.setInBlock.clear();
+    for (size_t i = 1; i < block.vtx.size(); i++) {
+        cached.setInBlock.insert(block.vtx[i]->GetHash());
+    }
+    cached.fIncludeWitness = assembler.fIncludeWitness;
+    cached.nBlockMaxWeight = assembler.nBlockMaxWeight;
+    cached.blockMinFeeRate = assembler.blockMinFeeRate;
+    cached.nHeight = assembler.nHeight;
+    cached.nLockTimeCutoff = assembler.nLockTimeCutoff;
+    cached.nSubsidy = block.vtx[0]->vout[0].nValue - assembler.nFees;
+    cached.nBlockWeight = assembler.nBlockWeight;
+    cached.nBlockSigOpsCost = assembler.nBlockSigOpsCost;
+    cached.nFees = assembler.nFees;
+    cached.nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    cached.nTimeAssembled = GetTime();
+    cached.fImprovable = false;
+    cached.fStale = false;
+    cached.fCoinbaseStale = false;
+    cached.pblocktemplate = std::move(pblocktemplate);
+    ++stats.assembled;
+}
+
+void CBlockTemplateCache::MempoolEntryAdded(CTransactionRef ptx)
+{
+    // Called from CTxMemPool::addUnchecked, with mempool.cs held and, through
+    // AcceptToMemoryPool, cs_main.
+    AssertLockHeld(mempool.cs);
+    LOCK(cs);
+    CTxMemPool::txiter it = mempool.mapTx.find(ptx->GetHash());
+    assert(it != mempool.mapTx.end());
+    const CTransaction& tx = it->GetTx();
+    const unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+
+    for (auto& item : mapTemplates) {
+        CachedTemplate& cached = item.second;
+        if (!cached.pblocktemplate)
+            continue;
+        if (cached.nTransactionsUpdated + 1 != nTransactionsUpdated)
+            cached.fImprovable = true;
+        cached.nTransactionsUpdated = nTransactionsUpdated;
+
+        // The transaction may spend the inputs of a template transaction
+        // that left the mempool
+        if (cached.fStale)
+            continue;
+
+        // The transaction was accepted on top of the current tip, so it can
+        // only be appended to a template for the same tip
+        if (cached.pindexPrev != chainActive.Tip()) {
+            cached.fImprovable = true;
+            continue;
+        }
+
+        // Transactions that a new selection would skip as well
+        if (!cached.fIncludeWitness && tx.HasWitness())
+            continue;
+        if (!IsFinalTx(tx, cached.nHeight, cached.nLockTimeCutoff))
+            continue;
+
+        // With parents outside the template, the transaction's package could
+        // make it in by a new selection
+        bool fParentsInBlock = true;
+        for (CTxMemPool::txiter parent : mempool.GetMemPoolParents(it)) {
+            if (!cached.setInBlock.count(parent->GetTx().GetHash())) {
+                fParentsInBlock = false;
+                break;
+            }
+        }
+        if (!fParentsInBlock) {
+            cached.fImprovable = true;
+            continue;
+        }
 
-        for (size_t i=0; i<sortedEntries.size(); ++i) {
-            AddToBlock(sortedEntries[i]);
-            // Erase from the modified set, if present
-            mapModifiedTx.erase(sortedEntries[i]);
+        // With its parents in the template, it makes it in by its own feerate
+        if (it->GetModifiedFee() < cached.blockMinFeeRate.GetFee(it->GetTxSize()))
+            continue;
+        if (cached.nBlockWeight + WITNESS_SCALE_FACTOR * it->GetTxSize() >= cached.nBlockMaxWeight ||
+                cached.nBlockSigOpsCost + it->GetSigOpCost() >= MAX_BLOCK_SIGOPS_COST) {
+            cached.fImprovable = true;
+            continue;
         }
 
-        ++nPackagesSelected;
+        CBlockTemplate& tmpl = *cached.pblocktemplate;
+        tmpl.block.vtx.emplace_back(it->GetSharedTx());
+        tmpl.vTxFees.push_back(it->GetFee());
+        tmpl.vTxSigOpsCost.push_back(it->GetSigOpCost());
+        cached.nBlockWeight += it->GetTxWeight();
+        cached.nBlockSigOpsCost += it->GetSigOpCost();
+        cached.nFees += it->GetFee();
+        cached.setInBlock.insert(tx.GetHash());
+        cached.fCoinbaseStale = true;
+        ++stats.appended;
+    }
+}
+
+void CBlockTemplateCache::MempoolEntryRemoved(CTransactionRef ptx, MemPoolRemovalReason reason)
+{
+    // A template transaction that leaves the mempool keeps the template valid
+    // only until another transaction spends its inputs, which a replacement
+    // does right away: the template is not appended to or served any more.
+    // Transactions that are mined or conflict with a block come with a new tip.
+    AssertLockHeld(mempool.cs);
+    LOCK(cs);
+    const unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    for (auto& item : mapTemplates) {
+        CachedTemplate& cached = item.second;
+        if (cached.nTransactionsUpdated + 1 != nTransactionsUpdated)
+            cached.fImprovable = true;
+        if (cached.setInBlock.count(ptx->GetHash()))
+            cached.fStale = true;
+        cached.nTransactionsUpdated = nTransactionsUpdated;
+    }
+}
 
-        // Update transactions that depend on each of these
-        nDescendantsUpdated += UpdatePackagesForAdded(ancestors, mapModifiedTx);
+void CBlockTemplateCache::UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload)
+{
+    if (fInitialDownload)
+        return;
+
+    // Have the templates that were asked for before ready for the new tip
+    LOCK2(cs_main, mempool.cs);
+    LOCK(cs);
+    for (auto& item : mapTemplates) {
+        CachedTemplate& cached = item.second;
+        if (!cached.pblocktemplate || cached.pindexPrev == chainActive.Tip())
+            continue;
+        const CScript scriptPubKey = cached.pblocktemplate->block.vtx[0]->vout[0].scriptPubKey;
+        try {
+            Assemble(cached, scriptPubKey, item.first.first, item.first.second);
+        } catch (const std::runtime_error& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
     }
 }
 
+void CBlockTemplateCache::RegisterWithMempoolSignals()
+{
+    mempool.NotifyEntryAdded.connect(boost::bind(&CBlockTemplateCache::MempoolEntryAdded, this, _1));
+    mempool.NotifyEntryRemoved.connect(boost::bind(&CBlockTemplateCache::MempoolEntryRemoved, this, _1, _2));
+}
+
+void CBlockTemplateCache::UnregisterWithMempoolSignals()
+{
+    mempool.NotifyEntryAdded.disconnect(boost::bind(&CBlockTemplateCache::MempoolEntryAdded, this, _1));
+    mempool.NotifyEntryRemoved.disconnect(boost::bind(&CBlockTemplateCache::MempoolEntryRemoved, this, _1, _2));
+}
+
+void CBlockTemplateCache::Clear()
+{
+    LOCK(cs);
+    mapTemplates.clear();
+}
+
+CBlockTemplateCache::Stats CBlockTemplateCache::GetStats() const
+{
+    LOCK(cs);
+    return stats;
+}
+
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -7,12 +7,14 @@
 #define BITCOIN_MINER_H
 
 #include <primitives/block.h>
+#include <sync.h>
 #include <txmempool.h>
+#include <validationinterface.h>
 
 #include <stdint.h>
+#include <map>
 #include <memory>
-#include <boost/multi_index_container.hpp>
-#include <boost/multi_index/ordered_index.hpp>
+#include <set>
 
 class CBlockIndex;
 class CChainParams;
@@ -30,98 +32,11 @@ struct CBlockTemplate
     std::vector<unsigned char> vchCoinbaseCommitment;
 };
 
-// Container for tracking updates to ancestor feerate as we include (parent)
-// transactions in a block
-struct CTxMemPoolModifiedEntry {
-    explicit CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
-    {
-        iter = entry;
-        nSizeWithAncestors = entry->GetSizeWithAncestors();
-        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
-        nSigOpCostWithAncestors = entry->GetSigOpCostWithAncestors();
-    }
-
-    int64_t GetModifiedFee() const { return iter->GetModifiedFee(); }
-    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
-    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
-    size_t GetTxSize() const { return iter->GetTxSize(); }
-    const CTransaction& GetTx() const { return iter->GetTx(); }
-
-    CTxMemPool::txiter iter;
-    uint64_t nSizeWithAncestors;
-    CAmount nModFeesWithAncestors;
-    int64_t nSigOpCostWithAncestors;
-};
-
-/** Comparator for CTxMemPool::txiter objects.
- *  It simply compares the internal memory address of the CTxMemPoolEntry object
- *  pointed to. This means it has no meaning, and is only useful for using them
- *  as key in other indexes.
- */
-struct CompareCTxMemPoolIter {
-    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
-    {
-        return &(*a) < &(*b);
-    }
-};
-
-struct modifiedentry_iter {
-    typedef CTxMemPool::txiter result_type;
-    result_type operator() (const CTxMemPoolModifiedEntry &entry) const
-    {
-        return entry.iter;
-    }
-};
-
-// A comparator that sorts transactions based on number of ancestors.
-// This is sufficient to sort an ancestor package in an order that is valid
-// to appear in a block.
-struct CompareTxIterByAncestorCount {
-    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b) const
-    {
-        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
-            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
-        return CTxMemPool::CompareIteratorByHash()(a, b);
-    }
-};
-
-typedef boost::multi_index_container<
-    CTxMemPoolModifiedEntry,
-    boost::multi_index::indexed_by<
-        boost::multi_index::ordered_unique<
-            modifiedentry_iter,
-            CompareCTxMemPoolIter
-        >,
-        // sorted by modified ancestor fee rate
-        boost::multi_index::ordered_non_unique<
-            // Reuse same tag from CTxMemPool's similar index
-            boost::multi_index::tag<ancestor_score>,
-            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
-            CompareTxMemPoolEntryByAncestorFee
-        >
-    >
-> indexed_modified_transaction_set;
-
-typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
-typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
-
-struct update_for_parent_inclusion
-{
-    explicit update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
-
-    void operator() (CTxMemPoolModifiedEntry &e)
-    {
-        e.nModFeesWithAncestors -= iter->GetFee();
-        e.nSizeWithAncestors -= iter->GetTxSize();
-        e.nSigOpCostWithAncestors -= iter->GetSigOpCost();
-    }
-
-    CTxMemPool::txiter iter;
-};
-
 /** Generate a new block, without valid proof-of-work */
 class BlockAssembler
 {
+    friend class CBlockTemplateCache;
+
 private:
     // The constructed block template
     std::unique_ptr<CBlockTemplate> pblocktemplate;
@@ -138,7 +53,6 @@ private:
     uint64_t nBlockTx;
     uint64_t nBlockSigOpsCost;
     CAmount nFees;
-    CTxMemPool::setEntries inBlock;
 
     // Chain context for the block
     int nHeight;
@@ -166,32 +80,102 @@ private:
     void AddToBlock(CTxMemPool::txiter iter);
 
     // Methods for how to add transactions to a block.
-    /** Add transactions based on feerate including unconfirmed ancestors
-      * Increments nPackagesSelected / nDescendantsUpdated with corresponding
-      * statistics from the package selection (for logging statistics). */
-    void addPackageTxs(int &nPackagesSelected, int &nDescendantsUpdated);
-
-    // helper functions for addPackageTxs()
-    /** Remove confirmed (inBlock) entries from given set */
-    void onlyUnconfirmed(CTxMemPool::setEntries& testSet);
+    /** Add transactions by the chunks of the mempool's cluster linearizations,
+      * highest feerate first. Increments nChunksSelected (for logging
+      * statistics). */
+    void addChunkTxs(int &nChunksSelected);
+
+    // helper functions for addChunkTxs()
     /** Test if a new package would "fit" in the block */
     bool TestPackage(uint64_t packageSize, int64_t packageSigOpsCost) const;
     /** Perform checks on each transaction in a package:
       * locktime, premature-witness, serialized size (if necessary)
       * These checks should always succeed, and they're here
       * only as an extra check in case of suboptimal node configuration */
-    bool TestPackageTransactions(const CTxMemPool::setEntries& package);
-    /** Return true if given transaction from mapTx has already been evaluated,
-      * or if the transaction's cached data in mapTx is incorrect. */
-    bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set &mapModifiedTx, CTxMemPool::setEntries &failedTx);
-    /** Sort the package in an order that is valid to appear in a block */
-    void SortForBlock(const CTxMemPool::setEntries& package, CTxMemPool::txiter entry, std::vector<CTxMemPool::txiter>& sortedEntries);
-    /** Add descendants of given transactions to mapModifiedTx with ancestor
-      * state updated assuming given transactions are inBlock. Returns number
-      * of updated descendants. */
-    int UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set &mapModifiedTx);
+    bool TestPackageTransactions(const std::vector<CTxMemPool::txiter>& package);
 };
 
+/**
+ * Keeps the block templates of earlier requests up to date as transactions
+ * enter and leave the mempool, so that getblocktemplate and createauxblock
+ * don't select packages from scratch for every request.
+ *
+ * A transaction that enters the mempool is appended to a template if it fits
+ * and all its in-mempool parents are in the template already. Other mempool
+ * changes that a new selection could do better with (a package that doesn't
+ * fit, a prioritisation) only mark the template as improvable; it is then
+ * assembled again once it is older than the rebuild interval of the request.
+ * A template transaction that leaves the mempool (replaced, evicted, expired)
+ * may have its inputs spent again by the next transaction to enter it, so
+ * such a template is no longer appended to and is assembled again on the next
+ * request, however old. Templates are assembled again as soon as the tip
+ * changes.
+ */
+class CBlockTemplateCache : public CValidationInterface
+{
+public:
+    struct Stats {
+        uint64_t assembled = 0;
+        uint64_t reused = 0;
+        uint64_t appended = 0;
+    };
+
+    /** Return a template on top of the current tip with coinbase to
+     *  scriptPubKeyIn. A cached template is returned unless a new selection
+     *  could improve on it and it is at least nRebuildInterval seconds old. */
+    std::unique_ptr<CBlockTemplate> GetBlockTemplate(const CScript& scriptPubKeyIn, int algo, bool fMineWitnessTx=true, int64_t nRebuildInterval=0);
+
+    /** Follow the transactions entering and leaving the global mempool */
+    void RegisterWithMempoolSignals();
+    void UnregisterWithMempoolSignals();
+
+    void Clear();
+    Stats GetStats() const;
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload) override;
+
+private:
+    struct CachedTemplate {
+        std::unique_ptr<CBlockTemplate> pblocktemplate;
+        const CBlockIndex* pindexPrev = nullptr;
+        std::set<uint256> setInBlock;
+
+        // Limits and chain context the template was assembled with
+        bool fIncludeWitness = false;
+        unsigned int nBlockMaxWeight = 0;
+        CFeeRate blockMinFeeRate;
+        int nHeight = 0;
+        int64_t nLockTimeCutoff = 0;
+        CAmount nSubsidy = 0;
+
+        // Information on the current status of the block
+        uint64_t nBlockWeight = 0;
+        uint64_t nBlockSigOpsCost = 0;
+        CAmount nFees = 0;
+
+        //! Value of mempool.GetTransactionsUpdated() the template has seen
+        unsigned int nTransactionsUpdated = 0;
+        int64_t nTimeAssembled = 0;
+        bool fImprovable = false;
+        //! Whether one of its transactions left the mempool
+        bool fStale = false;
+        //! Whether transactions were appended since the coinbase was made
+        bool fCoinbaseStale = false;
+    };
+
+    void Assemble(CachedTemplate& cached, const CScript& scriptPubKeyIn, int algo, bool fMineWitnessTx);
+    void MempoolEntryAdded(CTransactionRef ptx);
+    void MempoolEntryRemoved(CTransactionRef ptx, MemPoolRemovalReason reason);
+
+    mutable CCriticalSection cs;
+    //! Templates by algo and whether they may contain witness transactions
+    std::map<std::pair<int, bool>, CachedTemplate> mapTemplates;
+    Stats stats;
+};
+
+extern CBlockTemplateCache g_block_template_cache;
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
@@ -0,0 +1,105 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <policy/cluster.h>
+
+#include <assert.h>
+
+std::vector<uint32_t> LinearizeCluster(const std::vector<ClusterTx>& vTxs)
+{
+    const uint32_t n = vTxs.size();
+    const size_t nWords = (n + 63) / 64;
+
+    // A topological order, so that ancestor sets can be built from the ones
+    // of the parents
+    std::vector<uint32_t> vTopo;
+    vTopo.reserve(n);
+    std::vector<size_t> vParentsLeft(n);
+    std::vector<std::vector<uint32_t>> vChildren(n);
+    for (uint32_t i = 0; i < n; i++) {
+        vParentsLeft[i] = vTxs[i].vParents.size();
+        for (uint32_t nParent : vTxs[i].vParents) {
+            vChildren[nParent].push_back(i);
+        }
+        if (vParentsLeft[i] == 0) vTopo.push_back(i);
+    }
+    for (size_t k = 0; k < vTopo.size(); k++) {
+        for (uint32_t nChild : vChildren[vTopo[k]]) {
+            if (--vParentsLeft[nChild] == 0) vTopo.push_back(nChild);
+        }
+    }
+    assert(vTopo.size() == n);
+    if (n > MAX_LINEARIZE_CLUSTER_SIZE) return vTopo;
+
+    // Ancestor sets as bit vectors, each including the transaction itself
+    std::vector<uint64_t> vAncestors(n * nWords, 0);
+    auto IsAncestor = [&](uint32_t i, uint32_t j) {
+        return (vAncestors[i * nWords + j / 64] >> (j % 64)) & 1;
+    };
+    for (uint32_t i : vTopo) {
+        uint64_t* pAncestors = &vAncestors[i * nWords];
+        pAncestors[i / 64] |= uint64_t{1} << (i % 64);
+        for (uint32_t nParent : vTxs[i].vParents) {
+            const uint64_t* pParentAncestors = &vAncestors[nParent * nWords];
+            for (size_t w = 0; w < nWords; w++) {
+                pAncestors[w] |= pParentAncestors[w];
+            }
+        }
+    }
+
+    // Fee and size of each transaction with its ancestors that are not in
+    // the linearization yet
+    std::vector<CAmount> vFees(n, 0);
+    std::vector<int64_t> vSizes(n, 0);
+    for (uint32_t i = 0; i < n; i++) {
+        for (uint32_t j = 0; j < n; j++) {
+            if (IsAncestor(i, j)) {
+                vFees[i] += vTxs[j].nFee;
+                vSizes[i] += vTxs[j].nSize;
+            }
+        }
+    }
+
+    std::vector<uint32_t> vOrder;
+    vOrder.reserve(n);
+    std::vector<bool> vTaken(n, false);
+    while (vOrder.size() < n) {
+        // Ties go to the transaction that comes first topologically
+        uint32_t nBest = n;
+        for (uint32_t i : vTopo) {
+            if (vTaken[i]) continue;
+            if (nBest == n || FeeRateLess(vFees[nBest], vSizes[nBest], vFees[i], vSizes[i])) {
+                nBest = i;
+            }
+        }
+        for (uint32_t j : vTopo) {
+            if (vTaken[j] || !IsAncestor(nBest, j)) continue;
+            vTaken[j] = true;
+            vOrder.push_back(j);
+            for (uint32_t i = 0; i < n; i++) {
+                if (!vTaken[i] && IsAncestor(i, j)) {
+                    vFees[i] -= vTxs[j].nFee;
+                    vSizes[i] -= vTxs[j].nSize;
+                }
+            }
+        }
+    }
+    return vOrder;
+}
+
+std::vector<ClusterChunk> ChunkLinearization(const std::vector<ClusterTx>& vTxs, const std::vector<uint32_t>& vOrder)
+{
+    std::vector<ClusterChunk> vChunks;
+    for (uint32_t i : vOrder) {
+        vChunks.push_back(ClusterChunk{vTxs[i].nFee, vTxs[i].nSize, 1});
+        while (vChunks.size() > 1 && FeeRateLess(vChunks[vChunks.size() - 2], vChunks.back())) {
+            const ClusterChunk chunk = vChunks.back();
+            vChunks.pop_back();
+            vChunks.back().nFee += chunk.nFee;
+            vChunks.back().nSize += chunk.nSize;
+            vChunks.back().nTxCount += chunk.nTxCount;
+        }
+    }
+    return vChunks;
+}
@@ -0,0 +1,70 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_POLICY_CLUSTER_H
+#define BITCOIN_POLICY_CLUSTER_H
+
+#include <amount.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Larger clusters, which only transactions of disconnected blocks or a
+ * -limitclustercount above it create, are kept in topological order
+ * instead of being linearized by feerate.
+ */
+static const uint32_t MAX_LINEARIZE_CLUSTER_SIZE = 1000;
+
+/** A transaction of a cluster: its fee, its size and its in-cluster parents */
+struct ClusterTx
+{
+    CAmount nFee;
+    int64_t nSize;
+    std::vector<uint32_t> vParents; //!< Positions of the direct parents in the cluster
+};
+
+/**
+ * A run of consecutive transactions of a linearization that a miner takes
+ * as a whole: the transactions after the previous chunk that give the
+ * highest feerate together.
+ */
+struct ClusterChunk
+{
+    CAmount nFee;
+    int64_t nSize;
+    uint32_t nTxCount;
+};
+
+/** Whether fee a over size a is a lower feerate than fee b over size b */
+inline bool FeeRateLess(CAmount nFeeA, int64_t nSizeA, CAmount nFeeB, int64_t nSizeB)
+{
+    // Avoid division by rewriting (a/b < c/d) as (a*d < c*b)
+    return (double)nFeeA * nSizeB < (double)nFeeB * nSizeA;
+}
+
+inline bool FeeRateLess(const ClusterChunk& a, const ClusterChunk& b)
+{
+    return FeeRateLess(a.nFee, a.nSize, b.nFee, b.nSize);
+}
+
+/**
+ * Order the transactions of a cluster for mining: parents before their
+ * children, and the transactions that pay for the ones before them early.
+ * Repeatedly takes the set of a transaction and its ancestors not taken yet
+ * that has the highest feerate. Returns positions in vTxs.
+ *
+ * Costs O(n^2) time and space for n transactions, up to
+ * MAX_LINEARIZE_CLUSTER_SIZE.
+ */
+std::vector<uint32_t> LinearizeCluster(const std::vector<ClusterTx>& vTxs);
+
+/**
+ * Split a linearization of vTxs into chunks whose feerates never increase: a
+ * transaction that pays more than the chunk before it joins that chunk.
+ */
+std::vector<ClusterChunk> ChunkLinearization(const std::vector<ClusterTx>& vTxs, const std::vector<uint32_t>& vOrder);
+
+#endif // BITCOIN_POLICY_CLUSTER_H
@@ -6,17 +6,21 @@
 #define BITCOIN_POLICYESTIMATOR_H
 
 #include <amount.h>
+#include <hash.h>
 #include <policy/feerate.h>
 #include <uint256.h>
 #include <random.h>
+#include <support/allocators/pool.h>
 #include <sync.h>
 
 #include <map>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 class CAutoFile;
+class CDataStream;
 class CFeeRate;
 class CTxMemPoolEntry;
 class CTxMemPool;
@@ -65,6 +69,13 @@ class TxConfirmStats;
  * outstanding and use both of these numbers to increase the number of transactions
  * we've seen in that feerate bucket when calculating an estimate for any number
  * of confirmations below the number of blocks they've been outstanding.
+ *
+ * Tracking a transaction costs a bucket lookup and a hash table entry, whose
+ * node is recycled from an arena. estimateSmartFee answers are cached until
+ * the data they are computed from changes: when a block is processed, or when
+ * a transaction that entered the mempool before the last block leaves it.
+ * Transactions entering the mempool don't change any estimate, as estimates
+ * only count unconfirmed transactions that have waited at least one block.
  */
 
 /* Identifier for each of the 3 different TxConfirmStats which will track
@@ -242,8 +253,25 @@ private:
         TxStatsInfo() : blockHeight(0), bucketIndex(0) {}
     };
 
+    /** Salted hasher for the txids of mapMemPoolTxs */
+    class TxidHasher
+    {
+    private:
+        const uint64_t k0, k1;
+
+    public:
+        TxidHasher();
+
+        size_t operator()(const uint256& txid) const {
+            return SipHashUint256(k0, k1, txid);
+        }
+    };
+
+    //! Memory for the nodes of mapMemPoolTxs
+    NodeArena txStatsArena;
+    typedef std::unordered_map<uint256, TxStatsInfo, TxidHasher, std::equal_to<uint256>, pool_allocator<std::pair<const uint256, TxStatsInfo> > > txStatsMap;
     // map of txids to information about that transaction
-    std::map<uint256, TxStatsInfo> mapMemPoolTxs;
+    txStatsMap mapMemPoolTxs;
 
     /** Classes to track historical data on transaction confirmations */
     std::unique_ptr<TxConfirmStats> feeStats;
@@ -253,14 +281,32 @@ private:
     unsigned int trackedTxs;
     unsigned int untrackedTxs;
 
-    std::vector<double> buckets;              // The upper-bound of the range for the bucket (inclusive)
-    std::map<double, unsigned int> bucketMap; // Map of bucket upper-bound to index into all vectors by bucket
+    std::vector<double> buckets;              // The upper-bound of the range for the bucket (inclusive), increasing
 
     mutable CCriticalSection cs_feeEstimator;
 
+    /** A cached estimateSmartFee answer, valid while nGeneration is nEstimateGeneration */
+    struct SmartFeeEstimate
+    {
+        uint64_t nGeneration = 0;
+        CFeeRate feeRate;
+        FeeCalculation feeCalc;
+    };
+
+    //! Bumped whenever the data that estimates are computed from changes
+    uint64_t nEstimateGeneration;
+    //! estimateSmartFee answers by 2 * confTarget + conservative
+    mutable std::vector<SmartFeeEstimate> vSmartFeeCache;
+
     /** Process a transaction confirmed in a block*/
     bool processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry* entry);
 
+    /** Index of the bucket that a feerate falls in */
+    unsigned int bucketIndex(double feerate) const;
+
+    /** estimateSmartFee without the cache */
+    CFeeRate calculateSmartFee(int confTarget, FeeCalculation *feeCalc, bool conservative) const;
+
     /** Helper for estimateSmartFee */
     double estimateCombinedFee(unsigned int confTarget, double successThreshold, bool checkShorterHorizon, EstimationResult *result) const;
     /** Helper for estimateSmartFee */
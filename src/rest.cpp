@@ -3,6 +3,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <blockcache.h>
 #include <chain.h>
 #include <chainparams.h>
 #include <core_io.h>
@@ -146,7 +147,7 @@ static bool rest_headers(HTTPRequest* req,
     std::vector<const CBlockIndex *> headers;
     headers.reserve(count);
     {
-        LOCK(cs_main);
+        LOCK(cs_blockindex);
         BlockMap::const_iterator it = mapBlockIndex.find(hash);
         const CBlockIndex *pindex = (it != mapBlockIndex.end()) ? it->second : nullptr;
         while (pindex != nullptr && chainActive.Contains(pindex)) {
@@ -180,7 +181,7 @@ static bool rest_headers(HTTPRequest* req,
     case RF_JSON: {
         UniValue jsonHeaders(UniValue::VARR);
         {
-            LOCK(cs_main);
+            LOCK(cs_blockindex);
             for (const CBlockIndex *pindex : headers) {
                 jsonHeaders.push_back(blockheaderToJSON(pindex));
             }
@@ -209,8 +210,9 @@ static bool rest_block(HTTPRequest* req,
     if (!ParseHashStr(hashStr, hash))
         return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
 
-    CBlock block;
     CBlockIndex* pblockindex = nullptr;
+    // Where the block is stored, copied while cs_main guards it
+    CDiskBlockPos blockPos;
     {
         LOCK(cs_main);
         if (mapBlockIndex.count(hash) == 0)
@@ -219,24 +221,30 @@ static bool rest_block(HTTPRequest* req,
         pblockindex = mapBlockIndex[hash];
         if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
             return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not available (pruned data)");
+        blockPos = pblockindex->GetBlockPos();
+    }
 
-        if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
+    // Binary and hex replies are served from the cache of serialized blocks
+    CSerializedBlockRef block_data;
+    CBlock block;
+    if (rf == RF_BINARY || rf == RF_HEX) {
+        block_data = GetSerializedBlock(hash, blockPos, !(RPCSerializationFlags() & SERIALIZE_TRANSACTION_NO_WITNESS), Params().GetConsensus());
+        if (!block_data)
             return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
+    } else if (!ReadBlockFromDisk(block, blockPos, Params().GetConsensus()) || block.GetHash() != hash) {
+        return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
     }
 
-    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
-    ssBlock << block;
-
     switch (rf) {
     case RF_BINARY: {
-        std::string binaryBlock = ssBlock.str();
+        std::string binaryBlock(block_data->data.begin(), block_data->data.end());
         req->WriteHeader("Content-Type", "application/octet-stream");
         req->WriteReply(HTTP_OK, binaryBlock);
         return true;
     }
 
     case RF_HEX: {
-        std::string strHex = HexStr(ssBlock.begin(), ssBlock.end()) + "\n";
+        std::string strHex = HexStr(block_data->data.begin(), block_data->data.end()) + "\n";
         req->WriteHeader("Content-Type", "text/plain");
         req->WriteReply(HTTP_OK, strHex);
         return true;
@@ -571,6 +579,61 @@ static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
     }
 }
 
+UniValue getaddressutxos(const JSONRPCRequest& request);
+UniValue getaddresshistory(const JSONRPCRequest& request);
+
+static bool rest_address(HTTPRequest* req, const std::string& strURIPart, rpcfn_type actor)
+{
+    if (!CheckWarmup(req))
+        return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+    std::vector<std::string> path;
+    boost::split(path, param, boost::is_any_of("/"));
+
+    if (path.size() != 1 && path.size() != 3)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid URI format. Use /rest/address/<utxos|history>/<address>[/<skip>/<count>].json");
+
+    switch (rf) {
+    case RF_JSON: {
+        JSONRPCRequest jsonRequest;
+        jsonRequest.params = UniValue(UniValue::VARR);
+        jsonRequest.params.push_back(path[0]);
+        if (path.size() == 3) {
+            int32_t skip, count;
+            if (!ParseInt32(path[1], &skip) || !ParseInt32(path[2], &count))
+                return RESTERR(req, HTTP_BAD_REQUEST, "Invalid skip or count: " + path[1] + "/" + path[2]);
+            jsonRequest.params.push_back(skip);
+            jsonRequest.params.push_back(count);
+        }
+
+        UniValue result;
+        try {
+            result = actor(jsonRequest);
+        } catch (const UniValue& objError) {
+            return RESTERR(req, HTTP_BAD_REQUEST, find_value(objError, "message").get_str());
+        }
+        std::string strJSON = result.write() + "\n";
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
+        return true;
+    }
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: json)");
+    }
+    }
+}
+
+static bool rest_address_utxos(HTTPRequest* req, const std::string& strURIPart)
+{
+    return rest_address(req, strURIPart, getaddressutxos);
+}
+
+static bool rest_address_history(HTTPRequest* req, const std::string& strURIPart)
+{
+    return rest_address(req, strURIPart, getaddresshistory);
+}
+
 static const struct {
     const char* prefix;
     bool (*handler)(HTTPRequest* req, const std::string& strReq);
@@ -583,6 +646,8 @@ static const struct {
       {"/rest/mempool/contents", rest_mempool_contents},
       {"/rest/headers/", rest_headers},
       {"/rest/getutxos", rest_getutxos},
+      {"/rest/address/utxos/", rest_address_utxos},
+      {"/rest/address/history/", rest_address_history},
 };
 
 bool StartREST()
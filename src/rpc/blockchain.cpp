@@ -6,21 +6,31 @@
 #include <rpc/blockchain.h>
 
 #include <amount.h>
+#include <base58.h>
+#include <blockcache.h>
+#include <blockfilter.h>
 #include <chain.h>
 #include <chainparams.h>
 #include <checkpoints.h>
 #include <coins.h>
+#include <coinstats.h>
 #include <consensus/validation.h>
+#include <index/addressindex.h>
+#include <index/blockfilterindex.h>
+#include <index/blockstatsindex.h>
+#include <index/txindex.h>
 #include <validation.h>
 #include <core_io.h>
 #include <policy/feerate.h>
 #include <policy/policy.h>
 #include <primitives/transaction.h>
 #include <rpc/server.h>
+#include <script/standard.h>
 #include <streams.h>
 #include <sync.h>
 #include <txdb.h>
 #include <txmempool.h>
+#include <undo.h>
 #include <util.h>
 #include <utilstrencodings.h>
 #include <hash.h>
@@ -73,6 +83,11 @@ double GetDifficulty(const CChain& chain, const CBlockIndex* blockindex, int alg
     else
         nBits = blockindex->nBits;
 
+    return GetDifficultyFromBits(nBits);
+}
+
+double GetDifficultyFromBits(unsigned int nBits)
+{
     int nShift = (nBits >> 24) & 0xff;
     double dDiff = (double)0x0000ffff / (double)(nBits & 0x00ffffff);
 
@@ -95,6 +110,14 @@ double GetDifficulty(const CBlockIndex* blockindex, int algo)
     return GetDifficulty(chainActive, blockindex, algo);
 }
 
+std::shared_ptr<const CChainTipSnapshot> GetChainTipSnapshotOrThrow()
+{
+    std::shared_ptr<const CChainTipSnapshot> snapshot = GetChainTipSnapshot();
+    if (!snapshot)
+        throw JSONRPCError(RPC_IN_WARMUP, "No chain tip loaded yet");
+    return snapshot;
+}
+
 namespace
 {
 UniValue AuxpowToJSON(const CAuxPow& auxpow)
@@ -136,7 +159,7 @@ UniValue AuxpowToJSON(const CAuxPow& auxpow)
 
 UniValue blockheaderToJSON(const CBlockIndex* blockindex)
 {
-    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_blockindex);
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("hash", blockindex->GetBlockHash().GetHex()));
     int confirmations = -1;
@@ -240,8 +263,7 @@ UniValue getblockcount(const JSONRPCRequest& request)
             + HelpExampleRpc("getblockcount", "")
         );
 
-    LOCK(cs_main);
-    return chainActive.Height();
+    return GetChainTipSnapshotOrThrow()->nHeight;
 }
 
 UniValue getbestblockhash(const JSONRPCRequest& request)
@@ -257,8 +279,7 @@ UniValue getbestblockhash(const JSONRPCRequest& request)
             + HelpExampleRpc("getbestblockhash", "")
         );
 
-    LOCK(cs_main);
-    return chainActive.Tip()->GetBlockHash().GetHex();
+    return GetChainTipSnapshotOrThrow()->hashBlock.GetHex();
 }
 
 void RPCNotifyBlockChange(bool ibd, const CBlockIndex * pindex)
@@ -421,8 +442,7 @@ UniValue getdifficulty(const JSONRPCRequest& request)
             + HelpExampleRpc("getdifficulty", "")
         );
 
-    LOCK(cs_main);
-    return GetDifficulty(nullptr, miningAlgo);
+    return GetDifficultyFromBits(GetChainTipSnapshotOrThrow()->nBitsByAlgo[miningAlgo]);
 }
 
 std::string EntryDescriptionString()
@@ -444,53 +464,48 @@ std::string EntryDescriptionString()
            "       ... ]\n";
 }
 
-void entryToJSON(UniValue &info, const CTxMemPoolEntry &e)
+void entryToJSON(UniValue &info, const CTxMemPoolEntryInfo &e)
 {
-    AssertLockHeld(mempool.cs);
-
-    info.push_back(Pair("size", (int)e.GetTxSize()));
-    info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
-    info.push_back(Pair("modifiedfee", ValueFromAmount(e.GetModifiedFee())));
-    info.push_back(Pair("time", e.GetTime()));
-    info.push_back(Pair("height", (int)e.GetHeight()));
-    info.push_back(Pair("descendantcount", e.GetCountWithDescendants()));
-    info.push_back(Pair("descendantsize", e.GetSizeWithDescendants()));
-    info.push_back(Pair("descendantfees", e.GetModFeesWithDescendants()));
-    info.push_back(Pair("ancestorcount", e.GetCountWithAncestors()));
-    info.push_back(Pair("ancestorsize", e.GetSizeWithAncestors()));
-    info.push_back(Pair("ancestorfees", e.GetModFeesWithAncestors()));
-    info.push_back(Pair("wtxid", mempool.vTxHashes[e.vTxHashesIdx].first.ToString()));
-    const CTransaction& tx = e.GetTx();
-    std::set<std::string> setDepends;
-    for (const CTxIn& txin : tx.vin)
-    {
-        if (mempool.exists(txin.prevout.hash))
-            setDepends.insert(txin.prevout.hash.ToString());
-    }
+    info.push_back(Pair("size", (int)e.nTxSize));
+    info.push_back(Pair("fee", ValueFromAmount(e.nFee)));
+    info.push_back(Pair("modifiedfee", ValueFromAmount(e.nModifiedFee)));
+    info.push_back(Pair("time", e.nTime));
+    info.push_back(Pair("height", (int)e.nHeight));
+    info.push_back(Pair("descendantcount", e.nCountWithDescendants));
+    info.push_back(Pair("descendantsize", e.nSizeWithDescendants));
+    info.push_back(Pair("descendantfees", e.nModFeesWithDescendants));
+    info.push_back(Pair("ancestorcount", e.nCountWithAncestors));
+    info.push_back(Pair("ancestorsize", e.nSizeWithAncestors));
+    info.push_back(Pair("ancestorfees", e.nModFeesWithAncestors));
+    info.push_back(Pair("wtxid", e.wtxid.ToString()));
 
     UniValue depends(UniValue::VARR);
-    for (const std::string& dep : setDepends)
+    for (const uint256& dep : e.vDepends)
     {
-        depends.push_back(dep);
+        depends.push_back(dep.ToString());
     }
 
     info.push_back(Pair("depends", depends));
 }
 
+/** Entries to a JSON object keyed by txid; serialized without holding mempool.cs */
+static UniValue entriesToJSON(const std::vector<std::shared_ptr<const CTxMemPoolEntryInfo>>& vEntries)
+{
+    UniValue o(UniValue::VOBJ);
+    for (const std::shared_ptr<const CTxMemPoolEntryInfo>& e : vEntries)
+    {
+        UniValue info(UniValue::VOBJ);
+        entryToJSON(info, *e);
+        o.push_back(Pair(e->tx->GetHash().ToString(), info));
+    }
+    return o;
+}
+
 UniValue mempoolToJSON(bool fVerbose)
 {
     if (fVerbose)
     {
-        LOCK(mempool.cs);
-        UniValue o(UniValue::VOBJ);
-        for (const CTxMemPoolEntry& e : mempool.mapTx)
-        {
-            const uint256& hash = e.GetTx().GetHash();
-            UniValue info(UniValue::VOBJ);
-            entryToJSON(info, e);
-            o.push_back(Pair(hash.ToString(), info));
-        }
-        return o;
+        return entriesToJSON(mempool.GetSnapshot()->vEntries);
     }
     else
     {
@@ -505,15 +520,56 @@ UniValue mempoolToJSON(bool fVerbose)
     }
 }
 
+static UniValue mempoolChangesToJSON(bool fVerbose, uint64_t nSince)
+{
+    // The sequence only grows, so one ahead of it now was never handed out
+    const uint64_t nSequence = mempool.GetSequence();
+    if (nSince > nSequence) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("since_sequence %u is ahead of the mempool sequence %u", nSince, nSequence));
+    }
+
+    uint64_t nUntil;
+    std::vector<std::shared_ptr<const CTxMemPoolEntryInfo>> vAdded;
+    std::vector<uint256> vRemoved;
+    if (nSince == 0) {
+        std::shared_ptr<const CTxMemPoolSnapshot> snapshot = mempool.GetSnapshot();
+        nUntil = snapshot->nSequence;
+        vAdded = snapshot->vEntries;
+    } else if (!mempool.GetEntryChangesSince(nSince, nUntil, vAdded, vRemoved)) {
+        throw JSONRPCError(RPC_MISC_ERROR, strprintf("Changes since sequence %u are no longer known, use since_sequence 0 for the whole mempool", nSince));
+    }
+
+    UniValue added(UniValue::VARR);
+    if (fVerbose) {
+        added = entriesToJSON(vAdded);
+    } else {
+        for (const std::shared_ptr<const CTxMemPoolEntryInfo>& e : vAdded) {
+            added.push_back(e->tx->GetHash().ToString());
+        }
+    }
+    UniValue removed(UniValue::VARR);
+    for (const uint256& hash : vRemoved) {
+        removed.push_back(hash.ToString());
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("sequence", nUntil));
+    ret.push_back(Pair("added", added));
+    ret.push_back(Pair("removed", removed));
+    return ret;
+}
+
 UniValue getrawmempool(const JSONRPCRequest& request)
 {
-    if (request.fHelp || request.params.size() > 1)
+    if (request.fHelp || request.params.size() > 2)
         throw std::runtime_error(
-            "getrawmempool ( verbose )\n"
+            "getrawmempool ( verbose since_sequence )\n"
             "\nReturns all transaction ids in memory pool as a json array of string transaction ids.\n"
             "\nHint: use getmempoolentry to fetch a specific transaction from the mempool.\n"
             "\nArguments:\n"
-            "1. verbose (boolean, optional, default=false) True for a json object, false for array of transaction ids\n"
+            "1. verbose        (boolean, optional, default=false) True for a json object, false for array of transaction ids\n"
+            "2. since_sequence (numeric, optional) Only return the transactions added and removed after this mempool sequence,\n"
+            "                  as returned by an earlier call or getmempoolinfo. 0 returns the whole mempool as added.\n"
             "\nResult: (for verbose = false):\n"
             "[                     (json array of string)\n"
             "  \"transactionid\"     (string) The transaction id\n"
@@ -525,8 +581,16 @@ UniValue getrawmempool(const JSONRPCRequest& request)
             + EntryDescriptionString()
             + "  }, ...\n"
             "}\n"
+            "\nResult: (for since_sequence):\n"
+            "{\n"
+            "  \"sequence\" : n,            (numeric) The mempool sequence the changes go up to\n"
+            "  \"added\" : [...] or {...},  (json array or object) Transactions added since since_sequence and still in the mempool, as above\n"
+            "  \"removed\" : [...]          (json array of string) Ids of transactions removed since since_sequence.\n"
+            "                              A transaction that was replaced by one with the same id is in both\n"
+            "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getrawmempool", "true")
+            + HelpExampleCli("getrawmempool", "false 1234")
             + HelpExampleRpc("getrawmempool", "true")
         );
 
@@ -534,6 +598,13 @@ UniValue getrawmempool(const JSONRPCRequest& request)
     if (!request.params[0].isNull())
         fVerbose = request.params[0].get_bool();
 
+    if (!request.params[1].isNull()) {
+        int64_t nSince = request.params[1].get_int64();
+        if (nSince < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "since_sequence must not be negative");
+        return mempoolChangesToJSON(fVerbose, nSince);
+    }
+
     return mempoolToJSON(fVerbose);
 }
 
@@ -569,36 +640,33 @@ UniValue getmempoolancestors(const JSONRPCRequest& request)
 
     uint256 hash = ParseHashV(request.params[0], "parameter 1");
 
-    LOCK(mempool.cs);
+    std::vector<std::shared_ptr<const CTxMemPoolEntryInfo>> vEntries;
+    {
+        LOCK(mempool.cs);
 
-    CTxMemPool::txiter it = mempool.mapTx.find(hash);
-    if (it == mempool.mapTx.end()) {
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
-    }
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it == mempool.mapTx.end()) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
+        }
 
-    CTxMemPool::setEntries setAncestors;
-    uint64_t noLimit = std::numeric_limits<uint64_t>::max();
-    std::string dummy;
-    mempool.CalculateMemPoolAncestors(*it, setAncestors, noLimit, noLimit, noLimit, noLimit, dummy, false);
+        CTxMemPool::setEntries setAncestors;
+        uint64_t noLimit = std::numeric_limits<uint64_t>::max();
+        std::string dummy;
+        mempool.CalculateMemPoolAncestors(*it, setAncestors, noLimit, noLimit, noLimit, noLimit, dummy, false);
 
-    if (!fVerbose) {
-        UniValue o(UniValue::VARR);
-        for (CTxMemPool::txiter ancestorIt : setAncestors) {
-            o.push_back(ancestorIt->GetTx().GetHash().ToString());
-        }
+        if (!fVerbose) {
+            UniValue o(UniValue::VARR);
+            for (CTxMemPool::txiter ancestorIt : setAncestors) {
+                o.push_back(ancestorIt->GetTx().GetHash().ToString());
+            }
 
-        return o;
-    } else {
-        UniValue o(UniValue::VOBJ);
+            return o;
+        }
         for (CTxMemPool::txiter ancestorIt : setAncestors) {
-            const CTxMemPoolEntry &e = *ancestorIt;
-            const uint256& _hash = e.GetTx().GetHash();
-            UniValue info(UniValue::VOBJ);
-            entryToJSON(info, e);
-            o.push_back(Pair(_hash.ToString(), info));
+            vEntries.push_back(mempool.GetEntryInfo(ancestorIt));
         }
-        return o;
     }
+    return entriesToJSON(vEntries);
 }
 
 UniValue getmempooldescendants(const JSONRPCRequest& request)
@@ -633,36 +701,33 @@ UniValue getmempooldescendants(const JSONRPCRequest& request)
 
     uint256 hash = ParseHashV(request.params[0], "parameter 1");
 
-    LOCK(mempool.cs);
+    std::vector<std::shared_ptr<const CTxMemPoolEntryInfo>> vEntries;
+    {
+        LOCK(mempool.cs);
 
-    CTxMemPool::txiter it = mempool.mapTx.find(hash);
-    if (it == mempool.mapTx.end()) {
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
-    }
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it == mempool.mapTx.end()) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
+        }
 
-    CTxMemPool::setEntries setDescendants;
-    mempool.CalculateDescendants(it, setDescendants);
-    // CTxMemPool::CalculateDescendants will include the given tx
-    setDescendants.erase(it);
+        CTxMemPool::setEntries setDescendants;
+        mempool.CalculateDescendants(it, setDescendants);
+        // CTxMemPool::CalculateDescendants will include the given tx
+        setDescendants.erase(it);
 
-    if (!fVerbose) {
-        UniValue o(UniValue::VARR);
-        for (CTxMemPool::txiter descendantIt : setDescendants) {
-            o.push_back(descendantIt->GetTx().GetHash().ToString());
-        }
+        if (!fVerbose) {
+            UniValue o(UniValue::VARR);
+            for (CTxMemPool::txiter descendantIt : setDescendants) {
+                o.push_back(descendantIt->GetTx().GetHash().ToString());
+            }
 
-        return o;
-    } else {
-        UniValue o(UniValue::VOBJ);
+            return o;
+        }
         for (CTxMemPool::txiter descendantIt : setDescendants) {
-            const CTxMemPoolEntry &e = *descendantIt;
-            const uint256& _hash = e.GetTx().GetHash();
-            UniValue info(UniValue::VOBJ);
-            entryToJSON(info, e);
-            o.push_back(Pair(_hash.ToString(), info));
+            vEntries.push_back(mempool.GetEntryInfo(descendantIt));
         }
-        return o;
     }
+    return entriesToJSON(vEntries);
 }
 
 UniValue getmempoolentry(const JSONRPCRequest& request)
@@ -685,16 +750,19 @@ UniValue getmempoolentry(const JSONRPCRequest& request)
 
     uint256 hash = ParseHashV(request.params[0], "parameter 1");
 
-    LOCK(mempool.cs);
+    std::shared_ptr<const CTxMemPoolEntryInfo> e;
+    {
+        LOCK(mempool.cs);
 
-    CTxMemPool::txiter it = mempool.mapTx.find(hash);
-    if (it == mempool.mapTx.end()) {
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it == mempool.mapTx.end()) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
+        }
+        e = mempool.GetEntryInfo(it);
     }
 
-    const CTxMemPoolEntry &e = *it;
     UniValue info(UniValue::VOBJ);
-    entryToJSON(info, e);
+    entryToJSON(info, *e);
     return info;
 }
 
@@ -713,7 +781,7 @@ UniValue getblockhash(const JSONRPCRequest& request)
             + HelpExampleRpc("getblockhash", "1000")
         );
 
-    LOCK(cs_main);
+    LOCK(cs_blockindex);
 
     int nHeight = request.params[0].get_int();
     if (nHeight < 0 || nHeight > chainActive.Height())
@@ -760,8 +828,6 @@ UniValue getblockheader(const JSONRPCRequest& request)
             + HelpExampleRpc("getblockheader", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\"")
         );
 
-    LOCK(cs_main);
-
     std::string strHash = request.params[0].get_str();
     uint256 hash(uint256S(strHash));
 
@@ -769,20 +835,24 @@ UniValue getblockheader(const JSONRPCRequest& request)
     if (!request.params[1].isNull())
         fVerbose = request.params[1].get_bool();
 
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
-
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-
-    if (!fVerbose)
+    CBlockIndex* pblockindex;
     {
-        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
-        ssBlock << pblockindex->GetBlockHeader(Params().GetConsensus());
-        std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
-        return strHex;
+        LOCK(cs_blockindex);
+        BlockMap::const_iterator it = mapBlockIndex.find(hash);
+        if (it == mapBlockIndex.end())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        pblockindex = it->second;
+
+        if (fVerbose)
+            return blockheaderToJSON(pblockindex);
     }
 
-    return blockheaderToJSON(pblockindex);
+    // An auxpow header is read from the block file, whose position cs_main protects
+    LOCK(cs_main);
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << pblockindex->GetBlockHeader(Params().GetConsensus());
+    std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
+    return strHex;
 }
 
 UniValue getblock(const JSONRPCRequest& request)
@@ -862,6 +932,14 @@ UniValue getblock(const JSONRPCRequest& request)
     if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
         throw JSONRPCError(RPC_MISC_ERROR, "Block not available (pruned data)");
 
+    if (verbosity <= 0)
+    {
+        CSerializedBlockRef block_data = GetSerializedBlock(pblockindex, !(RPCSerializationFlags() & SERIALIZE_TRANSACTION_NO_WITNESS), Params().GetConsensus());
+        if (!block_data)
+            throw JSONRPCError(RPC_MISC_ERROR, "Block not found on disk");
+        return HexStr(block_data->data.begin(), block_data->data.end());
+    }
+
     if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
         // Block not found on disk. This could be because we have the block
         // header in our index but don't have the block (for example if a
@@ -870,86 +948,34 @@ UniValue getblock(const JSONRPCRequest& request)
         // block).
         throw JSONRPCError(RPC_MISC_ERROR, "Block not found on disk");
 
-    if (verbosity <= 0)
-    {
-        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
-        ssBlock << block;
-        std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
-        return strHex;
-    }
-
     return blockToJSON(block, pblockindex, verbosity >= 2);
 }
 
-struct CCoinsStats
-{
-    int nHeight;
-    uint256 hashBlock;
-    uint64_t nTransactions;
-    uint64_t nTransactionOutputs;
-    uint64_t nBogoSize;
-    uint256 hashSerialized;
-    uint64_t nDiskSize;
-    CAmount nTotalAmount;
-
-    CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nBogoSize(0), nDiskSize(0), nTotalAmount(0) {}
-};
-
-static void ApplyStats(CCoinsStats &stats, CHashWriter& ss, const uint256& hash, const std::map<uint32_t, Coin>& outputs)
-{
-    assert(!outputs.empty());
-    ss << hash;
-    ss << VARINT(outputs.begin()->second.nHeight * 2 + outputs.begin()->second.fCoinBase);
-    stats.nTransactions++;
-    for (const auto output : outputs) {
-        ss << VARINT(output.first + 1);
-        ss << output.second.out.scriptPubKey;
-        ss << VARINT(output.second.out.nValue);
-        stats.nTransactionOutputs++;
-        stats.nTotalAmount += output.second.out.nValue;
-        stats.nBogoSize += 32 /* txid */ + 4 /* vout index */ + 4 /* height + coinbase */ + 8 /* amount */ +
-                           2 /* scriptPubKey len */ + output.second.out.scriptPubKey.size() /* scriptPubKey */;
-    }
-    ss << VARINT(0);
-}
-
-//! Calculate statistics about the unspent transaction output set
-static bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats)
+/** Resolve a block hash or height parameter to a block in the active chain (requires cs_main) */
+static const CBlockIndex* ParseHashOrHeight(const UniValue& param)
 {
-    std::unique_ptr<CCoinsViewCursor> pcursor(view->Cursor());
-    assert(pcursor);
-
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = pcursor->GetBestBlock();
-    {
-        LOCK(cs_main);
-        stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
-    }
-    ss << stats.hashBlock;
-    uint256 prevkey;
-    std::map<uint32_t, Coin> outputs;
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        COutPoint key;
-        Coin coin;
-        if (pcursor->GetKey(key) && pcursor->GetValue(coin)) {
-            if (!outputs.empty() && key.hash != prevkey) {
-                ApplyStats(stats, ss, prevkey, outputs);
-                outputs.clear();
-            }
-            prevkey = key.hash;
-            outputs[key.n] = std::move(coin);
-        } else {
-            return error("%s: unable to read value", __func__);
+    AssertLockHeld(cs_main);
+    if (param.isNum()) {
+        const int height = param.get_int();
+        if (height < 0) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Target block height %d is negative", height));
+        }
+        const int current_tip = chainActive.Height();
+        if (height > current_tip) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Target block height %d after current tip %d", height, current_tip));
         }
-        pcursor->Next();
+        return chainActive[height];
+    }
+
+    const uint256 hash = ParseHashV(param, "hash_or_height");
+    BlockMap::const_iterator it = mapBlockIndex.find(hash);
+    if (it == mapBlockIndex.end()) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
     }
-    if (!outputs.empty()) {
-        ApplyStats(stats, ss, prevkey, outputs);
+    if (!chainActive.Contains(it->second)) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Block is not in the active chain");
     }
-    stats.hashSerialized = ss.GetHash();
-    stats.nDiskSize = view->EstimateSize();
-    return true;
+    return it->second;
 }
 
 UniValue pruneblockchain(const JSONRPCRequest& request)
@@ -1003,29 +1029,67 @@ UniValue pruneblockchain(const JSONRPCRequest& request)
 
 UniValue gettxoutsetinfo(const JSONRPCRequest& request)
 {
-    if (request.fHelp || request.params.size() != 0)
+    if (request.fHelp || request.params.size() > 1)
         throw std::runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( hash_or_height )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "With -coinstatsindex the statistics are served from the index, for the tip or for any earlier\n"
+            "block of the active chain. An index built after blocks were pruned only has statistics from the\n"
+            "height it was built at. Otherwise the whole set is scanned, which may take some time.\n"
+            "\nArguments:\n"
+            "1. hash_or_height  (string or numeric, optional) The block hash or height to report on (requires -coinstatsindex)\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
             "  \"bestblock\": \"hex\",   (string) The hash of the block at the tip of the chain\n"
-            "  \"transactions\": n,      (numeric) The number of transactions with unspent outputs\n"
+            "  \"transactions\": n,      (numeric) The number of transactions with unspent outputs (not available with -coinstatsindex)\n"
             "  \"txouts\": n,            (numeric) The number of unspent transaction outputs\n"
             "  \"bogosize\": n,          (numeric) A meaningless metric for UTXO set size\n"
-            "  \"hash_serialized_2\": \"hash\", (string) The serialized hash\n"
-            "  \"disk_size\": n,         (numeric) The estimated size of the chainstate on disk\n"
-            "  \"total_amount\": x.xxx          (numeric) The total amount\n"
+            "  \"hash_serialized_2\": \"hash\", (string) The serialized hash (not available with -coinstatsindex)\n"
+            "  \"muhash\": \"hash\",      (string) The rolling MuHash3072 set hash (only with -coinstatsindex)\n"
+            "  \"disk_size\": n,         (numeric) The estimated size of the chainstate on disk (only for the tip)\n"
+            "  \"total_amount\": x.xxx,  (numeric) The total amount\n"
+            "  \"moneysupply\": x.xxx    (numeric) The total amount ever created by coinbases up to this block (only with -coinstatsindex)\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "1000")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
     UniValue ret(UniValue::VOBJ);
 
+    if (pcoinstatsindex) {
+        LOCK(cs_main);
+        if (!pcoinstatsindex->IsInSync()) {
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Coin stats index is not in sync with the active chain, restart to rebuild it");
+        }
+        const CBlockIndex* pindex = request.params[0].isNull() ? chainActive.Tip() : ParseHashOrHeight(request.params[0]);
+        if (pindex->nHeight < pcoinstatsindex->GetStartHeight()) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Coin statistics are only available from height %d, where the coin stats index was built from the UTXO set of a pruned node",
+                                                                pcoinstatsindex->GetStartHeight()));
+        }
+        CUTXOStats stats;
+        if (!pcoinstatsindex->LookupStats(pindex, stats)) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Coin statistics are not available for block %s", pindex->GetBlockHash().GetHex()));
+        }
+        ret.push_back(Pair("height", (int64_t)stats.nHeight));
+        ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
+        ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
+        ret.push_back(Pair("bogosize", (int64_t)stats.nBogoSize));
+        ret.push_back(Pair("muhash", stats.hashMuHash.GetHex()));
+        if (pindex == chainActive.Tip()) {
+            ret.push_back(Pair("disk_size", (uint64_t)pcoinsdbview->EstimateSize()));
+        }
+        ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+        ret.push_back(Pair("moneysupply", ValueFromAmount(pindex->nMoneySupply)));
+        return ret;
+    }
+
+    if (!request.params[0].isNull()) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Querying statistics for a specific block requires -coinstatsindex");
+    }
+
     CCoinsStats stats;
     FlushStateToDisk();
     if (GetUTXOStats(pcoinsdbview.get(), stats)) {
@@ -1152,20 +1216,20 @@ UniValue verifychain(const JSONRPCRequest& request)
 }
 
 /** Implementation of IsSuperMajority with better feedback */
-static UniValue SoftForkMajorityDesc(int version, CBlockIndex* pindex, const Consensus::Params& consensusParams)
+static UniValue SoftForkMajorityDesc(int version, int nHeight, const Consensus::Params& consensusParams)
 {
     UniValue rv(UniValue::VOBJ);
     bool activated = false;
     switch(version)
     {
         case 2:
-            activated = pindex->nHeight >= consensusParams.BIP34Height;
+            activated = nHeight >= consensusParams.BIP34Height;
             break;
         case 3:
-            activated = pindex->nHeight >= consensusParams.BIP66Height;
+            activated = nHeight >= consensusParams.BIP66Height;
             break;
         case 4:
-            activated = pindex->nHeight >= consensusParams.BIP65Height;
+            activated = nHeight >= consensusParams.BIP65Height;
             break;
     }
 
@@ -1173,19 +1237,20 @@ static UniValue SoftForkMajorityDesc(int version, CBlockIndex* pindex, const Con
     return rv;
 }
 
-static UniValue SoftForkDesc(const std::string &name, int version, CBlockIndex* pindex, const Consensus::Params& consensusParams)
+static UniValue SoftForkDesc(const std::string &name, int version, int nHeight, const Consensus::Params& consensusParams)
 {
     UniValue rv(UniValue::VOBJ);
     rv.push_back(Pair("id", name));
     rv.push_back(Pair("version", version));
-    rv.push_back(Pair("reject", SoftForkMajorityDesc(version, pindex, consensusParams)));
+    rv.push_back(Pair("reject", SoftForkMajorityDesc(version, nHeight, consensusParams)));
     return rv;
 }
 
-static UniValue BIP9SoftForkDesc(const Consensus::Params& consensusParams, Consensus::DeploymentPos id)
+static UniValue BIP9SoftForkDesc(const Consensus::Params& consensusParams, Consensus::DeploymentPos id, const CChainTipSnapshot& snapshot)
 {
+    const CChainTipSnapshot::DeploymentState& deployment = snapshot.deployments[id];
     UniValue rv(UniValue::VOBJ);
-    const ThresholdState thresholdState = VersionBitsTipState(consensusParams, id);
+    const ThresholdState thresholdState = deployment.state;
     switch (thresholdState) {
     case THRESHOLD_DEFINED: rv.push_back(Pair("status", "defined")); break;
     case THRESHOLD_STARTED: rv.push_back(Pair("status", "started")); break;
@@ -1199,11 +1264,11 @@ static UniValue BIP9SoftForkDesc(const Consensus::Params& consensusParams, Conse
     }
     rv.push_back(Pair("startTime", consensusParams.vDeployments[id].nStartTime));
     rv.push_back(Pair("timeout", consensusParams.vDeployments[id].nTimeout));
-    rv.push_back(Pair("since", VersionBitsTipStateSinceHeight(consensusParams, id)));
+    rv.push_back(Pair("since", deployment.nSinceHeight));
     if (THRESHOLD_STARTED == thresholdState)
     {
         UniValue statsUV(UniValue::VOBJ);
-        BIP9Stats statsStruct = VersionBitsTipStatistics(consensusParams, id);
+        const BIP9Stats& statsStruct = snapshot.GetDeploymentStats(id);
         statsUV.push_back(Pair("period", statsStruct.period));
         statsUV.push_back(Pair("threshold", statsStruct.threshold));
         statsUV.push_back(Pair("elapsed", statsStruct.elapsed));
@@ -1214,13 +1279,13 @@ static UniValue BIP9SoftForkDesc(const Consensus::Params& consensusParams, Conse
     return rv;
 }
 
-void BIP9SoftForkDescPushBack(UniValue& bip9_softforks, const Consensus::Params& consensusParams, Consensus::DeploymentPos id)
+void BIP9SoftForkDescPushBack(UniValue& bip9_softforks, const Consensus::Params& consensusParams, Consensus::DeploymentPos id, const CChainTipSnapshot& snapshot)
 {
     // Deployments with timeout value of 0 are hidden.
     // A timeout value of 0 guarantees a softfork will never be activated.
     // This is used when softfork codes are merged without specifying the deployment schedule.
     if (consensusParams.vDeployments[id].nTimeout > 0)
-        bip9_softforks.push_back(Pair(VersionBitsDeploymentInfo[id].name, BIP9SoftForkDesc(consensusParams, id)));
+        bip9_softforks.push_back(Pair(VersionBitsDeploymentInfo[id].name, BIP9SoftForkDesc(consensusParams, id, snapshot)));
 }
 
 UniValue getblockchaininfo(const JSONRPCRequest& request)
@@ -1282,27 +1347,30 @@ UniValue getblockchaininfo(const JSONRPCRequest& request)
             + HelpExampleRpc("getblockchaininfo", "")
         );
 
-    LOCK(cs_main);
+    // Read from the published tip snapshot, so that this doesn't wait for
+    // blocks being connected.
+    const std::shared_ptr<const CChainTipSnapshot> tip = GetChainTipSnapshotOrThrow();
 
     UniValue obj(UniValue::VOBJ);
     obj.push_back(Pair("chain",                 Params().NetworkIDString()));
-    obj.push_back(Pair("blocks",                (int)chainActive.Height()));
-    obj.push_back(Pair("headers",               pindexBestHeader ? pindexBestHeader->nHeight : -1));
-    obj.push_back(Pair("bestblockhash",         chainActive.Tip()->GetBlockHash().GetHex()));
-    obj.push_back(Pair("moneysupply",           ValueFromAmount(chainActive.Tip()->nMoneySupply)));
-    obj.push_back(Pair("difficulty",            (double)GetDifficulty(nullptr, miningAlgo)));
-    obj.push_back(Pair("difficulty_sha256d",    (double)GetDifficulty(nullptr, ALGO_SHA256D)));
-    obj.push_back(Pair("difficulty_scrypt",     (double)GetDifficulty(nullptr, ALGO_SCRYPT)));
-    obj.push_back(Pair("difficulty_groestl",    (double)GetDifficulty(nullptr, ALGO_GROESTL)));
-    obj.push_back(Pair("difficulty_skein",      (double)GetDifficulty(nullptr, ALGO_SKEIN)));
-    obj.push_back(Pair("difficulty_yescrypt",   (double)GetDifficulty(nullptr, ALGO_YESCRYPT)));
-    obj.push_back(Pair("mediantime",            (int64_t)chainActive.Tip()->GetMedianTimePast()));
-    obj.push_back(Pair("verificationprogress",  GuessVerificationProgress(Params().TxData(), chainActive.Tip())));
-    obj.push_back(Pair("initialblockdownload",  IsInitialBlockDownload()));
-    obj.push_back(Pair("chainwork",             chainActive.Tip()->nChainWork.GetHex()));
+    obj.push_back(Pair("blocks",                tip->nHeight));
+    obj.push_back(Pair("headers",               nBestHeaderHeight.load()));
+    obj.push_back(Pair("bestblockhash",         tip->hashBlock.GetHex()));
+    obj.push_back(Pair("moneysupply",           ValueFromAmount(tip->nMoneySupply)));
+    obj.push_back(Pair("difficulty",            GetDifficultyFromBits(tip->nBitsByAlgo[miningAlgo])));
+    obj.push_back(Pair("difficulty_sha256d",    GetDifficultyFromBits(tip->nBitsByAlgo[ALGO_SHA256D])));
+    obj.push_back(Pair("difficulty_scrypt",     GetDifficultyFromBits(tip->nBitsByAlgo[ALGO_SCRYPT])));
+    obj.push_back(Pair("difficulty_groestl",    GetDifficultyFromBits(tip->nBitsByAlgo[ALGO_GROESTL])));
+    obj.push_back(Pair("difficulty_skein",      GetDifficultyFromBits(tip->nBitsByAlgo[ALGO_SKEIN])));
+    obj.push_back(Pair("difficulty_yescrypt",   GetDifficultyFromBits(tip->nBitsByAlgo[ALGO_YESCRYPT])));
+    obj.push_back(Pair("mediantime",            tip->nMedianTimePast));
+    obj.push_back(Pair("verificationprogress",  tip->dVerificationProgress));
+    obj.push_back(Pair("initialblockdownload",  tip->fInitialBlockDownload));
+    obj.push_back(Pair("chainwork",             tip->nChainWork.GetHex()));
     obj.push_back(Pair("size_on_disk",          CalculateCurrentUsage()));
     obj.push_back(Pair("pruned",                fPruneMode));
     if (fPruneMode) {
+        LOCK(cs_main);
         CBlockIndex* block = chainActive.Tip();
         assert(block);
         while (block->pprev && (block->pprev->nStatus & BLOCK_HAVE_DATA)) {
@@ -1320,14 +1388,13 @@ UniValue getblockchaininfo(const JSONRPCRequest& request)
     }
 
     const Consensus::Params& consensusParams = Params().GetConsensus();
-    CBlockIndex* tip = chainActive.Tip();
     UniValue softforks(UniValue::VARR);
     UniValue bip9_softforks(UniValue::VOBJ);
-    softforks.push_back(SoftForkDesc("bip34", 2, tip, consensusParams));
-    softforks.push_back(SoftForkDesc("bip66", 3, tip, consensusParams));
-    softforks.push_back(SoftForkDesc("bip65", 4, tip, consensusParams));
+    softforks.push_back(SoftForkDesc("bip34", 2, tip->nHeight, consensusParams));
+    softforks.push_back(SoftForkDesc("bip66", 3, tip->nHeight, consensusParams));
+    softforks.push_back(SoftForkDesc("bip65", 4, tip->nHeight, consensusParams));
     for (int pos = Consensus::DEPLOYMENT_CSV; pos != Consensus::MAX_VERSION_BITS_DEPLOYMENTS; ++pos) {
-        BIP9SoftForkDescPushBack(bip9_softforks, consensusParams, static_cast<Consensus::DeploymentPos>(pos));
+        BIP9SoftForkDescPushBack(bip9_softforks, consensusParams, static_cast<Consensus::DeploymentPos>(pos), *tip);
     }
     obj.push_back(Pair("softforks",             softforks));
     obj.push_back(Pair("bip9_softforks", bip9_softforks));
@@ -1460,10 +1527,24 @@ UniValue mempoolInfoToJSON()
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
     ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    ret.push_back(Pair("snapshotusage", (int64_t) mempool.SnapshotMemoryUsage()));
     size_t maxmempool = gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
     ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
     ret.push_back(Pair("mempoolminfee", ValueFromAmount(std::max(mempool.GetMinFee(maxmempool), ::minRelayTxFee).GetFeePerK())));
     ret.push_back(Pair("minrelaytxfee", ValueFromAmount(::minRelayTxFee.GetFeePerK())));
+    ret.push_back(Pair("sequence", mempool.GetSequence()));
+
+    const MempoolFeeHistogram histogram = mempool.GetFeeHistogram();
+    UniValue buckets(UniValue::VARR);
+    for (size_t i = 0; i < histogram.size(); i++) {
+        UniValue bucket(UniValue::VOBJ);
+        bucket.push_back(Pair("minfeerate", ValueFromAmount(MEMPOOL_FEE_HISTOGRAM_BOUNDS[i])));
+        bucket.push_back(Pair("count", histogram[i].nCount));
+        bucket.push_back(Pair("vsize", histogram[i].nSize));
+        bucket.push_back(Pair("fees", ValueFromAmount(histogram[i].nFees)));
+        buckets.push_back(bucket);
+    }
+    ret.push_back(Pair("feehistogram", buckets));
 
     return ret;
 }
@@ -1479,9 +1560,19 @@ UniValue getmempoolinfo(const JSONRPCRequest& request)
             "  \"size\": xxxxx,               (numeric) Current tx count\n"
             "  \"bytes\": xxxxx,              (numeric) Sum of all virtual transaction sizes as defined in BIP 141. Differs from actual serialized size because witness data is discounted\n"
             "  \"usage\": xxxxx,              (numeric) Total memory usage for the mempool\n"
+            "  \"snapshotusage\": xxxxx,      (numeric) Memory of the copy of the mempool kept for RPC and REST replies, not counted in usage\n"
             "  \"maxmempool\": xxxxx,         (numeric) Maximum memory usage for the mempool\n"
             "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee rate in " + CURRENCY_UNIT + "/kB for tx to be accepted. Is the maximum of minrelaytxfee and minimum mempool fee\n"
-            "  \"minrelaytxfee\": xxxxx       (numeric) Current minimum relay fee for transactions\n"
+            "  \"minrelaytxfee\": xxxxx,      (numeric) Current minimum relay fee for transactions\n"
+            "  \"sequence\": xxxxx,           (numeric) Mempool sequence, for getrawmempool since_sequence\n"
+            "  \"feehistogram\": [            (array) Transactions by their own feerate, including prioritisation\n"
+            "    {\n"
+            "      \"minfeerate\": xxxxx,       (numeric) Lowest feerate of the bucket in " + CURRENCY_UNIT + "/kB, up to the next bucket's\n"
+            "      \"count\": xxxxx,            (numeric) Number of transactions\n"
+            "      \"vsize\": xxxxx,            (numeric) Sum of their virtual sizes\n"
+            "      \"fees\": xxxxx              (numeric) Sum of their modified fees in " + CURRENCY_UNIT + "\n"
+            "    }, ...\n"
+            "  ]\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
@@ -1491,6 +1582,35 @@ UniValue getmempoolinfo(const JSONRPCRequest& request)
     return mempoolInfoToJSON();
 }
 
+UniValue getblockcacheinfo(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 0)
+        throw std::runtime_error(
+            "getblockcacheinfo\n"
+            "\nReturns details on the cache of serialized blocks served to peers, getblock and REST.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"entries\": xxxxx,            (numeric) Number of cached blocks; blocks with and without witness data count separately\n"
+            "  \"bytes\": xxxxx,              (numeric) Total size of the cached blocks\n"
+            "  \"maxbytes\": xxxxx,           (numeric) Maximum size of the cached blocks (-blockservecache)\n"
+            "  \"hits\": xxxxx,               (numeric) Number of blocks served from the cache\n"
+            "  \"misses\": xxxxx              (numeric) Number of blocks read from disk because they were not cached\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockcacheinfo", "")
+            + HelpExampleRpc("getblockcacheinfo", "")
+        );
+
+    const CSerializedBlockCache::Stats stats = g_serialized_block_cache.GetStats();
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("entries", (uint64_t)stats.entries));
+    ret.push_back(Pair("bytes", (uint64_t)stats.bytes));
+    ret.push_back(Pair("maxbytes", (uint64_t)stats.max_bytes));
+    ret.push_back(Pair("hits", stats.hits));
+    ret.push_back(Pair("misses", stats.misses));
+    return ret;
+}
+
 UniValue preciousblock(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() != 1)
@@ -1683,6 +1803,540 @@ UniValue getchaintxstats(const JSONRPCRequest& request)
     return ret;
 }
 
+static UniValue SummaryToJSON(const IndexSummary& summary, const std::string& index_name)
+{
+    UniValue ret_summary(UniValue::VOBJ);
+    if (!index_name.empty() && index_name != summary.name) return ret_summary;
+
+    UniValue entry(UniValue::VOBJ);
+    entry.push_back(Pair("synced", summary.synced));
+    entry.push_back(Pair("best_block_height", summary.best_block_height));
+
+    ret_summary.push_back(Pair(summary.name, entry));
+    return ret_summary;
+}
+
+UniValue getindexinfo(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 1)
+        throw std::runtime_error(
+            "getindexinfo ( \"index_name\" )\n"
+            "\nReturns the status of one or all available indices currently running in the node.\n"
+            "Indices that are built in the background report how far they have caught up with the chain.\n"
+            "\nArguments:\n"
+            "1. \"index_name\"  (string, optional) Filter results for an index with a specific name.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"name\": {                   (object) The name of the index\n"
+            "    \"synced\": true|false,      (boolean) Whether the index is synced or not\n"
+            "    \"best_block_height\": xxxxx (numeric) The block height to which the index is synced\n"
+            "  },\n"
+            "  ...\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getindexinfo", "")
+            + HelpExampleCli("getindexinfo", "\"txindex\"")
+            + HelpExampleRpc("getindexinfo", "")
+        );
+
+    UniValue result(UniValue::VOBJ);
+    const std::string index_name = request.params[0].isNull() ? "" : request.params[0].get_str();
+
+    if (g_txindex) {
+        result.pushKVs(SummaryToJSON(g_txindex->GetSummary(), index_name));
+    }
+
+    if (g_addressindex) {
+        result.pushKVs(SummaryToJSON(g_addressindex->GetSummary(), index_name));
+    }
+
+    if (g_blockfilterindex) {
+        result.pushKVs(SummaryToJSON(g_blockfilterindex->GetSummary(), index_name));
+    }
+
+    if (g_blockstatsindex) {
+        result.pushKVs(SummaryToJSON(g_blockstatsindex->GetSummary(), index_name));
+    }
+
+    return result;
+}
+
+UniValue getblockfilter(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
+        throw std::runtime_error(
+            "getblockfilter \"blockhash\" ( \"filtertype\" )\n"
+            "\nRetrieve a BIP 157 content filter for a particular block.\n"
+            "\nArguments:\n"
+            "1. \"blockhash\"   (string, required) The hash of the block\n"
+            "2. \"filtertype\"  (string, optional, default=basic) The type name of the filter\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"filter\" : (string) the hex-encoded filter data\n"
+            "  \"header\" : (string) the hex-encoded filter header\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockfilter", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\" \"basic\"")
+            + HelpExampleRpc("getblockfilter", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\", \"basic\"")
+        );
+
+    uint256 block_hash = ParseHashV(request.params[0], "blockhash");
+    std::string filtertype_name = "basic";
+    if (!request.params[1].isNull()) {
+        filtertype_name = request.params[1].get_str();
+    }
+
+    BlockFilterType filtertype;
+    if (!BlockFilterTypeByName(filtertype_name, filtertype)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown filtertype");
+    }
+
+    if (!g_blockfilterindex || g_blockfilterindex->GetFilterType() != filtertype) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Index is not enabled for filtertype " + filtertype_name);
+    }
+
+    const CBlockIndex* block_index;
+    bool block_was_connected;
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(block_hash);
+        if (it == mapBlockIndex.end()) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        }
+        block_index = it->second;
+        block_was_connected = block_index->IsValid(BLOCK_VALID_SCRIPTS);
+    }
+
+    bool index_ready = g_blockfilterindex->BlockUntilSyncedToCurrentChain();
+
+    BlockFilter filter;
+    uint256 filter_header;
+    if (!g_blockfilterindex->LookupFilter(block_index, filter) ||
+        !g_blockfilterindex->LookupFilterHeader(block_index, filter_header)) {
+        int err_code;
+        std::string errmsg = "Filter not found.";
+
+        if (!block_was_connected) {
+            err_code = RPC_INVALID_ADDRESS_OR_KEY;
+            errmsg += " Block was not connected to active chain.";
+        } else if (!index_ready) {
+            err_code = RPC_MISC_ERROR;
+            errmsg += " Block filters are still in the process of being indexed.";
+        } else {
+            err_code = RPC_INTERNAL_ERROR;
+            errmsg += " This error is unexpected and indicates index corruption.";
+        }
+
+        throw JSONRPCError(err_code, errmsg);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("filter", HexStr(filter.GetEncodedFilter())));
+    ret.push_back(Pair("header", filter_header.GetHex()));
+    return ret;
+}
+
+/** Largest range getchainalgostats reads from disk; longer ones need a synced block stats index. */
+static const int MAX_CHAIN_ALGO_STATS_BLOCKS_FROM_DISK = 1000;
+
+/** Get the statistics of a block, from the block stats index if it has them or else from disk. */
+static void GetBlockStats(const CBlockIndex* pindex, CBlockStats& stats)
+{
+    if (g_blockstatsindex && g_blockstatsindex->LookupStats(pindex, stats)) {
+        return;
+    }
+
+    {
+        LOCK(cs_main);
+        if (fHavePruned && !(pindex->nStatus & BLOCK_HAVE_DATA) && pindex->nTx > 0) {
+            throw JSONRPCError(RPC_MISC_ERROR, "Block not available (pruned data)");
+        }
+    }
+
+    // The reads only take cs_main to look up the positions, so a long range
+    // does not hold up validation. A block pruned in between fails to read.
+    CBlock block;
+    CBlockUndo block_undo;
+    if (!ReadBlockFromDisk(block, pindex, Params().GetConsensus())) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Block not found on disk");
+    }
+    if (pindex->nHeight > 0 && !UndoReadFromDisk(block_undo, pindex)) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Can't read undo data from disk");
+    }
+    ComputeBlockStats(block, block_undo, pindex, stats);
+}
+
+UniValue getblockstats(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2) {
+        throw std::runtime_error(
+            "getblockstats hash_or_height ( stats )\n"
+            "\nCompute per block statistics for a given window. All amounts are in satoshis.\n"
+            "Statistics are read from the block stats index when it is enabled (-blockstatsindex),\n"
+            "otherwise they are computed from the block and its undo data on disk.\n"
+            "\nArguments:\n"
+            "1. \"hash_or_height\"     (string or numeric, required) The block hash or height of the target block\n"
+            "2. \"stats\"              (array,  optional) Values to plot, by default all values (see result below)\n"
+            "    [\n"
+            "      \"height\",         (string, optional) Selected statistic\n"
+            "      \"time\",           (string, optional) Selected statistic\n"
+            "      ,...\n"
+            "    ]\n"
+            "\nResult:\n"
+            "{                           (json object)\n"
+            "  \"algo\": \"xxxx\",          (string) The proof-of-work algorithm of the block\n"
+            "  \"auxpow\": true|false,    (boolean) Whether the block is merge-mined\n"
+            "  \"avgfee\": xxxxx,         (numeric) Average fee in the block\n"
+            "  \"avgfeerate\": xxxxx,     (numeric) Average feerate (in satoshis per virtual byte)\n"
+            "  \"avgtxsize\": xxxxx,      (numeric) Average transaction size\n"
+            "  \"blockhash\": xxxxx,      (string) The block hash (to check for potential reorgs)\n"
+            "  \"feerate_percentiles\": [ (array of numeric) Feerates at the 10th, 25th, 50th, 75th, and 90th percentile weight unit (in satoshis per virtual byte)\n"
+            "      \"10th_percentile_feerate\",      (numeric) The 10th percentile feerate\n"
+            "      \"25th_percentile_feerate\",      (numeric) The 25th percentile feerate\n"
+            "      \"50th_percentile_feerate\",      (numeric) The 50th percentile feerate\n"
+            "      \"75th_percentile_feerate\",      (numeric) The 75th percentile feerate\n"
+            "      \"90th_percentile_feerate\",      (numeric) The 90th percentile feerate\n"
+            "  ],\n"
+            "  \"height\": xxxxx,         (numeric) The height of the block\n"
+            "  \"ins\": xxxxx,            (numeric) The number of inputs (excluding coinbase)\n"
+            "  \"maxfee\": xxxxx,         (numeric) Maximum fee in the block\n"
+            "  \"maxfeerate\": xxxxx,     (numeric) Maximum feerate (in satoshis per virtual byte)\n"
+            "  \"medianfee\": xxxxx,      (numeric) Truncated median fee in the block\n"
+            "  \"minfee\": xxxxx,         (numeric) Minimum fee in the block\n"
+            "  \"minfeerate\": xxxxx,     (numeric) Minimum feerate (in satoshis per virtual byte)\n"
+            "  \"outs\": xxxxx,           (numeric) The number of outputs\n"
+            "  \"subsidy\": xxxxx,        (numeric) The block subsidy\n"
+            "  \"swtxs\": xxxxx,          (numeric) The number of segwit transactions\n"
+            "  \"time\": xxxxx,           (numeric) The block time\n"
+            "  \"total_out\": xxxxx,      (numeric) Total amount in all outputs (excluding coinbase and thus reward [ie subsidy + totalfee])\n"
+            "  \"total_size\": xxxxx,     (numeric) Total size of all non-coinbase transactions\n"
+            "  \"total_weight\": xxxxx,   (numeric) Total weight of all non-coinbase transactions\n"
+            "  \"totalfee\": xxxxx,       (numeric) The fee total\n"
+            "  \"txs\": xxxxx,            (numeric) The number of transactions (including coinbase)\n"
+            "  \"utxo_increase\": xxxxx,  (numeric) The increase/decrease in the number of unspent outputs\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockstats", "1000 '[\"minfeerate\",\"avgfeerate\"]'")
+            + HelpExampleRpc("getblockstats", "1000 '[\"minfeerate\",\"avgfeerate\"]'")
+        );
+    }
+
+    const CBlockIndex* pindex;
+    {
+        LOCK(cs_main);
+        pindex = ParseHashOrHeight(request.params[0]);
+    }
+
+    std::set<std::string> stats;
+    if (!request.params[1].isNull()) {
+        const UniValue stats_univalue = request.params[1].get_array();
+        for (unsigned int i = 0; i < stats_univalue.size(); i++) {
+            const std::string stat = stats_univalue[i].get_str();
+            stats.insert(stat);
+        }
+    }
+
+    CBlockStats block_stats;
+    GetBlockStats(pindex, block_stats);
+
+    const int64_t txs = block_stats.txs - 1; // Exclude coinbase
+    UniValue feerates_res(UniValue::VARR);
+    for (int64_t i = 0; i < NUM_GETBLOCKSTATS_PERCENTILES; i++) {
+        feerates_res.push_back(block_stats.feerate_percentiles[i]);
+    }
+
+    UniValue ret_all(UniValue::VOBJ);
+    ret_all.push_back(Pair("algo", GetAlgoName(block_stats.algo, block_stats.time, Params().GetConsensus())));
+    ret_all.push_back(Pair("auxpow", block_stats.auxpow));
+    ret_all.push_back(Pair("avgfee", txs > 0 ? block_stats.totalfee / txs : 0));
+    ret_all.push_back(Pair("avgfeerate", block_stats.total_weight ? (block_stats.totalfee * WITNESS_SCALE_FACTOR) / block_stats.total_weight : 0)); // Unit: sat/vbyte
+    ret_all.push_back(Pair("avgtxsize", txs > 0 ? block_stats.total_size / txs : 0));
+    ret_all.push_back(Pair("blockhash", pindex->GetBlockHash().GetHex()));
+    ret_all.push_back(Pair("feerate_percentiles", feerates_res));
+    ret_all.push_back(Pair("height", (int64_t)block_stats.height));
+    ret_all.push_back(Pair("ins", block_stats.ins));
+    ret_all.push_back(Pair("maxfee", block_stats.maxfee));
+    ret_all.push_back(Pair("maxfeerate", block_stats.maxfeerate));
+    ret_all.push_back(Pair("medianfee", block_stats.medianfee));
+    ret_all.push_back(Pair("minfee", block_stats.minfee));
+    ret_all.push_back(Pair("minfeerate", block_stats.minfeerate));
+    ret_all.push_back(Pair("outs", block_stats.outs));
+    ret_all.push_back(Pair("subsidy", block_stats.subsidy));
+    ret_all.push_back(Pair("swtxs", block_stats.swtxs));
+    ret_all.push_back(Pair("time", block_stats.time));
+    ret_all.push_back(Pair("total_out", block_stats.total_out));
+    ret_all.push_back(Pair("total_size", block_stats.total_size));
+    ret_all.push_back(Pair("total_weight", block_stats.total_weight));
+    ret_all.push_back(Pair("totalfee", block_stats.totalfee));
+    ret_all.push_back(Pair("txs", block_stats.txs));
+    ret_all.push_back(Pair("utxo_increase", block_stats.utxo_increase));
+
+    if (stats.empty()) {
+        return ret_all;
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    for (const std::string& stat : stats) {
+        const UniValue& value = ret_all[stat];
+        if (value.isNull()) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Invalid selected statistic %s", stat));
+        }
+        ret.push_back(Pair(stat, value));
+    }
+    return ret;
+}
+
+UniValue getchainalgostats(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2) {
+        throw std::runtime_error(
+            "getchainalgostats start_height ( end_height )\n"
+            "\nAggregate block statistics per proof-of-work algorithm over a range of blocks of the active chain.\n"
+            "All amounts are in satoshis. Ranges of more than " + std::to_string(MAX_CHAIN_ALGO_STATS_BLOCKS_FROM_DISK) + " blocks need -blockstatsindex,\n"
+            "and are refused until the index has caught up with the chain.\n"
+            "\nArguments:\n"
+            "1. start_height     (numeric, required) The first block of the range\n"
+            "2. end_height       (numeric, optional) The last block of the range (default: the chain tip)\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"start_height\": xxxxx,   (numeric) The first block of the range\n"
+            "  \"end_height\": xxxxx,     (numeric) The last block of the range\n"
+            "  \"blocks\": xxxxx,         (numeric) The number of blocks in the range\n"
+            "  \"algos\": {\n"
+            "    \"name\": {               (object) The statistics of one algorithm\n"
+            "      \"blocks\": xxxxx,       (numeric) The number of blocks mined with the algorithm\n"
+            "      \"share\": x.xxx,        (numeric) The fraction of the blocks in the range\n"
+            "      \"auxpow_blocks\": xxxxx,(numeric) The number of those blocks that were merge-mined\n"
+            "      \"txs\": xxxxx,          (numeric) The number of transactions (including coinbases)\n"
+            "      \"totalfee\": xxxxx,     (numeric) The fee total\n"
+            "      \"subsidy\": xxxxx,      (numeric) The block subsidy total\n"
+            "      \"total_weight\": xxxxx  (numeric) Total weight of all non-coinbase transactions\n"
+            "    },\n"
+            "    ...\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getchainalgostats", "1000 2000")
+            + HelpExampleRpc("getchainalgostats", "1000, 2000")
+        );
+    }
+
+    std::vector<const CBlockIndex*> blocks;
+    {
+        LOCK(cs_main);
+        const int start_height = request.params[0].get_int();
+        const int end_height = request.params[1].isNull() ? chainActive.Height() : request.params[1].get_int();
+        if (start_height < 0 || end_height > chainActive.Height() || start_height > end_height) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Invalid block range %d-%d (chain height %d)", start_height, end_height, chainActive.Height()));
+        }
+        blocks.reserve(end_height - start_height + 1);
+        for (int height = start_height; height <= end_height; ++height) {
+            blocks.push_back(chainActive[height]);
+        }
+    }
+    if (blocks.size() > (size_t)MAX_CHAIN_ALGO_STATS_BLOCKS_FROM_DISK &&
+        !(g_blockstatsindex && g_blockstatsindex->BlockUntilSyncedToCurrentChain())) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Ranges of more than %d blocks need a synced -blockstatsindex", MAX_CHAIN_ALGO_STATS_BLOCKS_FROM_DISK));
+    }
+
+    struct AlgoTotals {
+        int64_t blocks = 0;
+        int64_t auxpow_blocks = 0;
+        int64_t txs = 0;
+        CAmount totalfee = 0;
+        CAmount subsidy = 0;
+        int64_t total_weight = 0;
+    };
+    AlgoTotals totals[NUM_ALGOS];
+
+    for (const CBlockIndex* pindex : blocks) {
+        CBlockStats block_stats;
+        GetBlockStats(pindex, block_stats);
+        if (block_stats.algo < 0 || block_stats.algo >= NUM_ALGOS) continue;
+
+        AlgoTotals& algo = totals[block_stats.algo];
+        ++algo.blocks;
+        if (block_stats.auxpow) ++algo.auxpow_blocks;
+        algo.txs += block_stats.txs;
+        algo.totalfee += block_stats.totalfee;
+        algo.subsidy += block_stats.subsidy;
+        algo.total_weight += block_stats.total_weight;
+    }
+
+    UniValue algos(UniValue::VOBJ);
+    for (int i = 0; i < NUM_ALGOS; ++i) {
+        const AlgoTotals& algo = totals[i];
+        UniValue entry(UniValue::VOBJ);
+        entry.push_back(Pair("blocks", algo.blocks));
+        entry.push_back(Pair("share", (double)algo.blocks / blocks.size()));
+        entry.push_back(Pair("auxpow_blocks", algo.auxpow_blocks));
+        entry.push_back(Pair("txs", algo.txs));
+        entry.push_back(Pair("totalfee", algo.totalfee));
+        entry.push_back(Pair("subsidy", algo.subsidy));
+        entry.push_back(Pair("total_weight", algo.total_weight));
+        algos.push_back(Pair(GetAlgoName(i, blocks.back()->nTime, Params().GetConsensus()), entry));
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("start_height", blocks.front()->nHeight));
+    ret.push_back(Pair("end_height", blocks.back()->nHeight));
+    ret.push_back(Pair("blocks", (int64_t)blocks.size()));
+    ret.push_back(Pair("algos", algos));
+    return ret;
+}
+
+/** Parse the address, skip and count arguments shared by the address index RPCs. */
+static CScript ParseAddressQuery(const JSONRPCRequest& request, size_t& skip, size_t& count)
+{
+    if (!g_addressindex) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index is not enabled. Use -addressindex");
+    }
+
+    CTxDestination dest = DecodeDestination(request.params[0].get_str());
+    if (!IsValidDestination(dest)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+    }
+
+    int skip_in = request.params[1].isNull() ? 0 : request.params[1].get_int();
+    int count_in = request.params[2].isNull() ? 1000 : request.params[2].get_int();
+    if (skip_in < 0) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative skip");
+    }
+    if (count_in < 1 || count_in > (int)MAX_ADDRESS_QUERY_RESULTS) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Count should be between 1 and %u", MAX_ADDRESS_QUERY_RESULTS));
+    }
+    skip = skip_in;
+    count = count_in;
+
+    if (!g_addressindex->BlockUntilSyncedToCurrentChain()) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index is still in the process of being built");
+    }
+
+    return GetScriptForDestination(dest);
+}
+
+UniValue getaddressutxos(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 3)
+        throw std::runtime_error(
+            "getaddressutxos \"address\" ( skip count )\n"
+            "\nReturns the unspent outputs paying to an address, from the address index (requires -addressindex).\n"
+            "Outputs are ordered by the height of the block that created them.\n"
+            "\nArguments:\n"
+            "1. \"address\"  (string, required) The address\n"
+            "2. skip       (numeric, optional, default=0) The number of outputs to skip\n"
+            "3. count      (numeric, optional, default=1000) The maximum number of outputs to return\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"height\": n,         (numeric) The block height the address index is synced to\n"
+            "  \"utxos\": [\n"
+            "    {\n"
+            "      \"txid\": \"hash\",  (string) The transaction id\n"
+            "      \"vout\": n,       (numeric) The output number\n"
+            "      \"height\": n,     (numeric) The height of the block containing the transaction\n"
+            "      \"amount\": x.xxx  (numeric) The output value in " + CURRENCY_UNIT + "\n"
+            "    },\n"
+            "    ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressutxos", "\"myaddress\"")
+            + HelpExampleCli("getaddressutxos", "\"myaddress\" 1000 1000")
+            + HelpExampleRpc("getaddressutxos", "\"myaddress\"")
+        );
+
+    size_t skip, count;
+    const CScript script = ParseAddressQuery(request, skip, count);
+
+    std::vector<AddressOutput> outputs;
+    if (!g_addressindex->FindUnspent(script, skip, count, outputs)) {
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read address index");
+    }
+
+    UniValue utxos(UniValue::VARR);
+    for (const AddressOutput& output : outputs) {
+        UniValue entry(UniValue::VOBJ);
+        entry.push_back(Pair("txid", output.outpoint.hash.GetHex()));
+        entry.push_back(Pair("vout", (int)output.outpoint.n));
+        entry.push_back(Pair("height", output.height));
+        entry.push_back(Pair("amount", ValueFromAmount(output.value)));
+        utxos.push_back(entry);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("height", g_addressindex->GetSummary().best_block_height));
+    ret.push_back(Pair("utxos", utxos));
+    return ret;
+}
+
+UniValue getaddresshistory(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 3)
+        throw std::runtime_error(
+            "getaddresshistory \"address\" ( skip count )\n"
+            "\nReturns the outputs received by and spent from an address, from the address index (requires -addressindex).\n"
+            "Entries are ordered by block height.\n"
+            "\nArguments:\n"
+            "1. \"address\"  (string, required) The address\n"
+            "2. skip       (numeric, optional, default=0) The number of entries to skip\n"
+            "3. count      (numeric, optional, default=1000) The maximum number of entries to return\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"height\": n,                 (numeric) The block height the address index is synced to\n"
+            "  \"history\": [\n"
+            "    {\n"
+            "      \"category\": \"receive|send\", (string) Whether an output was received or spent\n"
+            "      \"txid\": \"hash\",          (string) The transaction id\n"
+            "      \"height\": n,             (numeric) The height of the block containing the transaction\n"
+            "      \"vout\": n,               (numeric) For receives, the output number\n"
+            "      \"vin\": n,                (numeric) For sends, the input number\n"
+            "      \"amount\": x.xxx,         (numeric) The amount in " + CURRENCY_UNIT + ", negative for sends\n"
+            "      \"spent_txid\": \"hash\",    (string) For receives, the transaction spending the output, if spent\n"
+            "      \"spent_height\": n,       (numeric) For receives, the height at which the output was spent, if spent\n"
+            "      \"prevout_txid\": \"hash\",  (string) For sends, the transaction id of the output spent\n"
+            "      \"prevout_vout\": n        (numeric) For sends, the output number of the output spent\n"
+            "    },\n"
+            "    ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddresshistory", "\"myaddress\"")
+            + HelpExampleCli("getaddresshistory", "\"myaddress\" 1000 1000")
+            + HelpExampleRpc("getaddresshistory", "\"myaddress\"")
+        );
+
+    size_t skip, count;
+    const CScript script = ParseAddressQuery(request, skip, count);
+
+    std::vector<AddressHistoryEntry> history;
+    if (!g_addressindex->FindHistory(script, skip, count, history)) {
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read address index");
+    }
+
+    UniValue entries(UniValue::VARR);
+    for (const AddressHistoryEntry& history_entry : history) {
+        UniValue entry(UniValue::VOBJ);
+        entry.push_back(Pair("category", history_entry.spend ? "send" : "receive"));
+        entry.push_back(Pair("txid", history_entry.txid.GetHex()));
+        entry.push_back(Pair("height", history_entry.height));
+        entry.push_back(Pair(history_entry.spend ? "vin" : "vout", (int)history_entry.index));
+        entry.push_back(Pair("amount", ValueFromAmount(history_entry.value)));
+        if (history_entry.spend) {
+            entry.push_back(Pair("prevout_txid", history_entry.prevout.hash.GetHex()));
+            entry.push_back(Pair("prevout_vout", (int)history_entry.prevout.n));
+        } else if (history_entry.spent_height >= 0) {
+            entry.push_back(Pair("spent_txid", history_entry.spent_txid.GetHex()));
+            entry.push_back(Pair("spent_height", history_entry.spent_height));
+        }
+        entries.push_back(entry);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("height", g_addressindex->GetSummary().best_block_height));
+    ret.push_back(Pair("history", entries));
+    return ret;
+}
+
 UniValue savemempool(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() != 0) {
@@ -1707,9 +2361,16 @@ static const CRPCCommand commands[] =
   //  --------------------- ------------------------  -----------------------  ----------
     { "blockchain",         "getblockchaininfo",      &getblockchaininfo,      {} },
     { "blockchain",         "getchaintxstats",        &getchaintxstats,        {"nblocks", "blockhash"} },
+    { "blockchain",         "getindexinfo",           &getindexinfo,           {"index_name"} },
+    { "blockchain",         "getaddressutxos",        &getaddressutxos,        {"address", "skip", "count"} },
+    { "blockchain",         "getaddresshistory",      &getaddresshistory,      {"address", "skip", "count"} },
+    { "blockchain",         "getblockfilter",         &getblockfilter,         {"blockhash", "filtertype"} },
+    { "blockchain",         "getblockstats",          &getblockstats,          {"hash_or_height", "stats"} },
+    { "blockchain",         "getchainalgostats",      &getchainalgostats,      {"start_height", "end_height"} },
     { "blockchain",         "getbestblockhash",       &getbestblockhash,       {} },
     { "blockchain",         "getblockcount",          &getblockcount,          {} },
     { "blockchain",         "getblock",               &getblock,               {"blockhash","verbosity|verbose"} },
+    { "blockchain",         "getblockcacheinfo",      &getblockcacheinfo,      {} },
     { "blockchain",         "getblockhash",           &getblockhash,           {"height"} },
     { "blockchain",         "getblockheader",         &getblockheader,         {"blockhash","verbose"} },
     { "blockchain",         "getchaintips",           &getchaintips,           {} },
@@ -1718,9 +2379,9 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getmempooldescendants",  &getmempooldescendants,  {"txid","verbose"} },
     { "blockchain",         "getmempoolentry",        &getmempoolentry,        {"txid"} },
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         {} },
-    { "blockchain",         "getrawmempool",          &getrawmempool,          {"verbose"} },
+    { "blockchain",         "getrawmempool",          &getrawmempool,          {"verbose","since_sequence"} },
     { "blockchain",         "gettxout",               &gettxout,               {"txid","n","include_mempool"} },
-    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        {} },
+    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        {"hash_or_height"} },
     { "blockchain",         "pruneblockchain",        &pruneblockchain,        {"height"} },
     { "blockchain",         "savemempool",            &savemempool,            {} },
     { "blockchain",         "verifychain",            &verifychain,            {"checklevel","nblocks"} },
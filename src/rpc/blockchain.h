@@ -5,9 +5,12 @@
 #ifndef BITCOIN_RPC_BLOCKCHAIN_H
 #define BITCOIN_RPC_BLOCKCHAIN_H
 
+#include <memory>
+
 class CBlock;
 class CBlockIndex;
 class UniValue;
+struct CChainTipSnapshot;
 
 /**
  * Get the difficulty of the net wrt to the given block index, or the chain tip if
@@ -18,6 +21,12 @@ class UniValue;
  */
 double GetDifficulty(const CBlockIndex* blockindex = nullptr, int algo = 0);
 
+/** Get the difficulty that nBits encodes, like GetDifficulty. */
+double GetDifficultyFromBits(unsigned int nBits);
+
+/** The published snapshot of the chain tip, read without cs_main. Throws if there is none yet. */
+std::shared_ptr<const CChainTipSnapshot> GetChainTipSnapshotOrThrow();
+
 /** Callback for when block tip changed. */
 void RPCNotifyBlockChange(bool ibd, const CBlockIndex *);
 
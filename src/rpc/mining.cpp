@@ -57,28 +57,7 @@ UniValue GetNetworkHashPS(int lookup, int height) {
     if (lookup <= 0)
         lookup = pb->nHeight % Params().GetConsensus().DifficultyAdjustmentInterval() + 1;
 
-    // If lookup is larger than chain, then set it to chain length.
-    if (lookup > pb->nHeight)
-        lookup = pb->nHeight;
-
-    CBlockIndex *pb0 = pb;
-    int64_t minTime = pb0->GetBlockTime();
-    int64_t maxTime = minTime;
-    for (int i = 0; i < lookup; i++) {
-        pb0 = pb0->pprev;
-        int64_t time = pb0->GetBlockTime();
-        minTime = std::min(time, minTime);
-        maxTime = std::max(time, maxTime);
-    }
-
-    // In case there's a situation where minTime == maxTime, we don't want a divide by zero exception.
-    if (minTime == maxTime)
-        return 0;
-
-    arith_uint256 workDiff = pb->nChainWork - pb0->nChainWork;
-    int64_t timeDiff = maxTime - minTime;
-
-    return workDiff.getdouble() / timeDiff;
+    return GetAverageHashRate(pb, lookup);
 }
 
 UniValue getnetworkhashps(const JSONRPCRequest& request)
@@ -232,22 +211,23 @@ UniValue getmininginfo(const JSONRPCRequest& request)
             + HelpExampleRpc("getmininginfo", "")
         );
 
-
-    LOCK(cs_main);
+    // Read from the published tip snapshot, so that this doesn't wait for
+    // blocks being connected.
+    const std::shared_ptr<const CChainTipSnapshot> tip = GetChainTipSnapshotOrThrow();
 
     UniValue obj(UniValue::VOBJ);
-    obj.push_back(Pair("blocks",           (int)chainActive.Height()));
-    obj.push_back(Pair("currentblockweight", (uint64_t)nLastBlockWeight));
-    obj.push_back(Pair("currentblocktx",   (uint64_t)nLastBlockTx));
+    obj.push_back(Pair("blocks",           tip->nHeight));
+    obj.push_back(Pair("currentblockweight", nLastBlockWeight.load()));
+    obj.push_back(Pair("currentblocktx",   nLastBlockTx.load()));
     obj.push_back(Pair("pow_algo_id", miningAlgo));
     obj.push_back(Pair("pow_algo", GetAlgoName(miningAlgo, GetTime(), Params().GetConsensus())));
-    obj.push_back(Pair("difficulty",       (double)GetDifficulty(nullptr, miningAlgo)));
-    obj.push_back(Pair("difficulty_sha256d",     (double)GetDifficulty(nullptr, ALGO_SHA256D)));
-    obj.push_back(Pair("difficulty_scrypt",      (double)GetDifficulty(nullptr, ALGO_SCRYPT)));
-    obj.push_back(Pair("difficulty_groestl",     (double)GetDifficulty(nullptr, ALGO_GROESTL)));
-    obj.push_back(Pair("difficulty_skein",       (double)GetDifficulty(nullptr, ALGO_SKEIN)));
-    obj.push_back(Pair("difficulty_yescrypt",    (double)GetDifficulty(nullptr, ALGO_YESCRYPT)));
-    obj.push_back(Pair("networkhashps",    getnetworkhashps(request)));
+    obj.push_back(Pair("difficulty",       GetDifficultyFromBits(tip->nBitsByAlgo[miningAlgo])));
+    obj.push_back(Pair("difficulty_sha256d",     GetDifficultyFromBits(tip->nBitsByAlgo[ALGO_SHA256D])));
+    obj.push_back(Pair("difficulty_scrypt",      GetDifficultyFromBits(tip->nBitsByAlgo[ALGO_SCRYPT])));
+    obj.push_back(Pair("difficulty_groestl",     GetDifficultyFromBits(tip->nBitsByAlgo[ALGO_GROESTL])));
+    obj.push_back(Pair("difficulty_skein",       GetDifficultyFromBits(tip->nBitsByAlgo[ALGO_SKEIN])));
+    obj.push_back(Pair("difficulty_yescrypt",    GetDifficultyFromBits(tip->nBitsByAlgo[ALGO_YESCRYPT])));
+    obj.push_back(Pair("networkhashps",    tip->GetNetworkHashPS()));
     obj.push_back(Pair("pooledtx",         (uint64_t)mempool.size()));
     obj.push_back(Pair("chain",            Params().NetworkIDString()));
     if (IsDeprecatedRPCEnabled("getmininginfo")) {
@@ -532,35 +512,16 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
     // don't).
     bool fSupportsSegwit = setClientRules.find(segwit_info.name) != setClientRules.end();
 
-    // Update block
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static std::unique_ptr<CBlockTemplate> pblocktemplate;
-    // Cache whether the last invocation was with segwit support, to avoid returning
-    // a segwit-block to a non-segwit caller.
-    static bool fLastTemplateSupportsSegwit = true;
-    if (pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5) ||
-        fLastTemplateSupportsSegwit != fSupportsSegwit)
-    {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = nullptr;
-
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
-        fLastTemplateSupportsSegwit = fSupportsSegwit;
-
-        // Create new block
-        CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptDummy, miningAlgo, fSupportsSegwit);
-        if (!pblocktemplate)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-    }
+    // Update block. The template cache follows the mempool, and selects the
+    // transactions again at most every 5 seconds. Templates with and without
+    // segwit transactions are cached separately, to avoid returning a
+    // segwit-block to a non-segwit caller.
+    CBlockIndex* const pindexPrev = chainActive.Tip();
+    nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+    CScript scriptDummy = CScript() << OP_TRUE;
+    std::unique_ptr<CBlockTemplate> pblocktemplate = g_block_template_cache.GetBlockTemplate(scriptDummy, miningAlgo, fSupportsSegwit, 5);
+    if (!pblocktemplate)
+        throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
     CBlock* pblock = &pblocktemplate->block; // pointer for convenience
     const Consensus::Params& consensusParams = Params().GetConsensus();
 
@@ -1074,7 +1035,7 @@ UniValue AuxMiningCreateBlock(const CScript& scriptPubKey)
 
         // Create new block with nonce = 0 and extraNonce = 1
         std::unique_ptr<CBlockTemplate> newBlock
-            = BlockAssembler(Params()).CreateNewBlock(scriptPubKey, miningAlgo);
+            = g_block_template_cache.GetBlockTemplate(scriptPubKey, miningAlgo);
         if (!newBlock)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "out of memory");
 
@@ -524,6 +524,47 @@ UniValue getmemoryinfo(const JSONRPCRequest& request)
     }
 }
 
+UniValue getlockcontention(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 0)
+        throw std::runtime_error(
+            "getlockcontention\n"
+            "Returns how often and how long threads waited for locks held by other threads.\n"
+            "Waits are only counted while the \"lock\" debug log category is enabled, with -debug=lock or the logging RPC.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"enabled\": true|false,    (boolean) Whether waits are being counted\n"
+            "  \"locks\": [               (json array) The locks that were waited for\n"
+            "    {\n"
+            "      \"name\": \"name\",       (string) The name of the lock, e.g. cs_main. Locks of different objects may share a name\n"
+            "      \"address\": \"0x...\",   (string) The address of the lock, which tells such locks apart\n"
+            "      \"count\": n,           (numeric) Number of waits\n"
+            "      \"wait_us\": n,         (numeric) Total time waited, in microseconds\n"
+            "      \"max_wait_us\": n      (numeric) Longest wait, in microseconds\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getlockcontention", "")
+            + HelpExampleRpc("getlockcontention", "")
+        );
+
+    UniValue locks(UniValue::VARR);
+    for (const auto& entry : GetLockContentionStats()) {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("name", entry.first.first));
+        obj.push_back(Pair("address", strprintf("%p", entry.first.second)));
+        obj.push_back(Pair("count", entry.second.count));
+        obj.push_back(Pair("wait_us", entry.second.wait_micros));
+        obj.push_back(Pair("max_wait_us", entry.second.max_wait_micros));
+        locks.push_back(obj);
+    }
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("enabled", LogLockContentionEnabled()));
+    ret.push_back(Pair("locks", locks));
+    return ret;
+}
+
 uint32_t getCategoryMask(UniValue cats) {
     cats = cats.get_array();
     uint32_t mask = 0;
@@ -639,6 +680,7 @@ static const CRPCCommand commands[] =
 { //  category              name                      actor (function)         argNames
   //  --------------------- ------------------------  -----------------------  ----------
     { "control",            "getmemoryinfo",          &getmemoryinfo,          {"mode"} },
+    { "control",            "getlockcontention",      &getlockcontention,      {} },
     { "control",            "logging",                &logging,                {"include", "exclude"}},
     { "util",               "validateaddress",        &validateaddress,        {"address"} }, /* uses wallet if enabled */
     { "util",               "createmultisig",         &createmultisig,         {"nrequired","keys"} },
@@ -8,6 +8,7 @@
 #include <coins.h>
 #include <consensus/validation.h>
 #include <core_io.h>
+#include <index/txindex.h>
 #include <init.h>
 #include <keystore.h>
 #include <validation.h>
@@ -141,6 +142,13 @@ UniValue getrawtransaction(const JSONRPCRequest& request)
             + HelpExampleCli("getrawtransaction", "\"mytxid\" true \"myblockhash\"")
         );
 
+    // Let the transaction index process queued block notifications first;
+    // this must happen before cs_main is taken.
+    bool f_txindex_ready = false;
+    if (g_txindex && request.params[2].isNull()) {
+        f_txindex_ready = g_txindex->BlockUntilSyncedToCurrentChain();
+    }
+
     LOCK(cs_main);
 
     bool in_active_chain = true;
@@ -177,10 +185,12 @@ UniValue getrawtransaction(const JSONRPCRequest& request)
                 throw JSONRPCError(RPC_MISC_ERROR, "Block not available");
             }
             errmsg = "No such transaction found in the provided block";
+        } else if (!g_txindex) {
+            errmsg = "No such mempool transaction. Use -txindex to enable blockchain transaction queries";
+        } else if (!f_txindex_ready) {
+            errmsg = "No such mempool transaction. Blockchain transactions are still in the process of being indexed";
         } else {
-            errmsg = fTxIndex
-              ? "No such mempool or blockchain transaction"
-              : "No such mempool transaction. Use -txindex to enable blockchain transaction queries";
+            errmsg = "No such mempool or blockchain transaction";
         }
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, errmsg + ". Use gettransaction for wallet transactions.");
     }
@@ -230,6 +240,10 @@ UniValue gettxoutproof(const JSONRPCRequest& request)
        oneTxid = hash;
     }
 
+    if (g_txindex && request.params[1].isNull()) {
+        g_txindex->BlockUntilSyncedToCurrentChain();
+    }
+
     LOCK(cs_main);
 
     CBlockIndex* pblockindex = nullptr;
@@ -977,17 +991,21 @@ UniValue sendrawtransaction(const JSONRPCRequest& request)
     if (!request.params[1].isNull() && request.params[1].get_bool())
         nMaxRawTxFee = 0;
 
+    bool fHaveChain = false;
+    bool fHaveMempool;
     { // cs_main scope
     LOCK(cs_main);
     CCoinsViewCache &view = *pcoinsTip;
-    bool fHaveChain = false;
     for (size_t o = 0; !fHaveChain && o < tx->vout.size(); o++) {
         const Coin& existingCoin = view.AccessCoin(COutPoint(hashTx, o));
         fHaveChain = !existingCoin.IsSpent();
     }
-    bool fHaveMempool = mempool.exists(hashTx);
+    fHaveMempool = mempool.exists(hashTx);
+    } // cs_main
+
     if (!fHaveMempool && !fHaveChain) {
-        // push to local node and sync with wallets
+        // push to local node and sync with wallets, verifying the scripts
+        // without holding cs_main
         CValidationState state;
         bool fMissingInputs;
         if (!AcceptToMemoryPool(mempool, state, std::move(tx), &fMissingInputs,
@@ -1018,8 +1036,6 @@ UniValue sendrawtransaction(const JSONRPCRequest& request)
         promise.set_value();
     }
 
-    } // cs_main
-
     promise.get_future().wait();
 
     if(!g_connman)
@@ -1034,6 +1050,139 @@ UniValue sendrawtransaction(const JSONRPCRequest& request)
     return hashTx.GetHex();
 }
 
+UniValue sendrawtransactions(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
+        throw std::runtime_error(
+            "sendrawtransactions [\"hexstring\",...] ( allowhighfees )\n"
+            "\nSubmits a batch of raw transactions (serialized, hex-encoded) to local node and network.\n"
+            "The transactions may spend each other's outputs and be given in any order: parents are\n"
+            "added to the mempool before their children. The scripts of transactions that don't depend\n"
+            "on each other are verified in parallel.\n"
+            "\nArguments:\n"
+            "1. \"hexstrings\"     (array, required) The hex strings of the raw transactions\n"
+            "     [\n"
+            "       \"hexstring\"  (string) A raw transaction\n"
+            "       ,...\n"
+            "     ]\n"
+            "2. allowhighfees    (boolean, optional, default=false) Allow high fees\n"
+            "\nResult:\n"
+            "[                       (array) One result per transaction, in the order given\n"
+            "  {\n"
+            "    \"txid\" : \"hex\",       (string) The transaction hash in hex, if the transaction could be decoded\n"
+            "    \"accepted\" : true|false, (boolean) Whether the transaction is in the mempool now\n"
+            "    \"error\" : \"text\"      (string) Why the transaction was not accepted, if it wasn't\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("sendrawtransactions", "\"[\\\"signedhex\\\",\\\"signedhex\\\"]\"")
+            + HelpExampleRpc("sendrawtransactions", "[\"signedhex\",\"signedhex\"]")
+        );
+
+    ObserveSafeMode();
+
+    RPCTypeCheck(request.params, {UniValue::VARR, UniValue::VBOOL});
+    const UniValue& hexstrings = request.params[0].get_array();
+
+    CAmount nMaxRawTxFee = maxTxFee;
+    if (!request.params[1].isNull() && request.params[1].get_bool())
+        nMaxRawTxFee = 0;
+
+    const size_t nTxs = hexstrings.size();
+    std::vector<uint256> vHash(nTxs);
+    std::vector<bool> vDecoded(nTxs, false);
+    std::vector<bool> vAccepted(nTxs, false);
+    std::vector<std::string> vError(nTxs);
+
+    // Transactions to submit, and where they are in the batch
+    std::vector<CTransactionRef> txs;
+    std::vector<size_t> vIndex;
+
+    { // cs_main scope
+    LOCK(cs_main);
+    CCoinsViewCache &view = *pcoinsTip;
+    for (size_t i = 0; i < nTxs; i++) {
+        CMutableTransaction mtx;
+        if (!hexstrings[i].isStr() || !DecodeHexTx(mtx, hexstrings[i].get_str())) {
+            vError[i] = "TX decode failed";
+            continue;
+        }
+        CTransactionRef tx(MakeTransactionRef(std::move(mtx)));
+        vHash[i] = tx->GetHash();
+        vDecoded[i] = true;
+
+        bool fHaveChain = false;
+        for (size_t o = 0; !fHaveChain && o < tx->vout.size(); o++) {
+            const Coin& existingCoin = view.AccessCoin(COutPoint(vHash[i], o));
+            fHaveChain = !existingCoin.IsSpent();
+        }
+        if (fHaveChain) {
+            vError[i] = "transaction already in block chain";
+        } else if (mempool.exists(vHash[i])) {
+            vAccepted[i] = true;
+        } else {
+            txs.push_back(std::move(tx));
+            vIndex.push_back(i);
+        }
+    }
+    } // cs_main
+
+    // push to local node and sync with wallets
+    std::vector<CValidationState> states;
+    std::vector<bool> vBatchAccepted;
+    std::vector<bool> vMissingInputs;
+    AcceptToMemoryPoolBatch(mempool, txs, states, vBatchAccepted, vMissingInputs, nMaxRawTxFee);
+    bool fAnyAccepted = false;
+    for (size_t j = 0; j < txs.size(); j++) {
+        const size_t i = vIndex[j];
+        if (vBatchAccepted[j]) {
+            vAccepted[i] = fAnyAccepted = true;
+        } else if (states[j].IsInvalid()) {
+            vError[i] = strprintf("%i: %s", states[j].GetRejectCode(), states[j].GetRejectReason());
+        } else if (vMissingInputs[j]) {
+            vError[i] = "Missing inputs";
+        } else {
+            vError[i] = states[j].GetRejectReason();
+        }
+    }
+
+    if (fAnyAccepted) {
+        // As in sendrawtransaction, let the wallet see the new transactions
+        // before returning.
+        std::promise<void> promise;
+        CallFunctionInValidationInterfaceQueue([&promise] {
+            promise.set_value();
+        });
+        promise.get_future().wait();
+    }
+
+    if(!g_connman)
+        throw JSONRPCError(RPC_CLIENT_P2P_DISABLED, "Error: Peer-to-peer functionality missing or disabled");
+
+    std::vector<CInv> vInv;
+    UniValue result(UniValue::VARR);
+    for (size_t i = 0; i < nTxs; i++) {
+        UniValue entry(UniValue::VOBJ);
+        if (vDecoded[i])
+            entry.push_back(Pair("txid", vHash[i].GetHex()));
+        entry.push_back(Pair("accepted", (bool)vAccepted[i]));
+        if (vAccepted[i])
+            vInv.push_back(CInv(MSG_TX, vHash[i]));
+        else
+            entry.push_back(Pair("error", vError[i]));
+        result.push_back(entry);
+    }
+
+    g_connman->ForEachNode([&vInv](CNode* pnode)
+    {
+        for (const CInv& inv : vInv)
+            pnode->PushInventory(inv);
+    });
+
+    return result;
+}
+
 static const CRPCCommand commands[] =
 { //  category              name                      actor (function)         argNames
   //  --------------------- ------------------------  -----------------------  ----------
@@ -1042,6 +1191,7 @@ static const CRPCCommand commands[] =
     { "rawtransactions",    "decoderawtransaction",   &decoderawtransaction,   {"hexstring","iswitness"} },
     { "rawtransactions",    "decodescript",           &decodescript,           {"hexstring"} },
     { "rawtransactions",    "sendrawtransaction",     &sendrawtransaction,     {"hexstring","allowhighfees"} },
+    { "rawtransactions",    "sendrawtransactions",    &sendrawtransactions,    {"hexstrings","allowhighfees"} },
     { "rawtransactions",    "combinerawtransaction",  &combinerawtransaction,  {"txs"} },
     { "rawtransactions",    "signrawtransaction",     &signrawtransaction,     {"hexstring","prevtxs","privkeys","sighashtype"} }, /* uses wallet if enabled */
 
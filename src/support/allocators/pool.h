@@ -0,0 +1,221 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+#define BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+/**
+ * Memory for the nodes of node based containers (maps, sets, multi_index
+ * containers). Nodes are carved out of large chunks, so that a node costs its
+ * own size rather than its size plus the bookkeeping and rounding of malloc,
+ * and the nodes of a container stay close together.
+ *
+ * Each chunk holds nodes of one size, and keeps a free list of them. A chunk
+ * is released as soon as its last node is freed, so ChunkBytes() follows the
+ * nodes in use even when the mix of node sizes shifts; only partly used
+ * chunks hold memory that no node uses.
+ *
+ * Not thread safe; the containers using an arena need to be protected by the
+ * same lock.
+ */
+class NodeArena
+{
+public:
+    //! Nodes are aligned to, and their sizes rounded up to, this many bytes
+    static const size_t NODE_ALIGN = 8;
+    //! Larger allocations are left to operator new
+    static const size_t MAX_NODE_SIZE = 512;
+    //! Bytes per chunk unless given otherwise: 64KB, which a busy mempool
+    //! fills with a few hundred nodes of each size
+    static const size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+    explicit NodeArena(size_t nChunkSizeIn = DEFAULT_CHUNK_SIZE) : nChunkSize(nChunkSizeIn), vAvailable(MAX_NODE_SIZE / NODE_ALIGN + 1, nullptr)
+    {
+        static_assert(alignof(int64_t) <= NODE_ALIGN && alignof(void*) <= NODE_ALIGN, "nodes must be aligned for their members");
+        assert(nChunkSize >= MAX_NODE_SIZE);
+    }
+
+    NodeArena(const NodeArena&) = delete;
+    NodeArena& operator=(const NodeArena&) = delete;
+
+    void* Allocate(size_t nSize)
+    {
+        const size_t nNodeSize = RoundSize(nSize);
+        Chunk*& pAvailable = vAvailable[nNodeSize / NODE_ALIGN];
+        if (pAvailable == nullptr) {
+            std::unique_ptr<char[]> data(new char[nChunkSize]);
+            char* pData = data.get();
+            Chunk& chunk = mapChunks.emplace(pData, Chunk(std::move(data), nChunkSize / nNodeSize)).first->second;
+            LinkAvailable(pAvailable, &chunk);
+        }
+        Chunk& chunk = *pAvailable;
+        void* p = chunk.pFree;
+        if (p != nullptr) {
+            chunk.pFree = *static_cast<void**>(p);
+        } else {
+            // Without freed nodes, the nodes in use are the first nLive ones
+            p = chunk.data.get() + chunk.nLive * nNodeSize;
+        }
+        if (++chunk.nLive == chunk.nCapacity) {
+            UnlinkAvailable(pAvailable, &chunk);
+        }
+        nUsedBytes += nNodeSize;
+        return p;
+    }
+
+    void Deallocate(void* p, size_t nSize) noexcept
+    {
+        const size_t nNodeSize = RoundSize(nSize);
+        Chunk*& pAvailable = vAvailable[nNodeSize / NODE_ALIGN];
+        // The chunk that starts at or before p
+        ChunkMap::iterator it = mapChunks.upper_bound(static_cast<char*>(p));
+        assert(it != mapChunks.begin());
+        Chunk& chunk = (--it)->second;
+        if (chunk.nLive == chunk.nCapacity) {
+            LinkAvailable(pAvailable, &chunk);
+        }
+        nUsedBytes -= nNodeSize;
+        if (--chunk.nLive == 0) {
+            UnlinkAvailable(pAvailable, &chunk);
+            mapChunks.erase(it);
+        } else {
+            *static_cast<void**>(p) = chunk.pFree;
+            chunk.pFree = p;
+        }
+    }
+
+    /** Bytes of the nodes that are allocated from the arena now */
+    size_t UsedBytes() const { return nUsedBytes; }
+    /** Bytes of the chunks that the nodes are carved from, the arena's real footprint */
+    size_t ChunkBytes() const { return mapChunks.size() * nChunkSize; }
+
+    static size_t RoundSize(size_t nSize) { return (nSize + NODE_ALIGN - 1) & ~(NODE_ALIGN - 1); }
+
+private:
+    struct Chunk
+    {
+        std::unique_ptr<char[]> data;
+        size_t nCapacity;    //!< Number of nodes that fit in the chunk
+        size_t nLive = 0;    //!< Number of nodes allocated from the chunk now
+        void* pFree = nullptr; //!< Freed nodes, linked through their first bytes
+        //! Neighbours in the list of chunks of the same node size that have room
+        Chunk* pPrevAvailable = nullptr;
+        Chunk* pNextAvailable = nullptr;
+
+        Chunk(std::unique_ptr<char[]> dataIn, size_t nCapacityIn) : data(std::move(dataIn)), nCapacity(nCapacityIn) {}
+    };
+    //! Chunks by their address, to find the chunk of a node
+    typedef std::map<char*, Chunk> ChunkMap;
+
+    static void LinkAvailable(Chunk*& pHead, Chunk* pChunk) noexcept
+    {
+        pChunk->pPrevAvailable = nullptr;
+        pChunk->pNextAvailable = pHead;
+        if (pHead) pHead->pPrevAvailable = pChunk;
+        pHead = pChunk;
+    }
+
+    static void UnlinkAvailable(Chunk*& pHead, Chunk* pChunk) noexcept
+    {
+        if (pChunk->pPrevAvailable) {
+            pChunk->pPrevAvailable->pNextAvailable = pChunk->pNextAvailable;
+        } else {
+            pHead = pChunk->pNextAvailable;
+        }
+        if (pChunk->pNextAvailable) pChunk->pNextAvailable->pPrevAvailable = pChunk->pPrevAvailable;
+        pChunk->pPrevAvailable = pChunk->pNextAvailable = nullptr;
+    }
+
+    const size_t nChunkSize;
+    ChunkMap mapChunks;
+    //! Chunks with room by node size
+    std::vector<Chunk*> vAvailable;
+    size_t nUsedBytes = 0;
+};
+
+/**
+ * Allocator that takes single objects from a NodeArena, for containers that
+ * allocate their nodes one at a time. Arrays, such as the bucket array of a
+ * hash table, and objects larger than NodeArena::MAX_NODE_SIZE come from
+ * operator new.
+ */
+template <typename T>
+class pool_allocator
+{
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    template <typename U>
+    struct rebind {
+        typedef pool_allocator<U> other;
+    };
+
+    explicit pool_allocator(NodeArena* arenaIn) noexcept : arena(arenaIn) {}
+    template <typename U>
+    pool_allocator(const pool_allocator<U>& other) noexcept : arena(other.arena)
+    {
+    }
+
+    T* allocate(std::size_t n, const void* hint = nullptr)
+    {
+        if (n == 1 && sizeof(T) <= NodeArena::MAX_NODE_SIZE) {
+            return static_cast<T*>(arena->Allocate(sizeof(T)));
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept
+    {
+        if (n == 1 && sizeof(T) <= NodeArena::MAX_NODE_SIZE) {
+            arena->Deallocate(p, sizeof(T));
+        } else {
+            ::operator delete(p);
+        }
+    }
+
+    std::size_t max_size() const noexcept { return std::size_t(-1) / sizeof(T); }
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args)
+    {
+        ::new ((void*)p) U(std::forward<Args>(args)...);
+    }
+
+    template <typename U>
+    void destroy(U* p)
+    {
+        p->~U();
+    }
+
+    NodeArena* arena;
+};
+
+template <typename T, typename U>
+bool operator==(const pool_allocator<T>& a, const pool_allocator<U>& b) noexcept
+{
+    return a.arena == b.arena;
+}
+
+template <typename T, typename U>
+bool operator!=(const pool_allocator<T>& a, const pool_allocator<U>& b) noexcept
+{
+    return !(a == b);
+}
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_POOL_H
@@ -4,6 +4,7 @@
 
 #include <sync.h>
 
+#include <algorithm>
 #include <memory>
 #include <set>
 #include <util.h>
@@ -22,6 +23,30 @@ void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
 }
 #endif /* DEBUG_LOCKCONTENTION */
 
+static std::mutex g_lock_contention_mutex;
+static std::map<std::pair<std::string, const void*>, LockContentionStats> g_lock_contention_stats;
+
+bool LogLockContentionEnabled()
+{
+    return LogAcceptCategory(BCLog::LOCK);
+}
+
+void LogLockContention(const char* pszName, const char* pszFile, int nLine, const void* cs, int64_t nWaitMicros)
+{
+    LogPrint(BCLog::LOCK, "Lock contention %s, %s:%d, waited %dus\n", pszName, pszFile, nLine, nWaitMicros);
+    std::lock_guard<std::mutex> lock(g_lock_contention_mutex);
+    LockContentionStats& stats = g_lock_contention_stats[std::make_pair(std::string(pszName), cs)];
+    stats.count++;
+    stats.wait_micros += nWaitMicros;
+    stats.max_wait_micros = std::max(stats.max_wait_micros, nWaitMicros);
+}
+
+std::map<std::pair<std::string, const void*>, LockContentionStats> GetLockContentionStats()
+{
+    std::lock_guard<std::mutex> lock(g_lock_contention_mutex);
+    return g_lock_contention_stats;
+}
+
 #ifdef DEBUG_LOCKORDER
 //
 // Early deadlock detection.
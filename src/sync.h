@@ -7,8 +7,11 @@
 #define BITCOIN_SYNC_H
 
 #include <threadsafety.h>
+#include <utiltime.h>
 
 #include <condition_variable>
+#include <map>
+#include <string>
 #include <thread>
 #include <mutex>
 
@@ -112,6 +115,20 @@ typedef std::unique_lock<std::mutex> WaitableLock;
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine);
 #endif
 
+/** Waits for locks held by another thread, per lock */
+struct LockContentionStats {
+    uint64_t count = 0;
+    int64_t wait_micros = 0;
+    int64_t max_wait_micros = 0;
+};
+
+/** Whether waits for contended locks are logged and counted (-debug=lock) */
+bool LogLockContentionEnabled();
+/** Log and count a wait of nWaitMicros for the lock pszName at cs, taken at pszFile:nLine */
+void LogLockContention(const char* pszName, const char* pszFile, int nLine, const void* cs, int64_t nWaitMicros);
+/** The waits counted since startup, by lock name and address, as locks of different objects share a name */
+std::map<std::pair<std::string, const void*>, LockContentionStats> GetLockContentionStats();
+
 /** Wrapper around std::unique_lock<CCriticalSection> */
 class SCOPED_LOCKABLE CCriticalBlock
 {
@@ -121,14 +138,18 @@ private:
     void Enter(const char* pszName, const char* pszFile, int nLine)
     {
         EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()));
-#ifdef DEBUG_LOCKCONTENTION
         if (!lock.try_lock()) {
+#ifdef DEBUG_LOCKCONTENTION
             PrintLockContention(pszName, pszFile, nLine);
 #endif
-            lock.lock();
-#ifdef DEBUG_LOCKCONTENTION
+            if (LogLockContentionEnabled()) {
+                const int64_t nStart = GetTimeMicros();
+                lock.lock();
+                LogLockContention(pszName, pszFile, nLine, lock.mutex(), GetTimeMicros() - nStart);
+            } else {
+                lock.lock();
+            }
         }
-#endif
     }
 
     bool TryEnter(const char* pszName, const char* pszFile, int nLine)
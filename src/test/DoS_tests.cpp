@@ -11,6 +11,7 @@
 #include <pow.h>
 #include <script/sign.h>
 #include <serialize.h>
+#include <txorphanpool.h>
 #include <util.h>
 #include <validation.h>
 
@@ -20,17 +21,6 @@
 
 #include <boost/test/unit_test.hpp>
 
-// Tests these internal-to-net_processing.cpp methods:
-extern bool AddOrphanTx(const CTransactionRef& tx, NodeId peer);
-extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-struct COrphanTx {
-    CTransactionRef tx;
-    NodeId fromPeer;
-    int64_t nTimeExpire;
-};
-extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-
 CService ip(uint32_t i)
 {
     struct in_addr s;
@@ -293,14 +283,9 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     peerLogic->FinalizeNode(dummyNode.GetId(), dummy);
 }
 
-CTransactionRef RandomOrphan()
+static CTransactionRef RandomOrphan(const std::vector<CTransactionRef>& vOrphans)
 {
-    std::map<uint256, COrphanTx>::iterator it;
-    LOCK(cs_main);
-    it = mapOrphanTransactions.lower_bound(InsecureRand256());
-    if (it == mapOrphanTransactions.end())
-        it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    return vOrphans[InsecureRandRange(vOrphans.size())];
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -310,6 +295,9 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     CBasicKeyStore keystore;
     keystore.AddKey(key);
 
+    CTxOrphanPool orphanpool(1000, 100 * 1000000);
+    std::vector<CTransactionRef> vOrphans;
+
     // 50 orphan transactions:
     for (int i = 0; i < 50; i++)
     {
@@ -322,13 +310,14 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(MakeTransactionRef(tx), i);
+        vOrphans.push_back(MakeTransactionRef(tx));
+        BOOST_CHECK(orphanpool.AddTx(vOrphans.back(), i));
     }
 
     // ... and 50 that depend on other orphans:
     for (int i = 0; i < 50; i++)
     {
-        CTransactionRef txPrev = RandomOrphan();
+        CTransactionRef txPrev = RandomOrphan(vOrphans);
 
         CMutableTransaction tx;
         tx.vin.resize(1);
@@ -339,13 +328,14 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
         SignSignature(keystore, *txPrev, tx, 0, SIGHASH_ALL);
 
-        AddOrphanTx(MakeTransactionRef(tx), i);
+        vOrphans.push_back(MakeTransactionRef(tx));
+        orphanpool.AddTx(vOrphans.back(), i);
     }
 
     // This really-big orphan should be ignored:
     for (int i = 0; i < 10; i++)
     {
-        CTransactionRef txPrev = RandomOrphan();
+        CTransactionRef txPrev = RandomOrphan(vOrphans);
 
         CMutableTransaction tx;
         tx.vout.resize(1);
@@ -363,25 +353,134 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(MakeTransactionRef(tx), i));
+        BOOST_CHECK(!orphanpool.AddTx(MakeTransactionRef(tx), i));
     }
 
-    LOCK(cs_main);
-    // Test EraseOrphansFor:
+    // Test EraseForPeer:
     for (NodeId i = 0; i < 3; i++)
     {
-        size_t sizeBefore = mapOrphanTransactions.size();
-        EraseOrphansFor(i);
-        BOOST_CHECK(mapOrphanTransactions.size() < sizeBefore);
+        size_t sizeBefore = orphanpool.Size();
+        orphanpool.EraseForPeer(i);
+        BOOST_CHECK(orphanpool.Size() < sizeBefore);
+        BOOST_CHECK_EQUAL(orphanpool.PeerUsage(i), 0U);
+    }
+
+    // Test LimitOrphans():
+    orphanpool.SetLimits(40, 100 * 1000000);
+    orphanpool.LimitOrphans();
+    BOOST_CHECK(orphanpool.Size() <= 40);
+    orphanpool.SetLimits(10, 100 * 1000000);
+    orphanpool.LimitOrphans();
+    BOOST_CHECK(orphanpool.Size() <= 10);
+    orphanpool.SetLimits(0, 100 * 1000000);
+    orphanpool.LimitOrphans();
+    BOOST_CHECK_EQUAL(orphanpool.Size(), 0U);
+    BOOST_CHECK_EQUAL(orphanpool.Usage(), 0U);
+}
+
+/** A transaction spending vPrevouts, with nOutputs outputs that push nPushSize bytes each */
+static CTransactionRef MakeOrphan(const std::vector<COutPoint>& vPrevouts, size_t nOutputs = 1, size_t nPushSize = 20)
+{
+    CMutableTransaction tx;
+    for (const COutPoint& prevout : vPrevouts) {
+        tx.vin.emplace_back(prevout);
+        tx.vin.back().scriptSig << OP_1;
+    }
+    tx.vout.resize(nOutputs);
+    for (CTxOut& txout : tx.vout) {
+        txout.nValue = 1*CENT;
+        txout.scriptPubKey = CScript() << std::vector<unsigned char>(nPushSize, 0);
+    }
+    return MakeTransactionRef(tx);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_orphanPeerQuota)
+{
+    CTxOrphanPool orphanpool(1000, 100 * 1000000);
+
+    // Peer 1 has 5 small orphans, peer 2 fills the rest of the pool with larger ones.
+    for (int i = 0; i < 5; i++) {
+        BOOST_CHECK(orphanpool.AddTx(MakeOrphan({COutPoint(InsecureRand256(), 0)}), 1));
+    }
+    std::vector<CTransactionRef> vFlood;
+    for (int i = 0; i < 20; i++) {
+        vFlood.push_back(MakeOrphan({COutPoint(InsecureRand256(), 0)}, 1, 1000));
+        BOOST_CHECK(orphanpool.AddTx(vFlood.back(), 2));
+    }
+    BOOST_CHECK_EQUAL(orphanpool.Usage(), orphanpool.PeerUsage(1) + orphanpool.PeerUsage(2));
+    BOOST_CHECK(orphanpool.PeerUsage(2) > orphanpool.PeerUsage(1));
+
+    // Over the count limit, the flooding peer loses its oldest orphans, and
+    // the other peer keeps all of its own.
+    orphanpool.SetLimits(15, 100 * 1000000);
+    BOOST_CHECK_EQUAL(orphanpool.LimitOrphans(), 10U);
+    BOOST_CHECK_EQUAL(orphanpool.Size(), 15U);
+    for (int i = 0; i < 10; i++) {
+        BOOST_CHECK(!orphanpool.HaveTx(vFlood[i]->GetHash()));
+    }
+    for (int i = 10; i < 20; i++) {
+        BOOST_CHECK(orphanpool.HaveTx(vFlood[i]->GetHash()));
     }
 
-    // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
-    BOOST_CHECK(mapOrphanTransactions.empty());
+    // Over the memory limit, the same.
+    const size_t nPeer1Usage = orphanpool.PeerUsage(1);
+    orphanpool.SetLimits(15, nPeer1Usage * 2);
+    BOOST_CHECK(orphanpool.LimitOrphans() > 0);
+    BOOST_CHECK(orphanpool.Usage() <= nPeer1Usage * 2);
+    BOOST_CHECK_EQUAL(orphanpool.PeerUsage(1), nPeer1Usage);
+
+    // Once peer 1 holds more than peer 2, it is its turn.
+    orphanpool.SetLimits(15, orphanpool.Usage() - 1);
+    BOOST_CHECK_EQUAL(orphanpool.LimitOrphans(), 1U);
+    BOOST_CHECK(orphanpool.PeerUsage(1) < nPeer1Usage);
+
+    // Orphans expire.
+    SetMockTime(GetTime() + ORPHAN_TX_EXPIRE_TIME + ORPHAN_TX_EXPIRE_INTERVAL + 1);
+    orphanpool.LimitOrphans();
+    BOOST_CHECK_EQUAL(orphanpool.Size(), 0U);
+    BOOST_CHECK_EQUAL(orphanpool.Usage(), 0U);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_orphanDescendants)
+{
+    CTxOrphanPool orphanpool;
+
+    // parent -> a -> c, parent -> b -> c, and an orphan of some other transaction
+    const uint256 parent = InsecureRand256();
+    CTransactionRef a = MakeOrphan({COutPoint(parent, 0)}, 2);
+    CTransactionRef b = MakeOrphan({COutPoint(parent, 1)});
+    CTransactionRef c = MakeOrphan({COutPoint(a->GetHash(), 1), COutPoint(b->GetHash(), 0)});
+    CTransactionRef other = MakeOrphan({COutPoint(InsecureRand256(), 0)});
+    for (const CTransactionRef& tx : {c, other, b, a}) {
+        BOOST_CHECK(orphanpool.AddTx(tx, 1));
+    }
+    BOOST_CHECK(!orphanpool.AddTx(a, 2));
+
+    // All three that the parent unblocks, each once
+    std::vector<std::pair<CTransactionRef, NodeId>> vDescendants = orphanpool.GetDescendants(parent);
+    std::set<uint256> setFound;
+    for (const auto& descendant : vDescendants) {
+        setFound.insert(descendant.first->GetHash());
+        BOOST_CHECK_EQUAL(descendant.second, 1);
+    }
+    BOOST_CHECK_EQUAL(vDescendants.size(), 3U);
+    BOOST_CHECK(setFound == std::set<uint256>({a->GetHash(), b->GetHash(), c->GetHash()}));
+    BOOST_CHECK_EQUAL(orphanpool.GetDescendants(b->GetHash()).size(), 1U);
+    BOOST_CHECK(orphanpool.GetDescendants(c->GetHash()).empty());
+
+    // A block spending an outpoint of b conflicts with c
+    CBlock block;
+    block.vtx.push_back(MakeOrphan({COutPoint(b->GetHash(), 0)}));
+    BOOST_CHECK_EQUAL(orphanpool.EraseForBlock(block), 1);
+    BOOST_CHECK(!orphanpool.HaveTx(c->GetHash()));
+    BOOST_CHECK_EQUAL(orphanpool.GetDescendants(parent).size(), 2U);
+
+    BOOST_CHECK_EQUAL(orphanpool.EraseTx(a->GetHash()), 1);
+    BOOST_CHECK_EQUAL(orphanpool.EraseTx(a->GetHash()), 0);
+    orphanpool.Clear();
+    BOOST_CHECK_EQUAL(orphanpool.Size(), 0U);
+    BOOST_CHECK_EQUAL(orphanpool.PeerUsage(1), 0U);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,119 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chainparams.h>
+#include <consensus/validation.h>
+#include <index/addressindex.h>
+#include <script/sign.h>
+#include <test/test_bitcoin.h>
+#include <txmempool.h>
+#include <utiltime.h>
+#include <validation.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(addressindex_tests)
+
+BOOST_FIXTURE_TEST_CASE(addressindex_tracks_chain, TestChain100Setup)
+{
+    AddressIndex addressindex(1 << 20, true);
+    addressindex.Start();
+
+    // Allow the address index to catch up with the block index.
+    constexpr int64_t timeout_ms = 10 * 1000;
+    int64_t time_start = GetTimeMillis();
+    while (!addressindex.BlockUntilSyncedToCurrentChain()) {
+        BOOST_REQUIRE(time_start + timeout_ms > GetTimeMillis());
+        MilliSleep(100);
+    }
+
+    // Every coinbase of the setup chain pays to the same script.
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    std::vector<AddressOutput> outputs;
+    std::vector<AddressHistoryEntry> history;
+    BOOST_CHECK(addressindex.FindUnspent(scriptPubKey, 0, MAX_ADDRESS_QUERY_RESULTS, outputs));
+    BOOST_CHECK_EQUAL(outputs.size(), coinbaseTxns.size());
+    BOOST_CHECK(outputs.front().outpoint == COutPoint(coinbaseTxns.front().GetHash(), 0));
+    BOOST_CHECK(outputs.back().outpoint == COutPoint(coinbaseTxns.back().GetHash(), 0));
+    BOOST_CHECK_EQUAL(outputs.front().value, coinbaseTxns.front().vout[0].nValue);
+
+    // Unrelated scripts have no entries.
+    BOOST_CHECK(addressindex.FindUnspent(CScript() << OP_TRUE, 0, MAX_ADDRESS_QUERY_RESULTS, outputs));
+    BOOST_CHECK(outputs.empty());
+
+    // Spend the first coinbase back to the same script, in two outputs.
+    const CBlockIndex* pindexSeed = chainActive.Tip();
+    CMutableTransaction spend;
+    spend.nVersion = 1;
+    spend.vin.resize(1);
+    spend.vin[0].prevout.hash = coinbaseTxns[0].GetHash();
+    spend.vin[0].prevout.n = 0;
+    spend.vout.resize(2);
+    spend.vout[0].nValue = 11 * CENT;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+    spend.vout[1].nValue = 22 * CENT;
+    spend.vout[1].scriptPubKey = scriptPubKey;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+
+    CBlock block = CreateAndProcessBlock({spend}, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+    BOOST_CHECK(addressindex.BlockUntilSyncedToCurrentChain());
+
+    // One coin spent; two change outputs and the new coinbase received.
+    BOOST_CHECK(addressindex.FindUnspent(scriptPubKey, 0, MAX_ADDRESS_QUERY_RESULTS, outputs));
+    BOOST_CHECK_EQUAL(outputs.size(), coinbaseTxns.size() + 2);
+    BOOST_CHECK(outputs.front().outpoint == COutPoint(coinbaseTxns[1].GetHash(), 0));
+
+    BOOST_CHECK(addressindex.FindHistory(scriptPubKey, 0, MAX_ADDRESS_QUERY_RESULTS, history));
+    BOOST_CHECK_EQUAL(history.size(), coinbaseTxns.size() + 4);
+    BOOST_CHECK(!history.front().spend);
+    BOOST_CHECK(history.front().spent_txid == spend.GetHash());
+    BOOST_CHECK_EQUAL(history.front().spent_height, chainActive.Height());
+
+    // The spend of the new block sorts next to its receives.
+    const uint256 spend_txid = spend.GetHash();
+    auto it = std::find_if(history.begin(), history.end(),
+                           [&](const AddressHistoryEntry& entry) { return entry.spend; });
+    BOOST_REQUIRE(it != history.end());
+    BOOST_CHECK(it->txid == spend_txid);
+    BOOST_CHECK_EQUAL(it->height, chainActive.Height());
+    BOOST_CHECK_EQUAL(it->value, -coinbaseTxns[0].vout[0].nValue);
+    BOOST_CHECK(it->prevout == COutPoint(coinbaseTxns[0].GetHash(), 0));
+    BOOST_CHECK(std::next(it) != history.end() && std::next(it)->txid == spend_txid && !std::next(it)->spend);
+
+    // Pagination returns consecutive slices of the same ordering.
+    std::vector<AddressHistoryEntry> page;
+    BOOST_CHECK(addressindex.FindHistory(scriptPubKey, 10, 5, page));
+    BOOST_CHECK_EQUAL(page.size(), 5U);
+    for (size_t i = 0; i < page.size(); ++i) {
+        BOOST_CHECK(page[i].txid == history[10 + i].txid);
+        BOOST_CHECK_EQUAL(page[i].index, history[10 + i].index);
+    }
+    BOOST_CHECK(addressindex.FindUnspent(scriptPubKey, outputs.size() - 1, 5, outputs));
+    BOOST_CHECK_EQUAL(outputs.size(), 1U);
+
+    // Disconnecting the block restores the spent coin and drops its entries.
+    {
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(state, Params(), chainActive.Tip()));
+        BOOST_CHECK(chainActive.Tip() == pindexSeed);
+    }
+    BOOST_CHECK(addressindex.BlockUntilSyncedToCurrentChain());
+    BOOST_CHECK_EQUAL(addressindex.GetSummary().best_block_height, pindexSeed->nHeight);
+    BOOST_CHECK(addressindex.FindUnspent(scriptPubKey, 0, MAX_ADDRESS_QUERY_RESULTS, outputs));
+    BOOST_CHECK_EQUAL(outputs.size(), coinbaseTxns.size());
+    BOOST_CHECK(outputs.front().outpoint == COutPoint(coinbaseTxns.front().GetHash(), 0));
+    BOOST_CHECK(addressindex.FindHistory(scriptPubKey, 0, MAX_ADDRESS_QUERY_RESULTS, history));
+    BOOST_CHECK_EQUAL(history.size(), coinbaseTxns.size());
+    BOOST_CHECK(history.front().spent_height == -1);
+
+    addressindex.Stop();
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
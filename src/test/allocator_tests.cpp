@@ -4,9 +4,11 @@
 
 #include <util.h>
 
+#include <support/allocators/pool.h>
 #include <support/allocators/secure.h>
 #include <test/test_bitcoin.h>
 
+#include <map>
 #include <memory>
 
 #include <boost/test/unit_test.hpp>
@@ -233,4 +235,94 @@ BOOST_AUTO_TEST_CASE(lockedpool_tests_live)
     BOOST_CHECK(pool.stats().used == initial.used);
 }
 
+BOOST_AUTO_TEST_CASE(nodearena_tests)
+{
+    NodeArena arena(1024);
+    BOOST_CHECK_EQUAL(arena.UsedBytes(), 0U);
+    BOOST_CHECK_EQUAL(arena.ChunkBytes(), 0U);
+
+    // Sizes are rounded up to the node alignment
+    void *a0 = arena.Allocate(20);
+    void *a1 = arena.Allocate(24);
+    BOOST_CHECK_EQUAL(arena.UsedBytes(), 48U);
+    BOOST_CHECK_EQUAL(arena.ChunkBytes(), 1024U);
+    BOOST_CHECK_EQUAL((char*)a1 - (char*)a0, 24);
+    BOOST_CHECK_EQUAL((uintptr_t)a0 % NodeArena::NODE_ALIGN, 0U);
+
+    // Freed nodes are reused by allocations of the same size only; other
+    // sizes take chunks of their own
+    arena.Deallocate(a0, 20);
+    BOOST_CHECK_EQUAL(arena.UsedBytes(), 24U);
+    void *a2 = arena.Allocate(32);
+    BOOST_CHECK(a2 != a0);
+    BOOST_CHECK_EQUAL(arena.ChunkBytes(), 2048U);
+    void *a3 = arena.Allocate(17);
+    BOOST_CHECK(a3 == a0);
+
+    // A full chunk makes way for a new one
+    void *a4 = arena.Allocate(NodeArena::MAX_NODE_SIZE);
+    void *a5 = arena.Allocate(NodeArena::MAX_NODE_SIZE);
+    BOOST_CHECK_EQUAL(arena.ChunkBytes(), 3072U);
+    void *a6 = arena.Allocate(NodeArena::MAX_NODE_SIZE);
+    BOOST_CHECK_EQUAL(arena.ChunkBytes(), 4096U);
+
+    // A chunk is released with its last node
+    arena.Deallocate(a4, NodeArena::MAX_NODE_SIZE);
+    BOOST_CHECK_EQUAL(arena.ChunkBytes(), 4096U);
+    arena.Deallocate(a5, NodeArena::MAX_NODE_SIZE);
+    BOOST_CHECK_EQUAL(arena.ChunkBytes(), 3072U);
+    arena.Deallocate(a1, 24);
+    arena.Deallocate(a3, 17);
+    BOOST_CHECK_EQUAL(arena.ChunkBytes(), 2048U);
+    arena.Deallocate(a2, 32);
+    arena.Deallocate(a6, NodeArena::MAX_NODE_SIZE);
+    BOOST_CHECK_EQUAL(arena.UsedBytes(), 0U);
+    BOOST_CHECK_EQUAL(arena.ChunkBytes(), 0U);
+
+    // When the node sizes shift, the footprint follows the nodes in use
+    std::vector<void*> vNodes;
+    for (int i = 0; i < 100; i++) {
+        vNodes.push_back(arena.Allocate(24));
+    }
+    BOOST_CHECK_EQUAL(arena.ChunkBytes(), 3 * 1024U);
+    for (void* p : vNodes) {
+        arena.Deallocate(p, 24);
+    }
+    vNodes.clear();
+    for (int i = 0; i < 100; i++) {
+        vNodes.push_back(arena.Allocate(40));
+    }
+    BOOST_CHECK_EQUAL(arena.ChunkBytes(), 4 * 1024U);
+    // Freeing every other node keeps the chunks, which still have nodes in use
+    for (size_t i = 0; i < vNodes.size(); i += 2) {
+        arena.Deallocate(vNodes[i], 40);
+    }
+    BOOST_CHECK_EQUAL(arena.ChunkBytes(), 4 * 1024U);
+    for (size_t i = 1; i < vNodes.size(); i += 2) {
+        arena.Deallocate(vNodes[i], 40);
+    }
+    BOOST_CHECK_EQUAL(arena.ChunkBytes(), 0U);
+
+    // Containers using the arena account exactly for their nodes
+    NodeArena nodes;
+    {
+        std::map<int, int, std::less<int>, pool_allocator<std::pair<const int, int> > > m{pool_allocator<std::pair<const int, int> >(&nodes)};
+        for (int i = 0; i < 100; i++) {
+            m.emplace(i, i);
+        }
+        BOOST_CHECK(nodes.UsedBytes() > 0);
+        BOOST_CHECK_EQUAL(nodes.UsedBytes() % 100, 0U);
+        size_t nUsed = nodes.UsedBytes();
+        m.erase(m.begin());
+        BOOST_CHECK_EQUAL(nodes.UsedBytes(), nUsed / 100 * 99);
+        m.emplace(1000, 0);
+        BOOST_CHECK_EQUAL(nodes.UsedBytes(), nUsed);
+        // The nodes in use account for all chunks but the last one
+        BOOST_CHECK(nodes.ChunkBytes() >= nUsed);
+        BOOST_CHECK(nodes.ChunkBytes() < nUsed + 64 * 1024);
+    }
+    BOOST_CHECK_EQUAL(nodes.UsedBytes(), 0U);
+    BOOST_CHECK_EQUAL(nodes.ChunkBytes(), 0U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
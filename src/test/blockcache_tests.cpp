@@ -0,0 +1,108 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockcache.h>
+#include <chainparams.h>
+#include <streams.h>
+#include <test/test_bitcoin.h>
+#include <validation.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockcache_tests, BasicTestingSetup)
+
+static CSerializedBlockRef MakeSerializedBlock(size_t size)
+{
+    return std::make_shared<const CSerializedBlock>(std::vector<unsigned char>(size, 0x42));
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_lru)
+{
+    CSerializedBlockCache cache(250);
+    const uint256 hash1 = uint256S("01");
+    const uint256 hash2 = uint256S("02");
+    const uint256 hash3 = uint256S("03");
+
+    BOOST_CHECK(!cache.Get(hash1, true));
+    cache.Insert(hash1, true, MakeSerializedBlock(100));
+    cache.Insert(hash2, true, MakeSerializedBlock(100));
+    BOOST_CHECK(cache.Get(hash1, true));
+    // Blocks with and without witness data are cached separately.
+    BOOST_CHECK(!cache.Get(hash1, false));
+
+    CSerializedBlockCache::Stats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.entries, 2U);
+    BOOST_CHECK_EQUAL(stats.bytes, 200U);
+    BOOST_CHECK_EQUAL(stats.max_bytes, 250U);
+    BOOST_CHECK_EQUAL(stats.hits, 1U);
+    BOOST_CHECK_EQUAL(stats.misses, 2U);
+
+    // Going over budget evicts the least recently used block.
+    cache.Insert(hash3, true, MakeSerializedBlock(100));
+    BOOST_CHECK(cache.Get(hash1, true));
+    BOOST_CHECK(!cache.Get(hash2, true));
+    BOOST_CHECK(cache.Get(hash3, true));
+    BOOST_CHECK_EQUAL(cache.GetStats().bytes, 200U);
+
+    // Blocks larger than the budget are not cached.
+    cache.Insert(hash2, false, MakeSerializedBlock(251));
+    BOOST_CHECK(!cache.Get(hash2, false));
+    BOOST_CHECK_EQUAL(cache.GetStats().entries, 2U);
+
+    // Shrinking the budget evicts blocks.
+    cache.SetMaxBytes(150);
+    BOOST_CHECK_EQUAL(cache.GetStats().entries, 1U);
+    BOOST_CHECK(cache.Get(hash3, true));
+    cache.SetMaxBytes(0);
+    BOOST_CHECK_EQUAL(cache.GetStats().entries, 0U);
+    cache.Insert(hash1, true, MakeSerializedBlock(1));
+    BOOST_CHECK(!cache.Get(hash1, true));
+}
+
+BOOST_FIXTURE_TEST_CASE(blockcache_serialized_blocks, TestChain100Setup)
+{
+    g_serialized_block_cache.Clear();
+    const CBlockIndex* pindex = chainActive.Tip();
+    CBlock block;
+    BOOST_REQUIRE(ReadBlockFromDisk(block, pindex, Params().GetConsensus()));
+
+    for (bool witness : {true, false}) {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION | (witness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS));
+        ss << block;
+
+        const uint64_t misses = g_serialized_block_cache.GetStats().misses;
+        CSerializedBlockRef block_data = GetSerializedBlock(pindex, witness, Params().GetConsensus());
+        BOOST_REQUIRE(block_data);
+        BOOST_CHECK_EQUAL(g_serialized_block_cache.GetStats().misses, misses + 1);
+        BOOST_CHECK(block_data->data == std::vector<unsigned char>(ss.begin(), ss.end()));
+
+        // The second request is a hit that returns the same bytes.
+        const uint64_t hits = g_serialized_block_cache.GetStats().hits;
+        BOOST_CHECK(GetSerializedBlock(pindex, witness, Params().GetConsensus()) == block_data);
+        BOOST_CHECK_EQUAL(g_serialized_block_cache.GetStats().hits, hits + 1);
+
+        // Serializing the cached block writes its bytes as they are.
+        CDataStream ss_cached(SER_NETWORK, PROTOCOL_VERSION);
+        ss_cached << *block_data;
+        BOOST_CHECK(ss_cached.str() == ss.str());
+    }
+    g_serialized_block_cache.Clear();
+
+    // A position copied under cs_main reads the same block, but only if it
+    // holds the block asked for.
+    CDiskBlockPos pos;
+    {
+        LOCK(cs_main);
+        pos = pindex->GetBlockPos();
+    }
+    for (bool witness : {true, false}) {
+        BOOST_CHECK(!GetSerializedBlock(pindex->pprev->GetBlockHash(), pos, witness, Params().GetConsensus()));
+        CSerializedBlockRef block_data = GetSerializedBlock(pindex->GetBlockHash(), pos, witness, Params().GetConsensus());
+        BOOST_REQUIRE(block_data);
+        BOOST_CHECK(GetSerializedBlock(pindex, witness, Params().GetConsensus()) == block_data);
+    }
+    g_serialized_block_cache.Clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
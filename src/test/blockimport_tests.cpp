@@ -0,0 +1,90 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chain.h>
+#include <chainparams.h>
+#include <consensus/validation.h>
+#include <streams.h>
+#include <test/test_bitcoin.h>
+#include <utiltime.h>
+#include <validation.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockimport_tests)
+
+/** No global setup; the test case sets up the chains it needs one after the other. */
+struct NoSetup {};
+
+BOOST_FIXTURE_TEST_CASE(reindex_out_of_order_blocks, NoSetup)
+{
+    // Mine a chain and keep its blocks.
+    std::vector<CBlock> blocks;
+    int64_t nLastBlockTime;
+    {
+        TestChain100Setup setup;
+        for (const CBlockIndex* pindex = chainActive.Tip(); pindex->pprev; pindex = pindex->pprev) {
+            CBlock block;
+            BOOST_REQUIRE(ReadBlockFromDisk(block, pindex, Params().GetConsensus()));
+            blocks.insert(blocks.begin(), block);
+        }
+        nLastBlockTime = chainActive.Tip()->GetBlockTime();
+    }
+    BOOST_REQUIRE_EQUAL(blocks.size(), 100U);
+
+    // Swap some blocks with their children, and move one block to the end,
+    // so that its descendants are all read before it.
+    for (size_t i = 10; i < 50; i += 10) {
+        std::swap(blocks[i], blocks[i + 1]);
+    }
+    CBlock late = blocks[60];
+    blocks.erase(blocks.begin() + 60);
+    blocks.push_back(late);
+
+    TestingSetup setup(CBaseChainParams::REGTEST);
+    // Like TestChain100Setup, which mined the blocks without SegWit.
+    UpdateVersionBitsParameters(Consensus::DEPLOYMENT_SEGWIT, 0, Consensus::BIP9Deployment::NO_TIMEOUT);
+    const CChainParams& chainparams = Params();
+    SetMockTime(nLastBlockTime);
+
+    // Write them to a block file that the block index doesn't know about yet,
+    // as a block file looks when reindexing.
+    CDiskBlockPos pos(1, 0);
+    {
+        CAutoFile fileout(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!fileout.IsNull());
+        // Some garbage first, which is skipped.
+        fileout << FLATDATA(chainparams.MessageStart()) << (unsigned int)1;
+        for (size_t i = 0; i < blocks.size(); i++) {
+            if (i == 70) {
+                // A record that cannot be deserialized, with a size that
+                // takes in the start of the next one. The file is scanned
+                // again from just past its message start, so the next
+                // block is found all the same.
+                fileout << FLATDATA(chainparams.MessageStart()) << (unsigned int)200;
+                for (int n = 0; n < 100; n++) {
+                    fileout << (unsigned char)0xff;
+                }
+            }
+            fileout << FLATDATA(chainparams.MessageStart()) << (unsigned int)::GetSerializeSize(fileout, blocks[i]) << blocks[i];
+        }
+    }
+
+    BOOST_CHECK(LoadExternalBlockFile(chainparams, OpenBlockFile(pos, true), &pos));
+    CValidationState state;
+    BOOST_CHECK(ActivateBestChain(state, chainparams));
+
+    BOOST_CHECK_EQUAL(chainActive.Height(), 100);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == blocks[98].GetHash());
+
+    // Blocks are found at the positions they were read from.
+    CBlock block_read;
+    BOOST_CHECK(ReadBlockFromDisk(block_read, chainActive[61], chainparams.GetConsensus()));
+    BOOST_CHECK(block_read.GetHash() == late.GetHash());
+    BOOST_CHECK(chainActive[61]->GetBlockPos().nFile == 1);
+
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
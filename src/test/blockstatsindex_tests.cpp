@@ -0,0 +1,124 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chainparams.h>
+#include <coins.h>
+#include <index/blockstatsindex.h>
+#include <script/sign.h>
+#include <test/test_bitcoin.h>
+#include <undo.h>
+#include <utiltime.h>
+#include <validation.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockstatsindex_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(percentiles_by_weight)
+{
+    CAmount result[NUM_GETBLOCKSTATS_PERCENTILES] = {0};
+    std::vector<std::pair<CAmount, int64_t>> scores;
+    int64_t total_weight = 0;
+    for (int i = 1; i <= 10; ++i) {
+        scores.emplace_back(11 - i, 100);
+        total_weight += 100;
+    }
+    CalculatePercentilesByWeight(result, scores, total_weight);
+    BOOST_CHECK_EQUAL(result[0], 1);
+    BOOST_CHECK_EQUAL(result[1], 3);
+    BOOST_CHECK_EQUAL(result[2], 5);
+    BOOST_CHECK_EQUAL(result[3], 8);
+    BOOST_CHECK_EQUAL(result[4], 9);
+
+    // A single heavy transaction dominates every percentile.
+    CAmount single[NUM_GETBLOCKSTATS_PERCENTILES] = {0};
+    std::vector<std::pair<CAmount, int64_t>> one{{42, 4000}};
+    CalculatePercentilesByWeight(single, one, 4000);
+    for (int i = 0; i < NUM_GETBLOCKSTATS_PERCENTILES; ++i) {
+        BOOST_CHECK_EQUAL(single[i], 42);
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(blockstatsindex_tracks_chain, TestChain100Setup)
+{
+    BlockStatsIndex stats_index(1 << 20, true);
+    stats_index.Start();
+
+    // Allow the stats index to catch up with the block index.
+    constexpr int64_t timeout_ms = 10 * 1000;
+    int64_t time_start = GetTimeMillis();
+    while (!stats_index.BlockUntilSyncedToCurrentChain()) {
+        BOOST_REQUIRE(time_start + timeout_ms > GetTimeMillis());
+        MilliSleep(100);
+    }
+
+    CBlockStats stats;
+    BOOST_CHECK(stats_index.LookupStats(chainActive.Tip(), stats));
+    BOOST_CHECK_EQUAL(stats.height, chainActive.Height());
+    BOOST_CHECK_EQUAL(stats.algo, ALGO_SHA256D);
+    BOOST_CHECK(!stats.auxpow);
+    BOOST_CHECK_EQUAL(stats.txs, 1);
+    BOOST_CHECK_EQUAL(stats.totalfee, 0);
+    BOOST_CHECK_EQUAL(stats.subsidy, GetBlockSubsidy(chainActive.Height(), chainActive.Tip()->nBits, Params().GetConsensus(), chainActive.Tip()->pprev));
+
+    // Each block's subsidy is the one it was mined with, not one computed on
+    // top of the current tip.
+    for (int height : {2, 50, 99}) {
+        BOOST_CHECK(stats_index.LookupStats(chainActive[height], stats));
+        BOOST_CHECK_EQUAL(stats.height, height);
+        BOOST_CHECK_EQUAL(stats.subsidy, coinbaseTxns[height - 1].vout[0].nValue);
+    }
+
+    // Spend a mature coinbase output with a fee.
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const CAmount fee = 10000;
+    CMutableTransaction spend;
+    spend.nVersion = 1;
+    spend.vin.resize(1);
+    spend.vin[0].prevout.hash = coinbaseTxns[0].GetHash();
+    spend.vin[0].prevout.n = 0;
+    spend.vout.resize(2);
+    spend.vout[0].nValue = 11 * CENT;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+    spend.vout[1].nValue = coinbaseTxns[0].vout[0].nValue - 11 * CENT - fee;
+    spend.vout[1].scriptPubKey = scriptPubKey;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+
+    CBlock block = CreateAndProcessBlock({spend}, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+    BOOST_CHECK(stats_index.BlockUntilSyncedToCurrentChain());
+
+    BOOST_CHECK(stats_index.LookupStats(chainActive.Tip(), stats));
+    BOOST_CHECK_EQUAL(stats.txs, 2);
+    BOOST_CHECK_EQUAL(stats.ins, 1);
+    BOOST_CHECK_EQUAL(stats.outs, (int64_t)block.vtx[0]->vout.size() + 2);
+    BOOST_CHECK_EQUAL(stats.utxo_increase, 2);
+    BOOST_CHECK_EQUAL(stats.totalfee, fee);
+    BOOST_CHECK_EQUAL(stats.minfee, fee);
+    BOOST_CHECK_EQUAL(stats.maxfee, fee);
+    BOOST_CHECK_EQUAL(stats.total_out, coinbaseTxns[0].vout[0].nValue - fee);
+    BOOST_CHECK_EQUAL(stats.total_size, (int64_t)CTransaction(spend).GetTotalSize());
+
+    // The indexed record matches statistics computed from disk.
+    CBlockStats computed;
+    {
+        LOCK(cs_main);
+        CBlock block_disk;
+        CBlockUndo block_undo;
+        BOOST_CHECK(ReadBlockFromDisk(block_disk, chainActive.Tip(), Params().GetConsensus()));
+        BOOST_CHECK(UndoReadFromDisk(block_undo, chainActive.Tip()));
+        ComputeBlockStats(block_disk, block_undo, chainActive.Tip(), computed);
+    }
+    BOOST_CHECK_EQUAL(computed.totalfee, stats.totalfee);
+    BOOST_CHECK_EQUAL(computed.total_weight, stats.total_weight);
+    BOOST_CHECK_EQUAL(computed.feerate_percentiles[2], stats.feerate_percentiles[2]);
+
+    stats_index.Stop();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,211 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chain.h>
+#include <chainparams.h>
+#include <consensus/validation.h>
+#include <miner.h>
+#include <policy/policy.h>
+#include <script/interpreter.h>
+#include <test/test_bitcoin.h>
+#include <txmempool.h>
+#include <utilmoneystr.h>
+#include <validation.h>
+#include <validationinterface.h>
+
+#include <boost/test/unit_test.hpp>
+
+/** A template cache that follows the mempool and the tip for the duration of a test. */
+struct TemplateCacheSetup : public TestChain100Setup {
+    CBlockTemplateCache cache;
+    CScript scriptPubKey;
+
+    TemplateCacheSetup()
+    {
+        cache.RegisterWithMempoolSignals();
+        RegisterValidationInterface(&cache);
+        scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    }
+
+    ~TemplateCacheSetup()
+    {
+        UnregisterValidationInterface(&cache);
+        cache.UnregisterWithMempoolSignals();
+    }
+
+    /** A transaction spending output 0 of txPrev to scriptPubKey, which it adds to the mempool. */
+    CTransactionRef AddSpend(const CTransaction& txPrev, CAmount nFee, uint32_t nSequence = CTxIn::SEQUENCE_FINAL)
+    {
+        CMutableTransaction spend;
+        spend.vin.emplace_back(COutPoint(txPrev.GetHash(), 0), CScript(), nSequence);
+        spend.vout.resize(1);
+        spend.vout[0].nValue = txPrev.vout[0].nValue - nFee;
+        spend.vout[0].scriptPubKey = scriptPubKey;
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(txPrev.vout[0].scriptPubKey, spend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        spend.vin[0].scriptSig = CScript() << vchSig;
+
+        CTransactionRef tx = MakeTransactionRef(std::move(spend));
+        CValidationState state;
+        BOOST_CHECK(AcceptToMemoryPool(mempool, state, tx, nullptr /* pfMissingInputs */,
+                                       nullptr /* plTxnReplaced */, false /* bypass_limits */, 0 /* nAbsurdFee */));
+        return tx;
+    }
+};
+
+BOOST_FIXTURE_TEST_SUITE(blocktemplatecache_tests, TemplateCacheSetup)
+
+BOOST_AUTO_TEST_CASE(blocktemplatecache_incremental)
+{
+    std::unique_ptr<CBlockTemplate> pblocktemplate = cache.GetBlockTemplate(scriptPubKey, ALGO_SHA256D);
+    BOOST_REQUIRE(pblocktemplate);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1U);
+    const CAmount nSubsidy = pblocktemplate->block.vtx[0]->vout[0].nValue;
+    BOOST_CHECK_EQUAL(cache.GetStats().assembled, 1U);
+
+    // Transactions entering the mempool are appended to the template, children
+    // after their parents.
+    CTransactionRef parent = AddSpend(coinbaseTxns[0], 10000);
+    CTransactionRef child = AddSpend(*parent, 20000);
+    pblocktemplate = cache.GetBlockTemplate(scriptPubKey, ALGO_SHA256D);
+    BOOST_REQUIRE(pblocktemplate);
+    CBlockTemplateCache::Stats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.assembled, 1U);
+    BOOST_CHECK_EQUAL(stats.reused, 1U);
+    BOOST_CHECK_EQUAL(stats.appended, 2U);
+    const CBlock& block = pblocktemplate->block;
+    BOOST_REQUIRE_EQUAL(block.vtx.size(), 3U);
+    BOOST_CHECK(block.vtx[1] == parent);
+    BOOST_CHECK(block.vtx[2] == child);
+    BOOST_CHECK_EQUAL(block.vtx[0]->vout[0].nValue, nSubsidy + 30000);
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], -30000);
+    BOOST_CHECK(block.hashPrevBlock == chainActive.Tip()->GetBlockHash());
+
+    // It is the template that a new selection gives, and it is valid.
+    std::unique_ptr<CBlockTemplate> pfresh = BlockAssembler(Params()).CreateNewBlock(scriptPubKey, ALGO_SHA256D);
+    BOOST_REQUIRE(pfresh);
+    BOOST_REQUIRE_EQUAL(pfresh->block.vtx.size(), block.vtx.size());
+    for (size_t i = 0; i < block.vtx.size(); i++) {
+        BOOST_CHECK(pfresh->block.vtx[i]->GetWitnessHash() == block.vtx[i]->GetWitnessHash());
+        BOOST_CHECK_EQUAL(pfresh->vTxFees[i], pblocktemplate->vTxFees[i]);
+        BOOST_CHECK_EQUAL(pfresh->vTxSigOpsCost[i], pblocktemplate->vTxSigOpsCost[i]);
+    }
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(TestBlockValidity(state, Params(), block, chainActive.Tip(), false, false));
+    }
+
+    // Other coinbase outputs reuse the template as well.
+    const CScript scriptOther = CScript() << OP_TRUE;
+    pblocktemplate = cache.GetBlockTemplate(scriptOther, ALGO_SHA256D);
+    BOOST_REQUIRE(pblocktemplate);
+    BOOST_CHECK(pblocktemplate->block.vtx[0]->vout[0].scriptPubKey == scriptOther);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3U);
+    BOOST_CHECK_EQUAL(cache.GetStats().assembled, 1U);
+
+    // A template transaction that leaves the mempool has the template
+    // assembled again on the next request, whatever the rebuild interval.
+    mempool.removeRecursive(*child);
+    pblocktemplate = cache.GetBlockTemplate(scriptPubKey, ALGO_SHA256D, true, 3600);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2U);
+    BOOST_CHECK_EQUAL(cache.GetStats().assembled, 2U);
+
+    // A new tip has the template assembled right away, without a request.
+    CreateAndProcessBlock({CMutableTransaction(*parent)}, scriptPubKey);
+    SyncWithValidationInterfaceQueue();
+    BOOST_CHECK_EQUAL(cache.GetStats().assembled, 3U);
+    pblocktemplate = cache.GetBlockTemplate(scriptPubKey, ALGO_SHA256D);
+    BOOST_CHECK_EQUAL(cache.GetStats().assembled, 3U);
+    BOOST_CHECK(pblocktemplate->block.hashPrevBlock == chainActive.Tip()->GetBlockHash());
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1U);
+}
+
+/** Check that the template holds exactly txs after the coinbase and is a valid block. */
+static void CheckTemplateTxs(const CBlockTemplate& tmpl, const std::vector<CTransactionRef>& txs)
+{
+    BOOST_REQUIRE_EQUAL(tmpl.block.vtx.size(), txs.size() + 1);
+    for (size_t i = 0; i < txs.size(); i++) {
+        BOOST_CHECK(tmpl.block.vtx[i + 1] == txs[i]);
+    }
+    LOCK(cs_main);
+    CValidationState state;
+    BOOST_CHECK(TestBlockValidity(state, Params(), tmpl.block, chainActive.Tip(), false, false));
+}
+
+BOOST_AUTO_TEST_CASE(blocktemplatecache_conflicts)
+{
+    BOOST_CHECK(cache.GetBlockTemplate(scriptPubKey, ALGO_SHA256D));
+
+    // A replacement enters the mempool right after the transaction it
+    // replaces leaves it; it must not be appended next to it.
+    CTransactionRef original = AddSpend(coinbaseTxns[0], 10000, CTxIn::SEQUENCE_FINAL - 2);
+    std::unique_ptr<CBlockTemplate> pblocktemplate = cache.GetBlockTemplate(scriptPubKey, ALGO_SHA256D, true, 3600);
+    CheckTemplateTxs(*pblocktemplate, {original});
+    CTransactionRef replacement = AddSpend(coinbaseTxns[0], 50000);
+    BOOST_CHECK(!mempool.exists(original->GetHash()));
+    pblocktemplate = cache.GetBlockTemplate(scriptPubKey, ALGO_SHA256D, true, 3600);
+    CheckTemplateTxs(*pblocktemplate, {replacement});
+    BOOST_CHECK_EQUAL(cache.GetStats().assembled, 2U);
+
+    // Likewise a transaction spending the inputs of an evicted one.
+    mempool.TrimToSize(0);
+    BOOST_CHECK(!mempool.exists(replacement->GetHash()));
+    CTransactionRef respend = AddSpend(coinbaseTxns[0], 500000);
+    pblocktemplate = cache.GetBlockTemplate(scriptPubKey, ALGO_SHA256D, true, 3600);
+    CheckTemplateTxs(*pblocktemplate, {respend});
+    BOOST_CHECK_EQUAL(cache.GetStats().assembled, 3U);
+    BOOST_CHECK_EQUAL(cache.GetStats().appended, 1U);
+}
+
+BOOST_AUTO_TEST_CASE(blocktemplatecache_packages)
+{
+    gArgs.ForceSetArg("-blockmintxfee", FormatMoney(20 * DEFAULT_BLOCK_MIN_TX_FEE));
+    BOOST_CHECK(cache.GetBlockTemplate(scriptPubKey, ALGO_SHA256D));
+
+    // A transaction below the block feerate stays out, without making the
+    // template improvable.
+    CTransactionRef parent = AddSpend(coinbaseTxns[0], 1000);
+    std::unique_ptr<CBlockTemplate> pblocktemplate = cache.GetBlockTemplate(scriptPubKey, ALGO_SHA256D);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1U);
+    BOOST_CHECK_EQUAL(cache.GetStats().assembled, 1U);
+
+    // Its child pays for both, which takes a new selection.
+    CTransactionRef child = AddSpend(*parent, 100000);
+    pblocktemplate = cache.GetBlockTemplate(scriptPubKey, ALGO_SHA256D, true, 3600);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1U);
+    BOOST_CHECK_EQUAL(cache.GetStats().appended, 0U);
+    pblocktemplate = cache.GetBlockTemplate(scriptPubKey, ALGO_SHA256D, true, 0);
+    BOOST_CHECK_EQUAL(cache.GetStats().assembled, 2U);
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 3U);
+    BOOST_CHECK(pblocktemplate->block.vtx[1] == parent);
+    BOOST_CHECK(pblocktemplate->block.vtx[2] == child);
+
+    gArgs.ForceSetArg("-blockmintxfee", FormatMoney(DEFAULT_BLOCK_MIN_TX_FEE));
+}
+
+BOOST_AUTO_TEST_CASE(blocktemplatecache_chunks)
+{
+    // One more block for a second mature coinbase
+    CreateAndProcessBlock({}, scriptPubKey);
+
+    // A selection takes a low fee parent together with the child that pays
+    // for it, ahead of a transaction that pays more than the parent alone
+    CTransactionRef parent = AddSpend(coinbaseTxns[0], 1000);
+    CTransactionRef medium = AddSpend(coinbaseTxns[1], 10000);
+    CTransactionRef child = AddSpend(*parent, 50000);
+    std::unique_ptr<CBlockTemplate> pblocktemplate = cache.GetBlockTemplate(scriptPubKey, ALGO_SHA256D);
+    BOOST_REQUIRE(pblocktemplate);
+    BOOST_CHECK_EQUAL(cache.GetStats().assembled, 1U);
+    const CBlock& block = pblocktemplate->block;
+    BOOST_REQUIRE_EQUAL(block.vtx.size(), 4U);
+    BOOST_CHECK(block.vtx[1] == parent);
+    BOOST_CHECK(block.vtx[2] == child);
+    BOOST_CHECK(block.vtx[3] == medium);
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], -61000);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
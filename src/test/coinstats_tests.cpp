@@ -0,0 +1,164 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chainparams.h>
+#include <coinstats.h>
+#include <consensus/validation.h>
+#include <key.h>
+#include <script/sign.h>
+#include <script/standard.h>
+#include <test/test_bitcoin.h>
+#include <txmempool.h>
+#include <undo.h>
+#include <validation.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(coinstats_tests)
+
+static void CheckAgainstScan(const CBlockIndex* pindex)
+{
+    LOCK(cs_main);
+
+    FlushStateToDisk();
+    CCoinsStats scan;
+    MuHash3072 muhash;
+    BOOST_CHECK(GetUTXOStats(pcoinsdbview.get(), scan, &muhash));
+    BOOST_CHECK(scan.hashBlock == pindex->GetBlockHash());
+    uint256 hashMuHash;
+    muhash.Finalize(hashMuHash);
+
+    CUTXOStats stats;
+    BOOST_CHECK(pcoinstatsindex->LookupStats(pindex, stats));
+    BOOST_CHECK_EQUAL(stats.nHeight, pindex->nHeight);
+    BOOST_CHECK_EQUAL(stats.nTransactionOutputs, scan.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(stats.nBogoSize, scan.nBogoSize);
+    BOOST_CHECK_EQUAL(stats.nTotalAmount, scan.nTotalAmount);
+    BOOST_CHECK(stats.hashMuHash == hashMuHash);
+}
+
+BOOST_AUTO_TEST_CASE(muhash_order_independent)
+{
+    const unsigned char a[] = {1, 2, 3};
+    const unsigned char b[] = {4, 5, 6, 7};
+    const unsigned char c[] = {8};
+
+    MuHash3072 abc, cba, ab;
+    abc.Insert(a, sizeof(a)).Insert(b, sizeof(b)).Insert(c, sizeof(c));
+    cba.Insert(c, sizeof(c)).Insert(b, sizeof(b)).Insert(a, sizeof(a));
+    ab.Insert(a, sizeof(a)).Insert(b, sizeof(b));
+
+    uint256 hash_abc, hash_cba, hash_ab, hash_removed, hash_empty;
+    abc.Finalize(hash_abc);
+    cba.Finalize(hash_cba);
+    ab.Finalize(hash_ab);
+    BOOST_CHECK(hash_abc == hash_cba);
+    BOOST_CHECK(hash_abc != hash_ab);
+
+    abc.Remove(c, sizeof(c));
+    abc.Finalize(hash_removed);
+    BOOST_CHECK(hash_removed == hash_ab);
+
+    abc /= ab;
+    abc.Finalize(hash_removed);
+    MuHash3072().Finalize(hash_empty);
+    BOOST_CHECK(hash_removed == hash_empty);
+
+    cba *= MuHash3072(c, sizeof(c));
+    std::vector<uint256> batch;
+    MuHash3072::FinalizeBatch({ab, cba, MuHash3072()}, batch);
+    BOOST_CHECK_EQUAL(batch.size(), 3U);
+    BOOST_CHECK(batch[0] == hash_ab);
+    MuHash3072 abcc;
+    abcc.Insert(a, sizeof(a)).Insert(b, sizeof(b)).Insert(c, sizeof(c)).Insert(c, sizeof(c));
+    uint256 hash_abcc;
+    abcc.Finalize(hash_abcc);
+    BOOST_CHECK(batch[1] == hash_abcc);
+    BOOST_CHECK(batch[2] == hash_empty);
+}
+
+BOOST_FIXTURE_TEST_CASE(coinstatsindex_tracks_chain, TestChain100Setup)
+{
+    {
+        LOCK(cs_main);
+        pcoinstatsindex.reset(new CCoinStatsIndex(1 << 20, true));
+        BOOST_CHECK(pcoinstatsindex->Init(Params(), pcoinsdbview.get()));
+        BOOST_CHECK(pcoinstatsindex->IsInSync());
+    }
+    const CBlockIndex* pindexSeed = chainActive.Tip();
+    CheckAgainstScan(pindexSeed);
+
+    // Without pruning the index is built from genesis, so every height has
+    // statistics: each block of the test chain adds one coinbase output.
+    {
+        LOCK(cs_main);
+        BOOST_CHECK_EQUAL(pcoinstatsindex->GetStartHeight(), 0);
+        for (int nHeight : {0, 1, 50}) {
+            CUTXOStats stats;
+            BOOST_CHECK(pcoinstatsindex->LookupStats(chainActive[nHeight], stats));
+            BOOST_CHECK_EQUAL(stats.nHeight, nHeight);
+            BOOST_CHECK_EQUAL(stats.nTransactionOutputs, nHeight);
+        }
+
+        // Undo data that does not match the block is reported, not asserted on
+        CBlock block;
+        BOOST_CHECK(ReadBlockFromDisk(block, chainActive.Tip(), Params().GetConsensus()));
+        CBlockUndo blockundo;
+        blockundo.vtxundo.resize(1);
+        CUTXOStatsDelta delta;
+        BOOST_CHECK(!ComputeUTXOStatsDelta(block, blockundo, chainActive.Height(), delta));
+    }
+
+    // Spend a mature coinbase output in a new block.
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction spend;
+    spend.nVersion = 1;
+    spend.vin.resize(1);
+    spend.vin[0].prevout.hash = coinbaseTxns[0].GetHash();
+    spend.vin[0].prevout.n = 0;
+    spend.vout.resize(2);
+    spend.vout[0].nValue = 11 * CENT;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+    spend.vout[1].nValue = 22 * CENT;
+    spend.vout[1].scriptPubKey = scriptPubKey;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+
+    CBlock block = CreateAndProcessBlock({spend}, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+    CheckAgainstScan(chainActive.Tip());
+
+    // Statistics of earlier blocks remain available.
+    CUTXOStats statsSeed, statsTip;
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(pcoinstatsindex->LookupStats(pindexSeed, statsSeed));
+        BOOST_CHECK(pcoinstatsindex->LookupStats(chainActive.Tip(), statsTip));
+    }
+    BOOST_CHECK_EQUAL(statsSeed.nHeight + 1, statsTip.nHeight);
+    BOOST_CHECK_EQUAL(statsSeed.nTransactionOutputs + 2, statsTip.nTransactionOutputs);
+    BOOST_CHECK(statsSeed.hashMuHash != statsTip.hashMuHash);
+
+    // Disconnecting the block brings the running totals back.
+    {
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(state, Params(), chainActive.Tip()));
+        BOOST_CHECK(chainActive.Tip() == pindexSeed);
+    }
+    CheckAgainstScan(pindexSeed);
+
+    // A competing block at the same height is tracked as well.
+    mempool.clear();
+    CreateAndProcessBlock({}, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->pprev == pindexSeed);
+    CheckAgainstScan(chainActive.Tip());
+
+    LOCK(cs_main);
+    pcoinstatsindex.reset();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,8 +3,11 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <chainparams.h>
+#include <consensus/merkle.h>
+#include <consensus/validation.h>
 #include <validation.h>
 #include <net.h>
+#include <streams.h>
 
 #include <test/test_bitcoin.h>
 
@@ -93,4 +96,78 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     Test.disconnect(&ReturnTrue);
     BOOST_CHECK(Test());
 }
+static CBlock BuildCheckBlockTestBlock(size_t nTxs, unsigned int nSigOpsPerTx)
+{
+    CBlock block;
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig = CScript() << OP_1 << OP_1;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].nValue = 50 * COIN;
+    block.vtx.push_back(MakeTransactionRef(coinbase));
+    for (size_t i = 1; i < nTxs; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(InsecureRand256(), 0);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = COIN;
+        for (unsigned int j = 0; j < nSigOpsPerTx; j++)
+            tx.vout[0].scriptPubKey << OP_CHECKSIG;
+        block.vtx.push_back(MakeTransactionRef(tx));
+    }
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(checkblock_parallel_test)
+{
+    // Blocks this large have their transactions checked on the block check threads.
+    const Consensus::Params& params = Params().GetConsensus();
+    CValidationState state;
+    CBlock block = BuildCheckBlockTestBlock(300, 1);
+    BOOST_CHECK(CheckBlock(block, state, params, false, true));
+
+    // An invalid transaction deep in the block is found and reported.
+    CBlock bad_tx = BuildCheckBlockTestBlock(300, 1);
+    CMutableTransaction tx(*bad_tx.vtx[200]);
+    tx.vout[0].nValue = -1;
+    bad_tx.vtx[200] = MakeTransactionRef(tx);
+    bad_tx.hashMerkleRoot = BlockMerkleRoot(bad_tx);
+    BOOST_CHECK(!CheckBlock(bad_tx, state, params, false, true));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-txns-vout-negative");
+
+    // Sigops are summed over all the checks.
+    state = CValidationState();
+    CBlock too_many_sigops = BuildCheckBlockTestBlock(300, MAX_BLOCK_SIGOPS_COST / WITNESS_SCALE_FACTOR / 299 + 1);
+    BOOST_CHECK(!CheckBlock(too_many_sigops, state, params, false, true));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-blk-sigops");
+}
+
+BOOST_FIXTURE_TEST_CASE(verifydb_test, TestChain100Setup)
+{
+    // Blocks are checked in batches on the block check threads, ahead of
+    // being disconnected and reconnected.
+    const CChainParams& chainparams = Params();
+    const uint256 hashBestBlock = pcoinsTip->GetBestBlock();
+    for (int nCheckLevel = 0; nCheckLevel <= 4; nCheckLevel++) {
+        BOOST_CHECK(CVerifyDB().VerifyDB(chainparams, pcoinsTip.get(), nCheckLevel, 100));
+    }
+    BOOST_CHECK(pcoinsTip->GetBestBlock() == hashBestBlock);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == hashBestBlock);
+
+    // Damaged undo data of a block in the middle of a batch is found at level 2.
+    CBlockIndex* pindex = chainActive[60];
+    CDiskBlockPos pos = pindex->GetUndoPos();
+    {
+        CAutoFile file(fsbridge::fopen(GetBlockPosFilename(pos, "rev"), "rb+"), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!file.IsNull());
+        BOOST_REQUIRE_EQUAL(fseek(file.Get(), pos.nPos, SEEK_SET), 0);
+        file << (unsigned char)0x42;
+    }
+    BOOST_CHECK(CVerifyDB().VerifyDB(chainparams, pcoinsTip.get(), 1, 100));
+    BOOST_CHECK(!CVerifyDB().VerifyDB(chainparams, pcoinsTip.get(), 2, 100));
+    // Blocks below the damaged one are not checked.
+    BOOST_CHECK(CVerifyDB().VerifyDB(chainparams, pcoinsTip.get(), 3, 30));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
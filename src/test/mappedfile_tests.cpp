@@ -0,0 +1,125 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chainparams.h>
+#include <coins.h>
+#include <mappedfile.h>
+#include <streams.h>
+#include <test/test_bitcoin.h>
+#include <undo.h>
+#include <validation.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(mappedfile_tests, BasicTestingSetup)
+
+static void AppendToFile(const fs::path& path, const std::vector<unsigned char>& data)
+{
+    FILE* file = fsbridge::fopen(path, "ab");
+    BOOST_REQUIRE(file);
+    BOOST_REQUIRE_EQUAL(fwrite(data.data(), 1, data.size(), file), data.size());
+    fclose(file);
+}
+
+BOOST_AUTO_TEST_CASE(mappedfile_cache)
+{
+    const fs::path dirname = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(dirname);
+    const fs::path path = dirname / "mapped.dat";
+    const fs::path path_missing = dirname / "missing.dat";
+    CMappedFileCache cache(2);
+
+    BOOST_CHECK(!cache.Get(path_missing, 0));
+
+    AppendToFile(path, {1, 2, 3, 4});
+    std::shared_ptr<const CMappedFile> mapping = cache.Get(path, 4);
+#ifdef WIN32
+    // There is no mmap, so readers always use stdio.
+    BOOST_CHECK(!mapping);
+#else
+    BOOST_REQUIRE(mapping);
+    BOOST_CHECK_EQUAL(mapping->size(), 4U);
+    BOOST_CHECK_EQUAL(mapping->data()[3], 4);
+    BOOST_CHECK(cache.Get(path, 2) == mapping);
+
+    // Asking for more than was mapped maps the file again once it has grown.
+    BOOST_CHECK(!cache.Get(path, 6));
+    AppendToFile(path, {5, 6});
+    std::shared_ptr<const CMappedFile> grown = cache.Get(path, 6);
+    BOOST_REQUIRE(grown);
+    BOOST_CHECK(grown != mapping);
+    BOOST_CHECK_EQUAL(grown->size(), 6U);
+    BOOST_CHECK_EQUAL(grown->data()[5], 6);
+    // The old mapping stays valid for as long as it is referenced.
+    BOOST_CHECK_EQUAL(mapping->data()[0], 1);
+
+    // Forgotten mappings are not handed out again.
+    cache.Forget(path);
+    std::shared_ptr<const CMappedFile> remapped = cache.Get(path, 6);
+    BOOST_REQUIRE(remapped);
+    BOOST_CHECK(remapped != grown);
+
+    // The least recently used mapping is evicted when the cache is full.
+    const fs::path path2 = dirname / "mapped2.dat";
+    const fs::path path3 = dirname / "mapped3.dat";
+    AppendToFile(path2, {7});
+    AppendToFile(path3, {8});
+    std::shared_ptr<const CMappedFile> mapping2 = cache.Get(path2, 1);
+    BOOST_CHECK(cache.Get(path, 1) == remapped);
+    BOOST_CHECK(cache.Get(path3, 1));
+    BOOST_CHECK(cache.Get(path, 1) == remapped);
+    BOOST_CHECK(cache.Get(path2, 1) != mapping2);
+
+    // Mappings referenced outside the cache keep their file in use.
+    BOOST_CHECK(cache.InUse(path));
+    mapping.reset();
+    grown.reset();
+    BOOST_CHECK(cache.InUse(path));
+    remapped.reset();
+    BOOST_CHECK(!cache.InUse(path));
+    BOOST_CHECK(!cache.InUse(path_missing));
+
+    // A cache without room for mappings never maps anything.
+    CMappedFileCache disabled(0);
+    BOOST_CHECK(!disabled.Get(path, 1));
+#endif
+
+    fs::remove_all(dirname);
+}
+
+BOOST_FIXTURE_TEST_CASE(read_blocks_from_mapped_files, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CBlock block = CreateAndProcessBlock({}, scriptPubKey);
+    const CBlockIndex* pindex = chainActive.Tip();
+    BOOST_REQUIRE(pindex->GetBlockHash() == block.GetHash());
+
+    CBlock block_read;
+    BOOST_CHECK(ReadBlockFromDisk(block_read, pindex, Params().GetConsensus()));
+    BOOST_CHECK(block_read.GetHash() == block.GetHash());
+    BOOST_CHECK(block_read.vtx.size() == block.vtx.size());
+
+    CBlockUndo block_undo;
+    BOOST_CHECK(UndoReadFromDisk(block_undo, pindex));
+    BOOST_CHECK(block_undo.vtxundo.empty());
+
+    CMappedSpan block_data;
+#ifdef WIN32
+    BOOST_CHECK(!ReadRawBlockFromDisk(block_data, pindex));
+#else
+    // The raw bytes are the witness serialization of the block.
+    BOOST_REQUIRE(ReadRawBlockFromDisk(block_data, pindex));
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+    BOOST_CHECK_EQUAL(block_data.size(), ss.size());
+    BOOST_CHECK(std::equal(block_data.begin(), block_data.end(), (const unsigned char*)ss.data()));
+
+    // Older blocks are read from the same mapping of the block file.
+    for (const CBlockIndex* pindex_old = pindex->pprev; pindex_old; pindex_old = pindex_old->pprev) {
+        BOOST_CHECK(ReadRawBlockFromDisk(block_data, pindex_old));
+    }
+#endif
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -105,15 +105,39 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     BOOST_CHECK_EQUAL(testPool.size(), 0);
 }
 
-template<typename name>
-void CheckSort(CTxMemPool &pool, std::vector<std::string> &sortedOrder)
+// Check that a miner takes the entries in sortedOrder: the chunks of all
+// clusters by feerate, the highest first, ties going to the older cluster
+static void CheckMiningOrder(CTxMemPool &pool, const std::vector<std::string> &sortedOrder)
 {
-    BOOST_CHECK_EQUAL(pool.size(), sortedOrder.size());
-    typename CTxMemPool::indexed_transaction_set::index<name>::type::iterator it = pool.mapTx.get<name>().begin();
-    int count=0;
-    for (; it != pool.mapTx.get<name>().end(); ++it, ++count) {
-        BOOST_CHECK_EQUAL(it->GetTx().GetHash().ToString(), sortedOrder[count]);
+    struct ChunkPos {
+        const CTxMemPool::TxCluster* cluster;
+        uint64_t nClusterId;
+        size_t nChunk;
+        size_t nPos;
+    };
+    std::vector<ChunkPos> vChunks;
+    for (const auto& item : pool.GetClusters()) {
+        size_t nPos = 0;
+        for (size_t i = 0; i < item.second.vChunks.size(); i++) {
+            vChunks.push_back(ChunkPos{&item.second, item.first, i, nPos});
+            nPos += item.second.vChunks[i].nTxCount;
+        }
+    }
+    std::sort(vChunks.begin(), vChunks.end(), [](const ChunkPos& a, const ChunkPos& b) {
+        const ClusterChunk& chunk_a = a.cluster->vChunks[a.nChunk];
+        const ClusterChunk& chunk_b = b.cluster->vChunks[b.nChunk];
+        if (FeeRateLess(chunk_b, chunk_a)) return true;
+        if (FeeRateLess(chunk_a, chunk_b)) return false;
+        return std::make_pair(a.nClusterId, a.nChunk) < std::make_pair(b.nClusterId, b.nChunk);
+    });
+    std::vector<std::string> order;
+    for (const ChunkPos& pos : vChunks) {
+        for (size_t i = 0; i < pos.cluster->vChunks[pos.nChunk].nTxCount; i++) {
+            order.push_back(pos.cluster->vTxs[pos.nPos + i]->GetTx().GetHash().ToString());
+        }
     }
+    BOOST_CHECK_EQUAL(pool.size(), sortedOrder.size());
+    BOOST_CHECK_EQUAL_COLLECTIONS(order.begin(), order.end(), sortedOrder.begin(), sortedOrder.end());
 }
 
 BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
@@ -158,15 +182,17 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     pool.addUnchecked(tx5.GetHash(), entry.Fee(10000LL).FromTx(tx5));
     BOOST_CHECK_EQUAL(pool.size(), 5);
 
+    // All entries have the same size; tx1 and tx5 are in clusters of their own,
+    // and tx1's is older
     std::vector<std::string> sortedOrder;
     sortedOrder.resize(5);
-    sortedOrder[0] = tx3.GetHash().ToString(); // 0
-    sortedOrder[1] = tx5.GetHash().ToString(); // 10000
+    sortedOrder[0] = tx2.GetHash().ToString(); // 20000
+    sortedOrder[1] = tx4.GetHash().ToString(); // 15000
     sortedOrder[2] = tx1.GetHash().ToString(); // 10000
-    sortedOrder[3] = tx4.GetHash().ToString(); // 15000
-    sortedOrder[4] = tx2.GetHash().ToString(); // 20000
+    sortedOrder[3] = tx5.GetHash().ToString(); // 10000
+    sortedOrder[4] = tx3.GetHash().ToString(); // 0
     LOCK(pool.cs);
-    CheckSort<descendant_score>(pool, sortedOrder);
+    CheckMiningOrder(pool, sortedOrder);
 
     /* low fee but with high fee child */
     /* tx6 -> tx7 -> tx8, tx9 -> tx10 */
@@ -177,8 +203,8 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     pool.addUnchecked(tx6.GetHash(), entry.Fee(0LL).FromTx(tx6));
     BOOST_CHECK_EQUAL(pool.size(), 6);
     // Check that at this point, tx6 is sorted low
-    sortedOrder.insert(sortedOrder.begin(), tx6.GetHash().ToString());
-    CheckSort<descendant_score>(pool, sortedOrder);
+    sortedOrder.push_back(tx6.GetHash().ToString());
+    CheckMiningOrder(pool, sortedOrder);
 
     CTxMemPool::setEntries setAncestors;
     setAncestors.insert(pool.mapTx.find(tx6.GetHash()));
@@ -200,11 +226,12 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     pool.addUnchecked(tx7.GetHash(), entry.FromTx(tx7), setAncestors);
     BOOST_CHECK_EQUAL(pool.size(), 7);
 
-    // Now tx6 should be sorted higher (high fee child): tx7, tx6, tx2, ...
-    sortedOrder.erase(sortedOrder.begin());
-    sortedOrder.push_back(tx6.GetHash().ToString());
-    sortedOrder.push_back(tx7.GetHash().ToString());
-    CheckSort<descendant_score>(pool, sortedOrder);
+    // Now tx6 should be sorted higher (high fee child), in a chunk with tx7:
+    // tx6, tx7, tx2, ...
+    sortedOrder.pop_back();
+    sortedOrder.insert(sortedOrder.begin(), tx7.GetHash().ToString());
+    sortedOrder.insert(sortedOrder.begin(), tx6.GetHash().ToString());
+    CheckMiningOrder(pool, sortedOrder);
 
     /* low fee child of tx7 */
     CMutableTransaction tx8 = CMutableTransaction();
@@ -217,9 +244,10 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     setAncestors.insert(pool.mapTx.find(tx7.GetHash()));
     pool.addUnchecked(tx8.GetHash(), entry.Fee(0LL).Time(2).FromTx(tx8), setAncestors);
 
-    // Now tx8 should be sorted low, but tx6/tx both high
-    sortedOrder.insert(sortedOrder.begin(), tx8.GetHash().ToString());
-    CheckSort<descendant_score>(pool, sortedOrder);
+    // Now tx8 should be sorted low, in a chunk of its own, but tx6/tx7 both
+    // high. tx3 has the same feerate, and its cluster is older.
+    sortedOrder.push_back(tx8.GetHash().ToString());
+    CheckMiningOrder(pool, sortedOrder);
 
     /* low fee child of tx7 */
     CMutableTransaction tx9 = CMutableTransaction();
@@ -231,10 +259,10 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     tx9.vout[0].nValue = 1 * COIN;
     pool.addUnchecked(tx9.GetHash(), entry.Fee(0LL).Time(3).FromTx(tx9), setAncestors);
 
-    // tx9 should be sorted low
+    // tx9 should be sorted low, after tx8 which came first
     BOOST_CHECK_EQUAL(pool.size(), 9);
-    sortedOrder.insert(sortedOrder.begin(), tx9.GetHash().ToString());
-    CheckSort<descendant_score>(pool, sortedOrder);
+    sortedOrder.push_back(tx9.GetHash().ToString());
+    CheckMiningOrder(pool, sortedOrder);
 
     std::vector<std::string> snapshotOrder = sortedOrder;
 
@@ -258,32 +286,29 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     pool.addUnchecked(tx10.GetHash(), entry.FromTx(tx10), setAncestors);
 
     /**
-     *  tx8 and tx9 should both now be sorted higher
-     *  Final order after tx10 is added:
+     *  tx8 and tx9 should both now be sorted higher, in a chunk with tx10
+     *  Final order after tx10 is added (fee/size):
      *
-     *  tx3 = 0 (1)
-     *  tx5 = 10000 (1)
-     *  tx1 = 10000 (1)
-     *  tx4 = 15000 (1)
-     *  tx2 = 20000 (1)
-     *  tx9 = 200k (2 txs)
-     *  tx8 = 200k (2 txs)
-     *  tx10 = 200k (1 tx)
-     *  tx6 = 2.2M (5 txs)
-     *  tx7 = 2.2M (4 txs)
+     *  tx6, tx7 = 2M/95
+     *  tx2 = 20000/21
+     *  tx8, tx9, tx10 = 200k/231
+     *  tx4 = 15000/21
+     *  tx1 = 10000/21
+     *  tx5 = 10000/21
+     *  tx3 = 0/21
      */
-    sortedOrder.erase(sortedOrder.begin(), sortedOrder.begin()+2); // take out tx9, tx8 from the beginning
-    sortedOrder.insert(sortedOrder.begin()+5, tx9.GetHash().ToString());
-    sortedOrder.insert(sortedOrder.begin()+6, tx8.GetHash().ToString());
-    sortedOrder.insert(sortedOrder.begin()+7, tx10.GetHash().ToString()); // tx10 is just before tx6
-    CheckSort<descendant_score>(pool, sortedOrder);
+    sortedOrder.erase(sortedOrder.end()-2, sortedOrder.end()); // take out tx8, tx9 from the end
+    sortedOrder.insert(sortedOrder.begin()+3, tx8.GetHash().ToString());
+    sortedOrder.insert(sortedOrder.begin()+4, tx9.GetHash().ToString());
+    sortedOrder.insert(sortedOrder.begin()+5, tx10.GetHash().ToString());
+    CheckMiningOrder(pool, sortedOrder);
 
     // there should be 10 transactions in the mempool
     BOOST_CHECK_EQUAL(pool.size(), 10);
 
     // Now try removing tx10 and verify the sort order returns to normal
     pool.removeRecursive(pool.mapTx.find(tx10.GetHash())->GetTx());
-    CheckSort<descendant_score>(pool, snapshotOrder);
+    CheckMiningOrder(pool, snapshotOrder);
 
     pool.removeRecursive(pool.mapTx.find(tx9.GetHash())->GetTx());
     pool.removeRecursive(pool.mapTx.find(tx8.GetHash())->GetTx());
@@ -336,19 +361,13 @@ BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
     sortedOrder[0] = tx2.GetHash().ToString(); // 20000
     sortedOrder[1] = tx4.GetHash().ToString(); // 15000
     // tx1 and tx5 are both 10000
-    // Ties are broken by hash, not timestamp, so determine which
-    // hash comes first.
-    if (tx1.GetHash() < tx5.GetHash()) {
-        sortedOrder[2] = tx1.GetHash().ToString();
-        sortedOrder[3] = tx5.GetHash().ToString();
-    } else {
-        sortedOrder[2] = tx5.GetHash().ToString();
-        sortedOrder[3] = tx1.GetHash().ToString();
-    }
+    // Ties go to the older cluster
+    sortedOrder[2] = tx1.GetHash().ToString();
+    sortedOrder[3] = tx5.GetHash().ToString();
     sortedOrder[4] = tx3.GetHash().ToString(); // 0
 
     LOCK(pool.cs);
-    CheckSort<ancestor_score>(pool, sortedOrder);
+    CheckMiningOrder(pool, sortedOrder);
 
     /* low fee parent with high fee child */
     /* tx6 (0) -> tx7 (high) */
@@ -360,13 +379,10 @@ BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
 
     pool.addUnchecked(tx6.GetHash(), entry.Fee(0LL).FromTx(tx6));
     BOOST_CHECK_EQUAL(pool.size(), 6);
-    // Ties are broken by hash
-    if (tx3.GetHash() < tx6.GetHash())
-        sortedOrder.push_back(tx6.GetHash().ToString());
-    else
-        sortedOrder.insert(sortedOrder.end()-1,tx6.GetHash().ToString());
+    // Ties go to the older cluster
+    sortedOrder.push_back(tx6.GetHash().ToString());
 
-    CheckSort<ancestor_score>(pool, sortedOrder);
+    CheckMiningOrder(pool, sortedOrder);
 
     CMutableTransaction tx7 = CMutableTransaction();
     tx7.vin.resize(1);
@@ -382,22 +398,20 @@ BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
 
     pool.addUnchecked(tx7.GetHash(), entry.Fee(fee).FromTx(tx7));
     BOOST_CHECK_EQUAL(pool.size(), 7);
-    sortedOrder.insert(sortedOrder.begin()+1, tx7.GetHash().ToString());
-    CheckSort<ancestor_score>(pool, sortedOrder);
+    // tx6 is mined in a chunk with tx7
+    sortedOrder.pop_back();
+    sortedOrder.insert(sortedOrder.begin()+1, tx6.GetHash().ToString());
+    sortedOrder.insert(sortedOrder.begin()+2, tx7.GetHash().ToString());
+    CheckMiningOrder(pool, sortedOrder);
 
     /* after tx6 is mined, tx7 should move up in the sort */
     std::vector<CTransactionRef> vtx;
     vtx.push_back(MakeTransactionRef(tx6));
     pool.removeForBlock(vtx, 1);
 
-    sortedOrder.erase(sortedOrder.begin()+1);
-    // Ties are broken by hash
-    if (tx3.GetHash() < tx6.GetHash())
-        sortedOrder.pop_back();
-    else
-        sortedOrder.erase(sortedOrder.end()-2);
+    sortedOrder.erase(sortedOrder.begin()+1, sortedOrder.begin()+3);
     sortedOrder.insert(sortedOrder.begin(), tx7.GetHash().ToString());
-    CheckSort<ancestor_score>(pool, sortedOrder);
+    CheckMiningOrder(pool, sortedOrder);
 
     // High-fee parent, low-fee child
     // tx7 -> tx8
@@ -409,12 +423,12 @@ BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
     tx8.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
     tx8.vout[0].nValue = 10*COIN;
 
-    // Check that we sort by min(feerate, ancestor_feerate):
-    // set the fee so that the ancestor feerate is above tx1/5,
+    // Check that the child does not ride on its parent's feerate:
+    // set the fee so that the feerate with tx7 is above tx1/5,
     // but the transaction's own feerate is lower
     pool.addUnchecked(tx8.GetHash(), entry.Fee(5000LL).FromTx(tx8));
     sortedOrder.insert(sortedOrder.end()-1, tx8.GetHash().ToString());
-    CheckSort<ancestor_score>(pool, sortedOrder);
+    CheckMiningOrder(pool, sortedOrder);
 }
 
 
@@ -422,6 +436,9 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
 {
     CTxMemPool pool;
     TestMemPoolEntryHelper entry;
+    // The bucket array and header of an empty mapTx take memory as well, which
+    // trimming cannot give back; targets below are relative to it.
+    const size_t nEmptyUsage = pool.DynamicMemoryUsage();
 
     CMutableTransaction tx1 = CMutableTransaction();
     tx1.vin.resize(1);
@@ -443,7 +460,7 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     BOOST_CHECK(pool.exists(tx1.GetHash()));
     BOOST_CHECK(pool.exists(tx2.GetHash()));
 
-    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4); // should remove the lower-feerate transaction
+    pool.TrimToSize(nEmptyUsage + (pool.DynamicMemoryUsage() - nEmptyUsage) * 3 / 4); // should remove the lower-feerate transaction
     BOOST_CHECK(pool.exists(tx1.GetHash()));
     BOOST_CHECK(!pool.exists(tx2.GetHash()));
 
@@ -457,7 +474,7 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     tx3.vout[0].nValue = 10 * COIN;
     pool.addUnchecked(tx3.GetHash(), entry.Fee(20000LL).FromTx(tx3));
 
-    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4); // tx3 should pay for tx2 (CPFP)
+    pool.TrimToSize(nEmptyUsage + (pool.DynamicMemoryUsage() - nEmptyUsage) * 3 / 4); // tx3 should pay for tx2 (CPFP)
     BOOST_CHECK(!pool.exists(tx1.GetHash()));
     BOOST_CHECK(pool.exists(tx2.GetHash()));
     BOOST_CHECK(pool.exists(tx3.GetHash()));
@@ -523,23 +540,24 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     pool.addUnchecked(tx6.GetHash(), entry.Fee(1100LL).FromTx(tx6));
     pool.addUnchecked(tx7.GetHash(), entry.Fee(9000LL).FromTx(tx7));
 
-    // we only require this remove, at max, 2 txn, because its not clear what we're really optimizing for aside from that
+    // tx7 pays for both its parents, so tx5, tx6 and tx7 are the last chunk
+    // of the cluster, which goes as a whole
     pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
     BOOST_CHECK(pool.exists(tx4.GetHash()));
-    BOOST_CHECK(pool.exists(tx6.GetHash()));
+    BOOST_CHECK(!pool.exists(tx5.GetHash()));
+    BOOST_CHECK(!pool.exists(tx6.GetHash()));
     BOOST_CHECK(!pool.exists(tx7.GetHash()));
 
-    if (!pool.exists(tx5.GetHash()))
-        pool.addUnchecked(tx5.GetHash(), entry.Fee(1000LL).FromTx(tx5));
-    pool.addUnchecked(tx7.GetHash(), entry.Fee(9000LL).FromTx(tx7));
-
-    pool.TrimToSize(pool.DynamicMemoryUsage() / 2); // should maximize mempool size by only removing 5/7
+    // A child that doesn't pay for its parents is a chunk of its own
+    pool.addUnchecked(tx5.GetHash(), entry.Fee(1000LL).FromTx(tx5));
+    pool.addUnchecked(tx6.GetHash(), entry.Fee(1100LL).FromTx(tx6));
+    pool.addUnchecked(tx7.GetHash(), entry.Fee(500LL).FromTx(tx7));
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
     BOOST_CHECK(pool.exists(tx4.GetHash()));
-    BOOST_CHECK(!pool.exists(tx5.GetHash()));
+    BOOST_CHECK(pool.exists(tx5.GetHash()));
     BOOST_CHECK(pool.exists(tx6.GetHash()));
     BOOST_CHECK(!pool.exists(tx7.GetHash()));
 
-    pool.addUnchecked(tx5.GetHash(), entry.Fee(1000LL).FromTx(tx5));
     pool.addUnchecked(tx7.GetHash(), entry.Fee(9000LL).FromTx(tx7));
 
     std::vector<CTransactionRef> vtx;
@@ -571,4 +589,350 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolUsageTest)
+{
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+    const size_t nEmptyUsage = pool.DynamicMemoryUsage();
+    BOOST_CHECK(nEmptyUsage >= memusage::MallocUsage(sizeof(void*) * pool.mapTx.bucket_count()));
+
+    std::vector<CMutableTransaction> vParents(5);
+    size_t nEntriesUsage = 0;
+    for (size_t i = 0; i < vParents.size(); i++) {
+        vParents[i].vin.resize(1);
+        vParents[i].vin[0].scriptSig = CScript() << (int64_t)i;
+        vParents[i].vout.resize(2);
+        vParents[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        vParents[i].vout[0].nValue = 10 * COIN;
+        vParents[i].vout[1] = vParents[i].vout[0];
+        pool.addUnchecked(vParents[i].GetHash(), entry.Fee(1000LL).FromTx(vParents[i]));
+        nEntriesUsage += pool.mapTx.find(vParents[i].GetHash())->DynamicMemoryUsage();
+    }
+    // The entries themselves and their nodes are accounted for
+    const size_t nUsage = pool.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage >= nEntriesUsage + vParents.size() * sizeof(CTxMemPoolEntry));
+
+    // A child of two of them links to both, which costs memory...
+    CMutableTransaction txChild;
+    txChild.vin.resize(2);
+    txChild.vin[0].prevout = COutPoint(vParents[0].GetHash(), 0);
+    txChild.vin[1].prevout = COutPoint(vParents[1].GetHash(), 1);
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(txChild.GetHash(), entry.Fee(2000LL).FromTx(txChild));
+    CTxMemPool::txiter childit = pool.mapTx.find(txChild.GetHash());
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(childit).size(), 2U);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(pool.mapTx.find(vParents[0].GetHash())).size(), 1U);
+    BOOST_CHECK(pool.DynamicMemoryUsage() > nUsage + childit->DynamicMemoryUsage());
+
+    // ... all of which is given back when it leaves again.
+    pool.removeRecursive(txChild);
+    BOOST_CHECK_EQUAL(pool.size(), vParents.size());
+    BOOST_CHECK(pool.GetMemPoolChildren(pool.mapTx.find(vParents[0].GetHash())).empty());
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), nUsage);
+
+    // Removing the parents out of order keeps the links of the rest in place
+    pool.addUnchecked(txChild.GetHash(), entry.Fee(2000LL).FromTx(txChild));
+    pool.removeRecursive(vParents[2]);
+    pool.removeRecursive(vParents[4]);
+    childit = pool.mapTx.find(txChild.GetHash());
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(childit).size(), 2U);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(pool.mapTx.find(vParents[1].GetHash())).size(), 1U);
+    pool.removeRecursive(vParents[0]);
+    BOOST_CHECK_EQUAL(pool.size(), 2U);
+    BOOST_CHECK(pool.GetMemPoolChildren(pool.mapTx.find(vParents[1].GetHash())).empty());
+
+    pool.clear();
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), nEmptyUsage);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSnapshotTest)
+{
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+    LOCK(pool.cs);
+
+    std::vector<CMutableTransaction> vtx(3);
+    for (size_t i = 0; i < vtx.size(); i++) {
+        vtx[i].vin.resize(1);
+        vtx[i].vin[0].scriptSig = CScript() << (int64_t)i;
+        vtx[i].vout.resize(1);
+        vtx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        vtx[i].vout[0].nValue = 10 * COIN;
+    }
+    // vtx[2] spends vtx[1]
+    vtx[2].vin[0].prevout = COutPoint(vtx[1].GetHash(), 0);
+
+    const uint64_t nStart = pool.GetSequence();
+    pool.addUnchecked(vtx[0].GetHash(), entry.Fee(1000LL).FromTx(vtx[0]));
+    pool.addUnchecked(vtx[1].GetHash(), entry.Fee(2000LL).FromTx(vtx[1]));
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot1 = pool.GetSnapshot();
+    BOOST_CHECK_EQUAL(snapshot1->nSequence, pool.GetSequence());
+    BOOST_CHECK_EQUAL(snapshot1->vEntries.size(), 2U);
+    BOOST_CHECK(pool.GetSnapshot() == snapshot1);
+
+    // The child changes the descendant state of its parent only
+    pool.addUnchecked(vtx[2].GetHash(), entry.Fee(3000LL).FromTx(vtx[2]));
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot2 = pool.GetSnapshot();
+    BOOST_CHECK(snapshot2->nSequence > snapshot1->nSequence);
+    BOOST_CHECK_EQUAL(snapshot2->vEntries.size(), 3U);
+    BOOST_CHECK(snapshot2->Find(vtx[0].GetHash()) == snapshot1->Find(vtx[0].GetHash()));
+    const CTxMemPoolEntryInfo* parent = snapshot2->Find(vtx[1].GetHash());
+    BOOST_CHECK(parent != snapshot1->Find(vtx[1].GetHash()));
+    BOOST_CHECK_EQUAL(parent->nCountWithDescendants, 2U);
+    BOOST_CHECK_EQUAL(parent->nModFeesWithDescendants, 5000);
+    BOOST_CHECK_EQUAL(snapshot1->Find(vtx[1].GetHash())->nCountWithDescendants, 1U);
+    const CTxMemPoolEntryInfo* child = snapshot2->Find(vtx[2].GetHash());
+    BOOST_REQUIRE(child);
+    BOOST_CHECK_EQUAL(child->vDepends.size(), 1U);
+    BOOST_CHECK(child->vDepends[0] == vtx[1].GetHash());
+    BOOST_CHECK(child->wtxid == CTransaction(vtx[2]).GetWitnessHash());
+    BOOST_CHECK(pool.GetEntryInfo(pool.mapTx.find(vtx[2].GetHash())).get() == child);
+
+    // The last snapshot is counted apart from the mempool's memory, along
+    // with the transactions it keeps alive after they left
+    BOOST_CHECK(snapshot2->nUsage > 0);
+    BOOST_CHECK_EQUAL(pool.SnapshotMemoryUsage(), snapshot2->nUsage);
+    const size_t nEntryUsage = pool.mapTx.find(vtx[0].GetHash())->DynamicMemoryUsage();
+    pool.removeRecursive(vtx[0]);
+    BOOST_CHECK_EQUAL(pool.SnapshotMemoryUsage(), snapshot2->nUsage + nEntryUsage);
+
+    // Entries are still shared with it after a removal
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshotRemoved = pool.GetSnapshot();
+    BOOST_CHECK(snapshotRemoved->Find(vtx[1].GetHash()) == snapshot2->Find(vtx[1].GetHash()));
+    BOOST_CHECK(snapshotRemoved->Find(vtx[2].GetHash()) == snapshot2->Find(vtx[2].GetHash()));
+    BOOST_CHECK_EQUAL(pool.SnapshotMemoryUsage(), snapshotRemoved->nUsage);
+
+    // Snapshots stay as they were
+    pool.PrioritiseTransaction(vtx[2].GetHash(), 1000);
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot3 = pool.GetSnapshot();
+    BOOST_CHECK_EQUAL(snapshot2->vEntries.size(), 3U);
+    BOOST_CHECK_EQUAL(snapshot3->vEntries.size(), 2U);
+    BOOST_CHECK(snapshot3->Find(vtx[0].GetHash()) == nullptr);
+    BOOST_CHECK_EQUAL(snapshot3->Find(vtx[2].GetHash())->nModifiedFee, 4000);
+    BOOST_CHECK_EQUAL(snapshot2->Find(vtx[2].GetHash())->nModifiedFee, 3000);
+
+    // Changes between sequences
+    std::vector<uint256> vAdded, vRemoved;
+    BOOST_CHECK(pool.GetChangesSince(nStart, snapshot3->nSequence, vAdded, vRemoved));
+    BOOST_CHECK_EQUAL(vAdded.size(), 2U);
+    BOOST_CHECK(vRemoved.empty());
+    vAdded.clear();
+    BOOST_CHECK(pool.GetChangesSince(snapshot1->nSequence, snapshot2->nSequence, vAdded, vRemoved));
+    BOOST_CHECK_EQUAL(vAdded.size(), 1U);
+    BOOST_CHECK(vAdded[0] == vtx[2].GetHash());
+    BOOST_CHECK(vRemoved.empty());
+    vAdded.clear();
+    BOOST_CHECK(pool.GetChangesSince(snapshot2->nSequence, snapshot3->nSequence, vAdded, vRemoved));
+    BOOST_CHECK(vAdded.empty());
+    BOOST_REQUIRE_EQUAL(vRemoved.size(), 1U);
+    BOOST_CHECK(vRemoved[0] == vtx[0].GetHash());
+
+    // Removed and added again is in both
+    vRemoved.clear();
+    pool.addUnchecked(vtx[0].GetHash(), entry.Fee(1000LL).FromTx(vtx[0]));
+    BOOST_CHECK(pool.GetChangesSince(snapshot1->nSequence, pool.GetSequence(), vAdded, vRemoved));
+    BOOST_CHECK_EQUAL(vAdded.size(), 2U);
+    BOOST_CHECK_EQUAL(vRemoved.size(), 1U);
+
+    // The entries of the changes are copied without a new snapshot
+    std::vector<std::shared_ptr<const CTxMemPoolEntryInfo>> vAddedEntries;
+    uint64_t nUntil = 0;
+    vRemoved.clear();
+    BOOST_CHECK(pool.GetEntryChangesSince(snapshot3->nSequence, nUntil, vAddedEntries, vRemoved));
+    BOOST_CHECK_EQUAL(nUntil, pool.GetSequence());
+    BOOST_REQUIRE_EQUAL(vAddedEntries.size(), 1U);
+    BOOST_CHECK(vAddedEntries[0]->tx->GetHash() == vtx[0].GetHash());
+    BOOST_CHECK(vRemoved.empty());
+    BOOST_CHECK_EQUAL(pool.SnapshotMemoryUsage(), snapshot3->nUsage);
+
+    // Clearing forgets the changes
+    pool.clear();
+    BOOST_CHECK(!pool.GetChangesSince(snapshot3->nSequence, pool.GetSequence(), vAdded, vRemoved));
+    BOOST_CHECK(pool.GetSnapshot()->vEntries.empty());
+}
+
+BOOST_AUTO_TEST_CASE(ClusterLinearizationTest)
+{
+    // A low fee parent comes with the high fee child that pays for it,
+    // before a medium fee transaction
+    std::vector<ClusterTx> vTxs(3);
+    vTxs[0] = ClusterTx{100, 100, {}};
+    vTxs[1] = ClusterTx{1000, 100, {0}};
+    vTxs[2] = ClusterTx{500, 100, {}};
+    std::vector<uint32_t> vOrder = LinearizeCluster(vTxs);
+    BOOST_CHECK(vOrder == std::vector<uint32_t>({0, 1, 2}));
+    std::vector<ClusterChunk> vChunks = ChunkLinearization(vTxs, vOrder);
+    BOOST_REQUIRE_EQUAL(vChunks.size(), 2U);
+    BOOST_CHECK_EQUAL(vChunks[0].nFee, 1100);
+    BOOST_CHECK_EQUAL(vChunks[0].nSize, 200);
+    BOOST_CHECK_EQUAL(vChunks[0].nTxCount, 2U);
+    BOOST_CHECK_EQUAL(vChunks[1].nFee, 500);
+    BOOST_CHECK_EQUAL(vChunks[1].nTxCount, 1U);
+
+    // Parents come first, whatever order the transactions are in
+    vTxs[0] = ClusterTx{300, 100, {1}};
+    vTxs[1] = ClusterTx{100, 100, {}};
+    vTxs[2] = ClusterTx{150, 100, {}};
+    vOrder = LinearizeCluster(vTxs);
+    BOOST_CHECK(vOrder == std::vector<uint32_t>({1, 0, 2}));
+    vChunks = ChunkLinearization(vTxs, vOrder);
+    BOOST_REQUIRE_EQUAL(vChunks.size(), 2U);
+    BOOST_CHECK_EQUAL(vChunks[0].nTxCount, 2U);
+
+    // A parent that pays more than its children is a chunk of its own, and
+    // the children follow by their own feerates
+    vTxs[0] = ClusterTx{1000, 100, {}};
+    vTxs[1] = ClusterTx{100, 100, {0}};
+    vTxs[2] = ClusterTx{300, 100, {0}};
+    vOrder = LinearizeCluster(vTxs);
+    BOOST_CHECK(vOrder == std::vector<uint32_t>({0, 2, 1}));
+    vChunks = ChunkLinearization(vTxs, vOrder);
+    BOOST_REQUIRE_EQUAL(vChunks.size(), 3U);
+    for (size_t i = 1; i < vChunks.size(); i++) {
+        BOOST_CHECK(!FeeRateLess(vChunks[i - 1], vChunks[i]));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(MempoolClusterTest)
+{
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+    LOCK(pool.cs);
+
+    // Two unrelated transactions, and a child of the first that pays for it
+    std::vector<CMutableTransaction> vtx(2);
+    for (size_t i = 0; i < vtx.size(); i++) {
+        vtx[i].vin.resize(1);
+        vtx[i].vin[0].scriptSig = CScript() << (int64_t)i;
+        vtx[i].vout.resize(2);
+        vtx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        vtx[i].vout[0].nValue = 10 * COIN;
+        vtx[i].vout[1] = vtx[i].vout[0];
+    }
+    pool.addUnchecked(vtx[0].GetHash(), entry.Fee(1000LL).FromTx(vtx[0]));
+    pool.addUnchecked(vtx[1].GetHash(), entry.Fee(5000LL).FromTx(vtx[1]));
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(vtx[0].GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(txChild.GetHash(), entry.Fee(20000LL).FromTx(txChild));
+
+    CTxMemPool::txiter it0 = pool.mapTx.find(vtx[0].GetHash());
+    CTxMemPool::txiter it1 = pool.mapTx.find(vtx[1].GetHash());
+    CTxMemPool::txiter itChild = pool.mapTx.find(txChild.GetHash());
+    BOOST_CHECK_EQUAL(pool.GetClusters().size(), 2U);
+    BOOST_CHECK_EQUAL(it0->nClusterId, itChild->nClusterId);
+    {
+        const CTxMemPool::TxCluster& cluster = pool.GetClusters().at(it0->nClusterId);
+        BOOST_REQUIRE_EQUAL(cluster.vTxs.size(), 2U);
+        BOOST_CHECK(cluster.vTxs[0] == it0);
+        BOOST_CHECK(cluster.vTxs[1] == itChild);
+        BOOST_CHECK_EQUAL(cluster.vChunks.size(), 1U);
+    }
+    BOOST_CHECK(pool.GetChunkFeeRate(it0) == CFeeRate(21000, it0->GetTxSize() + itChild->GetTxSize()));
+    BOOST_CHECK(pool.GetChunkFeeRate(itChild) == pool.GetChunkFeeRate(it0));
+    BOOST_CHECK(pool.GetChunkFeeRate(it1) == CFeeRate(5000, it1->GetTxSize()));
+
+    // A transaction spending both joins their clusters; paying nothing, it
+    // is the last chunk
+    CMutableTransaction txJoin;
+    txJoin.vin.resize(2);
+    txJoin.vin[0].prevout = COutPoint(vtx[0].GetHash(), 1);
+    txJoin.vin[1].prevout = COutPoint(vtx[1].GetHash(), 0);
+    txJoin.vout.resize(1);
+    txJoin.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txJoin.vout[0].nValue = 10 * COIN;
+    CTxMemPool::setEntries setAncestors{it0, it1};
+    BOOST_CHECK_EQUAL(pool.CalculateClusterCount(setAncestors), 4U);
+    pool.addUnchecked(txJoin.GetHash(), entry.Fee(0LL).FromTx(txJoin));
+    CTxMemPool::txiter itJoin = pool.mapTx.find(txJoin.GetHash());
+    BOOST_REQUIRE_EQUAL(pool.GetClusters().size(), 1U);
+    {
+        const CTxMemPool::TxCluster& cluster = pool.GetClusters().begin()->second;
+        BOOST_REQUIRE_EQUAL(cluster.vTxs.size(), 4U);
+        BOOST_CHECK(cluster.vTxs.back() == itJoin);
+        BOOST_CHECK_EQUAL(cluster.vChunks.back().nTxCount, 1U);
+        BOOST_CHECK_EQUAL(cluster.vChunks.back().nFee, 0);
+    }
+
+    // Once prioritised, it pays for both its parents and comes first
+    pool.PrioritiseTransaction(txJoin.GetHash(), 100000);
+    BOOST_CHECK(pool.GetChunkFeeRate(itJoin) == CFeeRate(106000, it0->GetTxSize() + it1->GetTxSize() + itJoin->GetTxSize()));
+    BOOST_CHECK(pool.GetChunkFeeRate(it1) == pool.GetChunkFeeRate(itJoin));
+    BOOST_CHECK(pool.GetChunkFeeRate(itChild) == CFeeRate(20000, itChild->GetTxSize()));
+
+    // Without it, the clusters are apart again
+    pool.removeRecursive(txJoin);
+    BOOST_CHECK_EQUAL(pool.GetClusters().size(), 2U);
+    BOOST_CHECK(it0->nClusterId != it1->nClusterId);
+    BOOST_CHECK(pool.GetChunkFeeRate(it1) == CFeeRate(5000, it1->GetTxSize()));
+
+    pool.clear();
+    BOOST_CHECK(pool.GetClusters().empty());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolFeeHistogramTest)
+{
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+
+    std::vector<CMutableTransaction> vTxs(3);
+    for (size_t i = 0; i < vTxs.size(); i++) {
+        vTxs[i].vin.resize(1);
+        vTxs[i].vin[0].scriptSig = CScript() << (int64_t)i;
+        vTxs[i].vout.resize(1);
+        vTxs[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        vTxs[i].vout[0].nValue = 10 * COIN;
+    }
+    const int64_t nSize = GetVirtualTransactionSize(vTxs[0]);
+    BOOST_CHECK_EQUAL(GetVirtualTransactionSize(vTxs[2]), nSize);
+
+    // 5 satoshis per vbyte are the bucket starting at 5000 per 1000 vbytes,
+    // and the bound itself is in it
+    BOOST_CHECK_EQUAL(MEMPOOL_FEE_HISTOGRAM_BOUNDS[5], 5000);
+    pool.addUnchecked(vTxs[0].GetHash(), entry.Fee(5 * nSize).FromTx(vTxs[0]));
+    pool.addUnchecked(vTxs[1].GetHash(), entry.Fee(5 * nSize + 1).FromTx(vTxs[1]));
+    pool.addUnchecked(vTxs[2].GetHash(), entry.Fee(0).FromTx(vTxs[2]));
+    MempoolFeeHistogram histogram = pool.GetFeeHistogram();
+    BOOST_CHECK_EQUAL(histogram[5].nCount, 2U);
+    BOOST_CHECK_EQUAL(histogram[5].nSize, uint64_t(2 * nSize));
+    BOOST_CHECK_EQUAL(histogram[5].nFees, 10 * nSize + 1);
+    BOOST_CHECK_EQUAL(histogram[0].nCount, 1U);
+    BOOST_CHECK_EQUAL(histogram[0].nFees, 0);
+    uint64_t nCount = 0;
+    for (const MempoolFeeHistogramBucket& bucket : histogram) nCount += bucket.nCount;
+    BOOST_CHECK_EQUAL(nCount, pool.size());
+
+    // Prioritisation moves a transaction to the bucket of its modified
+    // feerate, below the first bound as well
+    pool.PrioritiseTransaction(vTxs[2].GetHash(), 20000 * nSize);
+    pool.PrioritiseTransaction(vTxs[1].GetHash(), -10 * nSize);
+    histogram = pool.GetFeeHistogram();
+    BOOST_CHECK_EQUAL(histogram[5].nCount, 1U);
+    BOOST_CHECK_EQUAL(histogram[5].nFees, 5 * nSize);
+    BOOST_CHECK_EQUAL(histogram[0].nCount, 1U);
+    BOOST_CHECK_EQUAL(histogram[0].nFees, 1 - 5 * nSize);
+    BOOST_CHECK_EQUAL(histogram[MEMPOOL_FEE_HISTOGRAM_BUCKETS - 1].nCount, 1U);
+    BOOST_CHECK_EQUAL(histogram[MEMPOOL_FEE_HISTOGRAM_BUCKETS - 1].nSize, uint64_t(nSize));
+
+    // A transaction prioritised before it enters lands in its modified bucket
+    pool.removeRecursive(vTxs[0]);
+    pool.PrioritiseTransaction(vTxs[0].GetHash(), nSize);
+    pool.addUnchecked(vTxs[0].GetHash(), entry.Fee(5 * nSize).FromTx(vTxs[0]));
+    histogram = pool.GetFeeHistogram();
+    BOOST_CHECK_EQUAL(histogram[5].nCount, 0U);
+    BOOST_CHECK_EQUAL(histogram[6].nCount, 1U);
+    BOOST_CHECK_EQUAL(histogram[6].nFees, 6 * nSize);
+
+    // Removing everything empties all buckets
+    pool.removeRecursive(vTxs[0]);
+    pool.removeRecursive(vTxs[1]);
+    pool.removeRecursive(vTxs[2]);
+    BOOST_CHECK(pool.GetFeeHistogram() == MempoolFeeHistogram());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
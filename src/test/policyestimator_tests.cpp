@@ -2,8 +2,11 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <clientversion.h>
+#include <fs.h>
 #include <policy/policy.h>
 #include <policy/fees.h>
+#include <streams.h>
 #include <txmempool.h>
 #include <uint256.h>
 #include <util.h>
@@ -179,4 +182,86 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     }
 }
 
+BOOST_AUTO_TEST_CASE(BlockPolicyEstimatesCachedAndSaved)
+{
+    CBlockPolicyEstimator feeEst;
+    CTxMemPool mpool(&feeEst);
+    TestMemPoolEntryHelper entry;
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(128, 'X');
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 0LL;
+
+    // 100 blocks in which the transactions of the higher fees get mined first
+    std::vector<CTransactionRef> block;
+    std::vector<uint256> txHashes[10];
+    int blocknum = 0;
+    while (blocknum < 100) {
+        for (int j = 0; j < 10; j++) {
+            for (int k = 0; k < 4; k++) {
+                tx.vin[0].prevout.n = 10000*blocknum+100*j+k;
+                mpool.addUnchecked(tx.GetHash(), entry.Fee(2000 * (j+1)).Time(GetTime()).Height(blocknum).FromTx(tx));
+                txHashes[j].push_back(tx.GetHash());
+            }
+        }
+        for (int h = 0; h <= blocknum%10; h++) {
+            while (txHashes[9-h].size()) {
+                CTransactionRef ptx = mpool.get(txHashes[9-h].back());
+                if (ptx)
+                    block.push_back(ptx);
+                txHashes[9-h].pop_back();
+            }
+        }
+        mpool.removeForBlock(block, ++blocknum);
+        block.clear();
+    }
+
+    FeeCalculation feeCalc;
+    const CFeeRate estimate = feeEst.estimateSmartFee(4, &feeCalc, false);
+    BOOST_CHECK(estimate > CFeeRate(0));
+    BOOST_CHECK_EQUAL(feeCalc.returnedTarget, 4);
+
+    // Transactions entering the mempool don't change the answer
+    for (int k = 0; k < 100; k++) {
+        tx.vin[0].prevout.n = 10000*blocknum+k;
+        mpool.addUnchecked(tx.GetHash(), entry.Fee(2000).Time(GetTime()).Height(blocknum).FromTx(tx));
+    }
+    FeeCalculation feeCalcCached;
+    BOOST_CHECK(feeEst.estimateSmartFee(4, &feeCalcCached, false) == estimate);
+    BOOST_CHECK(feeCalcCached.reason == feeCalc.reason);
+    BOOST_CHECK_EQUAL(feeCalcCached.returnedTarget, 4);
+
+    // New blocks do, as they decay the data the estimate is computed from
+    while (blocknum < 110) {
+        mpool.removeForBlock(block, ++blocknum);
+    }
+    FeeCalculation feeCalcAfter;
+    feeEst.estimateSmartFee(4, &feeCalcAfter, false);
+    BOOST_CHECK(feeCalcAfter.est.pass.totalConfirmed < feeCalc.est.pass.totalConfirmed);
+
+    // Read back from a file, the estimator gives the same answers once the
+    // transactions it tracks in the mempool are flushed, as those are not saved
+    feeEst.FlushUnconfirmed(mpool);
+    const fs::path path = fs::temp_directory_path() / fs::unique_path();
+    {
+        CAutoFile fileout(fsbridge::fopen(path, "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!fileout.IsNull());
+        BOOST_CHECK(feeEst.Write(fileout));
+    }
+    CBlockPolicyEstimator feeEstRead;
+    {
+        CAutoFile filein(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!filein.IsNull());
+        BOOST_CHECK(feeEstRead.Read(filein));
+    }
+    fs::remove(path);
+    for (int i = 1; i <= 48; i++) {
+        BOOST_CHECK(feeEstRead.estimateSmartFee(i, nullptr, false) == feeEst.estimateSmartFee(i, nullptr, false));
+        BOOST_CHECK(feeEstRead.estimateSmartFee(i, nullptr, true) == feeEst.estimateSmartFee(i, nullptr, true));
+        BOOST_CHECK(feeEstRead.estimateRawFee(i, 0.85, FeeEstimateHorizon::MED_HALFLIFE) == feeEst.estimateRawFee(i, 0.85, FeeEstimateHorizon::MED_HALFLIFE));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -6,11 +6,18 @@
 #include <rpc/client.h>
 
 #include <base58.h>
+#include <chain.h>
+#include <consensus/validation.h>
 #include <core_io.h>
 #include <netbase.h>
+#include <rpc/blockchain.h>
+#include <validation.h>
 
 #include <test/test_bitcoin.h>
 
+#include <atomic>
+#include <thread>
+
 #include <boost/algorithm/string.hpp>
 #include <boost/test/unit_test.hpp>
 
@@ -82,6 +89,16 @@ BOOST_AUTO_TEST_CASE(rpc_rawparams)
     BOOST_CHECK_THROW(CallRPC("sendrawtransaction null"), std::runtime_error);
     BOOST_CHECK_THROW(CallRPC("sendrawtransaction DEADBEEF"), std::runtime_error);
     BOOST_CHECK_THROW(CallRPC(std::string("sendrawtransaction ")+rawtx+" extra"), std::runtime_error);
+
+    BOOST_CHECK_THROW(CallRPC("sendrawtransactions"), std::runtime_error);
+    BOOST_CHECK_THROW(CallRPC("sendrawtransactions DEADBEEF"), std::runtime_error);
+    BOOST_CHECK_NO_THROW(r = CallRPC(std::string("sendrawtransactions [\"DEADBEEF\",\"")+rawtx+"\"]"));
+    BOOST_CHECK_EQUAL(r.size(), 2U);
+    BOOST_CHECK(find_value(r[0].get_obj(), "txid").isNull());
+    BOOST_CHECK_EQUAL(find_value(r[0].get_obj(), "accepted").get_bool(), false);
+    BOOST_CHECK_EQUAL(find_value(r[0].get_obj(), "error").get_str(), "TX decode failed");
+    BOOST_CHECK_EQUAL(find_value(r[1].get_obj(), "txid").get_str(), "a6eab3c14ab5272a58a5ba91505ba1a4b6d7a3a9fcbd187b6cd99a7b6d548cb7");
+    BOOST_CHECK_EQUAL(find_value(r[1].get_obj(), "error").get_str(), "Missing inputs");
 }
 
 BOOST_AUTO_TEST_CASE(rpc_togglenetwork)
@@ -345,4 +362,63 @@ BOOST_AUTO_TEST_CASE(rpc_convert_values_generatetoaddress)
     BOOST_CHECK_EQUAL(result[2].get_int(), 9);
 }
 
+static void CheckChainTipSnapshot()
+{
+    LOCK(cs_main);
+    std::shared_ptr<const CChainTipSnapshot> snapshot = GetChainTipSnapshot();
+    BOOST_REQUIRE(snapshot);
+    BOOST_CHECK_EQUAL(snapshot->nHeight, chainActive.Height());
+    BOOST_CHECK(snapshot->hashBlock == chainActive.Tip()->GetBlockHash());
+    BOOST_CHECK(snapshot->nChainWork == chainActive.Tip()->nChainWork);
+    BOOST_CHECK_EQUAL(snapshot->nMedianTimePast, chainActive.Tip()->GetMedianTimePast());
+    BOOST_CHECK_EQUAL(snapshot->nMoneySupply, chainActive.Tip()->nMoneySupply);
+    for (int algo = 0; algo < NUM_ALGOS; algo++) {
+        BOOST_CHECK_EQUAL(GetDifficultyFromBits(snapshot->nBitsByAlgo[algo]), GetDifficulty(nullptr, algo));
+    }
+    // Computed on first use, from the snapshot's tip
+    BOOST_CHECK(snapshot->pindex == chainActive.Tip());
+    BOOST_CHECK_EQUAL(snapshot->GetNetworkHashPS(), GetAverageHashRate(chainActive.Tip(), TIP_SNAPSHOT_HASHPS_BLOCKS));
+}
+
+BOOST_FIXTURE_TEST_CASE(rpc_chain_tip_snapshot, TestChain100Setup)
+{
+    // The snapshot follows the tip as blocks are connected and disconnected.
+    CheckChainTipSnapshot();
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CreateAndProcessBlock({}, scriptPubKey);
+    CheckChainTipSnapshot();
+    CValidationState state;
+    BOOST_CHECK(InvalidateBlock(state, Params(), chainActive.Tip()));
+    CheckChainTipSnapshot();
+
+    // The chain RPCs read it without waiting for cs_main.
+    std::atomic<bool> fLocked(false), fDone(false), fReleasedEarly(false);
+    std::thread holder([&] {
+        LOCK(cs_main);
+        fLocked = true;
+        int64_t nStart = GetTimeMillis();
+        while (!fDone) {
+            if (GetTimeMillis() - nStart > 10000) {
+                fReleasedEarly = true;
+                break;
+            }
+            MilliSleep(1);
+        }
+    });
+    while (!fLocked)
+        MilliSleep(1);
+    BOOST_CHECK_EQUAL(CallRPC("getblockcount").get_int(), 100);
+    BOOST_CHECK_EQUAL(CallRPC("getbestblockhash").get_str(), GetChainTipSnapshot()->hashBlock.GetHex());
+    BOOST_CHECK_EQUAL(find_value(CallRPC("getblockchaininfo").get_obj(), "blocks").get_int(), 100);
+    BOOST_CHECK_EQUAL(find_value(CallRPC("getmininginfo").get_obj(), "blocks").get_int(), 100);
+    CallRPC("getdifficulty");
+    // Block index lookups only wait for cs_blockindex.
+    std::string strHash = CallRPC("getblockhash 100").get_str();
+    BOOST_CHECK_EQUAL(strHash, GetChainTipSnapshot()->hashBlock.GetHex());
+    BOOST_CHECK_EQUAL(find_value(CallRPC("getblockheader " + strHash).get_obj(), "height").get_int(), 100);
+    fDone = true;
+    holder.join();
+    BOOST_CHECK(!fReleasedEarly);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,53 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <sync.h>
+#include <test/test_bitcoin.h>
+#include <util.h>
+
+#include <thread>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(sync_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(lock_contention_stats)
+{
+    CCriticalSection cs_contended;
+    CWaitableCriticalSection cs_started;
+    CConditionVariable cond_started;
+    bool fStarted = false;
+
+    // Waits are counted only while the lock category is logged.
+    const uint32_t nCategories = logCategories;
+    logCategories |= BCLog::LOCK;
+    BOOST_CHECK(LogLockContentionEnabled());
+
+    std::thread waiter;
+    {
+        LOCK(cs_contended);
+        waiter = std::thread([&] {
+            {
+                WaitableLock lock(cs_started);
+                fStarted = true;
+                cond_started.notify_one();
+            }
+            LOCK(cs_contended);
+        });
+        WaitableLock lock(cs_started);
+        cond_started.wait(lock, [&] { return fStarted; });
+        MilliSleep(20);
+    }
+    waiter.join();
+    logCategories = nCategories;
+
+    const std::map<std::pair<std::string, const void*>, LockContentionStats> stats = GetLockContentionStats();
+    auto it = stats.find(std::make_pair(std::string("cs_contended"), (const void*)&cs_contended));
+    BOOST_REQUIRE(it != stats.end());
+    BOOST_CHECK_EQUAL(it->second.count, 1U);
+    BOOST_CHECK(it->second.wait_micros >= it->second.max_wait_micros);
+    BOOST_CHECK(it->second.max_wait_micros > 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -7,9 +7,12 @@
 #include <amount.h>
 #include <consensus/validation.h>
 #include <primitives/transaction.h>
+#include <script/interpreter.h>
 #include <script/script.h>
 #include <test/test_bitcoin.h>
 
+#include <thread>
+
 #include <boost/test/unit_test.hpp>
 
 
@@ -58,4 +61,224 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_reject_coinbase, TestChain100Setup)
     BOOST_CHECK_EQUAL(nDoS, 100);
 }
 
+/** A transaction spending the given outputs, which pay to key, to scriptPubKey. */
+static CMutableTransaction SpendOutputs(const std::vector<std::pair<const CTransaction*, unsigned int>>& outputs, const CKey& key, const CScript& scriptPubKey, CAmount nFee)
+{
+    CMutableTransaction spend;
+    spend.vout.resize(1);
+    spend.vout[0].nValue = -nFee;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+    for (const auto& output : outputs) {
+        spend.vin.emplace_back(COutPoint(output.first->GetHash(), output.second));
+        spend.vout[0].nValue += output.first->vout[output.second].nValue;
+    }
+    for (unsigned int i = 0; i < spend.vin.size(); i++) {
+        const CTxOut& txout = outputs[i].first->vout[outputs[i].second];
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(txout.scriptPubKey, spend, i, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(key.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        spend.vin[i].scriptSig = CScript() << vchSig;
+    }
+    return spend;
+}
+
+/** A transaction spending outputs nOut and nOut + 1 of txPrev, paying to scriptPubKey. */
+static CMutableTransaction SpendPair(const CTransaction& txPrev, unsigned int nOut, const CKey& key, const CScript& scriptPubKey, CAmount nFee)
+{
+    return SpendOutputs({{&txPrev, nOut}, {&txPrev, nOut + 1}}, key, scriptPubKey, nFee);
+}
+
+/** A transaction splitting a mature coinbase paying to key into nOutputs outputs. */
+static CMutableTransaction SplitCoinbase(const CTransaction& coinbase, const CKey& key, const CScript& scriptPubKey, unsigned int nOutputs)
+{
+    CMutableTransaction split;
+    split.vin.resize(1);
+    split.vin[0].prevout = COutPoint(coinbase.GetHash(), 0);
+    split.vout.resize(nOutputs);
+    for (CTxOut& out : split.vout) {
+        out.nValue = coinbase.vout[0].nValue / (2 * nOutputs);
+        out.scriptPubKey = scriptPubKey;
+    }
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(coinbase.vout[0].scriptPubKey, split, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    split.vin[0].scriptSig = CScript() << vchSig;
+    return split;
+}
+
+/**
+ * Ensure that transactions accepted by several threads at once, without
+ * holding cs_main, end up in a consistent mempool without double spends.
+ */
+BOOST_FIXTURE_TEST_CASE(tx_mempool_accept_concurrent, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const unsigned int nPairs = 20;
+
+    // Split a mature coinbase into outputs to spend.
+    CMutableTransaction split = SplitCoinbase(coinbaseTxns[0], coinbaseKey, scriptPubKey, 2 * nPairs);
+    CreateAndProcessBlock({split}, scriptPubKey);
+    const CTransaction txSplit(split);
+
+    // Every pair of outputs is spent twice, with different fees.
+    std::vector<CTransactionRef> txs;
+    for (unsigned int i = 0; i < nPairs; i++) {
+        txs.push_back(MakeTransactionRef(SpendPair(txSplit, 2 * i, coinbaseKey, scriptPubKey, 10000)));
+        txs.push_back(MakeTransactionRef(SpendPair(txSplit, 2 * i, coinbaseKey, scriptPubKey, 20000)));
+    }
+    std::vector<char> accepted(txs.size(), false);
+    std::vector<std::thread> threads;
+    const size_t nThreads = 4;
+    for (size_t t = 0; t < nThreads; t++) {
+        threads.emplace_back([&txs, &accepted, t, nThreads] {
+            for (size_t i = t; i < txs.size(); i += nThreads) {
+                CValidationState state;
+                accepted[i] = AcceptToMemoryPool(mempool, state, txs[i], nullptr /* pfMissingInputs */,
+                                                 nullptr /* plTxnReplaced */, false /* bypass_limits */, 0 /* nAbsurdFee */);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    LOCK(cs_main);
+    BOOST_CHECK_EQUAL(mempool.size(), nPairs);
+    for (unsigned int i = 0; i < nPairs; i++) {
+        // Exactly one spend of each pair got in.
+        BOOST_CHECK(accepted[2 * i] != accepted[2 * i + 1]);
+        BOOST_CHECK_EQUAL(mempool.exists(txs[2 * i]->GetHash()), (bool)accepted[2 * i]);
+    }
+    mempool.check(pcoinsTip.get());
+
+    // A bad signature is reported as such, also when the inputs were checked
+    // on the script check threads.
+    CMutableTransaction bad = SpendPair(txSplit, 0, coinbaseKey, scriptPubKey, 10000);
+    bad.vout[0].nValue -= 1;
+    mempool.clear();
+    CValidationState state;
+    BOOST_CHECK(!AcceptToMemoryPool(mempool, state, MakeTransactionRef(bad), nullptr /* pfMissingInputs */,
+                                    nullptr /* plTxnReplaced */, false /* bypass_limits */, 0 /* nAbsurdFee */));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "mandatory-script-verify-flag-failed (Signature must be zero for failed CHECK(MULTI)SIG operation)");
+}
+
+/**
+ * Ensure that a batch is added to the mempool parents first, and that every
+ * transaction in it gets its own result.
+ */
+BOOST_FIXTURE_TEST_CASE(tx_mempool_accept_batch, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction split = SplitCoinbase(coinbaseTxns[0], coinbaseKey, scriptPubKey, 4);
+    CreateAndProcessBlock({split}, scriptPubKey);
+    const CTransaction txSplit(split);
+
+    const CTransaction parent(SpendPair(txSplit, 0, coinbaseKey, scriptPubKey, 10000));
+    const CTransaction child(SpendOutputs({{&parent, 0}, {&txSplit, 2}}, coinbaseKey, scriptPubKey, 10000));
+    const CTransaction grandchild(SpendOutputs({{&child, 0}}, coinbaseKey, scriptPubKey, 10000));
+    const CTransaction doubleSpend(SpendPair(txSplit, 0, coinbaseKey, scriptPubKey, 20000));
+    CMutableTransaction orphan = SpendOutputs({{&txSplit, 3}}, coinbaseKey, scriptPubKey, 10000);
+    orphan.vin[0].prevout.hash = uint256S("01");
+
+    std::vector<CTransactionRef> txs{MakeTransactionRef(grandchild), MakeTransactionRef(child), MakeTransactionRef(parent),
+                                     MakeTransactionRef(doubleSpend), MakeTransactionRef(orphan)};
+    std::vector<CValidationState> states;
+    std::vector<bool> vAccepted, vMissingInputs;
+    AcceptToMemoryPoolBatch(mempool, txs, states, vAccepted, vMissingInputs, 0 /* nAbsurdFee */);
+
+    BOOST_CHECK(vAccepted == std::vector<bool>({true, true, true, false, false}));
+    BOOST_CHECK(vMissingInputs == std::vector<bool>({false, false, false, false, true}));
+    BOOST_CHECK_EQUAL(states[3].GetRejectReason(), "txn-mempool-conflict");
+    BOOST_CHECK(!states[4].IsInvalid());
+
+    LOCK(cs_main);
+    BOOST_CHECK_EQUAL(mempool.size(), 3U);
+    BOOST_CHECK(mempool.exists(grandchild.GetHash()));
+    mempool.check(pcoinsTip.get());
+}
+
+/**
+ * Ensure that the transactions of one batch generation can't grow a cluster
+ * past -limitclustercount together, when each would fit on its own.
+ */
+BOOST_FIXTURE_TEST_CASE(tx_mempool_batch_cluster_limit, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    // One more block for a second mature coinbase
+    CreateAndProcessBlock({}, scriptPubKey);
+
+    // A cluster of three: two unrelated transactions and one spending both
+    const CTransaction a(SplitCoinbase(coinbaseTxns[0], coinbaseKey, scriptPubKey, 2));
+    const CTransaction b(SplitCoinbase(coinbaseTxns[1], coinbaseKey, scriptPubKey, 2));
+    const CTransaction join(SpendOutputs({{&a, 0}, {&b, 0}}, coinbaseKey, scriptPubKey, 10000));
+    for (const CTransaction* tx : {&a, &b, &join}) {
+        CValidationState state;
+        BOOST_CHECK(AcceptToMemoryPool(mempool, state, MakeTransactionRef(*tx), nullptr /* pfMissingInputs */,
+                                       nullptr /* plTxnReplaced */, false /* bypass_limits */, 0 /* nAbsurdFee */));
+    }
+
+    // Each spends a different member, without ancestors in common
+    gArgs.ForceSetArg("-limitclustercount", "4");
+    std::vector<CTransactionRef> txs{MakeTransactionRef(SpendOutputs({{&a, 1}}, coinbaseKey, scriptPubKey, 10000)),
+                                     MakeTransactionRef(SpendOutputs({{&b, 1}}, coinbaseKey, scriptPubKey, 10000))};
+    std::vector<CValidationState> states;
+    std::vector<bool> vAccepted, vMissingInputs;
+    AcceptToMemoryPoolBatch(mempool, txs, states, vAccepted, vMissingInputs, 0 /* nAbsurdFee */);
+    gArgs.ForceSetArg("-limitclustercount", std::to_string(DEFAULT_CLUSTER_LIMIT));
+
+    BOOST_CHECK(vAccepted == std::vector<bool>({true, false}));
+    BOOST_CHECK_EQUAL(states[1].GetRejectReason(), "too-long-mempool-chain");
+
+    LOCK(cs_main);
+    BOOST_CHECK_EQUAL(mempool.size(), 4U);
+    mempool.check(pcoinsTip.get());
+}
+
+/**
+ * Ensure that mempool.dat is loaded back in batches with the acceptance times
+ * and fee deltas it was dumped with, children after their parents.
+ */
+BOOST_FIXTURE_TEST_CASE(tx_mempool_dump_load, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction split = SplitCoinbase(coinbaseTxns[0], coinbaseKey, scriptPubKey, 4);
+    CreateAndProcessBlock({split}, scriptPubKey);
+    const CTransaction txSplit(split);
+
+    const CTransaction parent(SpendPair(txSplit, 0, coinbaseKey, scriptPubKey, 10000));
+    const CTransaction child(SpendOutputs({{&parent, 0}, {&txSplit, 2}}, coinbaseKey, scriptPubKey, 10000));
+    const CTransaction other(SpendOutputs({{&txSplit, 3}}, coinbaseKey, scriptPubKey, 10000));
+    std::vector<CTransactionRef> txs{MakeTransactionRef(parent), MakeTransactionRef(child), MakeTransactionRef(other)};
+    for (const CTransactionRef& tx : txs) {
+        CValidationState state;
+        BOOST_CHECK(AcceptToMemoryPool(mempool, state, tx, nullptr /* pfMissingInputs */,
+                                       nullptr /* plTxnReplaced */, false /* bypass_limits */, 0 /* nAbsurdFee */));
+    }
+    mempool.PrioritiseTransaction(child.GetHash(), 5000);
+    std::vector<TxMempoolInfo> vInfoBefore = mempool.infoAll();
+
+    BOOST_REQUIRE(DumpMempool());
+    mempool.clear();
+    mempool.ClearPrioritisation(child.GetHash());
+    BOOST_REQUIRE(LoadMempool());
+
+    BOOST_CHECK_EQUAL(mempool.size(), 3U);
+    for (const TxMempoolInfo& before : vInfoBefore) {
+        const TxMempoolInfo after = mempool.info(before.tx->GetHash());
+        BOOST_REQUIRE(after.tx);
+        BOOST_CHECK_EQUAL(after.nTime, before.nTime);
+        BOOST_CHECK_EQUAL(after.nFeeDelta, before.nFeeDelta);
+    }
+    BOOST_CHECK_EQUAL(mempool.info(child.GetHash()).nFeeDelta, 5000);
+
+    // Loading again finds them all there already
+    BOOST_REQUIRE(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 3U);
+
+    LOCK(cs_main);
+    mempool.check(pcoinsTip.get());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <chainparams.h>
 #include <consensus/validation.h>
 #include <key.h>
 #include <validation.h>
@@ -16,6 +17,7 @@
 #include <core_io.h>
 #include <keystore.h>
 #include <policy/policy.h>
+#include <pow.h>
 
 #include <boost/test/unit_test.hpp>
 
@@ -368,4 +370,188 @@ BOOST_FIXTURE_TEST_CASE(checkinputs_test, TestChain100Setup)
     }
 }
 
+
+BOOST_FIXTURE_TEST_CASE(pipelined_script_checks, TestChain100Setup)
+{
+    // Blocks connected as one run have the script checks of each block
+    // overlapped with connecting the next.
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const CChainParams& chainparams = Params();
+    CBlock blockA = CreateAndProcessBlock({}, scriptPubKey);
+    CBlock blockB = CreateAndProcessBlock({}, scriptPubKey);
+    CBlockIndex* pindexA = mapBlockIndex[blockA.GetHash()];
+
+    // Reconnecting valid blocks as a run ends at the same tip and UTXO set.
+    CValidationState state;
+    BOOST_CHECK(InvalidateBlock(state, chainparams, pindexA));
+    BOOST_CHECK(chainActive.Tip() == pindexA->pprev);
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(ResetBlockFailureFlags(pindexA));
+    }
+    BOOST_CHECK(ActivateBestChain(state, chainparams));
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == blockB.GetHash());
+    BOOST_CHECK(pcoinsTip->GetBestBlock() == blockB.GetHash());
+    BOOST_CHECK(chainActive.Tip()->IsValid(BLOCK_VALID_SCRIPTS));
+    BOOST_CHECK_EQUAL(chainActive.Tip()->nMoneySupply, pindexA->nMoneySupply + blockB.vtx[0]->GetValueOut());
+
+    // A run ending in a block with a bad signature stops at the block before it.
+    CBlock blockC = CreateAndProcessBlock({}, scriptPubKey);
+    CBlockIndex* pindexC = mapBlockIndex[blockC.GetHash()];
+
+    CMutableTransaction spend;
+    spend.nVersion = 1;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = COutPoint(coinbaseTxns[0].GetHash(), 0);
+    spend.vin[0].scriptSig << std::vector<unsigned char>(72, 1);
+    spend.vout.resize(1);
+    spend.vout[0].nValue = coinbaseTxns[0].vout[0].nValue - 1000;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+
+    std::unique_ptr<CBlockTemplate> pblocktemplate = BlockAssembler(chainparams).CreateNewBlock(scriptPubKey, ALGO_SHA256D);
+    CBlock& blockD = pblocktemplate->block;
+    blockD.vtx.resize(1);
+    blockD.vtx.push_back(MakeTransactionRef(spend));
+    unsigned int extraNonce = 0;
+    {
+        LOCK(cs_main);
+        IncrementExtraNonce(&blockD, pindexC, extraNonce);
+    }
+    while (!CheckProofOfWork(blockD.GetPoWHash(blockD.GetAlgo(), chainparams.GetConsensus()), blockD.GetAlgo(), blockD.nBits, chainparams.GetConsensus())) ++blockD.nNonce;
+
+    BOOST_CHECK(InvalidateBlock(state, chainparams, pindexC));
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(ResetBlockFailureFlags(pindexC));
+    }
+    ProcessNewBlock(chainparams, std::make_shared<const CBlock>(blockD), true, nullptr);
+
+    BOOST_CHECK(chainActive.Tip() == pindexC);
+    BOOST_CHECK(pcoinsTip->GetBestBlock() == blockC.GetHash());
+    BOOST_CHECK(mapBlockIndex[blockD.GetHash()]->nStatus & BLOCK_FAILED_VALID);
+    // Undo data is only written for blocks whose scripts verified.
+    BOOST_CHECK(!(mapBlockIndex[blockD.GetHash()]->nStatus & BLOCK_HAVE_UNDO));
+    BOOST_CHECK_EQUAL(mapBlockIndex[blockD.GetHash()]->nMoneySupply, 0);
+    BOOST_CHECK(pcoinsTip->HaveCoin(COutPoint(coinbaseTxns[0].GetHash(), 0)));
+}
+
+/** Spend the first output of txPrev, which pays to key, back to key */
+static CMutableTransaction CreateSpend(const CTransaction& txPrev, const CKey& key, CAmount nFee)
+{
+    CMutableTransaction spend;
+    spend.nVersion = 1;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = COutPoint(txPrev.GetHash(), 0);
+    spend.vout.resize(1);
+    spend.vout[0].nValue = txPrev.vout[0].nValue - nFee;
+    spend.vout[0].scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(txPrev.vout[0].scriptPubKey, spend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+    return spend;
+}
+
+BOOST_FIXTURE_TEST_CASE(reorg_resurrects_transactions, TestChain100Setup)
+{
+    // Blocks of a reorg more than one block deep are disconnected in a
+    // batch, and their transactions added back to the mempool in one pass.
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const CChainParams& chainparams = Params();
+    // Let the second coinbase mature.
+    CreateAndProcessBlock({}, scriptPubKey);
+    CreateAndProcessBlock({}, scriptPubKey);
+    const CBlockIndex* pindexFork = chainActive.Tip();
+
+    // The branch to reorg to spends the first coinbase.
+    CBlock blockA = CreateAndProcessBlock({CreateSpend(coinbaseTxns[0], coinbaseKey, CENT)}, scriptPubKey);
+    CreateAndProcessBlock({}, scriptPubKey);
+    CBlock blockC = CreateAndProcessBlock({}, scriptPubKey);
+    CBlockIndex* pindexA = mapBlockIndex[blockA.GetHash()];
+    CValidationState state;
+    BOOST_CHECK(InvalidateBlock(state, chainparams, pindexA));
+    BOOST_CHECK(chainActive.Tip() == pindexFork);
+
+    // The branch to reorg from double spends it, and spends the second
+    // coinbase. Both spends have a child in the next block.
+    CMutableTransaction conflicted = CreateSpend(coinbaseTxns[0], coinbaseKey, 2 * CENT);
+    CMutableTransaction conflictedChild = CreateSpend(conflicted, coinbaseKey, CENT);
+    CMutableTransaction resurrected = CreateSpend(coinbaseTxns[1], coinbaseKey, CENT);
+    CMutableTransaction resurrectedChild = CreateSpend(resurrected, coinbaseKey, CENT);
+    CreateAndProcessBlock({conflicted, resurrected}, scriptPubKey);
+    CreateAndProcessBlock({conflictedChild, resurrectedChild}, scriptPubKey);
+    BOOST_CHECK_EQUAL(chainActive.Height(), pindexFork->nHeight + 2);
+    BOOST_CHECK_EQUAL(mempool.size(), 0U);
+
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(ResetBlockFailureFlags(pindexA));
+    }
+    BOOST_CHECK(ActivateBestChain(state, chainparams));
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == blockC.GetHash());
+    BOOST_CHECK(pcoinsTip->GetBestBlock() == blockC.GetHash());
+
+    // The double spend and its child are dropped; the other spend and its
+    // child are back, with the child counted as its descendant.
+    BOOST_CHECK(!mempool.exists(conflicted.GetHash()));
+    BOOST_CHECK(!mempool.exists(conflictedChild.GetHash()));
+    BOOST_CHECK(mempool.exists(resurrected.GetHash()));
+    BOOST_CHECK(mempool.exists(resurrectedChild.GetHash()));
+    BOOST_CHECK_EQUAL(mempool.size(), 2U);
+    {
+        LOCK(mempool.cs);
+        BOOST_CHECK_EQUAL(mempool.mapTx.find(resurrected.GetHash())->GetCountWithDescendants(), 2U);
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(reorg_interrupted_batch, TestChain100Setup)
+{
+    // A batch of blocks to disconnect that fails part way leaves the chain,
+    // the coins and the mempool consistent at the last block still connected.
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const CChainParams& chainparams = Params();
+    CreateAndProcessBlock({}, scriptPubKey);
+    const CBlockIndex* pindexFork = chainActive.Tip();
+
+    CBlock blockA = CreateAndProcessBlock({}, scriptPubKey);
+    CreateAndProcessBlock({}, scriptPubKey);
+    CBlock blockC = CreateAndProcessBlock({}, scriptPubKey);
+    CBlockIndex* pindexA = mapBlockIndex[blockA.GetHash()];
+    CValidationState state;
+    BOOST_CHECK(InvalidateBlock(state, chainparams, pindexA));
+    BOOST_CHECK(chainActive.Tip() == pindexFork);
+
+    CMutableTransaction parent = CreateSpend(coinbaseTxns[0], coinbaseKey, CENT);
+    CMutableTransaction child = CreateSpend(parent, coinbaseKey, CENT);
+    CBlock blockX = CreateAndProcessBlock({parent}, scriptPubKey);
+    CBlock blockY = CreateAndProcessBlock({child}, scriptPubKey);
+    CBlockIndex* pindexX = mapBlockIndex[blockX.GetHash()];
+
+    // Without its undo data, X fails to disconnect after Y was.
+    {
+        LOCK(cs_main);
+        pindexX->nStatus &= ~BLOCK_HAVE_UNDO;
+        BOOST_CHECK(ResetBlockFailureFlags(pindexA));
+    }
+    BOOST_CHECK(!ActivateBestChain(state, chainparams));
+    BOOST_CHECK(chainActive.Tip() == pindexX);
+    BOOST_CHECK(pcoinsTip->GetBestBlock() == blockX.GetHash());
+    BOOST_CHECK(pcoinsTip->HaveCoin(COutPoint(parent.GetHash(), 0)));
+    BOOST_CHECK(!pcoinsTip->HaveCoin(COutPoint(child.GetHash(), 0)));
+    BOOST_CHECK_EQUAL(mempool.size(), 0U);
+
+    // With it back, the reorg completes from there.
+    {
+        LOCK(cs_main);
+        pindexX->nStatus |= BLOCK_HAVE_UNDO;
+    }
+    BOOST_CHECK(ActivateBestChain(state, chainparams));
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == blockC.GetHash());
+    BOOST_CHECK(pcoinsTip->GetBestBlock() == blockC.GetHash());
+    BOOST_CHECK(mempool.exists(parent.GetHash()));
+    BOOST_CHECK_EQUAL(mempool.size(), 1U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -18,6 +18,8 @@
 #include <utilmoneystr.h>
 #include <utiltime.h>
 
+#include <algorithm>
+
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
                                  int64_t _nTime, unsigned int _entryHeight,
                                  bool _spendsCoinbase, int64_t _sigOpsCost, LockPoints lp):
@@ -37,6 +39,10 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFe
     nSizeWithAncestors = GetTxSize();
     nModFeesWithAncestors = nFee;
     nSigOpCostWithAncestors = sigOpCost;
+
+    nClusterId = 0;
+    nChunkModFees = nFee;
+    nChunkSize = GetTxSize();
 }
 
 void CTxMemPoolEntry::UpdateFeeDelta(int64_t newFeeDelta)
@@ -61,15 +67,15 @@ size_t CTxMemPoolEntry::GetTxSize() const
 // descendants.
 void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendants, const std::set<uint256> &setExclude)
 {
-    setEntries stageEntries, setAllDescendants;
-    stageEntries = GetMemPoolChildren(updateIt);
+    const vecEntries &vUpdateChildren = GetMemPoolChildren(updateIt);
+    setEntries stageEntries(vUpdateChildren.begin(), vUpdateChildren.end()), setAllDescendants;
 
     while (!stageEntries.empty()) {
         const txiter cit = *stageEntries.begin();
         setAllDescendants.insert(cit);
         stageEntries.erase(cit);
-        const setEntries &setChildren = GetMemPoolChildren(cit);
-        for (const txiter childEntry : setChildren) {
+        const vecEntries &vChildren = GetMemPoolChildren(cit);
+        for (const txiter childEntry : vChildren) {
             cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
             if (cacheIt != cachedDescendants.end()) {
                 // We've already calculated this one, just add the entries for this set
@@ -109,6 +115,8 @@ void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendan
 void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashesToUpdate)
 {
     LOCK(cs);
+    // Descendant and ancestor state changes below
+    ++nSequence;
     // For each entry in vHashesToUpdate, store the set of in-mempool, but not
     // in-vHashesToUpdate transactions, so that we don't have to recalculate
     // descendants when we come across a previously seen entry.
@@ -143,6 +151,8 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
             if (setChildren.insert(childIter).second && !setAlreadyIncluded.count(childHash)) {
                 UpdateChild(it, childIter, true);
                 UpdateParent(childIter, it, true);
+                // The new link may join clusters
+                JoinClusters({it, childIter});
             }
         }
         UpdateForDescendants(it, mapMemPoolDescendantsToUpdate, setAlreadyIncluded);
@@ -174,7 +184,8 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // If we're not searching for parents, we require this to be an
         // entry in the mempool already.
         txiter it = mapTx.iterator_to(entry);
-        parentHashes = GetMemPoolParents(it);
+        const vecEntries &vParents = GetMemPoolParents(it);
+        parentHashes.insert(vParents.begin(), vParents.end());
     }
 
     size_t totalSizeWithAncestors = entry.GetTxSize();
@@ -197,8 +208,8 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
             return false;
         }
 
-        const setEntries & setMemPoolParents = GetMemPoolParents(stageit);
-        for (const txiter &phash : setMemPoolParents) {
+        const vecEntries & vMemPoolParents = GetMemPoolParents(stageit);
+        for (const txiter &phash : vMemPoolParents) {
             // If this is a new ancestor, add it.
             if (setAncestors.count(phash) == 0) {
                 parentHashes.insert(phash);
@@ -215,7 +226,7 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
 
 void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, setEntries &setAncestors)
 {
-    setEntries parentIters = GetMemPoolParents(it);
+    const vecEntries &parentIters = GetMemPoolParents(it);
     // add or remove this tx as a child of each parent
     for (txiter piter : parentIters) {
         UpdateChild(piter, it, add);
@@ -244,8 +255,8 @@ void CTxMemPool::UpdateEntryForAncestors(txiter it, const setEntries &setAncesto
 
 void CTxMemPool::UpdateChildrenForRemoval(txiter it)
 {
-    const setEntries &setMemPoolChildren = GetMemPoolChildren(it);
-    for (txiter updateIt : setMemPoolChildren) {
+    const vecEntries &vMemPoolChildren = GetMemPoolChildren(it);
+    for (txiter updateIt : vMemPoolChildren) {
         UpdateParent(updateIt, it, false);
     }
 }
@@ -328,8 +339,32 @@ void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee,
     assert(int(nSigOpCostWithAncestors) >= 0);
 }
 
+const CAmount MEMPOOL_FEE_HISTOGRAM_BOUNDS[MEMPOOL_FEE_HISTOGRAM_BUCKETS] = {
+    0, 1000, 2000, 3000, 4000, 5000, 6000, 7000, 8000, 10000, 12000, 14000, 17000, 20000, 25000,
+    30000, 40000, 50000, 60000, 70000, 80000, 100000, 120000, 140000, 170000, 200000, 250000, 300000,
+    400000, 500000, 600000, 700000, 800000, 1000000, 1200000, 1400000, 1700000, 2000000, 2500000,
+    3000000, 4000000, 5000000, 6000000, 7000000, 8000000, 10000000
+};
+
+/** Add (nSign = 1) or remove (nSign = -1) an entry from a feerate histogram */
+static void UpdateFeeHistogram(MempoolFeeHistogram& histogram, const CTxMemPoolEntry& entry, int nSign)
+{
+    const CAmount nFeePerK = CFeeRate(entry.GetModifiedFee(), entry.GetTxSize()).GetFeePerK();
+    const CAmount* pBound = std::upper_bound(MEMPOOL_FEE_HISTOGRAM_BOUNDS, MEMPOOL_FEE_HISTOGRAM_BOUNDS + MEMPOOL_FEE_HISTOGRAM_BUCKETS, nFeePerK);
+    MempoolFeeHistogramBucket& bucket = histogram[pBound == MEMPOOL_FEE_HISTOGRAM_BOUNDS ? 0 : pBound - MEMPOOL_FEE_HISTOGRAM_BOUNDS - 1];
+    bucket.nCount += nSign;
+    bucket.nSize += nSign * int64_t(entry.GetTxSize());
+    bucket.nFees += nSign * entry.GetModifiedFee();
+}
+
 CTxMemPool::CTxMemPool(CBlockPolicyEstimator* estimator) :
-    nTransactionsUpdated(0), minerPolicyEstimator(estimator)
+    nTransactionsUpdated(0), minerPolicyEstimator(estimator), nSequence(0), nChangesFrom(0),
+    mapTx(indexed_transaction_set::ctor_args_list(), indexed_transaction_set::allocator_type(&nodeArena)),
+    mapClusters(clusterMap::key_compare(), clusterMap::allocator_type(&nodeArena)),
+    setClustersByWorstChunk(decltype(setClustersByWorstChunk)::key_compare(), decltype(setClustersByWorstChunk)::allocator_type(&nodeArena)),
+    setDirtyClusters(decltype(setDirtyClusters)::key_compare(), decltype(setDirtyClusters)::allocator_type(&nodeArena)),
+    nLastClusterId(0),
+    mapNextTx(decltype(mapNextTx)::allocator_type(&nodeArena))
 {
     _clear(); //lock free clear
 
@@ -359,13 +394,14 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
 
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, setEntries &setAncestors, bool validFeeEstimate)
 {
-    NotifyEntryAdded(entry.GetSharedTx());
     // Add to memory pool without checking anything.
     // Used by AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
     indexed_transaction_set::iterator newit = mapTx.insert(entry).first;
-    mapLinks.insert(make_pair(newit, TxLinks()));
+    vTxHashes.emplace_back(entry.GetTx().GetWitnessHash(), newit);
+    vTxLinks.emplace_back();
+    newit->vTxHashesIdx = vTxHashes.size() - 1;
 
     // Update transaction for any feeDelta created by PrioritiseTransaction
     // TODO: refactor so that the fee delta is calculated before inserting
@@ -377,6 +413,7 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
             mapTx.modify(newit, update_fee_delta(delta));
         }
     }
+    UpdateFeeHistogram(feeHistogram, *newit, 1);
 
     // Update cachedInnerUsage to include contained transaction's usage.
     // (When we update the entry for in-mempool parents, memory usage will be
@@ -397,48 +434,67 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     // to clean up the mess we're leaving here.
 
     // Update ancestors with information about this tx
+    std::vector<txiter> vJoined{newit};
     for (const uint256 &phash : setParentTransactions) {
         txiter pit = mapTx.find(phash);
         if (pit != mapTx.end()) {
             UpdateParent(newit, pit, true);
+            vJoined.push_back(pit);
         }
     }
     UpdateAncestorsOf(true, newit, setAncestors);
     UpdateEntryForAncestors(newit, setAncestors);
+    // The new entry joins the clusters of its parents together
+    JoinClusters(vJoined);
 
     nTransactionsUpdated++;
     totalTxSize += entry.GetTxSize();
     if (minerPolicyEstimator) {minerPolicyEstimator->processTransaction(entry, validFeeEstimate);}
+    LogChange(hash, true);
 
-    vTxHashes.emplace_back(tx.GetWitnessHash(), newit);
-    newit->vTxHashesIdx = vTxHashes.size() - 1;
-
+    // Notify once the entry and its ancestor state are in place
+    NotifyEntryAdded(entry.GetSharedTx());
     return true;
 }
 
 void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
 {
-    NotifyEntryRemoved(it->GetSharedTx(), reason);
+    const CTransactionRef ptx = it->GetSharedTx();
     const uint256 hash = it->GetTx().GetHash();
     for (const CTxIn& txin : it->GetTx().vin)
         mapNextTx.erase(txin.prevout);
 
+    TxLinks& links = vTxLinks[it->vTxHashesIdx];
+    cachedInnerUsage -= memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
     if (vTxHashes.size() > 1) {
         vTxHashes[it->vTxHashesIdx] = std::move(vTxHashes.back());
         vTxHashes[it->vTxHashesIdx].second->vTxHashesIdx = it->vTxHashesIdx;
         vTxHashes.pop_back();
-        if (vTxHashes.size() * 2 < vTxHashes.capacity())
+        links = std::move(vTxLinks.back());
+        vTxLinks.pop_back();
+        if (vTxHashes.size() * 2 < vTxHashes.capacity()) {
             vTxHashes.shrink_to_fit();
-    } else
+            vTxLinks.shrink_to_fit();
+        }
+    } else {
         vTxHashes.clear();
+        vTxLinks.clear();
+    }
 
     totalTxSize -= it->GetTxSize();
     cachedInnerUsage -= it->DynamicMemoryUsage();
-    cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
-    mapLinks.erase(it);
+    UpdateFeeHistogram(feeHistogram, *it, -1);
+    // The last snapshot keeps sharing its other entries with the next one;
+    // the transaction it keeps alive is counted with it from now on.
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot = std::atomic_load(&lastSnapshot);
+    if (snapshot && snapshot->Find(hash)) {
+        nSnapshotRetainedUsage += it->DynamicMemoryUsage();
+    }
     mapTx.erase(it);
     nTransactionsUpdated++;
+    LogChange(hash, false);
     if (minerPolicyEstimator) {minerPolicyEstimator->removeTx(hash, false);}
+    NotifyEntryRemoved(ptx, reason);
 }
 
 // Calculates descendants of entry that are not already in setDescendants, and adds to
@@ -461,8 +517,8 @@ void CTxMemPool::CalculateDescendants(txiter entryit, setEntries &setDescendants
         setDescendants.insert(it);
         stage.erase(it);
 
-        const setEntries &setChildren = GetMemPoolChildren(it);
-        for (const txiter &childiter : setChildren) {
+        const vecEntries &vChildren = GetMemPoolChildren(it);
+        for (const txiter &childiter : vChildren) {
             if (!setDescendants.count(childiter)) {
                 stage.insert(childiter);
             }
@@ -470,6 +526,21 @@ void CTxMemPool::CalculateDescendants(txiter entryit, setEntries &setDescendants
     }
 }
 
+uint64_t CTxMemPool::CalculateClusterCount(const setEntries &setAncestors) const
+{
+    LOCK(cs);
+    // The clusters of the ancestors are those of the parents, which the
+    // entry would join together
+    std::set<uint64_t> setClusters;
+    uint64_t nCount = 1;
+    for (const txiter it : setAncestors) {
+        if (setClusters.insert(it->nClusterId).second) {
+            nCount += mapClusters.at(it->nClusterId).vTxs.size();
+        }
+    }
+    return nCount;
+}
+
 void CTxMemPool::removeRecursive(const CTransaction &origTx, MemPoolRemovalReason reason)
 {
     // Remove transaction from memory pool
@@ -590,15 +661,27 @@ void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigne
 
 void CTxMemPool::_clear()
 {
-    mapLinks.clear();
+    mapClusters.clear();
+    setClustersByWorstChunk.clear();
+    setDirtyClusters.clear();
+    vTxLinks.clear();
+    vTxLinks.shrink_to_fit();
+    vTxHashes.clear();
+    vTxHashes.shrink_to_fit();
     mapTx.clear();
     mapNextTx.clear();
     totalTxSize = 0;
     cachedInnerUsage = 0;
+    feeHistogram = MempoolFeeHistogram();
+    std::atomic_store(&lastSnapshot, std::shared_ptr<const CTxMemPoolSnapshot>());
+    nSnapshotRetainedUsage = 0;
     lastRollingFeeUpdate = GetTime();
     blockSinceLastRollingFeeBump = false;
     rollingMinimumFeeRate = 0;
     ++nTransactionsUpdated;
+    ++nSequence;
+    dequeChanges.clear();
+    nChangesFrom = nSequence;
 }
 
 void CTxMemPool::clear()
@@ -628,6 +711,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
     uint64_t checkTotal = 0;
     uint64_t innerUsage = 0;
+    MempoolFeeHistogram checkHistogram;
 
     CCoinsViewCache mempoolDuplicate(const_cast<CCoinsViewCache*>(pcoins));
     const int64_t spendheight = GetSpendHeight(mempoolDuplicate);
@@ -638,10 +722,10 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
         unsigned int i = 0;
         checkTotal += it->GetTxSize();
         innerUsage += it->DynamicMemoryUsage();
+        UpdateFeeHistogram(checkHistogram, *it, 1);
         const CTransaction& tx = it->GetTx();
-        txlinksMap::const_iterator linksiter = mapLinks.find(it);
-        assert(linksiter != mapLinks.end());
-        const TxLinks &links = linksiter->second;
+        const TxLinks &links = vTxLinks[it->vTxHashesIdx];
+        assert(vTxHashes[it->vTxHashesIdx].second == it);
         innerUsage += memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
         bool fDependsWait = false;
         setEntries setParentCheck;
@@ -668,7 +752,9 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             assert(it3->second == &tx);
             i++;
         }
-        assert(setParentCheck == GetMemPoolParents(it));
+        const vecEntries &vParents = GetMemPoolParents(it);
+        assert(vParents.size() == setParentCheck.size());
+        assert(setParentCheck == setEntries(vParents.begin(), vParents.end()));
         // Verify ancestor state is correct.
         setEntries setAncestors;
         uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
@@ -701,7 +787,9 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                 childSizes += childit->GetTxSize();
             }
         }
-        assert(setChildrenCheck == GetMemPoolChildren(it));
+        const vecEntries &vChildren = GetMemPoolChildren(it);
+        assert(vChildren.size() == setChildrenCheck.size());
+        assert(setChildrenCheck == setEntries(vChildren.begin(), vChildren.end()));
         // Also check to make sure size is greater than sum with immediate children.
         // just a sanity check, not definitive that this calc is correct...
         assert(it->GetSizeWithDescendants() >= childSizes + it->GetTxSize());
@@ -734,8 +822,58 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
         assert(&tx == it->second);
     }
 
+    // Every entry is in the cluster it names, which has its parents and
+    // children too. Unless the cluster is dirty, the entry comes after its
+    // parents, with the fees and size of its chunk.
+    uint64_t nClusterTxs = 0;
+    for (const auto& item : mapClusters) {
+        const TxCluster& cluster = item.second;
+        assert(!cluster.vTxs.empty());
+        for (const txiter it : cluster.vTxs) {
+            assert(it->nClusterId == item.first);
+            for (const txiter link : GetMemPoolParents(it)) {
+                assert(link->nClusterId == item.first);
+            }
+            for (const txiter link : GetMemPoolChildren(it)) {
+                assert(link->nClusterId == item.first);
+            }
+        }
+        nClusterTxs += cluster.vTxs.size();
+        innerUsage += memusage::DynamicUsage(cluster.vTxs) + memusage::DynamicUsage(cluster.vChunks);
+        if (setDirtyClusters.count(item.first)) {
+            assert(cluster.vChunks.empty());
+            continue;
+        }
+        assert(!cluster.vChunks.empty());
+        assert(setClustersByWorstChunk.count(std::make_pair(cluster.vChunks.back(), item.first)));
+        setEntries setTaken;
+        size_t nPos = 0;
+        for (size_t i = 0; i < cluster.vChunks.size(); i++) {
+            const ClusterChunk& chunk = cluster.vChunks[i];
+            assert(i == 0 || !FeeRateLess(cluster.vChunks[i - 1], chunk));
+            CAmount nChunkFees = 0;
+            int64_t nChunkSize = 0;
+            for (uint32_t j = 0; j < chunk.nTxCount; j++) {
+                assert(nPos < cluster.vTxs.size());
+                const txiter it = cluster.vTxs[nPos++];
+                assert(it->nChunkModFees == chunk.nFee && it->nChunkSize == chunk.nSize);
+                for (const txiter parent : GetMemPoolParents(it)) {
+                    assert(setTaken.count(parent));
+                }
+                setTaken.insert(it);
+                nChunkFees += it->GetModifiedFee();
+                nChunkSize += it->GetTxSize();
+            }
+            assert(nChunkFees == chunk.nFee && nChunkSize == chunk.nSize);
+        }
+        assert(nPos == cluster.vTxs.size());
+    }
+    assert(nClusterTxs == mapTx.size());
+    assert(setClustersByWorstChunk.size() + setDirtyClusters.size() == mapClusters.size());
+
     assert(totalTxSize == checkTotal);
     assert(innerUsage == cachedInnerUsage);
+    assert(feeHistogram == checkHistogram);
 }
 
 bool CTxMemPool::CompareDepthAndScore(const uint256& hasha, const uint256& hashb)
@@ -832,6 +970,164 @@ TxMempoolInfo CTxMemPool::info(const uint256& hash) const
     return GetInfo(i);
 }
 
+typedef std::vector<std::shared_ptr<const CTxMemPoolEntryInfo>> vecEntryInfos;
+
+static vecEntryInfos::const_iterator FindEntryInfo(const vecEntryInfos& vEntries, const uint256& txid)
+{
+    vecEntryInfos::const_iterator it = std::lower_bound(vEntries.begin(), vEntries.end(), txid,
+        [](const std::shared_ptr<const CTxMemPoolEntryInfo>& info, const uint256& hash) { return info->tx->GetHash() < hash; });
+    if (it != vEntries.end() && (*it)->tx->GetHash() == txid) {
+        return it;
+    }
+    return vEntries.end();
+}
+
+const CTxMemPoolEntryInfo* CTxMemPoolSnapshot::Find(const uint256& txid) const
+{
+    vecEntryInfos::const_iterator it = FindEntryInfo(vEntries, txid);
+    return it == vEntries.end() ? nullptr : it->get();
+}
+
+std::shared_ptr<const CTxMemPoolEntryInfo> CTxMemPool::GetEntryInfo(txiter it) const
+{
+    AssertLockHeld(cs);
+    return MakeEntryInfo(it, std::atomic_load(&lastSnapshot).get());
+}
+
+std::shared_ptr<const CTxMemPoolEntryInfo> CTxMemPool::MakeEntryInfo(txiter it, const CTxMemPoolSnapshot* prev) const
+{
+    const vecEntries& vParents = GetMemPoolParents(it);
+
+    // An entry whose transaction, fees, ancestors and descendants are what
+    // they were in the previous snapshot is shown the same.
+    if (prev) {
+        vecEntryInfos::const_iterator previt = FindEntryInfo(prev->vEntries, it->GetTx().GetHash());
+        if (previt != prev->vEntries.end()) {
+            const CTxMemPoolEntryInfo& info = **previt;
+            if (info.tx == it->GetSharedTx() && info.nModifiedFee == it->GetModifiedFee() &&
+                info.nCountWithDescendants == it->GetCountWithDescendants() &&
+                info.nSizeWithDescendants == it->GetSizeWithDescendants() &&
+                info.nModFeesWithDescendants == it->GetModFeesWithDescendants() &&
+                info.nCountWithAncestors == it->GetCountWithAncestors() &&
+                info.nSizeWithAncestors == it->GetSizeWithAncestors() &&
+                info.nModFeesWithAncestors == it->GetModFeesWithAncestors() &&
+                info.vDepends.size() == vParents.size()) {
+                return *previt;
+            }
+        }
+    }
+
+    std::shared_ptr<CTxMemPoolEntryInfo> info = std::make_shared<CTxMemPoolEntryInfo>();
+    info->tx = it->GetSharedTx();
+    info->wtxid = vTxHashes[it->vTxHashesIdx].first;
+    info->nFee = it->GetFee();
+    info->nModifiedFee = it->GetModifiedFee();
+    info->nTime = it->GetTime();
+    info->nHeight = it->GetHeight();
+    info->nTxSize = it->GetTxSize();
+    info->nCountWithDescendants = it->GetCountWithDescendants();
+    info->nSizeWithDescendants = it->GetSizeWithDescendants();
+    info->nModFeesWithDescendants = it->GetModFeesWithDescendants();
+    info->nCountWithAncestors = it->GetCountWithAncestors();
+    info->nSizeWithAncestors = it->GetSizeWithAncestors();
+    info->nModFeesWithAncestors = it->GetModFeesWithAncestors();
+    info->vDepends.reserve(vParents.size());
+    for (txiter parent : vParents) {
+        info->vDepends.push_back(parent->GetTx().GetHash());
+    }
+    std::sort(info->vDepends.begin(), info->vDepends.end());
+    return info;
+}
+
+std::shared_ptr<const CTxMemPoolSnapshot> CTxMemPool::GetSnapshot() const
+{
+    std::shared_ptr<CTxMemPoolSnapshot> snapshot = std::make_shared<CTxMemPoolSnapshot>();
+    {
+        LOCK(cs);
+        std::shared_ptr<const CTxMemPoolSnapshot> prev = std::atomic_load(&lastSnapshot);
+        if (prev && prev->nSequence == nSequence) {
+            return prev;
+        }
+        snapshot->nSequence = nSequence;
+        snapshot->vEntries.reserve(mapTx.size());
+        for (txiter it = mapTx.begin(); it != mapTx.end(); ++it) {
+            snapshot->vEntries.push_back(MakeEntryInfo(it, prev.get()));
+        }
+    }
+    std::sort(snapshot->vEntries.begin(), snapshot->vEntries.end(),
+        [](const std::shared_ptr<const CTxMemPoolEntryInfo>& a, const std::shared_ptr<const CTxMemPoolEntryInfo>& b) { return a->tx->GetHash() < b->tx->GetHash(); });
+    snapshot->nUsage = memusage::MallocUsage(sizeof(CTxMemPoolSnapshot)) + memusage::DynamicUsage(snapshot->vEntries);
+    for (const std::shared_ptr<const CTxMemPoolEntryInfo>& info : snapshot->vEntries) {
+        snapshot->nUsage += memusage::DynamicUsage(info) + memusage::DynamicUsage(info->vDepends);
+    }
+
+    // Keep it for the next one to share entries with, unless the mempool
+    // changed meanwhile, as the transactions it keeps alive after they left
+    // are only counted for the snapshot kept.
+    std::shared_ptr<const CTxMemPoolSnapshot> result(std::move(snapshot));
+    LOCK(cs);
+    if (result->nSequence == nSequence) {
+        std::atomic_store(&lastSnapshot, result);
+        nSnapshotRetainedUsage = 0;
+    }
+    return result;
+}
+
+bool CTxMemPool::GetEntryChangesSince(uint64_t nSince, uint64_t& nUntil, std::vector<std::shared_ptr<const CTxMemPoolEntryInfo>>& vAdded, std::vector<uint256>& vRemoved) const
+{
+    LOCK(cs);
+    nUntil = nSequence;
+    std::vector<uint256> vAddedTxid;
+    if (!GetChangesSince(nSince, nUntil, vAddedTxid, vRemoved)) {
+        return false;
+    }
+    vAdded.reserve(vAddedTxid.size());
+    for (const uint256& txid : vAddedTxid) {
+        // Added after nSince and not removed since, so it is in the mempool
+        txiter it = mapTx.find(txid);
+        assert(it != mapTx.end());
+        vAdded.push_back(GetEntryInfo(it));
+    }
+    return true;
+}
+
+void CTxMemPool::LogChange(const uint256& txid, bool fAdded)
+{
+    ++nSequence;
+    dequeChanges.push_back(Change{nSequence, txid, fAdded});
+    if (dequeChanges.size() > MEMPOOL_CHANGE_LOG_SIZE) {
+        nChangesFrom = dequeChanges.front().nSequence;
+        dequeChanges.pop_front();
+    }
+}
+
+bool CTxMemPool::GetChangesSince(uint64_t nSince, uint64_t nUntil, std::vector<uint256>& vAdded, std::vector<uint256>& vRemoved) const
+{
+    LOCK(cs);
+    if (nSince < nChangesFrom) {
+        return false;
+    }
+
+    // Whether each transaction was in the mempool before its first change
+    // and after its last one
+    std::map<uint256, std::pair<bool, bool>> mapWasIsIn;
+    std::deque<Change>::const_iterator it = std::upper_bound(dequeChanges.begin(), dequeChanges.end(), nSince,
+        [](uint64_t nSequenceIn, const Change& change) { return nSequenceIn < change.nSequence; });
+    for (; it != dequeChanges.end() && it->nSequence <= nUntil; ++it) {
+        auto inserted = mapWasIsIn.emplace(it->txid, std::make_pair(!it->fAdded, it->fAdded));
+        inserted.first->second.second = it->fAdded;
+    }
+    for (const auto& item : mapWasIsIn) {
+        if (item.second.first) {
+            vRemoved.push_back(item.first);
+        }
+        if (item.second.second) {
+            vAdded.push_back(item.first);
+        }
+    }
+    return true;
+}
+
 void CTxMemPool::PrioritiseTransaction(const uint256& hash, const CAmount& nFeeDelta)
 {
     {
@@ -840,7 +1136,9 @@ void CTxMemPool::PrioritiseTransaction(const uint256& hash, const CAmount& nFeeD
         delta += nFeeDelta;
         txiter it = mapTx.find(hash);
         if (it != mapTx.end()) {
+            UpdateFeeHistogram(feeHistogram, *it, -1);
             mapTx.modify(it, update_fee_delta(delta));
+            UpdateFeeHistogram(feeHistogram, *it, 1);
             // Now update all ancestors' modified fees with descendants
             setEntries setAncestors;
             uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
@@ -856,7 +1154,9 @@ void CTxMemPool::PrioritiseTransaction(const uint256& hash, const CAmount& nFeeD
             for (txiter descendantIt : setDescendants) {
                 mapTx.modify(descendantIt, update_ancestor_state(0, nFeeDelta, 0, 0));
             }
+            MarkClusterDirty(mapClusters.find(it->nClusterId));
             ++nTransactionsUpdated;
+            ++nSequence;
         }
     }
     LogPrintf("PrioritiseTransaction: %s feerate += %s\n", hash.ToString(), FormatMoney(nFeeDelta));
@@ -906,12 +1206,22 @@ bool CCoinsViewMemPool::GetCoin(const COutPoint &outpoint, Coin &coin) const {
 
 size_t CTxMemPool::DynamicMemoryUsage() const {
     LOCK(cs);
-    // Estimate the overhead of mapTx to be 12 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
+    // The nodes of mapTx and mapNextTx come from nodeArena, which knows their
+    // exact size and releases chunks once they are empty, so only the partly
+    // used chunk of each node size goes uncounted. The hashed index of mapTx
+    // adds its bucket array.
+    return nodeArena.UsedBytes() + memusage::MallocUsage(sizeof(void*) * mapTx.bucket_count()) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(vTxLinks) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
+}
+
+size_t CTxMemPool::SnapshotMemoryUsage() const {
+    LOCK(cs);
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot = std::atomic_load(&lastSnapshot);
+    return (snapshot ? snapshot->nUsage : 0) + nSnapshotRetainedUsage;
 }
 
 void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants, MemPoolRemovalReason reason) {
     AssertLockHeld(cs);
+    SplitClusters(stage);
     UpdateForRemoveFromMempool(stage, updateDescendants);
     for (const txiter& it : stage) {
         removeUnchecked(it, reason);
@@ -944,40 +1254,237 @@ bool CTxMemPool::addUnchecked(const uint256&hash, const CTxMemPoolEntry &entry,
     return addUnchecked(hash, entry, setAncestors, validFeeEstimate);
 }
 
-void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+void CTxMemPool::UpdateLink(vecEntries &links, txiter link, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].children.insert(child).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].children.erase(child)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    // Links are few per entry, so a linear scan beats a tree of nodes.
+    // A list that becomes empty gives its memory back, so that the usage of
+    // an entry does not depend on the links it had before.
+    vecEntries::iterator pos = std::find(links.begin(), links.end(), link);
+    const size_t nUsageBefore = memusage::DynamicUsage(links);
+    if (add && pos == links.end()) {
+        links.push_back(link);
+    } else if (!add && pos != links.end()) {
+        *pos = links.back();
+        links.pop_back();
+        if (links.empty()) {
+            vecEntries().swap(links);
+        }
+    } else {
+        return;
     }
+    cachedInnerUsage += memusage::DynamicUsage(links);
+    cachedInnerUsage -= nUsageBefore;
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+{
+    UpdateLink(vTxLinks[entry->vTxHashesIdx].children, child, add);
 }
 
 void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].parents.insert(parent).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].parents.erase(parent)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
-    }
+    UpdateLink(vTxLinks[entry->vTxHashesIdx].parents, parent, add);
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
+const CTxMemPool::vecEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
 {
     assert (entry != mapTx.end());
-    txlinksMap::const_iterator it = mapLinks.find(entry);
-    assert(it != mapLinks.end());
-    return it->second.parents;
+    assert (entry->vTxHashesIdx < vTxLinks.size());
+    return vTxLinks[entry->vTxHashesIdx].parents;
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
+const CTxMemPool::vecEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
 {
     assert (entry != mapTx.end());
-    txlinksMap::const_iterator it = mapLinks.find(entry);
-    assert(it != mapLinks.end());
-    return it->second.children;
+    assert (entry->vTxHashesIdx < vTxLinks.size());
+    return vTxLinks[entry->vTxHashesIdx].children;
+}
+
+void CTxMemPool::JoinClusters(const std::vector<txiter>& vEntries)
+{
+    // Keep the largest cluster and move the entries of the others into it, so
+    // that an entry moves O(log n) times while its cluster grows to n entries.
+    // Of clusters of the same size the oldest is kept.
+    clusterMap::iterator itTarget = mapClusters.end();
+    for (const txiter it : vEntries) {
+        if (it->nClusterId == 0) continue;
+        const clusterMap::iterator itCluster = mapClusters.find(it->nClusterId);
+        if (itTarget == mapClusters.end() || itCluster->second.vTxs.size() > itTarget->second.vTxs.size() ||
+            (itCluster->second.vTxs.size() == itTarget->second.vTxs.size() && itCluster->first < itTarget->first)) {
+            itTarget = itCluster;
+        }
+    }
+    if (itTarget == mapClusters.end()) {
+        itTarget = mapClusters.emplace(++nLastClusterId, TxCluster()).first;
+        setDirtyClusters.insert(itTarget->first);
+    } else {
+        MarkClusterDirty(itTarget);
+    }
+
+    const uint64_t nClusterId = itTarget->first;
+    std::vector<txiter>& vTxs = itTarget->second.vTxs;
+    cachedInnerUsage -= memusage::DynamicUsage(vTxs);
+    for (const txiter it : vEntries) {
+        if (it->nClusterId == nClusterId) continue;
+        if (it->nClusterId == 0) {
+            it->nClusterId = nClusterId;
+            vTxs.push_back(it);
+            continue;
+        }
+        const clusterMap::iterator itCluster = mapClusters.find(it->nClusterId);
+        for (const txiter member : itCluster->second.vTxs) {
+            member->nClusterId = nClusterId;
+            vTxs.push_back(member);
+        }
+        RemoveCluster(itCluster);
+    }
+    cachedInnerUsage += memusage::DynamicUsage(vTxs);
+}
+
+void CTxMemPool::SplitClusters(const setEntries& stage)
+{
+    // The entries that stay behind next to the removed ones, by cluster. Any
+    // part a cluster falls apart into has one of them.
+    std::map<uint64_t, setEntries> mapNeighbours;
+    for (const txiter it : stage) {
+        setEntries& setNeighbours = mapNeighbours[it->nClusterId];
+        const TxLinks& links = vTxLinks[it->vTxHashesIdx];
+        for (const vecEntries* pLinks : {&links.parents, &links.children}) {
+            for (const txiter link : *pLinks) {
+                if (!stage.count(link)) setNeighbours.insert(link);
+            }
+        }
+    }
+
+    for (const auto& item : mapNeighbours) {
+        const clusterMap::iterator itCluster = mapClusters.find(item.first);
+        const setEntries& setNeighbours = item.second;
+        if (setNeighbours.empty()) {
+            // Nothing stays behind, or only entries that were not connected
+            // to the removed ones, which a cluster cannot have
+            RemoveCluster(itCluster);
+            continue;
+        }
+        MarkClusterDirty(itCluster);
+
+        // Number the parts the rest of the cluster falls apart into, walking
+        // from the neighbours. With one neighbour there is only one part.
+        std::map<txiter, size_t, CompareIteratorByHash> mapPart;
+        size_t nParts = 0;
+        if (setNeighbours.size() > 1) {
+            for (const txiter seed : setNeighbours) {
+                if (!mapPart.emplace(seed, nParts).second) continue;
+                std::vector<txiter> vWalk{seed};
+                while (!vWalk.empty()) {
+                    const TxLinks& links = vTxLinks[vWalk.back()->vTxHashesIdx];
+                    vWalk.pop_back();
+                    for (const vecEntries* pLinks : {&links.parents, &links.children}) {
+                        for (const txiter link : *pLinks) {
+                            if (!stage.count(link) && mapPart.emplace(link, nParts).second) vWalk.push_back(link);
+                        }
+                    }
+                }
+                ++nParts;
+            }
+        }
+
+        // The first part keeps the cluster; the others get new ones. The
+        // entries stay in the order they had.
+        std::vector<std::vector<txiter>> vParts(std::max<size_t>(nParts, 1));
+        for (const txiter it : itCluster->second.vTxs) {
+            if (stage.count(it)) continue;
+            vParts[nParts > 1 ? mapPart.at(it) : 0].push_back(it);
+        }
+        cachedInnerUsage -= memusage::DynamicUsage(itCluster->second.vTxs);
+        itCluster->second.vTxs = std::move(vParts[0]);
+        cachedInnerUsage += memusage::DynamicUsage(itCluster->second.vTxs);
+        for (size_t i = 1; i < vParts.size(); i++) {
+            const uint64_t nClusterId = ++nLastClusterId;
+            TxCluster& cluster = mapClusters[nClusterId];
+            for (const txiter it : vParts[i]) {
+                it->nClusterId = nClusterId;
+            }
+            cluster.vTxs = std::move(vParts[i]);
+            cachedInnerUsage += memusage::DynamicUsage(cluster.vTxs);
+            setDirtyClusters.insert(nClusterId);
+        }
+    }
+}
+
+void CTxMemPool::MarkClusterDirty(clusterMap::iterator it)
+{
+    if (!setDirtyClusters.insert(it->first).second) return;
+    TxCluster& cluster = it->second;
+    setClustersByWorstChunk.erase(std::make_pair(cluster.vChunks.back(), it->first));
+    cachedInnerUsage -= memusage::DynamicUsage(cluster.vChunks);
+    std::vector<ClusterChunk>().swap(cluster.vChunks);
+}
+
+void CTxMemPool::UpdateLinearization(clusterMap::iterator it)
+{
+    const uint64_t nClusterId = it->first;
+    TxCluster& cluster = it->second;
+    const std::vector<txiter> vEntries = std::move(cluster.vTxs);
+
+    std::map<txiter, uint32_t, CompareIteratorByHash> mapPos;
+    for (uint32_t i = 0; i < vEntries.size(); i++) {
+        mapPos.emplace(vEntries[i], i);
+    }
+    std::vector<ClusterTx> vTxs(vEntries.size());
+    for (uint32_t i = 0; i < vEntries.size(); i++) {
+        vTxs[i].nFee = vEntries[i]->GetModifiedFee();
+        vTxs[i].nSize = vEntries[i]->GetTxSize();
+        for (const txiter parent : GetMemPoolParents(vEntries[i])) {
+            vTxs[i].vParents.push_back(mapPos.at(parent));
+        }
+    }
+    const std::vector<uint32_t> vOrder = LinearizeCluster(vTxs);
+
+    cluster.vTxs.reserve(vOrder.size());
+    for (uint32_t nPos : vOrder) {
+        cluster.vTxs.push_back(vEntries[nPos]);
+    }
+    cluster.vChunks = ChunkLinearization(vTxs, vOrder);
+    cluster.vChunks.shrink_to_fit();
+
+    size_t nPos = 0;
+    for (const ClusterChunk& chunk : cluster.vChunks) {
+        for (uint32_t i = 0; i < chunk.nTxCount; i++) {
+            const txiter entry = cluster.vTxs[nPos++];
+            entry->nChunkModFees = chunk.nFee;
+            entry->nChunkSize = chunk.nSize;
+        }
+    }
+    setClustersByWorstChunk.emplace(cluster.vChunks.back(), nClusterId);
+    cachedInnerUsage += memusage::DynamicUsage(cluster.vTxs) + memusage::DynamicUsage(cluster.vChunks) - memusage::DynamicUsage(vEntries);
+    setDirtyClusters.erase(nClusterId);
+}
+
+void CTxMemPool::LinearizeDirtyClusters()
+{
+    AssertLockHeld(cs);
+    while (!setDirtyClusters.empty()) {
+        UpdateLinearization(mapClusters.find(*setDirtyClusters.begin()));
+    }
+}
+
+CFeeRate CTxMemPool::GetChunkFeeRate(txiter it)
+{
+    AssertLockHeld(cs);
+    if (setDirtyClusters.count(it->nClusterId)) {
+        UpdateLinearization(mapClusters.find(it->nClusterId));
+    }
+    return CFeeRate(it->nChunkModFees, it->nChunkSize);
+}
+
+void CTxMemPool::RemoveCluster(clusterMap::iterator it)
+{
+    const TxCluster& cluster = it->second;
+    if (!setDirtyClusters.erase(it->first)) {
+        setClustersByWorstChunk.erase(std::make_pair(cluster.vChunks.back(), it->first));
+    }
+    cachedInnerUsage -= memusage::DynamicUsage(cluster.vTxs) + memusage::DynamicUsage(cluster.vChunks);
+    mapClusters.erase(it);
 }
 
 CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const {
@@ -1018,19 +1525,23 @@ void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpends
     unsigned nTxnRemoved = 0;
     CFeeRate maxFeeRateRemoved(0);
     while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
-        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+        LinearizeDirtyClusters();
+        // The last chunk of a cluster is the one a miner takes last, and as
+        // the linearization puts children after their parents, it has all
+        // in-mempool descendants of its entries.
+        const TxCluster& cluster = mapClusters.at(setClustersByWorstChunk.begin()->second);
+        const ClusterChunk& chunk = cluster.vChunks.back();
 
         // We set the new mempool min fee to the feerate of the removed set, plus the
         // "minimum reasonable fee rate" (ie some value under which we consider txn
         // to have 0 fee). This way, we don't allow txn to enter mempool with feerate
         // equal to txn which were removed with no block in between.
-        CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
+        CFeeRate removed(chunk.nFee, chunk.nSize);
         removed += incrementalRelayFee;
         trackPackageRemoved(removed);
         maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
 
-        setEntries stage;
-        CalculateDescendants(mapTx.project<0>(it), stage);
+        setEntries stage(cluster.vTxs.end() - chunk.nTxCount, cluster.vTxs.end());
         nTxnRemoved += stage.size();
 
         std::vector<CTransaction> txn;
@@ -6,6 +6,8 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
+#include <array>
+#include <deque>
 #include <memory>
 #include <set>
 #include <map>
@@ -16,10 +18,12 @@
 #include <amount.h>
 #include <coins.h>
 #include <indirectmap.h>
+#include <policy/cluster.h>
 #include <policy/feerate.h>
 #include <primitives/transaction.h>
 #include <sync.h>
 #include <random.h>
+#include <support/allocators/pool.h>
 
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/hashed_index.hpp>
@@ -127,7 +131,10 @@ public:
     CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
     int64_t GetSigOpCostWithAncestors() const { return nSigOpCostWithAncestors; }
 
-    mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes and vTxLinks
+    mutable uint64_t nClusterId; //!< Key of the entry's cluster in the mempool's mapClusters
+    mutable CAmount nChunkModFees; //!< Modified fees of the chunk of the cluster linearization the entry is in
+    mutable int64_t nChunkSize; //!< ... and its size
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -197,45 +204,14 @@ struct mempoolentry_txid
     }
 };
 
-/** \class CompareTxMemPoolEntryByDescendantScore
- *
- *  Sort an entry by max(score/size of entry's tx, score/size with all descendants).
- */
-class CompareTxMemPoolEntryByDescendantScore
+/** Sort clusters by the feerate of their last, lowest feerate chunk, lowest first */
+struct CompareClusterByWorstChunk
 {
-public:
-    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
-    {
-        double a_mod_fee, a_size, b_mod_fee, b_size;
-
-        GetModFeeAndSize(a, a_mod_fee, a_size);
-        GetModFeeAndSize(b, b_mod_fee, b_size);
-
-        // Avoid division by rewriting (a/b > c/d) as (a*d > c*b).
-        double f1 = a_mod_fee * b_size;
-        double f2 = a_size * b_mod_fee;
-
-        if (f1 == f2) {
-            return a.GetTime() >= b.GetTime();
-        }
-        return f1 < f2;
-    }
-
-    // Return the fee/size we're using for sorting this entry.
-    void GetModFeeAndSize(const CTxMemPoolEntry &a, double &mod_fee, double &size) const
+    bool operator()(const std::pair<ClusterChunk, uint64_t>& a, const std::pair<ClusterChunk, uint64_t>& b) const
     {
-        // Compare feerate with descendants to feerate of the transaction, and
-        // return the fee/size for the max.
-        double f1 = (double)a.GetModifiedFee() * a.GetSizeWithDescendants();
-        double f2 = (double)a.GetModFeesWithDescendants() * a.GetTxSize();
-
-        if (f2 > f1) {
-            mod_fee = a.GetModFeesWithDescendants();
-            size = a.GetSizeWithDescendants();
-        } else {
-            mod_fee = a.GetModifiedFee();
-            size = a.GetTxSize();
-        }
+        if (FeeRateLess(a.first, b.first)) return true;
+        if (FeeRateLess(b.first, a.first)) return false;
+        return a.second < b.second;
     }
 };
 
@@ -266,54 +242,8 @@ public:
     }
 };
 
-/** \class CompareTxMemPoolEntryByAncestorScore
- *
- *  Sort an entry by min(score/size of entry's tx, score/size with all ancestors).
- */
-class CompareTxMemPoolEntryByAncestorFee
-{
-public:
-    template<typename T>
-    bool operator()(const T& a, const T& b) const
-    {
-        double a_mod_fee, a_size, b_mod_fee, b_size;
-
-        GetModFeeAndSize(a, a_mod_fee, a_size);
-        GetModFeeAndSize(b, b_mod_fee, b_size);
-
-        // Avoid division by rewriting (a/b > c/d) as (a*d > c*b).
-        double f1 = a_mod_fee * b_size;
-        double f2 = a_size * b_mod_fee;
-
-        if (f1 == f2) {
-            return a.GetTx().GetHash() < b.GetTx().GetHash();
-        }
-        return f1 > f2;
-    }
-
-    // Return the fee/size we're using for sorting this entry.
-    template <typename T>
-    void GetModFeeAndSize(const T &a, double &mod_fee, double &size) const
-    {
-        // Compare feerate with ancestors to feerate of the transaction, and
-        // return the fee/size for the min.
-        double f1 = (double)a.GetModifiedFee() * a.GetSizeWithAncestors();
-        double f2 = (double)a.GetModFeesWithAncestors() * a.GetTxSize();
-
-        if (f1 > f2) {
-            mod_fee = a.GetModFeesWithAncestors();
-            size = a.GetSizeWithAncestors();
-        } else {
-            mod_fee = a.GetModifiedFee();
-            size = a.GetTxSize();
-        }
-    }
-};
-
 // Multi_index tag names
-struct descendant_score {};
 struct entry_time {};
-struct ancestor_score {};
 
 class CBlockPolicyEstimator;
 
@@ -335,6 +265,70 @@ struct TxMempoolInfo
     int64_t nFeeDelta;
 };
 
+/** The state of a mempool entry as RPC shows it, copied out of the mempool. */
+struct CTxMemPoolEntryInfo
+{
+    CTransactionRef tx;
+    uint256 wtxid;
+    CAmount nFee;
+    CAmount nModifiedFee;
+    int64_t nTime;
+    unsigned int nHeight;
+    size_t nTxSize;
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    CAmount nModFeesWithDescendants;
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+    //! In-mempool parents, sorted by txid
+    std::vector<uint256> vDepends;
+};
+
+/**
+ * A copy of the mempool at one sequence number, which can be read and
+ * serialized without holding the mempool's lock. Never changed once made;
+ * entries whose state did not change are shared with the previous snapshot.
+ */
+struct CTxMemPoolSnapshot
+{
+    uint64_t nSequence;
+    //! Memory of the entries, not counting their transactions, which are the mempool's
+    size_t nUsage;
+    //! All entries, sorted by txid
+    std::vector<std::shared_ptr<const CTxMemPoolEntryInfo>> vEntries;
+
+    /** The entry of a transaction, or nullptr if it was not in the mempool */
+    const CTxMemPoolEntryInfo* Find(const uint256& txid) const;
+};
+
+/** Number of added and removed transactions the mempool remembers for GetChangesSince */
+static const size_t MEMPOOL_CHANGE_LOG_SIZE = 50000;
+
+/** Number of buckets of the mempool feerate histogram */
+static const size_t MEMPOOL_FEE_HISTOGRAM_BUCKETS = 46;
+/**
+ * Lowest feerate of each histogram bucket, in satoshis per 1000 vbytes. A
+ * bucket holds the transactions from its feerate up to the next bucket's;
+ * the first also holds those paying less than nothing after prioritisation.
+ */
+extern const CAmount MEMPOOL_FEE_HISTOGRAM_BOUNDS[MEMPOOL_FEE_HISTOGRAM_BUCKETS];
+
+/** Transactions of one mempool feerate histogram bucket */
+struct MempoolFeeHistogramBucket
+{
+    uint64_t nCount = 0;
+    uint64_t nSize = 0; //!< Virtual size
+    CAmount nFees = 0;  //!< Modified fees
+
+    bool operator==(const MempoolFeeHistogramBucket& other) const
+    {
+        return nCount == other.nCount && nSize == other.nSize && nFees == other.nFees;
+    }
+};
+
+typedef std::array<MempoolFeeHistogramBucket, MEMPOOL_FEE_HISTOGRAM_BUCKETS> MempoolFeeHistogram;
+
 /** Reason why a transaction was removed from the mempool,
  * this is passed to the notification signal.
  */
@@ -377,19 +371,21 @@ public:
  *
  * CTxMemPool::mapTx, and CTxMemPoolEntry bookkeeping:
  *
- * mapTx is a boost::multi_index that sorts the mempool on 4 criteria:
+ * mapTx is a boost::multi_index that sorts the mempool on 2 criteria:
  * - transaction hash
- * - feerate [we use max(feerate of tx, feerate of tx with all descendants)]
  * - time in mempool
  *
+ * Ordering by feerate is left to the clusters (see below).
+ *
  * Note: the term "descendant" refers to in-mempool transactions that depend on
  * this one, while "ancestor" refers to in-mempool transactions that a given
  * transaction depends on.
  *
- * In order for the feerate sort to remain correct, we must update transactions
- * in the mempool when new descendants arrive.  To facilitate this, we track
- * the set of in-mempool direct parents and direct children in mapLinks.  Within
- * each CTxMemPoolEntry, we track the size and fees of all descendants.
+ * In order for the ancestor and descendant limits to remain correct, we must
+ * update transactions in the mempool when new descendants arrive.  To
+ * facilitate this, we track the in-mempool direct parents and direct children
+ * in vTxLinks.  Within each CTxMemPoolEntry, we track the size and fees of all
+ * descendants.
  *
  * Usually when a new transaction is added to the mempool, it has no in-mempool
  * children (because any such children would be an orphan).  So in
@@ -421,10 +417,50 @@ public:
  * state, to account for in-mempool, out-of-block descendants for all the
  * in-block transactions by calling UpdateTransactionsFromBlock().  Note that
  * until this is called, the mempool state is not consistent, and in particular
- * mapLinks may not be correct (and therefore functions like
+ * vTxLinks may not be correct (and therefore functions like
  * CalculateMemPoolAncestors() and CalculateDescendants() that rely
  * on them to walk the mempool are not generally safe to use).
  *
+ * Clusters:
+ *
+ * Entries that are connected through their links, directly or not, form a
+ * cluster. Each cluster keeps a linearization of its entries (parents before
+ * children, in the order a miner would take them) that is split into chunks
+ * whose feerates never increase. Block assembly takes chunks by feerate,
+ * TrimToSize() evicts the chunk with the lowest feerate and replacements are
+ * compared against the chunk feerates of the entries they conflict with.
+ *
+ * The clusters replace the feerate indexes of mapTx: the ancestor feerate
+ * order block assembly used to take packages by, and the descendant feerate
+ * order TrimToSize() used to evict by. The ancestor and descendant state of
+ * each entry (its counts, sizes, fees and sigops with ancestors or
+ * descendants) is still kept up to date, as the ancestor and descendant
+ * limits, TransactionWithinChainLimit() and the RPCs use it. It is kept by
+ * walking the ancestors and descendants of the entries that change
+ * (CalculateMemPoolAncestors(), UpdateAncestorsOf() and
+ * UpdateForDescendants()), not derived from the clusters, so the cost of
+ * those walks is what the ancestor and descendant limits bound, and they
+ * keep their defaults of 25 rather than rising to -limitclustercount.
+ *
+ * Which entries a cluster has is kept up to date as they are added and
+ * removed: joining clusters moves the entries of the smaller ones into the
+ * largest one, and removing entries only walks the rest of their clusters
+ * when they may fall apart. Linearizing, which costs O(n^2) for a cluster of
+ * n entries, is deferred: a cluster that an entry joins or leaves, or whose
+ * fees are prioritised, is only marked dirty, and it is linearized when the
+ * order of its entries is next needed (by GetClusters(), GetChunkFeeRate()
+ * and TrimToSize()) or at the end of a batch with LinearizeDirtyClusters().
+ * So a batch of transactions, like the ones of a reorg, costs one
+ * linearization per cluster. -limitclustercount bounds n for new
+ * transactions.
+ *
+ * Memory layout:
+ *
+ * The nodes of mapTx, mapNextTx and the cluster indexes come from a NodeArena
+ * instead of one malloc each. The direct parents and children of an entry are
+ * kept in small vectors in vTxLinks, at the entry's vTxHashesIdx, rather than
+ * in a map of sets keyed by the entry.
+ *
  * Computational limits:
  *
  * Updating all in-mempool ancestors of a newly added transaction can be slow,
@@ -442,11 +478,31 @@ private:
 
     uint64_t totalTxSize;      //!< sum of all mempool tx's virtual sizes. Differs from serialized tx size since witness data is discounted. Defined in BIP 141.
     uint64_t cachedInnerUsage; //!< sum of dynamic memory usage of all the map elements (NOT the maps themselves)
+    MempoolFeeHistogram feeHistogram; //!< the entries by their own modified feerate
 
     mutable int64_t lastRollingFeeUpdate;
     mutable bool blockSinceLastRollingFeeBump;
     mutable double rollingMinimumFeeRate; //!< minimum fee to get into the pool, decreases exponentially
 
+    NodeArena nodeArena; //!< Memory for the nodes of mapTx, mapNextTx and the cluster indexes
+
+    uint64_t nSequence; //!< Bumped on every change that a snapshot shows
+    struct Change
+    {
+        uint64_t nSequence;
+        uint256 txid;
+        bool fAdded;
+    };
+    std::deque<Change> dequeChanges; //!< The last MEMPOOL_CHANGE_LOG_SIZE additions and removals
+    uint64_t nChangesFrom; //!< dequeChanges holds all changes after this sequence
+    //! Shares unchanged entries with the next one. Counted by SnapshotMemoryUsage
+    //! rather than DynamicMemoryUsage, so that it is not held against -maxmempool.
+    mutable std::shared_ptr<const CTxMemPoolSnapshot> lastSnapshot;
+    //! Memory of the transactions that left the mempool but lastSnapshot keeps alive
+    mutable size_t nSnapshotRetainedUsage;
+
+    void LogChange(const uint256& txid, bool fAdded);
+
     void trackPackageRemoved(const CFeeRate& rate);
 
 public:
@@ -458,25 +514,14 @@ public:
         boost::multi_index::indexed_by<
             // sorted by txid
             boost::multi_index::hashed_unique<mempoolentry_txid, SaltedTxidHasher>,
-            // sorted by fee rate
-            boost::multi_index::ordered_non_unique<
-                boost::multi_index::tag<descendant_score>,
-                boost::multi_index::identity<CTxMemPoolEntry>,
-                CompareTxMemPoolEntryByDescendantScore
-            >,
             // sorted by entry time
             boost::multi_index::ordered_non_unique<
                 boost::multi_index::tag<entry_time>,
                 boost::multi_index::identity<CTxMemPoolEntry>,
                 CompareTxMemPoolEntryByEntryTime
-            >,
-            // sorted by fee rate with ancestors
-            boost::multi_index::ordered_non_unique<
-                boost::multi_index::tag<ancestor_score>,
-                boost::multi_index::identity<CTxMemPoolEntry>,
-                CompareTxMemPoolEntryByAncestorFee
             >
-        >
+        >,
+        pool_allocator<CTxMemPoolEntry>
     > indexed_transaction_set;
 
     mutable CCriticalSection cs;
@@ -491,27 +536,54 @@ public:
         }
     };
     typedef std::set<txiter, CompareIteratorByHash> setEntries;
+    //! Direct parents or children of an entry, in no particular order
+    typedef std::vector<txiter> vecEntries;
 
-    const setEntries & GetMemPoolParents(txiter entry) const;
-    const setEntries & GetMemPoolChildren(txiter entry) const;
+    const vecEntries & GetMemPoolParents(txiter entry) const;
+    const vecEntries & GetMemPoolChildren(txiter entry) const;
 private:
     typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
 
     struct TxLinks {
-        setEntries parents;
-        setEntries children;
+        vecEntries parents;
+        vecEntries children;
+    };
+
+    std::vector<TxLinks> vTxLinks; //!< Links of all entries in mapTx, at their vTxHashesIdx
+
+public:
+    /** A cluster of entries, with its linearization */
+    struct TxCluster {
+        std::vector<txiter> vTxs; //!< The entries; unless the cluster is dirty, parents before children, in the order a miner takes them
+        std::vector<ClusterChunk> vChunks; //!< The chunks of vTxs, from the highest feerate to the lowest; empty while the cluster is dirty
     };
+    typedef std::map<uint64_t, TxCluster, std::less<uint64_t>, pool_allocator<std::pair<const uint64_t, TxCluster> > > clusterMap;
 
-    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
-    txlinksMap mapLinks;
+private:
+    clusterMap mapClusters; //!< All clusters, by the nClusterId of their entries
+    std::set<std::pair<ClusterChunk, uint64_t>, CompareClusterByWorstChunk, pool_allocator<std::pair<ClusterChunk, uint64_t> > > setClustersByWorstChunk; //!< The last chunk of each cluster that is not dirty, lowest feerate first
+    std::set<uint64_t, std::less<uint64_t>, pool_allocator<uint64_t> > setDirtyClusters; //!< Clusters that changed since they were last linearized
+    uint64_t nLastClusterId;
 
+    std::shared_ptr<const CTxMemPoolEntryInfo> MakeEntryInfo(txiter it, const CTxMemPoolSnapshot* prev) const;
+    void UpdateLink(vecEntries &links, txiter link, bool add);
+    /**
+     * Put vEntries, and the other entries of their clusters, into one cluster.
+     * Entries that are in no cluster yet are added to it.
+     */
+    void JoinClusters(const std::vector<txiter>& vEntries);
+    /** Take the entries of stage out of their clusters, splitting the ones that fall apart. Needs the links of stage. */
+    void SplitClusters(const setEntries& stage);
+    void MarkClusterDirty(clusterMap::iterator it);
+    void UpdateLinearization(clusterMap::iterator it);
+    void RemoveCluster(clusterMap::iterator it);
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
 
     std::vector<indexed_transaction_set::const_iterator> GetSortedDepthAndScore() const;
 
 public:
-    indirectmap<COutPoint, const CTransaction*> mapNextTx;
+    indirectmap<COutPoint, const CTransaction*, pool_allocator<std::pair<const COutPoint* const, const CTransaction*> > > mapNextTx;
     std::map<uint256, CAmount> mapDeltas;
 
     /** Create a new CTxMemPool.
@@ -589,10 +661,27 @@ public:
      *  limitDescendantSize = max size of descendants any ancestor can have
      *  errString = populated with error reason if any limits are hit
      *  fSearchForParents = whether to search a tx's vin for in-mempool parents, or
-     *    look up parents from mapLinks. Must be true for entries not in the mempool
+     *    look up parents from vTxLinks. Must be true for entries not in the mempool
      */
     bool CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents = true) const;
 
+    /** The number of entries in the cluster that an entry with in-mempool
+     *  ancestors setAncestors would be in, the entry itself included. */
+    uint64_t CalculateClusterCount(const setEntries &setAncestors) const;
+
+    /** Linearize the clusters that changed since they were last linearized. Requires cs. */
+    void LinearizeDirtyClusters();
+
+    /** All clusters with their linearizations. Requires cs. */
+    const clusterMap& GetClusters()
+    {
+        LinearizeDirtyClusters();
+        return mapClusters;
+    }
+
+    /** The feerate of the chunk of its cluster that the entry is mined with. Requires cs. */
+    CFeeRate GetChunkFeeRate(txiter it);
+
     /** Populate setDescendants with all in-mempool descendants of hash.
      *  Assumes that setDescendants includes all in-mempool descendants of anything
      *  already in it.  */
@@ -606,7 +695,8 @@ public:
       */
     CFeeRate GetMinFee(size_t sizelimit) const;
 
-    /** Remove transactions from the mempool until its dynamic size is <= sizelimit.
+    /** Remove transactions from the mempool until its dynamic size is <= sizelimit,
+      *  the chunk with the lowest feerate of any cluster first.
       *  pvNoSpendsRemaining, if set, will be populated with the list of outpoints
       *  which are not in mempool which no longer have any spends in this mempool.
       */
@@ -630,6 +720,13 @@ public:
         return totalTxSize;
     }
 
+    /** The entries by feerate, kept up to date as they are added, removed and prioritised */
+    MempoolFeeHistogram GetFeeHistogram() const
+    {
+        LOCK(cs);
+        return feeHistogram;
+    }
+
     bool exists(uint256 hash) const
     {
         LOCK(cs);
@@ -640,7 +737,41 @@ public:
     TxMempoolInfo info(const uint256& hash) const;
     std::vector<TxMempoolInfo> infoAll() const;
 
+    /** The current sequence number, which grows with every change to the entries */
+    uint64_t GetSequence() const
+    {
+        LOCK(cs);
+        return nSequence;
+    }
+
+    /**
+     * A snapshot of the current entries. Only entries that changed since the
+     * last snapshot are copied; if nothing changed, it is the last snapshot.
+     */
+    std::shared_ptr<const CTxMemPoolSnapshot> GetSnapshot() const;
+
+    /** A copy of one entry, shared with the last snapshot if it did not change. Requires cs. */
+    std::shared_ptr<const CTxMemPoolEntryInfo> GetEntryInfo(txiter it) const;
+
+    /**
+     * The transactions added and removed after sequence nSince, up to and
+     * including nUntil. A transaction that was removed and added again is in
+     * both, one that was added and removed again in neither. Returns false if
+     * the changes after nSince are no longer known.
+     */
+    bool GetChangesSince(uint64_t nSince, uint64_t nUntil, std::vector<uint256>& vAdded, std::vector<uint256>& vRemoved) const;
+
+    /**
+     * The changes after sequence nSince up to the current sequence, which is
+     * returned in nUntil, with copies of the entries of the transactions
+     * added, sorted by txid. Unlike GetSnapshot it only copies those entries.
+     * Returns false if the changes after nSince are no longer known.
+     */
+    bool GetEntryChangesSince(uint64_t nSince, uint64_t& nUntil, std::vector<std::shared_ptr<const CTxMemPoolEntryInfo>>& vAdded, std::vector<uint256>& vRemoved) const;
+
     size_t DynamicMemoryUsage() const;
+    /** Memory of the snapshot kept for sharing entries with the next one, which DynamicMemoryUsage leaves out */
+    size_t SnapshotMemoryUsage() const;
 
     boost::signals2::signal<void (CTransactionRef)> NotifyEntryAdded;
     boost::signals2::signal<void (CTransactionRef, MemPoolRemovalReason)> NotifyEntryRemoved;
@@ -0,0 +1,217 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <txorphanpool.h>
+
+#include <consensus/validation.h>
+#include <core_memusage.h>
+#include <memusage.h>
+#include <policy/policy.h>
+#include <primitives/block.h>
+#include <util.h>
+#include <utiltime.h>
+
+#include <assert.h>
+
+CTxOrphanPool::CTxOrphanPool(size_t nMaxCountIn, size_t nMaxUsageIn) :
+    nMaxCount(nMaxCountIn), nMaxUsage(nMaxUsageIn), nTotalUsage(0), nLastSequence(0), nNextSweep(0)
+{
+}
+
+void CTxOrphanPool::SetLimits(size_t nMaxCountIn, size_t nMaxUsageIn)
+{
+    nMaxCount = nMaxCountIn;
+    nMaxUsage = nMaxUsageIn;
+}
+
+bool CTxOrphanPool::AddTx(const CTransactionRef& tx, NodeId peer)
+{
+    const uint256& hash = tx->GetHash();
+    if (mapOrphans.count(hash))
+        return false;
+
+    // Ignore big transactions, to avoid a
+    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
+    // large transaction with a missing parent then we assume
+    // it will rebroadcast it later, after the parent transaction(s)
+    // have been mined or received.
+    unsigned int sz = GetTransactionWeight(*tx);
+    if (sz >= MAX_STANDARD_TX_WEIGHT)
+    {
+        LogPrint(BCLog::MEMPOOL, "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
+        return false;
+    }
+
+    const size_t nUsage = RecursiveDynamicUsage(tx) + memusage::IncrementalDynamicUsage(mapOrphans) +
+                          tx->vin.size() * memusage::IncrementalDynamicUsage(mapOrphansByPrev);
+    auto ret = mapOrphans.emplace(hash, COrphanTx{tx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME, nUsage, ++nLastSequence});
+    assert(ret.second);
+    for (const CTxIn& txin : tx->vin) {
+        mapOrphansByPrev[txin.prevout].insert(ret.first);
+    }
+
+    PeerOrphans& peerOrphans = mapPeers[peer];
+    setPeersByUsage.erase(std::make_pair(peerOrphans.nUsage, peer));
+    peerOrphans.nUsage += nUsage;
+    peerOrphans.mapBySequence.emplace(nLastSequence, ret.first);
+    setPeersByUsage.emplace(peerOrphans.nUsage, peer);
+    nTotalUsage += nUsage;
+
+    LogPrint(BCLog::MEMPOOL, "stored orphan tx %s (poolsz %u txn, %u kB)\n", hash.ToString(),
+             mapOrphans.size(), nTotalUsage / 1000);
+    return true;
+}
+
+bool CTxOrphanPool::HaveTx(const uint256& txid) const
+{
+    return mapOrphans.count(txid) != 0;
+}
+
+void CTxOrphanPool::EraseOrphan(OrphanMap::iterator it)
+{
+    for (const CTxIn& txin : it->second.tx->vin)
+    {
+        auto itPrev = mapOrphansByPrev.find(txin.prevout);
+        if (itPrev == mapOrphansByPrev.end())
+            continue;
+        itPrev->second.erase(it);
+        if (itPrev->second.empty())
+            mapOrphansByPrev.erase(itPrev);
+    }
+
+    const NodeId peer = it->second.fromPeer;
+    auto itPeer = mapPeers.find(peer);
+    assert(itPeer != mapPeers.end());
+    setPeersByUsage.erase(std::make_pair(itPeer->second.nUsage, peer));
+    itPeer->second.nUsage -= it->second.nUsage;
+    itPeer->second.mapBySequence.erase(it->second.nSequence);
+    if (itPeer->second.mapBySequence.empty()) {
+        mapPeers.erase(itPeer);
+    } else {
+        setPeersByUsage.emplace(itPeer->second.nUsage, peer);
+    }
+
+    nTotalUsage -= it->second.nUsage;
+    mapOrphans.erase(it);
+}
+
+int CTxOrphanPool::EraseTx(const uint256& txid)
+{
+    OrphanMap::iterator it = mapOrphans.find(txid);
+    if (it == mapOrphans.end())
+        return 0;
+    EraseOrphan(it);
+    return 1;
+}
+
+int CTxOrphanPool::EraseForPeer(NodeId peer)
+{
+    auto itPeer = mapPeers.find(peer);
+    if (itPeer == mapPeers.end())
+        return 0;
+    // Erasing the peer's last orphan erases its entry of mapPeers
+    int nErased = 0;
+    while (mapPeers.count(peer)) {
+        EraseOrphan(itPeer->second.mapBySequence.begin()->second);
+        ++nErased;
+    }
+    LogPrint(BCLog::MEMPOOL, "Erased %d orphan tx from peer=%d\n", nErased, peer);
+    return nErased;
+}
+
+int CTxOrphanPool::EraseForBlock(const CBlock& block)
+{
+    std::vector<uint256> vOrphanErase;
+
+    for (const CTransactionRef& ptx : block.vtx) {
+        const CTransaction& tx = *ptx;
+
+        // Which orphan pool entries must we evict?
+        for (const auto& txin : tx.vin) {
+            auto itByPrev = mapOrphansByPrev.find(txin.prevout);
+            if (itByPrev == mapOrphansByPrev.end()) continue;
+            for (auto mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi) {
+                vOrphanErase.push_back((*mi)->first);
+            }
+        }
+    }
+
+    // Erase orphan transactions included or precluded by this block
+    int nErased = 0;
+    for (const uint256& orphanHash : vOrphanErase) {
+        nErased += EraseTx(orphanHash);
+    }
+    if (nErased > 0) LogPrint(BCLog::MEMPOOL, "Erased %d orphan tx included or conflicted by block\n", nErased);
+    return nErased;
+}
+
+unsigned int CTxOrphanPool::LimitOrphans()
+{
+    unsigned int nEvicted = 0;
+    int64_t nNow = GetTime();
+    if (nNextSweep <= nNow) {
+        // Sweep out expired orphan pool entries:
+        int nErased = 0;
+        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+        OrphanMap::iterator iter = mapOrphans.begin();
+        while (iter != mapOrphans.end())
+        {
+            OrphanMap::iterator maybeErase = iter++;
+            if (maybeErase->second.nTimeExpire <= nNow) {
+                EraseOrphan(maybeErase);
+                ++nErased;
+            } else {
+                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
+            }
+        }
+        // Sweep again 5 minutes after the next entry that expires in order to batch the linear scan.
+        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nErased > 0) LogPrint(BCLog::MEMPOOL, "Erased %d orphan tx due to expiration\n", nErased);
+    }
+    while (mapOrphans.size() > nMaxCount || nTotalUsage > nMaxUsage)
+    {
+        // Evict the oldest orphan of the peer whose orphans take the most memory
+        const PeerOrphans& peerOrphans = mapPeers.at(setPeersByUsage.rbegin()->second);
+        EraseOrphan(peerOrphans.mapBySequence.begin()->second);
+        ++nEvicted;
+    }
+    return nEvicted;
+}
+
+std::vector<std::pair<CTransactionRef, NodeId>> CTxOrphanPool::GetDescendants(const uint256& txid) const
+{
+    std::vector<std::pair<CTransactionRef, NodeId>> vDescendants;
+    std::set<uint256> setFound;
+    std::vector<uint256> vWork{txid};
+    while (!vWork.empty()) {
+        const uint256 hash = vWork.back();
+        vWork.pop_back();
+        // The outpoints of all outputs of hash, in order
+        for (auto itByPrev = mapOrphansByPrev.lower_bound(COutPoint(hash, 0));
+             itByPrev != mapOrphansByPrev.end() && itByPrev->first.hash == hash; ++itByPrev) {
+            for (const OrphanMap::iterator& it : itByPrev->second) {
+                if (setFound.insert(it->first).second) {
+                    vDescendants.emplace_back(it->second.tx, it->second.fromPeer);
+                    vWork.push_back(it->first);
+                }
+            }
+        }
+    }
+    return vDescendants;
+}
+
+size_t CTxOrphanPool::PeerUsage(NodeId peer) const
+{
+    auto itPeer = mapPeers.find(peer);
+    return itPeer == mapPeers.end() ? 0 : itPeer->second.nUsage;
+}
+
+void CTxOrphanPool::Clear()
+{
+    mapOrphans.clear();
+    mapOrphansByPrev.clear();
+    mapPeers.clear();
+    setPeersByUsage.clear();
+    nTotalUsage = 0;
+}
@@ -0,0 +1,135 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXORPHANPOOL_H
+#define BITCOIN_TXORPHANPOOL_H
+
+#include <net.h>
+#include <primitives/transaction.h>
+#include <uint256.h>
+
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+class CBlock;
+
+/** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 1000;
+/** Default for -maxorphanpool, maximum memory of the orphan transactions in megabytes */
+static const unsigned int DEFAULT_MAX_ORPHAN_POOL_SIZE = 10;
+/** Expiration time for orphan transactions in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum time between orphan transactions expire time checks in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+
+/** A transaction that spends outputs of transactions we don't have yet */
+struct COrphanTx {
+    CTransactionRef tx;
+    NodeId fromPeer;
+    int64_t nTimeExpire;
+    size_t nUsage;      //!< Memory the orphan counts for against the limits
+    uint64_t nSequence; //!< Order of arrival, to evict the oldest orphans first
+};
+
+/**
+ * Orphan transactions, kept until the transactions they spend arrive.
+ *
+ * The pool is bounded both in count and in memory. When it is over either
+ * limit, the oldest orphan of the peer whose orphans take the most memory
+ * makes room. A single peer may fill an otherwise unused pool, but a peer
+ * flooding it only displaces its own orphans once it holds more than the
+ * others: each of n peers with orphans keeps a quota of 1/n of the pool.
+ *
+ * Orphans are indexed by the outpoints they spend. Outpoints sort by txid
+ * first, so the orphans that spend any output of a transaction are one
+ * range of the index, which GetDescendants() scans instead of looking up
+ * every output.
+ *
+ * Not thread safe; net_processing guards its pool with g_cs_orphans.
+ */
+class CTxOrphanPool
+{
+public:
+    explicit CTxOrphanPool(size_t nMaxCountIn = DEFAULT_MAX_ORPHAN_TRANSACTIONS, size_t nMaxUsageIn = DEFAULT_MAX_ORPHAN_POOL_SIZE * 1000000);
+
+    /** Set the limits that LimitOrphans() enforces. */
+    void SetLimits(size_t nMaxCountIn, size_t nMaxUsageIn);
+
+    /**
+     * Add an orphan received from peer. Returns false if it is in the pool
+     * already, or too large to keep. Does not enforce the limits; call
+     * LimitOrphans() afterwards.
+     */
+    bool AddTx(const CTransactionRef& tx, NodeId peer);
+
+    bool HaveTx(const uint256& txid) const;
+
+    /** Remove an orphan. Returns the number of orphans removed, 0 or 1. */
+    int EraseTx(const uint256& txid);
+
+    /** Remove the orphans received from peer. Returns the number removed. */
+    int EraseForPeer(NodeId peer);
+
+    /** Remove the orphans that a block includes or conflicts with. Returns the number removed. */
+    int EraseForBlock(const CBlock& block);
+
+    /**
+     * Remove expired orphans, at most every ORPHAN_TX_EXPIRE_INTERVAL, then
+     * evict orphans until the pool is within its limits. Returns the number
+     * evicted for the limits.
+     */
+    unsigned int LimitOrphans();
+
+    /**
+     * The orphans that spend outputs of txid, the orphans that spend theirs,
+     * and so on, with the peers they came from. These are the orphans that
+     * accepting txid may unblock; they are returned in the order found, which
+     * need not put parents before their children.
+     */
+    std::vector<std::pair<CTransactionRef, NodeId>> GetDescendants(const uint256& txid) const;
+
+    size_t Size() const { return mapOrphans.size(); }
+    /** Memory of the orphans, as counted against the limit */
+    size_t Usage() const { return nTotalUsage; }
+    /** Memory of the orphans received from peer */
+    size_t PeerUsage(NodeId peer) const;
+
+    void Clear();
+
+private:
+    typedef std::map<uint256, COrphanTx> OrphanMap;
+
+    struct IteratorComparator
+    {
+        bool operator()(const OrphanMap::iterator& a, const OrphanMap::iterator& b) const
+        {
+            return &(*a) < &(*b);
+        }
+    };
+
+    /** The orphans of one peer, and the memory they take */
+    struct PeerOrphans
+    {
+        size_t nUsage = 0;
+        std::map<uint64_t, OrphanMap::iterator> mapBySequence; //!< Oldest first
+    };
+
+    size_t nMaxCount;
+    size_t nMaxUsage;
+    size_t nTotalUsage;
+    uint64_t nLastSequence;
+    int64_t nNextSweep;
+
+    OrphanMap mapOrphans;
+    std::map<COutPoint, std::set<OrphanMap::iterator, IteratorComparator>> mapOrphansByPrev;
+    std::map<NodeId, PeerOrphans> mapPeers;
+    std::set<std::pair<size_t, NodeId>> setPeersByUsage; //!< Peers by the memory of their orphans
+
+    void EraseOrphan(OrphanMap::iterator it);
+};
+
+#endif // BITCOIN_TXORPHANPOOL_H
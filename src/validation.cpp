@@ -11,13 +11,16 @@
 #include <chainparams.h>
 #include <checkpoints.h>
 #include <checkqueue.h>
+#include <coinstats.h>
 #include <consensus/consensus.h>
 #include <consensus/merkle.h>
 #include <consensus/tx_verify.h>
 #include <consensus/validation.h>
 #include <cuckoocache.h>
 #include <hash.h>
+#include <index/txindex.h>
 #include <init.h>
+#include <mappedfile.h>
 #include <policy/fees.h>
 #include <policy/policy.h>
 #include <policy/rbf.h>
@@ -41,8 +44,11 @@
 #include <validationinterface.h>
 #include <warnings.h>
 
+#include <functional>
 #include <future>
+#include <list>
 #include <sstream>
+#include <thread>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/algorithm/string/join.hpp>
@@ -89,6 +95,7 @@ enum DisconnectResult
 };
 
 class ConnectTrace;
+struct ScriptCheckPipeline;
 
 /**
  * CChainState stores and provides an API to update our local knowledge of the
@@ -161,16 +168,19 @@ public:
 
     bool ActivateBestChain(CValidationState &state, const CChainParams& chainparams, std::shared_ptr<const CBlock> pblock);
 
-    bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex);
+    bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fCheckedPoW = false);
     bool AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock);
 
     // Block (dis)connection on a given view:
-    DisconnectResult DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, CCoinsViewCache& view);
+    DisconnectResult DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, CCoinsViewCache& view, CUTXOStatsDelta* pstatsdelta = nullptr);
+    DisconnectResult DisconnectBlock(const CBlock& block, CBlockUndo& blockUndo, const CBlockIndex* pindex, CCoinsViewCache& view, CUTXOStatsDelta* pstatsdelta = nullptr);
     bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex,
-                    CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck = false);
+                    CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck = false, CUTXOStatsDelta* pstatsdelta = nullptr,
+                    ScriptCheckPipeline* pipeline = nullptr);
 
     // Block disconnection on our pcoinsTip:
     bool DisconnectTip(CValidationState& state, const CChainParams& chainparams, DisconnectedBlockTransactions *disconnectpool);
+    bool DisconnectTips(CValidationState& state, const CChainParams& chainparams, const CBlockIndex* pindexFork, DisconnectedBlockTransactions& disconnectpool);
 
     // Manual block validity manipulation:
     bool PreciousBlock(CValidationState& state, const CChainParams& params, CBlockIndex *pindex);
@@ -188,6 +198,8 @@ public:
 private:
     bool ActivateBestChainStep(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexMostWork, const std::shared_ptr<const CBlock>& pblock, bool& fInvalidFound, ConnectTrace& connectTrace);
     bool ConnectTip(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexNew, const std::shared_ptr<const CBlock>& pblock, ConnectTrace& connectTrace, DisconnectedBlockTransactions &disconnectpool);
+    bool ConnectTipsPipelined(CValidationState& state, const CChainParams& chainparams, const std::vector<CBlockIndex*>& vpindexToConnect, CBlockIndex* pindexMostWork, const std::shared_ptr<const CBlock>& pblock, ConnectTrace& connectTrace, DisconnectedBlockTransactions &disconnectpool, size_t& nConnected);
+    void FinishDisconnectTip(const CChainParams& chainparams, const std::shared_ptr<CBlock>& pblock, DisconnectedBlockTransactions *disconnectpool);
 
     CBlockIndex* AddToBlockIndex(const CBlockHeader& block);
     /** Create a new block index entry for a given block hash */
@@ -205,17 +217,20 @@ private:
 
 
 CCriticalSection cs_main;
+CCriticalSection cs_blockindex;
 
 BlockMap& mapBlockIndex = g_chainstate.mapBlockIndex;
 CChain& chainActive = g_chainstate.chainActive;
 CBlockIndex *pindexBestHeader = nullptr;
+std::atomic<int> nBestHeaderHeight{-1};
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 uint256 hashBestBlock;
 int nScriptCheckThreads = 0;
+int nBlockCheckThreads = 0;
+bool fPipelineScriptChecks = DEFAULT_PIPELINE_SCRIPT_CHECKS;
 std::atomic_bool fImporting(false);
 std::atomic_bool fReindex(false);
-bool fTxIndex = false;
 bool fHavePruned = false;
 bool fPruneMode = false;
 bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
@@ -264,6 +279,9 @@ namespace {
 
     /** Dirty block file entries. */
     std::set<int> setDirtyFileInfo;
+
+    /** Finished block files whose truncation was put off because they were in use. */
+    std::set<int> setPendingTruncation;
 } // anon namespace
 
 CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& locator)
@@ -427,6 +445,11 @@ bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool
 // Returns the script flags which should be checked for a given block
 static unsigned int GetBlockScriptFlags(const CBlockIndex* pindex, const Consensus::Params& chainparams);
 
+static void AcceptToMemoryPoolBatchWithTime(const CChainParams& chainparams, CTxMemPool& pool, const std::vector<CTransactionRef>& txs,
+                                            const std::vector<int64_t>& vAcceptTime, std::vector<CValidationState>& states,
+                                            std::vector<bool>& vAccepted, std::vector<bool>& vMissingInputs, const CAmount nAbsurdFee,
+                                            bool bypass_limits);
+
 static void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age) {
     int expired = pool.Expire(GetTime() - age);
     if (expired != 0) {
@@ -471,6 +494,11 @@ static bool IsCurrentForFeeEstimation()
  *
  * Passing fAddToMempool=false will skip trying to add the transactions back,
  * and instead just erase from the mempool as needed.
+ *
+ * The transactions are added back as one AcceptToMemoryPoolBatch, so the
+ * scripts of each generation are verified together. A transaction spending
+ * an output of one that did not make it back (or of a disconnected coinbase)
+ * fails its PreChecks for missing inputs, without its scripts being verified.
  */
 
 void UpdateMempoolForReorg(DisconnectedBlockTransactions &disconnectpool, bool fAddToMempool)
@@ -483,20 +511,31 @@ void UpdateMempoolForReorg(DisconnectedBlockTransactions &disconnectpool, bool f
     // Iterate disconnectpool in reverse, so that we add transactions
     // back to the mempool starting with the earliest transaction that had
     // been previously seen in a block.
-    auto it = disconnectpool.queuedTx.get<insertion_order>().rbegin();
-    while (it != disconnectpool.queuedTx.get<insertion_order>().rend()) {
-        // ignore validation errors in resurrected transactions
-        CValidationState stateDummy;
-        if (!fAddToMempool || (*it)->IsCoinBase() ||
-            !AcceptToMemoryPool(mempool, stateDummy, *it, nullptr /* pfMissingInputs */,
-                                nullptr /* plTxnReplaced */, true /* bypass_limits */, 0 /* nAbsurdFee */)) {
+    std::vector<CTransactionRef> vToAdd;
+    if (fAddToMempool) {
+        for (auto it = disconnectpool.queuedTx.get<insertion_order>().rbegin(); it != disconnectpool.queuedTx.get<insertion_order>().rend(); ++it) {
+            if (!(*it)->IsCoinBase())
+                vToAdd.push_back(*it);
+        }
+    }
+    // ignore validation errors in resurrected transactions
+    std::vector<CValidationState> states;
+    std::vector<bool> vAccepted, vMissingInputs;
+    if (!vToAdd.empty()) {
+        const std::vector<int64_t> vAcceptTime(vToAdd.size(), GetTime());
+        AcceptToMemoryPoolBatchWithTime(Params(), mempool, vToAdd, vAcceptTime, states, vAccepted, vMissingInputs,
+                                        0 /* nAbsurdFee */, true /* bypass_limits */);
+    }
+    size_t nAdd = 0;
+    for (auto it = disconnectpool.queuedTx.get<insertion_order>().rbegin(); it != disconnectpool.queuedTx.get<insertion_order>().rend(); ++it) {
+        const bool fAccepted = fAddToMempool && !(*it)->IsCoinBase() && vAccepted[nAdd++];
+        if (!fAccepted) {
             // If the transaction doesn't make it in to the mempool, remove any
             // transactions that depend on it (which would now be orphans).
             mempool.removeRecursive(**it, MemPoolRemovalReason::REORG);
         } else if (mempool.exists((*it)->GetHash())) {
             vHashUpdate.push_back((*it)->GetHash());
         }
-        ++it;
     }
     disconnectpool.queuedTx.clear();
     // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
@@ -510,6 +549,9 @@ void UpdateMempoolForReorg(DisconnectedBlockTransactions &disconnectpool, bool f
     mempool.removeForReorg(pcoinsTip.get(), chainActive.Tip()->nHeight + 1, STANDARD_LOCKTIME_VERIFY_FLAGS);
     // Re-limit mempool size, in case we added any transactions
     LimitMempoolSize(mempool, gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+    // Linearize the clusters the reorg changed once, now that it is all in
+    LOCK(mempool.cs);
+    mempool.LinearizeDirtyClusters();
 }
 
 // Used to avoid mempool polluting consensus critical paths if CCoinsViewMempool
@@ -548,17 +590,45 @@ static bool CheckInputsFromMempoolAndCache(const CTransaction& tx, CValidationSt
     return CheckInputs(tx, state, view, true, flags, cacheSigStore, true, txdata);
 }
 
-static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx,
-                              bool* pfMissingInputs, int64_t nAcceptTime, std::list<CTransactionRef>* plTxnReplaced,
-                              bool bypass_limits, const CAmount& nAbsurdFee, std::vector<COutPoint>& coins_to_uncache)
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+/**
+ * What AcceptToMemoryPoolWorker learns about a transaction while holding
+ * cs_main and the mempool lock, for verifying its scripts after releasing
+ * them and for adding it to the mempool once it has taken them again.
+ */
+struct MemPoolAcceptState
 {
-    const CTransaction& tx = *ptx;
+    const CTransactionRef ptx;
+    CCoinsView dummy;
+    //! The coins the transaction spends, no longer backed by the chainstate or the mempool
+    CCoinsViewCache view;
+    PrecomputedTransactionData txdata;
+    std::unique_ptr<CTxMemPoolEntry> entry;
+    CTxMemPool::setEntries setAncestors;
+    CTxMemPool::setEntries allConflicting;
+    CAmount nModifiedFees = 0;
+    CAmount nConflictingFees = 0;
+    size_t nConflictingSize = 0;
+    bool fReplacementTransaction = false;
+    unsigned int scriptVerifyFlags = 0;
+    unsigned int currentBlockScriptVerifyFlags = 0;
+    //! The tip and mempool the checks were done against
+    const CBlockIndex* pindexTip = nullptr;
+    unsigned int nMempoolUpdated = 0;
+
+    explicit MemPoolAcceptState(const CTransactionRef& ptxIn) : ptx(ptxIn), view(&dummy), txdata(*ptxIn) {}
+};
+
+/** The checks of AcceptToMemoryPoolWorker that depend on the chainstate and the mempool, all but the scripts. */
+static bool PreChecks(const CChainParams& chainparams, CTxMemPool& pool, CValidationState& state, MemPoolAcceptState& ws,
+                      bool* pfMissingInputs, int64_t nAcceptTime, bool bypass_limits, const CAmount& nAbsurdFee,
+                      std::vector<COutPoint>& coins_to_uncache)
+{
+    const CTransaction& tx = *ws.ptx;
     const uint256 hash = tx.GetHash();
     AssertLockHeld(cs_main);
-    LOCK(pool.cs); // mempool "read lock" (held through GetMainSignals().TransactionAddedToMempool())
-    if (pfMissingInputs) {
-        *pfMissingInputs = false;
-    }
+    AssertLockHeld(pool.cs);
 
     if (!CheckTransaction(tx, state))
         return false; // state filled in by CheckTransaction
@@ -639,8 +709,7 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
     }
 
     {
-        CCoinsView dummy;
-        CCoinsViewCache view(&dummy);
+        CCoinsViewCache& view = ws.view;
 
         LockPoints lp;
         CCoinsViewMemPool viewMemPool(pcoinsTip.get(), pool);
@@ -671,7 +740,7 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         view.GetBestBlock();
 
         // we have all inputs cached now, so switch back to dummy, so we don't need to keep lock on mempool
-        view.SetBackend(dummy);
+        view.SetBackend(ws.dummy);
 
         // Only accept BIP68 sequence locked transactions that can be mined in the next
         // block; we don't want our mempool filled up with transactions that can't
@@ -697,7 +766,8 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         int64_t nSigOpsCost = GetTransactionSigOpCost(tx, view, STANDARD_SCRIPT_VERIFY_FLAGS);
 
         // nModifiedFees includes any fee deltas from PrioritiseTransaction
-        CAmount nModifiedFees = nFees;
+        CAmount& nModifiedFees = ws.nModifiedFees;
+        nModifiedFees = nFees;
         pool.ApplyDelta(hash, nModifiedFees);
 
         // Keep track of transactions that spend a coinbase, which we re-scan
@@ -711,8 +781,9 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
             }
         }
 
-        CTxMemPoolEntry entry(ptx, nFees, nAcceptTime, chainActive.Height(),
-                              fSpendsCoinbase, nSigOpsCost, lp);
+        ws.entry.reset(new CTxMemPoolEntry(ws.ptx, nFees, nAcceptTime, chainActive.Height(),
+                                           fSpendsCoinbase, nSigOpsCost, lp));
+        const CTxMemPoolEntry& entry = *ws.entry;
         unsigned int nSize = entry.GetTxSize();
 
         // Check that the transaction doesn't have an excessive number of
@@ -740,7 +811,7 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
                 strprintf("%d > %d", nFees, nAbsurdFee));
 
         // Calculate in-mempool ancestors, up to a limit.
-        CTxMemPool::setEntries setAncestors;
+        CTxMemPool::setEntries& setAncestors = ws.setAncestors;
         size_t nLimitAncestors = gArgs.GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
         size_t nLimitAncestorSize = gArgs.GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
         size_t nLimitDescendants = gArgs.GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
@@ -749,6 +820,13 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
             return state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false, errString);
         }
+        // Clusters are linearized again on every change, so bound their size
+        const uint64_t nLimitCluster = gArgs.GetArg("-limitclustercount", DEFAULT_CLUSTER_LIMIT);
+        const uint64_t nClusterCount = pool.CalculateClusterCount(setAncestors);
+        if (nClusterCount > nLimitCluster) {
+            return state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false,
+                             strprintf("too many transactions in cluster [limit: %u]", nLimitCluster));
+        }
 
         // A transaction that spends outputs that would be replaced by it is invalid. Now
         // that we have the set of all ancestors we can detect this
@@ -769,15 +847,15 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
 
         // Check if it's economically rational to mine this transaction rather
         // than the ones it replaces.
-        CAmount nConflictingFees = 0;
-        size_t nConflictingSize = 0;
+        CAmount& nConflictingFees = ws.nConflictingFees;
+        size_t& nConflictingSize = ws.nConflictingSize;
         uint64_t nConflictingCount = 0;
-        CTxMemPool::setEntries allConflicting;
+        CTxMemPool::setEntries& allConflicting = ws.allConflicting;
 
         // If we don't hold the lock allConflicting might be incomplete; the
         // subsequent RemoveStaged() and addUnchecked() calls don't guarantee
         // mempool consistency for us.
-        const bool fReplacementTransaction = setConflicts.size();
+        const bool fReplacementTransaction = ws.fReplacementTransaction = setConflicts.size();
         if (fReplacementTransaction)
         {
             CFeeRate newFeeRate(nModifiedFees, nSize);
@@ -802,14 +880,12 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
                 // be increased is also an easy-to-reason about way to prevent
                 // DoS attacks via replacements.
                 //
-                // The mining code doesn't (currently) take children into
-                // account (CPFP) so we only consider the feerates of
-                // transactions being directly replaced, not their indirect
-                // descendants. While that does mean high feerate children are
-                // ignored when deciding whether or not to replace, we do
-                // require the replacement to pay more overall fees too,
-                // mitigating most cases.
-                CFeeRate oldFeeRate(mi->GetModifiedFee(), mi->GetTxSize());
+                // The mining code takes transactions by the chunks of their
+                // cluster, so compare with the feerate of the chunk that the
+                // directly replaced transaction is mined in: a high feerate
+                // child pays for it, a low feerate parent holds it back. We
+                // require the replacement to pay more overall fees too.
+                CFeeRate oldFeeRate = pool.GetChunkFeeRate(mi);
                 if (newFeeRate <= oldFeeRate)
                 {
                     return state.DoS(0, false,
@@ -893,92 +969,202 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
             }
         }
 
-        unsigned int scriptVerifyFlags = STANDARD_SCRIPT_VERIFY_FLAGS;
+        ws.scriptVerifyFlags = STANDARD_SCRIPT_VERIFY_FLAGS;
         if (!chainparams.RequireStandard()) {
-            scriptVerifyFlags = gArgs.GetArg("-promiscuousmempoolflags", scriptVerifyFlags);
-        }
-
-        // Check against previous transactions
-        // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        PrecomputedTransactionData txdata(tx);
-        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true, false, txdata)) {
-            // SCRIPT_VERIFY_CLEANSTACK requires SCRIPT_VERIFY_WITNESS, so we
-            // need to turn both off, and compare against just turning off CLEANSTACK
-            // to see if the failure is specifically due to witness validation.
-            CValidationState stateDummy; // Want reported failures to be from first CheckInputs
-            if (!tx.HasWitness() && CheckInputs(tx, stateDummy, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, false, txdata) &&
-                !CheckInputs(tx, stateDummy, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, false, txdata)) {
-                // Only the witness is missing, so the transaction itself may be fine.
-                state.SetCorruptionPossible();
-            }
-            return false; // state filled in by CheckInputs
-        }
-
-        // Check again against the current block tip's script verification
-        // flags to cache our script execution flags. This is, of course,
-        // useless if the next block has different script flags from the
-        // previous one, but because the cache tracks script flags for us it
-        // will auto-invalidate and we'll just have a few blocks of extra
-        // misses on soft-fork activation.
-        //
-        // This is also useful in case of bugs in the standard flags that cause
-        // transactions to pass as valid when they're actually invalid. For
-        // instance the STRICTENC flag was incorrectly allowing certain
-        // CHECKSIG NOT scripts to pass, even though they were invalid.
-        //
-        // There is a similar check in CreateNewBlock() to prevent creating
-        // invalid blocks (using TestBlockValidity), however allowing such
-        // transactions into the mempool can be exploited as a DoS attack.
-        unsigned int currentBlockScriptVerifyFlags = GetBlockScriptFlags(chainActive.Tip(), Params().GetConsensus());
-        if (!CheckInputsFromMempoolAndCache(tx, state, view, pool, currentBlockScriptVerifyFlags, true, txdata))
-        {
-            // If we're using promiscuousmempoolflags, we may hit this normally
-            // Check if current block has some flags that scriptVerifyFlags
-            // does not before printing an ominous warning
-            if (!(~scriptVerifyFlags & currentBlockScriptVerifyFlags)) {
-                return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against latest-block but not STANDARD flags %s, %s",
+            ws.scriptVerifyFlags = gArgs.GetArg("-promiscuousmempoolflags", ws.scriptVerifyFlags);
+        }
+    }
+
+    ws.currentBlockScriptVerifyFlags = GetBlockScriptFlags(chainActive.Tip(), chainparams.GetConsensus());
+    ws.pindexTip = chainActive.Tip();
+    ws.nMempoolUpdated = pool.GetTransactionsUpdated();
+    return true;
+}
+
+/**
+ * CheckInputs for a transaction entering the mempool, with its script checks
+ * spread over the script check threads unless they are busy with a block or
+ * another transaction.
+ */
+static bool CheckInputsForMemPool(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, unsigned int flags, PrecomputedTransactionData& txdata)
+{
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads && tx.vin.size() > 1 ? &scriptcheckqueue : nullptr, std::try_to_lock);
+    if (!control.HasQueue())
+        return CheckInputs(tx, state, view, true, flags, true, false, txdata);
+
+    std::vector<CScriptCheck> vChecks;
+    if (!CheckInputs(tx, state, view, true, flags, true, false, txdata, &vChecks))
+        return false;
+    control.Add(vChecks);
+    if (control.Wait())
+        return true;
+    // The queue only tells that a check failed, so run them again here to fill in state.
+    return CheckInputs(tx, state, view, true, flags, true, false, txdata);
+}
+
+/** Verify the scripts of a transaction that passed PreChecks. Needs neither cs_main nor the mempool lock. */
+static bool CheckMemPoolScripts(CValidationState& state, MemPoolAcceptState& ws)
+{
+    const CTransaction& tx = *ws.ptx;
+    CCoinsViewCache& view = ws.view;
+    PrecomputedTransactionData& txdata = ws.txdata;
+    const unsigned int scriptVerifyFlags = ws.scriptVerifyFlags;
+
+    // Check against previous transactions
+    // This is done last to help prevent CPU exhaustion denial-of-service attacks.
+    if (!CheckInputsForMemPool(tx, state, view, scriptVerifyFlags, txdata)) {
+        // SCRIPT_VERIFY_CLEANSTACK requires SCRIPT_VERIFY_WITNESS, so we
+        // need to turn both off, and compare against just turning off CLEANSTACK
+        // to see if the failure is specifically due to witness validation.
+        CValidationState stateDummy; // Want reported failures to be from first CheckInputs
+        if (!tx.HasWitness() && CheckInputs(tx, stateDummy, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, false, txdata) &&
+            !CheckInputs(tx, stateDummy, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, false, txdata)) {
+            // Only the witness is missing, so the transaction itself may be fine.
+            state.SetCorruptionPossible();
+        }
+        return false; // state filled in by CheckInputs
+    }
+
+    // Run them against the script verification flags of the tip as well,
+    // which is cheap now that the signatures are cached. Only the signature
+    // cache is filled here: the tip may change before Finalize, which checks
+    // these again under the locks and is the only one to store the result in
+    // the script execution cache.
+    CValidationState stateDummy;
+    CheckInputs(tx, stateDummy, view, true, ws.currentBlockScriptVerifyFlags, true, false, txdata);
+    return true;
+}
+
+/** Add a transaction that passed PreChecks and CheckMemPoolScripts to the mempool. */
+static bool Finalize(const CChainParams& chainparams, CTxMemPool& pool, CValidationState& state, MemPoolAcceptState& ws,
+                     std::list<CTransactionRef>* plTxnReplaced, bool bypass_limits)
+{
+    const CTransaction& tx = *ws.ptx;
+    const uint256 hash = tx.GetHash();
+    AssertLockHeld(cs_main);
+    AssertLockHeld(pool.cs);
+    CCoinsViewCache& view = ws.view;
+    PrecomputedTransactionData& txdata = ws.txdata;
+    const unsigned int scriptVerifyFlags = ws.scriptVerifyFlags;
+    const unsigned int currentBlockScriptVerifyFlags = GetBlockScriptFlags(chainActive.Tip(), chainparams.GetConsensus());
+    const CTxMemPoolEntry& entry = *ws.entry;
+    const unsigned int nSize = entry.GetTxSize();
+    const CAmount nModifiedFees = ws.nModifiedFees;
+    const CAmount nConflictingFees = ws.nConflictingFees;
+    const size_t nConflictingSize = ws.nConflictingSize;
+    const bool fReplacementTransaction = ws.fReplacementTransaction;
+    CTxMemPool::setEntries& allConflicting = ws.allConflicting;
+    CTxMemPool::setEntries& setAncestors = ws.setAncestors;
+
+    // Check again against the current block tip's script verification
+    // flags to cache our script execution flags. This is, of course,
+    // useless if the next block has different script flags from the
+    // previous one, but because the cache tracks script flags for us it
+    // will auto-invalidate and we'll just have a few blocks of extra
+    // misses on soft-fork activation.
+    //
+    // This is also useful in case of bugs in the standard flags that cause
+    // transactions to pass as valid when they're actually invalid. For
+    // instance the STRICTENC flag was incorrectly allowing certain
+    // CHECKSIG NOT scripts to pass, even though they were invalid.
+    //
+    // There is a similar check in CreateNewBlock() to prevent creating
+    // invalid blocks (using TestBlockValidity), however allowing such
+    // transactions into the mempool can be exploited as a DoS attack.
+    if (!CheckInputsFromMempoolAndCache(tx, state, view, pool, currentBlockScriptVerifyFlags, true, txdata))
+    {
+        // If we're using promiscuousmempoolflags, we may hit this normally
+        // Check if current block has some flags that scriptVerifyFlags
+        // does not before printing an ominous warning
+        if (!(~scriptVerifyFlags & currentBlockScriptVerifyFlags)) {
+            return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against latest-block but not STANDARD flags %s, %s",
+                __func__, hash.ToString(), FormatStateMessage(state));
+        } else {
+            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, false, txdata)) {
+                return error("%s: ConnectInputs failed against MANDATORY but not STANDARD flags due to promiscuous mempool %s, %s",
                     __func__, hash.ToString(), FormatStateMessage(state));
             } else {
-                if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, false, txdata)) {
-                    return error("%s: ConnectInputs failed against MANDATORY but not STANDARD flags due to promiscuous mempool %s, %s",
-                        __func__, hash.ToString(), FormatStateMessage(state));
-                } else {
-                    LogPrintf("Warning: -promiscuousmempool flags set to not include currently enforced soft forks, this may break mining or otherwise cause instability!\n");
-                }
+                LogPrintf("Warning: -promiscuousmempool flags set to not include currently enforced soft forks, this may break mining or otherwise cause instability!\n");
             }
         }
+    }
 
-        // Remove conflicting transactions from the mempool
-        for (const CTxMemPool::txiter it : allConflicting)
-        {
-            LogPrint(BCLog::MEMPOOL, "replacing tx %s with %s for %s BTC additional fees, %d delta bytes\n",
-                    it->GetTx().GetHash().ToString(),
-                    hash.ToString(),
-                    FormatMoney(nModifiedFees - nConflictingFees),
-                    (int)nSize - (int)nConflictingSize);
-            if (plTxnReplaced)
-                plTxnReplaced->push_back(it->GetSharedTx());
-        }
-        pool.RemoveStaged(allConflicting, false, MemPoolRemovalReason::REPLACED);
+    // Transactions of the same batch generation added since PreChecks may
+    // have grown the clusters this one joins, without touching its ancestors
+    const uint64_t nLimitCluster = gArgs.GetArg("-limitclustercount", DEFAULT_CLUSTER_LIMIT);
+    const uint64_t nClusterCount = pool.CalculateClusterCount(setAncestors);
+    if (nClusterCount > nLimitCluster) {
+        return state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false,
+                         strprintf("too many transactions in cluster [limit: %u]", nLimitCluster));
+    }
+
+    // Remove conflicting transactions from the mempool
+    for (const CTxMemPool::txiter it : allConflicting)
+    {
+        LogPrint(BCLog::MEMPOOL, "replacing tx %s with %s for %s BTC additional fees, %d delta bytes\n",
+                it->GetTx().GetHash().ToString(),
+                hash.ToString(),
+                FormatMoney(nModifiedFees - nConflictingFees),
+                (int)nSize - (int)nConflictingSize);
+        if (plTxnReplaced)
+            plTxnReplaced->push_back(it->GetSharedTx());
+    }
+    pool.RemoveStaged(allConflicting, false, MemPoolRemovalReason::REPLACED);
 
-        // This transaction should only count for fee estimation if:
-        // - it isn't a BIP 125 replacement transaction (may not be widely supported)
-        // - it's not being readded during a reorg which bypasses typical mempool fee limits
-        // - the node is not behind
-        // - the transaction is not dependent on any other transactions in the mempool
-        bool validForFeeEstimation = !fReplacementTransaction && !bypass_limits && IsCurrentForFeeEstimation() && pool.HasNoInputsOf(tx);
+    // This transaction should only count for fee estimation if:
+    // - it isn't a BIP 125 replacement transaction (may not be widely supported)
+    // - it's not being readded during a reorg which bypasses typical mempool fee limits
+    // - the node is not behind
+    // - the transaction is not dependent on any other transactions in the mempool
+    bool validForFeeEstimation = !fReplacementTransaction && !bypass_limits && IsCurrentForFeeEstimation() && pool.HasNoInputsOf(tx);
 
-        // Store transaction in memory
-        pool.addUnchecked(hash, entry, setAncestors, validForFeeEstimation);
+    // Store transaction in memory
+    pool.addUnchecked(hash, entry, setAncestors, validForFeeEstimation);
 
-        // trim mempool and check if tx was trimmed
-        if (!bypass_limits) {
-            LimitMempoolSize(pool, gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
-            if (!pool.exists(hash))
-                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
-        }
+    // trim mempool and check if tx was trimmed
+    if (!bypass_limits) {
+        LimitMempoolSize(pool, gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+        if (!pool.exists(hash))
+            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+    }
+
+    return true;
+}
+
+static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx,
+                              bool* pfMissingInputs, int64_t nAcceptTime, std::list<CTransactionRef>* plTxnReplaced,
+                              bool bypass_limits, const CAmount& nAbsurdFee, std::vector<COutPoint>& coins_to_uncache)
+{
+    if (pfMissingInputs) {
+        *pfMissingInputs = false;
     }
 
+    std::unique_ptr<MemPoolAcceptState> ws(new MemPoolAcceptState(ptx));
+    {
+        LOCK2(cs_main, pool.cs);
+        if (!PreChecks(chainparams, pool, state, *ws, pfMissingInputs, nAcceptTime, bypass_limits, nAbsurdFee, coins_to_uncache))
+            return false;
+    }
+
+    // The scripts are verified without holding cs_main or the mempool lock
+    // (unless the caller holds them), so that several threads can accept
+    // transactions at once and blocks can be connected meanwhile.
+    if (!CheckMemPoolScripts(state, *ws))
+        return false;
+
+    LOCK2(cs_main, pool.cs); // mempool "read lock" (held through GetMainSignals().TransactionAddedToMempool())
+    if (ws->pindexTip != chainActive.Tip() || ws->nMempoolUpdated != pool.GetTransactionsUpdated()) {
+        // The tip or the mempool changed while the scripts were verified, so
+        // redo the other checks. The scripts need not be verified again: the
+        // outputs they spend are committed to by the prevouts, and only
+        // whether they are still unspent may have changed.
+        ws.reset(new MemPoolAcceptState(ptx));
+        if (!PreChecks(chainparams, pool, state, *ws, pfMissingInputs, nAcceptTime, bypass_limits, nAbsurdFee, coins_to_uncache))
+            return false;
+    }
+    if (!Finalize(chainparams, pool, state, *ws, plTxnReplaced, bypass_limits))
+        return false;
+
     GetMainSignals().TransactionAddedToMempool(ptx);
 
     return true;
@@ -991,6 +1177,7 @@ static bool AcceptToMemoryPoolWithTime(const CChainParams& chainparams, CTxMemPo
 {
     std::vector<COutPoint> coins_to_uncache;
     bool res = AcceptToMemoryPoolWorker(chainparams, pool, state, tx, pfMissingInputs, nAcceptTime, plTxnReplaced, bypass_limits, nAbsurdFee, coins_to_uncache);
+    LOCK(cs_main);
     if (!res) {
         for (const COutPoint& hashTx : coins_to_uncache)
             pcoinsTip->Uncache(hashTx);
@@ -1009,6 +1196,165 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return AcceptToMemoryPoolWithTime(chainparams, pool, state, tx, pfMissingInputs, GetTime(), plTxnReplaced, bypass_limits, nAbsurdFee);
 }
 
+/**
+ * Add one generation of a batch to the memory pool: transactions that don't
+ * spend each other's outputs. Their scripts are verified together, and they
+ * are added in one pass under the locks.
+ */
+static void AcceptGenerationToMemoryPool(const CChainParams& chainparams, CTxMemPool& pool, const std::vector<CTransactionRef>& txs,
+                                         const std::vector<size_t>& vGeneration, const std::vector<int64_t>& vAcceptTime, const CAmount nAbsurdFee,
+                                         bool bypass_limits, std::vector<CValidationState>& states, std::vector<bool>& vAccepted,
+                                         std::vector<bool>& vMissingInputs, std::vector<COutPoint>& coins_to_uncache)
+{
+    std::vector<std::unique_ptr<MemPoolAcceptState>> vws(vGeneration.size());
+    unsigned int nPreChecked;
+    {
+        LOCK2(cs_main, pool.cs);
+        nPreChecked = pool.GetTransactionsUpdated();
+        for (size_t k = 0; k < vGeneration.size(); k++) {
+            const size_t i = vGeneration[k];
+            vws[k].reset(new MemPoolAcceptState(txs[i]));
+            bool fMissingInputs = false;
+            if (!PreChecks(chainparams, pool, states[i], *vws[k], &fMissingInputs, vAcceptTime[i], bypass_limits, nAbsurdFee, coins_to_uncache)) {
+                vMissingInputs[i] = fMissingInputs;
+                vws[k].reset();
+            }
+        }
+    }
+
+    // Spread the script checks of the whole generation over the script
+    // check threads. This fills the signature cache, so that checking them
+    // per transaction afterwards, to tell which failed and why, is cheap.
+    if (nScriptCheckThreads) {
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        for (const std::unique_ptr<MemPoolAcceptState>& ws : vws) {
+            if (!ws)
+                continue;
+            std::vector<CScriptCheck> vChecks;
+            CValidationState stateDummy;
+            if (CheckInputs(*ws->ptx, stateDummy, ws->view, true, ws->scriptVerifyFlags, true, false, ws->txdata, &vChecks))
+                control.Add(vChecks);
+        }
+        control.Wait();
+    }
+    for (size_t k = 0; k < vGeneration.size(); k++) {
+        if (vws[k] && !CheckMemPoolScripts(states[vGeneration[k]], *vws[k]))
+            vws[k].reset();
+    }
+
+    // Adding the transactions of the generation changes the mempool, but the
+    // PreChecks of the rest only need to be redone if they spend the same
+    // outputs as one that was added, or share an in-mempool ancestor whose
+    // descendant limits it counts against. Any other change, such as a
+    // replacement, trimming or a change while the locks were released, has
+    // them redone for all.
+    LOCK2(cs_main, pool.cs);
+    bool fStale = nPreChecked != pool.GetTransactionsUpdated();
+    std::set<COutPoint> setSpentByAdded;
+    CTxMemPool::setEntries setAncestorsOfAdded;
+    for (size_t k = 0; k < vGeneration.size(); k++) {
+        const size_t i = vGeneration[k];
+        if (!vws[k])
+            continue;
+        bool fRecheck = fStale || vws[k]->pindexTip != chainActive.Tip();
+        for (size_t n = 0; !fRecheck && n < txs[i]->vin.size(); n++) {
+            fRecheck = setSpentByAdded.count(txs[i]->vin[n].prevout) != 0;
+        }
+        for (CTxMemPool::setEntries::const_iterator it = vws[k]->setAncestors.begin(); !fRecheck && it != vws[k]->setAncestors.end(); ++it) {
+            fRecheck = setAncestorsOfAdded.count(*it) != 0;
+        }
+        if (fRecheck) {
+            vws[k].reset(new MemPoolAcceptState(txs[i]));
+            bool fMissingInputs = false;
+            if (!PreChecks(chainparams, pool, states[i], *vws[k], &fMissingInputs, vAcceptTime[i], bypass_limits, nAbsurdFee, coins_to_uncache)) {
+                vMissingInputs[i] = fMissingInputs;
+                continue;
+            }
+        }
+        const unsigned int nUpdated = pool.GetTransactionsUpdated();
+        const bool fAdded = Finalize(chainparams, pool, states[i], *vws[k], nullptr /* plTxnReplaced */, bypass_limits);
+        if (pool.GetTransactionsUpdated() != nUpdated + (fAdded ? 1 : 0))
+            fStale = true;
+        if (!fAdded)
+            continue;
+        for (const CTxIn& txin : txs[i]->vin) {
+            setSpentByAdded.insert(txin.prevout);
+        }
+        setAncestorsOfAdded.insert(vws[k]->setAncestors.begin(), vws[k]->setAncestors.end());
+        vAccepted[i] = true;
+        GetMainSignals().TransactionAddedToMempool(txs[i]);
+    }
+}
+
+/** AcceptToMemoryPoolBatch with a specified acceptance time for every transaction */
+static void AcceptToMemoryPoolBatchWithTime(const CChainParams& chainparams, CTxMemPool& pool, const std::vector<CTransactionRef>& txs,
+                                            const std::vector<int64_t>& vAcceptTime, std::vector<CValidationState>& states,
+                                            std::vector<bool>& vAccepted, std::vector<bool>& vMissingInputs, const CAmount nAbsurdFee,
+                                            bool bypass_limits)
+{
+    states.assign(txs.size(), CValidationState());
+    vAccepted.assign(txs.size(), false);
+    vMissingInputs.assign(txs.size(), false);
+
+    // Sort the transactions into generations, each of which only spends
+    // outputs of the ones before it, besides the chain and the mempool.
+    std::map<uint256, size_t> mapIndex;
+    for (size_t i = 0; i < txs.size(); i++) {
+        mapIndex.emplace(txs[i]->GetHash(), i);
+    }
+    std::vector<std::vector<size_t>> vChildren(txs.size());
+    std::vector<size_t> vParentsLeft(txs.size(), 0);
+    std::vector<size_t> vGeneration;
+    for (size_t i = 0; i < txs.size(); i++) {
+        std::set<size_t> setParents;
+        for (const CTxIn& txin : txs[i]->vin) {
+            auto it = mapIndex.find(txin.prevout.hash);
+            if (it != mapIndex.end() && it->second != i)
+                setParents.insert(it->second);
+        }
+        for (size_t parent : setParents) {
+            vChildren[parent].push_back(i);
+        }
+        vParentsLeft[i] = setParents.size();
+        if (setParents.empty())
+            vGeneration.push_back(i);
+    }
+
+    std::vector<COutPoint> coins_to_uncache;
+    while (!vGeneration.empty()) {
+        AcceptGenerationToMemoryPool(chainparams, pool, txs, vGeneration, vAcceptTime, nAbsurdFee, bypass_limits, states, vAccepted, vMissingInputs, coins_to_uncache);
+        std::vector<size_t> vNext;
+        for (size_t i : vGeneration) {
+            for (size_t child : vChildren[i]) {
+                if (--vParentsLeft[child] == 0)
+                    vNext.push_back(child);
+            }
+        }
+        vGeneration.swap(vNext);
+    }
+    {
+        // Linearize the clusters the batch changed once, now that it is all in
+        LOCK(pool.cs);
+        pool.LinearizeDirtyClusters();
+    }
+
+    LOCK(cs_main);
+    for (const COutPoint& outpoint : coins_to_uncache) {
+        // Keep the coins that accepted transactions spend cached, as AcceptToMemoryPool does.
+        if (!pool.isSpent(outpoint))
+            pcoinsTip->Uncache(outpoint);
+    }
+    CValidationState stateDummy;
+    FlushStateToDisk(chainparams, stateDummy, FLUSH_STATE_PERIODIC);
+}
+
+void AcceptToMemoryPoolBatch(CTxMemPool& pool, const std::vector<CTransactionRef>& txs, std::vector<CValidationState>& states,
+                             std::vector<bool>& vAccepted, std::vector<bool>& vMissingInputs, const CAmount nAbsurdFee)
+{
+    const std::vector<int64_t> vAcceptTime(txs.size(), GetTime());
+    AcceptToMemoryPoolBatchWithTime(Params(), pool, txs, vAcceptTime, states, vAccepted, vMissingInputs, nAbsurdFee, false /* bypass_limits */);
+}
+
 /**
  * Return transaction in txOut, and if it was found inside a block, its hash is placed in hashBlock.
  * If blockIndex is provided, the transaction is fetched from the corresponding block.
@@ -1026,28 +1372,8 @@ bool GetTransaction(const uint256& hash, CTransactionRef& txOut, const Consensus
             return true;
         }
 
-        if (fTxIndex) {
-            CDiskTxPos postx;
-            if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-                if (file.IsNull())
-                    return error("%s: OpenBlockFile failed", __func__);
-                CBlockHeader header;
-                try {
-                    file >> header;
-                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
-                } catch (const std::exception& e) {
-                    return error("%s: Deserialize or I/O error - %s", __func__, e.what());
-                }
-                hashBlock = header.GetHash();
-                if (txOut->GetHash() != hash)
-                    return error("%s: txid mismatch", __func__);
-                return true;
-            }
-
-            // transaction not found in index, nothing more can be done
-            return false;
+        if (g_txindex) {
+            return g_txindex->FindTx(hash, hashBlock, txOut);
         }
 
         if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
@@ -1151,6 +1477,39 @@ static bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMes
     return true;
 }
 
+/** Mappings of recently read block and undo files. Disabled where address space is scarce. */
+static CMappedFileCache g_blockfile_mappings(sizeof(void*) >= 8 ? MAX_BLOCKFILE_MAPPINGS : 0);
+
+/**
+ * Locate the record (a block or undo data) stored at pos in a mapping of its
+ * file, checking the message start and length written in front of it. extra
+ * bytes following the record are mapped as well. Returns an empty span if the
+ * file cannot be mapped or the record does not look right; callers then read
+ * it with stdio instead, which reports any error.
+ */
+static CMappedSpan MapDiskRecord(const CDiskBlockPos& pos, const char* prefix, size_t extra)
+{
+    if (pos.IsNull() || pos.nPos < CMessageHeader::MESSAGE_START_SIZE + sizeof(uint32_t))
+        return CMappedSpan();
+
+    const fs::path path = GetBlockPosFilename(pos, prefix);
+    std::shared_ptr<const CMappedFile> file = g_blockfile_mappings.Get(path, pos.nPos);
+    if (!file)
+        return CMappedSpan();
+
+    const unsigned char* header = file->data() + pos.nPos - CMessageHeader::MESSAGE_START_SIZE - sizeof(uint32_t);
+    if (memcmp(header, Params().MessageStart(), CMessageHeader::MESSAGE_START_SIZE) != 0)
+        return CMappedSpan();
+    uint32_t nSize = ReadLE32(header + CMessageHeader::MESSAGE_START_SIZE);
+    uint64_t nEnd = (uint64_t)pos.nPos + nSize + extra;
+    if (file->size() < nEnd) {
+        file = g_blockfile_mappings.Get(path, nEnd);
+        if (!file)
+            return CMappedSpan();
+    }
+    return CMappedSpan(file, file->data() + pos.nPos, nSize);
+}
+
 ///* Generic implementation of block reading that can handle
 //   both a block and its header.  */
 template<typename T>
@@ -1158,14 +1517,18 @@ static bool ReadBlockOrHeader(T& block, const CDiskBlockPos& pos, const Consensu
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
-
-    // Read block
+    // Read block, straight from a mapping of the file if possible
     try {
-        filein >> block;
+        CMappedSpan span = MapDiskRecord(pos, "blk", 0);
+        if (!span.empty()) {
+            SpanReader(SER_DISK, CLIENT_VERSION, span.begin(), span.size()) >> block;
+        } else {
+            // Open history file to read
+            CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+            filein >> block;
+        }
     }
     catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
@@ -1211,19 +1574,65 @@ bool ReadBlockHeaderFromDisk(CBlockHeader& block, const CBlockIndex* pindex, con
     return ReadBlockOrHeader(block, pindex, consensusParams);
 }
 
+bool ReadRawBlockFromDisk(CMappedSpan& block_data, const CDiskBlockPos& pos, const uint256& hash)
+{
+    block_data = MapDiskRecord(pos, "blk", 0);
+    if (block_data.empty())
+        return false;
+    if (block_data.size() < 80 || block_data.size() > MAX_BLOCK_SERIALIZED_SIZE) {
+        block_data = CMappedSpan();
+        return error("ReadRawBlockFromDisk: block at %s has bad size for %s", pos.ToString(), hash.ToString());
+    }
+
+    // Check the header, including any auxpow, like ReadBlockFromDisk does.
+    // The bytes go to peers and into the serialized block cache as they are.
+    CBlockHeader header;
+    try {
+        SpanReader(SER_DISK, CLIENT_VERSION, block_data.begin(), block_data.size()) >> header;
+    } catch (const std::exception& e) {
+        block_data = CMappedSpan();
+        return error("ReadRawBlockFromDisk: Deserialize error - %s at %s", e.what(), pos.ToString());
+    }
+    if (header.GetHash() != hash || !CheckProofOfWork(header, Params().GetConsensus())) {
+        block_data = CMappedSpan();
+        return error("ReadRawBlockFromDisk: block at %s doesn't match %s", pos.ToString(), hash.ToString());
+    }
+    return true;
+}
+
+bool ReadRawBlockFromDisk(CMappedSpan& block_data, const CBlockIndex* pindex)
+{
+    CDiskBlockPos blockPos;
+    {
+        LOCK(cs_main);
+        blockPos = pindex->GetBlockPos();
+    }
+
+    return ReadRawBlockFromDisk(block_data, blockPos, pindex->GetBlockHash());
+}
+
 CAmount GetBlockSubsidy(int nHeight, int nBits, const Consensus::Params& consensusParams)
+{
+    return GetBlockSubsidy(nHeight, nBits, consensusParams, chainActive.Tip());
+}
+
+CAmount GetBlockSubsidy(int nHeight, int nBits, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
+{
+    return GetBlockSubsidy(nHeight, nBits, consensusParams, pindexPrev, pindexPrev->nMoneySupply);
+}
+
+CAmount GetBlockSubsidy(int nHeight, int nBits, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev, CAmount nMoneySupply)
 {
     if (nHeight == 1)
         return 6000000000 * COIN;
 
     CAmount nMoneyLimit = 21000000000 * COIN;
-    CAmount nMoneySupply = chainActive.Tip()->nMoneySupply;
     if (nMoneySupply >= nMoneyLimit)
         return 0;
 
     double multipl = 1.0;
-    CBlockIndex* block = chainActive.Tip();
-    if(chainActive.Height() >= consensusParams.nAveragingInterval) {
+    const CBlockIndex* block = pindexPrev;
+    if(pindexPrev->nHeight >= consensusParams.nAveragingInterval) {
         int nRun = 0;
         while (nRun < consensusParams.nAveragingInterval) {
             int tipHash = UintToArith256(block->GetBlockPoWHash(consensusParams)).GetCompact();
@@ -1443,6 +1852,8 @@ int GetSpendHeight(const CCoinsViewCache& inputs)
 }
 
 
+/** Guards scriptExecutionCache, which transactions entering the mempool use without holding cs_main */
+static CCriticalSection cs_scriptExecutionCache;
 static CuckooCache::cache<uint256, SignatureCacheHasher> scriptExecutionCache;
 static uint256 scriptExecutionCacheNonce(GetRandHash());
 
@@ -1496,9 +1907,11 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
             // round - giving us 19 + 32 + 4 = 55 bytes (+ 8 + 1 = 64)
             static_assert(55 - sizeof(flags) - 32 >= 128/8, "Want at least 128 bits of nonce for script execution cache");
             CSHA256().Write(scriptExecutionCacheNonce.begin(), 55 - sizeof(flags) - 32).Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
-            AssertLockHeld(cs_main); //TODO: Remove this requirement by making CuckooCache not require external locks
-            if (scriptExecutionCache.contains(hashCacheEntry, !cacheFullScriptStore)) {
-                return true;
+            {
+                LOCK(cs_scriptExecutionCache);
+                if (scriptExecutionCache.contains(hashCacheEntry, !cacheFullScriptStore)) {
+                    return true;
+                }
             }
 
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
@@ -1544,6 +1957,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
             if (cacheFullScriptStore && !pvChecks) {
                 // We executed all of the provided scripts, and were told to
                 // cache the result. Do so now.
+                LOCK(cs_scriptExecutionCache);
                 scriptExecutionCache.insert(hashCacheEntry);
             }
         }
@@ -1581,21 +1995,14 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
     return true;
 }
 
-static bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex *pindex)
-{
-    CDiskBlockPos pos = pindex->GetUndoPos();
-    if (pos.IsNull()) {
-        return error("%s: no undo data available", __func__);
-    }
-
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("%s: OpenUndoFile failed", __func__);
+} // namespace
 
+template<typename Stream>
+static bool UndoReadFromStream(CBlockUndo& blockundo, Stream& filein, const CBlockIndex* pindex)
+{
     // Read block
     uint256 hashChecksum;
-    CHashVerifier<CAutoFile> verifier(&filein); // We need a CHashVerifier as reserializing may lose data
+    CHashVerifier<Stream> verifier(&filein); // We need a CHashVerifier as reserializing may lose data
     try {
         verifier << pindex->pprev->GetBlockHash();
         verifier >> blockundo;
@@ -1612,6 +2019,40 @@ static bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex *pindex)
     return true;
 }
 
+/** Read the undo data of pindex at pos, without cs_main, as the block check threads do */
+static bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const CBlockIndex *pindex)
+{
+    if (pos.IsNull()) {
+        return error("%s: no undo data available", __func__);
+    }
+
+    // Read from a mapping of the file if possible; the checksum follows the undo data
+    CMappedSpan span = MapDiskRecord(pos, "rev", sizeof(uint256));
+    if (!span.empty()) {
+        SpanReader filein(SER_DISK, CLIENT_VERSION, span.begin(), span.size() + sizeof(uint256));
+        return UndoReadFromStream(blockundo, filein, pindex);
+    }
+
+    // Open history file to read
+    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenUndoFile failed", __func__);
+
+    return UndoReadFromStream(blockundo, filein, pindex);
+}
+
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex *pindex)
+{
+    CDiskBlockPos pos;
+    {
+        LOCK(cs_main);
+        pos = pindex->GetUndoPos();
+    }
+    return UndoReadFromDisk(blockundo, pos, pindex);
+}
+
+namespace {
+
 /** Abort with a message */
 bool AbortNode(const std::string& strMessage, const std::string& userMessage="")
 {
@@ -1667,22 +2108,36 @@ int ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
 }
 
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
- *  When FAILED is returned, view is left in an indeterminate state. */
-DisconnectResult CChainState::DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, CCoinsViewCache& view)
+ *  When FAILED is returned, view is left in an indeterminate state.
+ *  If pstatsdelta is given, it receives the change the block made to the UTXO set statistics. */
+DisconnectResult CChainState::DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, CCoinsViewCache& view, CUTXOStatsDelta* pstatsdelta)
 {
-    bool fClean = true;
-
     CBlockUndo blockUndo;
     if (!UndoReadFromDisk(blockUndo, pindex)) {
         error("DisconnectBlock(): failure reading undo data");
         return DISCONNECT_FAILED;
     }
 
+    return DisconnectBlock(block, blockUndo, pindex, view, pstatsdelta);
+}
+
+/** Undo the effects of this block with its undo data, which was read already.
+ *  The coins of blockUndo are moved into the view. */
+DisconnectResult CChainState::DisconnectBlock(const CBlock& block, CBlockUndo& blockUndo, const CBlockIndex* pindex, CCoinsViewCache& view, CUTXOStatsDelta* pstatsdelta)
+{
+    bool fClean = true;
+
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size()) {
         error("DisconnectBlock(): block and undo data inconsistent");
         return DISCONNECT_FAILED;
     }
 
+    // Must happen before the undo coins are moved back into the view below
+    if (pstatsdelta && !ComputeUTXOStatsDelta(block, blockUndo, pindex->nHeight, *pstatsdelta)) {
+        error("DisconnectBlock(): block and undo data inconsistent");
+        return DISCONNECT_FAILED;
+    }
+
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
         const CTransaction &tx = *(block.vtx[i]);
@@ -1725,31 +2180,86 @@ DisconnectResult CChainState::DisconnectBlock(const CBlock& block, const CBlockI
     return fClean ? DISCONNECT_OK : DISCONNECT_UNCLEAN;
 }
 
-void static FlushBlockFile(bool fFinalize = false)
+/**
+ * Whether a block or undo file is mapped by a reader outside the mapping
+ * cache, e.g. one sending a block to a peer from a CMappedSpan. Such files
+ * are neither pruned nor truncated until the reader is done.
+ */
+static bool BlockFileInUse(int nFile)
 {
-    LOCK(cs_LastBlockFile);
+    const CDiskBlockPos pos(nFile, 0);
+    return g_blockfile_mappings.InUse(GetBlockPosFilename(pos, "blk")) || g_blockfile_mappings.InUse(GetBlockPosFilename(pos, "rev"));
+}
 
-    CDiskBlockPos posOld(nLastBlockFile, 0);
+/**
+ * Commit a block file and its undo file to disk, and if fTruncate, cut off
+ * the space preallocated past their ends. A mapping still in use may extend
+ * past the end the file is truncated to, so the truncation of such a file is
+ * put off until a later flush finds it released.
+ */
+static void CommitBlockFile(int nFile, bool fTruncate)
+{
+    AssertLockHeld(cs_LastBlockFile);
+
+    CDiskBlockPos pos(nFile, 0);
+
+    if (fTruncate) {
+        // Don't leave mappings that extend past the truncated ends of the files.
+        g_blockfile_mappings.Forget(GetBlockPosFilename(pos, "blk"));
+        g_blockfile_mappings.Forget(GetBlockPosFilename(pos, "rev"));
 
-    FILE *fileOld = OpenBlockFile(posOld);
+        if (BlockFileInUse(nFile)) {
+            LogPrintf("%s: putting off truncation of block file %05u in use\n", __func__, nFile);
+            setPendingTruncation.insert(nFile);
+            fTruncate = false;
+        } else {
+            setPendingTruncation.erase(nFile);
+        }
+    }
+
+    FILE *fileOld = OpenBlockFile(pos);
     if (fileOld) {
-        if (fFinalize)
-            TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nSize);
+        if (fTruncate)
+            TruncateFile(fileOld, vinfoBlockFile[nFile].nSize);
         FileCommit(fileOld);
         fclose(fileOld);
     }
 
-    fileOld = OpenUndoFile(posOld);
+    fileOld = OpenUndoFile(pos);
     if (fileOld) {
-        if (fFinalize)
-            TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nUndoSize);
+        if (fTruncate)
+            TruncateFile(fileOld, vinfoBlockFile[nFile].nUndoSize);
         FileCommit(fileOld);
         fclose(fileOld);
     }
 }
 
+void static FlushBlockFile(bool fFinalize = false)
+{
+    LOCK(cs_LastBlockFile);
+
+    // Retry the truncations put off earlier. Copy the set, as it is changed
+    // by CommitBlockFile.
+    const std::set<int> setRetry = setPendingTruncation;
+    for (int nFile : setRetry) {
+        if (nFile != nLastBlockFile && !BlockFileInUse(nFile)) {
+            CommitBlockFile(nFile, true);
+        }
+    }
+
+    CommitBlockFile(nLastBlockFile, fFinalize);
+}
+
 static bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
+/** Set the money supply after a connected block in its index entry and write the entry. */
+static bool WriteBlockMoneySupply(CBlockIndex* pindex, CAmount nMoneySupply)
+{
+    pindex->nMoneySupply = nMoneySupply;
+    CDiskBlockIndex blockindex(pindex);
+    return pblocktree->WriteBlockIndex(blockindex);
+}
+
 static bool WriteUndoDataForBlock(const CBlockUndo& blockundo, CValidationState& state, CBlockIndex* pindex, const CChainParams& chainparams)
 {
     // Write undo information to disk
@@ -1769,27 +2279,79 @@ static bool WriteUndoDataForBlock(const CBlockUndo& blockundo, CValidationState&
     return true;
 }
 
-static bool WriteTxIndexDataForBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex)
+/**
+ * Closure representing one context-free check of (part of) a block or a
+ * header. These need no chain state, so they are run on the block check
+ * threads without holding cs_main.
+ */
+/** Set while the current thread runs a CBlockCheck, which must not wait for block checks of its own */
+static thread_local bool fInBlockCheck = false;
+
+class CBlockCheck
 {
-    if (!fTxIndex) return true;
+private:
+    std::function<bool()> m_check;
 
-    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
-    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
-    vPos.reserve(block.vtx.size());
-    for (const CTransactionRef& tx : block.vtx)
+public:
+    CBlockCheck() {}
+    explicit CBlockCheck(std::function<bool()> check) : m_check(std::move(check)) {}
+
+    bool operator()()
     {
-        vPos.push_back(std::make_pair(tx->GetHash(), pos));
-        pos.nTxOffset += ::GetSerializeSize(*tx, SER_DISK, CLIENT_VERSION);
+        const bool fWasInBlockCheck = fInBlockCheck;
+        fInBlockCheck = true;
+        const bool fRet = m_check();
+        fInBlockCheck = fWasInBlockCheck;
+        return fRet;
     }
 
-    if (!pblocktree->WriteTxIndex(vPos)) {
-        return AbortNode(state, "Failed to write transaction index");
-    }
+    void swap(CBlockCheck& check) { m_check.swap(check.m_check); }
+};
 
-    return true;
+static CCheckQueue<CBlockCheck> blockcheckqueue(8);
+
+/** Number of transactions CheckBlock hands to one CBlockCheck */
+static const size_t BLOCK_CHECK_TXS_PER_CHECK = 64;
+/** Number of headers whose proof of work ProcessNewBlockHeaders checks at once */
+static const size_t HEADERS_POW_CHECK_BATCH = 16;
+
+void ThreadBlockCheck() {
+    RenameThread("bitcoin-blockch");
+    blockcheckqueue.Thread();
 }
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+/** Run checks on the block check threads, or on this thread if there are none. Returns whether all passed. */
+static bool RunBlockChecks(std::vector<CBlockCheck>& vChecks)
+{
+    if (!nBlockCheckThreads) {
+        for (CBlockCheck& check : vChecks)
+            if (!check())
+                return false;
+        return true;
+    }
+    CCheckQueueControl<CBlockCheck> control(&blockcheckqueue);
+    control.Add(vChecks);
+    return control.Wait();
+}
+
+/**
+ * Script checks of a run of blocks that are connected without waiting for
+ * the checks of one block before connecting the next. See
+ * CChainState::ConnectTipsPipelined.
+ */
+struct ScriptCheckPipeline
+{
+    //! Precomputed data of the transactions being checked. The vectors never move once added.
+    std::list<std::vector<PrecomputedTransactionData>> txdata;
+    //! Declared after txdata, so that the checks are finished before it is destroyed.
+    CCheckQueueControl<CScriptCheck> control;
+    //! Undo data of the blocks connected, to be written once their scripts verified
+    std::vector<CBlockUndo> vUndo;
+    //! Money supply after each block connected, to be set in its index entry then too
+    std::vector<CAmount> vMoneySupply;
+
+    ScriptCheckPipeline() : control(&scriptcheckqueue) {}
+};
 
 void ThreadScriptCheck() {
     RenameThread("bitcoin-scriptch");
@@ -1890,7 +2452,8 @@ static int64_t nBlocksTotal = 0;
  *  Validity checks that depend on the UTXO set are also done; ConnectBlock()
  *  can fail if those validity checks fail (among other reasons). */
 bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex,
-                  CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck)
+                  CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck, CUTXOStatsDelta* pstatsdelta,
+                  ScriptCheckPipeline* pipeline)
 {
     AssertLockHeld(cs_main);
     assert(pindex);
@@ -2010,7 +2573,11 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
 
     CBlockUndo blockundo;
 
-    CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : nullptr);
+    // With a pipeline the checks are queued on its control and left running
+    // when we return; the caller waits for them before the block is applied.
+    assert(!pipeline || (!fJustCheck && nScriptCheckThreads));
+    CCheckQueueControl<CScriptCheck> control_local(fScriptChecks && nScriptCheckThreads && !pipeline ? &scriptcheckqueue : nullptr);
+    CCheckQueueControl<CScriptCheck>& control = pipeline ? pipeline->control : control_local;
 
     CAmount nCoinCreation = 0;
     std::vector<int> prevheights;
@@ -2018,7 +2585,9 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
     int nInputs = 0;
     int64_t nSigOpsCost = 0;
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
-    std::vector<PrecomputedTransactionData> txdata;
+    std::vector<PrecomputedTransactionData> txdata_local;
+    if (pipeline) pipeline->txdata.emplace_back();
+    std::vector<PrecomputedTransactionData>& txdata = pipeline ? pipeline->txdata.back() : txdata_local;
     txdata.reserve(block.vtx.size()); // Required so that pointers to individual PrecomputedTransactionData don't get invalidated
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
@@ -2081,26 +2650,23 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
         UpdateCoins(tx, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
     }
 
-    if (!fJustCheck)
-    {
-        // badcoin: track money supply
-        pindex->nMoneySupply = (pindex->pprev ? pindex->pprev->nMoneySupply : 0) + nCoinCreation;
-        CDiskBlockIndex blockindex(pindex);
-        if (!pblocktree->WriteBlockIndex(blockindex))
-            return error("Failed to write block index for moneysupply");
-    }
+    // badcoin: track money supply. The blocks before this one in a pipeline
+    // have theirs only in the pipeline until their scripts verified.
+    const CAmount nMoneySupplyPrev = pipeline && !pipeline->vMoneySupply.empty() ? pipeline->vMoneySupply.back() :
+                                     pindex->pprev ? pindex->pprev->nMoneySupply : 0;
+    const CAmount nMoneySupply = nMoneySupplyPrev + nCoinCreation;
 
     int64_t nTime3 = GetTimeMicros(); nTimeConnect += nTime3 - nTime2;
     LogPrint(BCLog::BENCH, "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs (%.2fms/blk)]\n", (unsigned)block.vtx.size(), MILLI * (nTime3 - nTime2), MILLI * (nTime3 - nTime2) / block.vtx.size(), nInputs <= 1 ? 0 : MILLI * (nTime3 - nTime2) / (nInputs-1), nTimeConnect * MICRO, nTimeConnect * MILLI / nBlocksTotal);
 
-    CAmount blockReward = nFees + GetBlockSubsidy(pindex->nHeight, pindex->nBits, chainparams.GetConsensus());
+    CAmount blockReward = nFees + GetBlockSubsidy(pindex->nHeight, pindex->nBits, chainparams.GetConsensus(), pindex->pprev, nMoneySupplyPrev);
     if (block.vtx[0]->GetValueOut() > blockReward)
         return state.DoS(100,
                          error("ConnectBlock(): coinbase pays too much (actual=%d vs limit=%d)",
                                block.vtx[0]->GetValueOut(), blockReward),
                                REJECT_INVALID, "bad-cb-amount");
 
-    if (!control.Wait())
+    if (!pipeline && !control.Wait())
         return state.DoS(100, error("%s: CheckQueue failed", __func__), REJECT_INVALID, "block-validation-failed");
     int64_t nTime4 = GetTimeMicros(); nTimeVerify += nTime4 - nTime2;
     LogPrint(BCLog::BENCH, "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs (%.2fms/blk)]\n", nInputs - 1, MILLI * (nTime4 - nTime2), nInputs <= 1 ? 0 : MILLI * (nTime4 - nTime2) / (nInputs-1), nTimeVerify * MICRO, nTimeVerify * MILLI / nBlocksTotal);
@@ -2108,17 +2674,27 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
     if (fJustCheck)
         return true;
 
-    if (!WriteUndoDataForBlock(blockundo, state, pindex, chainparams))
-        return false;
+    if (pstatsdelta && !ComputeUTXOStatsDelta(block, blockundo, pindex->nHeight, *pstatsdelta)) {
+        return error("ConnectBlock(): undo data of %s does not match the block", pindex->GetBlockHash().ToString());
+    }
 
-    if (!pindex->IsValid(BLOCK_VALID_SCRIPTS)) {
+    if (pipeline) {
+        // The caller writes them once the scripts verified, so that a block
+        // that turns out to be invalid gets no undo data and no money supply.
+        pipeline->vUndo.push_back(std::move(blockundo));
+        pipeline->vMoneySupply.push_back(nMoneySupply);
+    } else {
+        if (!WriteBlockMoneySupply(pindex, nMoneySupply))
+            return error("Failed to write block index for moneysupply");
+        if (!WriteUndoDataForBlock(blockundo, state, pindex, chainparams))
+            return false;
+    }
+
+    if (!pipeline && !pindex->IsValid(BLOCK_VALID_SCRIPTS)) {
         pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
         setDirtyBlockIndex.insert(pindex);
     }
 
-    if (!WriteTxIndexDataForBlock(block, state, pindex))
-        return false;
-
     assert(pindex->phashBlock);
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
@@ -2232,6 +2808,9 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState &
             // Flush the chainstate (which may refer to block index entries).
             if (!pcoinsTip->Flush())
                 return AbortNode(state, "Failed to write to coin database");
+            // Keep the coin stats index at least as far along as the chainstate.
+            if (pcoinstatsindex && !pcoinstatsindex->Flush())
+                return AbortNode(state, "Failed to write to coin stats index");
             nLastFlush = nNow;
         }
     }
@@ -2269,6 +2848,74 @@ static void DoWarning(const std::string& strWarning)
     }
 }
 
+static std::shared_ptr<const CChainTipSnapshot> g_chain_tip_snapshot;
+
+std::shared_ptr<const CChainTipSnapshot> GetChainTipSnapshot()
+{
+    return std::atomic_load(&g_chain_tip_snapshot);
+}
+
+const CChainTipSnapshot::Statistics& CChainTipSnapshot::GetStatistics() const
+{
+    std::call_once(m_statistics_once, [this]() {
+        const Consensus::Params& consensusParams = Params().GetConsensus();
+        m_statistics.dNetworkHashPS = GetAverageHashRate(pindex, TIP_SNAPSHOT_HASHPS_BLOCKS);
+        for (int i = 0; i < (int)Consensus::MAX_VERSION_BITS_DEPLOYMENTS; i++) {
+            if (deployments[i].state == THRESHOLD_STARTED) {
+                m_statistics.deploymentStats[i] = VersionBitsStatistics(pindex, consensusParams, static_cast<Consensus::DeploymentPos>(i));
+            }
+        }
+    });
+    return m_statistics;
+}
+
+/** Publish a snapshot of chainActive's tip for GetChainTipSnapshot, or none if there is no tip. */
+static void PublishChainTipSnapshot(const CChainParams& chainParams)
+{
+    AssertLockHeld(cs_main);
+    const CBlockIndex* pindex = chainActive.Tip();
+    if (!pindex) {
+        std::atomic_store(&g_chain_tip_snapshot, std::shared_ptr<const CChainTipSnapshot>());
+        return;
+    }
+
+    const Consensus::Params& consensusParams = chainParams.GetConsensus();
+    std::shared_ptr<CChainTipSnapshot> snapshot = std::make_shared<CChainTipSnapshot>();
+    snapshot->nHeight = pindex->nHeight;
+    snapshot->hashBlock = pindex->GetBlockHash();
+    snapshot->nChainWork = pindex->nChainWork;
+    snapshot->nTime = pindex->GetBlockTime();
+    snapshot->nMedianTimePast = pindex->GetMedianTimePast();
+    snapshot->nMoneySupply = pindex->nMoneySupply;
+    snapshot->dVerificationProgress = GuessVerificationProgress(chainParams.TxData(), pindex);
+    snapshot->fInitialBlockDownload = IsInitialBlockDownload();
+
+    const std::shared_ptr<const CChainTipSnapshot> prev = GetChainTipSnapshot();
+    const int algo = pindex->GetAlgo();
+    if (prev && pindex->pprev && prev->hashBlock == pindex->pprev->GetBlockHash() && algo >= 0 && algo < NUM_ALGOS) {
+        // Only the algo of the new block can have a new last block
+        std::copy(std::begin(prev->nBitsByAlgo), std::end(prev->nBitsByAlgo), std::begin(snapshot->nBitsByAlgo));
+        snapshot->nBitsByAlgo[algo] = pindex->nBits;
+    } else {
+        const unsigned int nBitsLimit = UintToArith256(consensusParams.powLimit).GetCompact();
+        for (int i = 0; i < NUM_ALGOS; i++) {
+            const CBlockIndex* pindexAlgo = GetLastBlockIndexForAlgo(pindex, i);
+            snapshot->nBitsByAlgo[i] = pindexAlgo ? pindexAlgo->nBits : nBitsLimit;
+        }
+    }
+    snapshot->pindex = pindex;
+
+    // The states are cached per period, unlike the statistics of GetStatistics
+    for (int i = 0; i < (int)Consensus::MAX_VERSION_BITS_DEPLOYMENTS; i++) {
+        const Consensus::DeploymentPos pos = static_cast<Consensus::DeploymentPos>(i);
+        CChainTipSnapshot::DeploymentState& deployment = snapshot->deployments[i];
+        deployment.state = VersionBitsState(pindex, consensusParams, pos, versionbitscache);
+        deployment.nSinceHeight = VersionBitsStateSinceHeight(pindex, consensusParams, pos, versionbitscache);
+    }
+
+    std::atomic_store(&g_chain_tip_snapshot, std::shared_ptr<const CChainTipSnapshot>(std::move(snapshot)));
+}
+
 /** Check warning conditions and do some notifications on new chain tip set. */
 void static UpdateTip(const CBlockIndex *pindexNew, const CChainParams& chainParams) {
     // New best block
@@ -2279,6 +2926,7 @@ void static UpdateTip(const CBlockIndex *pindexNew, const CChainParams& chainPar
         hashBestBlock = pindexNew->GetBlockHash();
         cvBlockChange.notify_all();
     }
+    PublishChainTipSnapshot(chainParams);
 
     std::vector<std::string> warningMessages;
     if (!IsInitialBlockDownload())
@@ -2352,16 +3000,28 @@ bool CChainState::DisconnectTip(CValidationState& state, const CChainParams& cha
     {
         CCoinsViewCache view(pcoinsTip.get());
         assert(view.GetBestBlock() == pindexDelete->GetBlockHash());
-        if (DisconnectBlock(block, pindexDelete, view) != DISCONNECT_OK)
+        CUTXOStatsDelta statsdelta;
+        if (DisconnectBlock(block, pindexDelete, view, pcoinstatsindex ? &statsdelta : nullptr) != DISCONNECT_OK)
             return error("DisconnectTip(): DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
         bool flushed = view.Flush();
         assert(flushed);
+        if (pcoinstatsindex)
+            pcoinstatsindex->BlockDisconnected(pindexDelete, statsdelta);
     }
     LogPrint(BCLog::BENCH, "- Disconnect block: %.2fms\n", (GetTimeMicros() - nStart) * MILLI);
     // Write the chain state to disk, if necessary.
     if (!FlushStateToDisk(chainparams, state, FLUSH_STATE_IF_NEEDED))
         return false;
 
+    FinishDisconnectTip(chainparams, pblock, disconnectpool);
+    return true;
+}
+
+/** Move chainActive's tip back past a block whose effects were undone in pcoinsTip or a view on it. */
+void CChainState::FinishDisconnectTip(const CChainParams& chainparams, const std::shared_ptr<CBlock>& pblock, DisconnectedBlockTransactions *disconnectpool)
+{
+    CBlockIndex *pindexDelete = chainActive.Tip();
+    const CBlock& block = *pblock;
     if (disconnectpool) {
         // Save transactions to re-add to mempool at end of reorg
         for (auto it = block.vtx.rbegin(); it != block.vtx.rend(); ++it) {
@@ -2375,12 +3035,128 @@ bool CChainState::DisconnectTip(CValidationState& state, const CChainParams& cha
         }
     }
 
-    chainActive.SetTip(pindexDelete->pprev);
+    {
+        LOCK(cs_blockindex);
+        chainActive.SetTip(pindexDelete->pprev);
+    }
 
     UpdateTip(pindexDelete->pprev, chainparams);
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
     GetMainSignals().BlockDisconnected(pblock);
+}
+
+/** Number of blocks whose data DisconnectTips reads ahead at a time */
+static const size_t REORG_PREFETCH_BATCH_SIZE = 32;
+
+namespace {
+
+/** A block to disconnect in a reorg, with its block and undo data once read */
+struct DisconnectPrefetch
+{
+    CBlockIndex* pindex;
+    CDiskBlockPos pos;
+    CDiskBlockPos undoPos;
+    std::shared_ptr<CBlock> block;
+    CBlockUndo undo;
+    bool fUndoRead = false;
+
+    explicit DisconnectPrefetch(CBlockIndex* pindexIn) : pindex(pindexIn), pos(pindexIn->GetBlockPos()), undoPos(pindexIn->GetUndoPos()) {}
+};
+
+} // namespace
+
+/**
+ * Read the block and undo data of a batch of blocks to disconnect, in
+ * parallel on the block check threads. Entries that could not be read are
+ * left without a block or undo data.
+ */
+static void PrefetchDisconnectBatch(const CChainParams& chainparams, std::vector<DisconnectPrefetch>& batch)
+{
+    std::vector<CBlockCheck> vChecks;
+    vChecks.reserve(batch.size());
+    for (DisconnectPrefetch& entry : batch) {
+        vChecks.emplace_back([&entry, &chainparams]() {
+            std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+            if (ReadBlockFromDisk(*pblock, entry.pos, chainparams.GetConsensus()) && pblock->GetHash() == entry.pindex->GetBlockHash())
+                entry.block = std::move(pblock);
+            entry.fUndoRead = UndoReadFromDisk(entry.undo, entry.undoPos, entry.pindex);
+            return true;
+        });
+    }
+    RunBlockChecks(vChecks);
+}
+
+/**
+ * Disconnect chainActive's tip down to pindexFork, like calling DisconnectTip
+ * for each block. The block and undo data of the next
+ * REORG_PREFETCH_BATCH_SIZE blocks are read in parallel ahead of
+ * disconnecting them, and the blocks of a batch are undone in a single view
+ * on pcoinsTip that is flushed once per batch.
+ *
+ * If a block of a batch fails to disconnect, the ones before it stay
+ * disconnected: their view is still flushed to pcoinsTip, whose best block is
+ * then chainActive's tip, and their transactions are in disconnectpool for the
+ * caller to pass to UpdateMempoolForReorg. pcoinsTip only reaches the disk in
+ * FlushStateToDisk, between batches, so a crash in the middle of a batch
+ * leaves the state of the batch before it on disk.
+ */
+bool CChainState::DisconnectTips(CValidationState& state, const CChainParams& chainparams, const CBlockIndex* pindexFork, DisconnectedBlockTransactions& disconnectpool)
+{
+    AssertLockHeld(cs_main);
+    assert(pindexFork && chainActive.Contains(pindexFork));
+    if (chainActive.Tip()->pprev == pindexFork) {
+        return DisconnectTip(state, chainparams, &disconnectpool);
+    }
+
+    while (chainActive.Tip() != pindexFork) {
+        std::vector<DisconnectPrefetch> batch;
+        batch.reserve(std::min<size_t>(REORG_PREFETCH_BATCH_SIZE, chainActive.Height() - pindexFork->nHeight));
+        for (CBlockIndex* pindex = chainActive.Tip(); pindex != pindexFork && batch.size() < REORG_PREFETCH_BATCH_SIZE; pindex = pindex->pprev) {
+            batch.emplace_back(pindex);
+        }
+        int64_t nStart = GetTimeMicros();
+        PrefetchDisconnectBatch(chainparams, batch);
+        LogPrint(BCLog::BENCH, "- Prefetch %u blocks to disconnect: %.2fms\n", (unsigned int)batch.size(), (GetTimeMicros() - nStart) * MILLI);
+
+        nStart = GetTimeMicros();
+        bool fOk = true;
+        CCoinsViewCache viewReorg(pcoinsTip.get());
+        for (DisconnectPrefetch& entry : batch) {
+            CBlockIndex* pindexDelete = entry.pindex;
+            assert(pindexDelete == chainActive.Tip());
+            if (!entry.block) {
+                fOk = AbortNode(state, "Failed to read block");
+                break;
+            }
+            if (!entry.fUndoRead) {
+                fOk = error("DisconnectTips(): failure reading undo data of %s", pindexDelete->GetBlockHash().ToString());
+                break;
+            }
+            CCoinsViewCache view(&viewReorg);
+            assert(view.GetBestBlock() == pindexDelete->GetBlockHash());
+            CUTXOStatsDelta statsdelta;
+            if (DisconnectBlock(*entry.block, entry.undo, pindexDelete, view, pcoinstatsindex ? &statsdelta : nullptr) != DISCONNECT_OK) {
+                fOk = error("DisconnectTips(): DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
+                break;
+            }
+            bool flushed = view.Flush();
+            assert(flushed);
+            if (pcoinstatsindex)
+                pcoinstatsindex->BlockDisconnected(pindexDelete, statsdelta);
+            FinishDisconnectTip(chainparams, entry.block, &disconnectpool);
+            entry.block.reset();
+        }
+        // Blocks disconnected before a failure stay disconnected.
+        bool flushed = viewReorg.Flush();
+        assert(flushed);
+        LogPrint(BCLog::BENCH, "- Disconnect %u blocks: %.2fms\n", (unsigned int)batch.size(), (GetTimeMicros() - nStart) * MILLI);
+        if (!fOk)
+            return false;
+        // Write the chain state to disk, if necessary.
+        if (!FlushStateToDisk(chainparams, state, FLUSH_STATE_IF_NEEDED))
+            return false;
+    }
     return true;
 }
 
@@ -2482,7 +3258,8 @@ bool CChainState::ConnectTip(CValidationState& state, const CChainParams& chainp
     LogPrint(BCLog::BENCH, "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * MILLI, nTimeReadFromDisk * MICRO);
     {
         CCoinsViewCache view(pcoinsTip.get());
-        bool rv = ConnectBlock(blockConnecting, state, pindexNew, view, chainparams);
+        CUTXOStatsDelta statsdelta;
+        bool rv = ConnectBlock(blockConnecting, state, pindexNew, view, chainparams, false, pcoinstatsindex ? &statsdelta : nullptr);
         GetMainSignals().BlockChecked(blockConnecting, state);
         if (!rv) {
             if (state.IsInvalid())
@@ -2493,6 +3270,8 @@ bool CChainState::ConnectTip(CValidationState& state, const CChainParams& chainp
         LogPrint(BCLog::BENCH, "  - Connect total: %.2fms [%.2fs (%.2fms/blk)]\n", (nTime3 - nTime2) * MILLI, nTimeConnectTotal * MICRO, nTimeConnectTotal * MILLI / nBlocksTotal);
         bool flushed = view.Flush();
         assert(flushed);
+        if (pcoinstatsindex)
+            pcoinstatsindex->BlockConnected(pindexNew, statsdelta);
     }
     int64_t nTime4 = GetTimeMicros(); nTimeFlush += nTime4 - nTime3;
     LogPrint(BCLog::BENCH, "  - Flush: %.2fms [%.2fs (%.2fms/blk)]\n", (nTime4 - nTime3) * MILLI, nTimeFlush * MICRO, nTimeFlush * MILLI / nBlocksTotal);
@@ -2505,15 +3284,126 @@ bool CChainState::ConnectTip(CValidationState& state, const CChainParams& chainp
     mempool.removeForBlock(blockConnecting.vtx, pindexNew->nHeight);
     disconnectpool.removeForBlock(blockConnecting.vtx);
     // Update chainActive & related variables.
-    chainActive.SetTip(pindexNew);
+    {
+        LOCK(cs_blockindex);
+        chainActive.SetTip(pindexNew);
+    }
     UpdateTip(pindexNew, chainparams);
 
-    int64_t nTime6 = GetTimeMicros(); nTimePostConnect += nTime6 - nTime5; nTimeTotal += nTime6 - nTime1;
-    LogPrint(BCLog::BENCH, "  - Connect postprocess: %.2fms [%.2fs (%.2fms/blk)]\n", (nTime6 - nTime5) * MILLI, nTimePostConnect * MICRO, nTimePostConnect * MILLI / nBlocksTotal);
-    LogPrint(BCLog::BENCH, "- Connect block: %.2fms [%.2fs (%.2fms/blk)]\n", (nTime6 - nTime1) * MILLI, nTimeTotal * MICRO, nTimeTotal * MILLI / nBlocksTotal);
+    int64_t nTime6 = GetTimeMicros(); nTimePostConnect += nTime6 - nTime5; nTimeTotal += nTime6 - nTime1;
+    LogPrint(BCLog::BENCH, "  - Connect postprocess: %.2fms [%.2fs (%.2fms/blk)]\n", (nTime6 - nTime5) * MILLI, nTimePostConnect * MICRO, nTimePostConnect * MILLI / nBlocksTotal);
+    LogPrint(BCLog::BENCH, "- Connect block: %.2fms [%.2fs (%.2fms/blk)]\n", (nTime6 - nTime1) * MILLI, nTimeTotal * MICRO, nTimeTotal * MILLI / nBlocksTotal);
+
+    connectTrace.BlockConnected(pindexNew, std::move(pthisBlock));
+    return true;
+}
+
+/**
+ * Connect a run of blocks without waiting for the script checks of one block
+ * before connecting the next, so the script check threads stay busy while the
+ * master updates the UTXO set. The blocks are connected to a scratch view on
+ * top of pcoinsTip, and are only applied to the chain state once the scripts
+ * of all of them verified: their undo data is written, the view flushed and
+ * chainActive moved only then. If any check fails nothing is applied, the tip
+ * stays at the last fully verified block and the caller connects the blocks
+ * one at a time with ConnectTip to find the invalid one. No more blocks are
+ * added to the run once MAX_PIPELINE_CONNECT_TIME has passed, as cs_main is
+ * held throughout; the rest are left to the caller.
+ *
+ * nConnected is set to the number of blocks added to chainActive. Returns
+ * false only on a system error.
+ */
+bool CChainState::ConnectTipsPipelined(CValidationState& state, const CChainParams& chainparams, const std::vector<CBlockIndex*>& vpindexToConnect, CBlockIndex* pindexMostWork, const std::shared_ptr<const CBlock>& pblock, ConnectTrace& connectTrace, DisconnectedBlockTransactions &disconnectpool, size_t& nConnected)
+{
+    AssertLockHeld(cs_main);
+    nConnected = 0;
+
+    int64_t nTimeStart = GetTimeMicros();
+    // Blocks are kept alive until the pipeline is done, as its checks point into them.
+    std::vector<std::shared_ptr<const CBlock>> vBlocks;
+    std::vector<CUTXOStatsDelta> vStatsDelta;
+    std::vector<CBlockUndo> vUndo;
+    std::vector<CAmount> vMoneySupply;
+    size_t nValid = 0;
+    CCoinsViewCache view(pcoinsTip.get());
+    {
+        ScriptCheckPipeline pipeline;
+        for (CBlockIndex *pindexConnect : reverse_iterate(vpindexToConnect)) {
+            // cs_main is held until the whole run is applied; leave the rest
+            // of a slow run to the next call.
+            if (nValid > 0 && GetTimeMicros() - nTimeStart > MAX_PIPELINE_CONNECT_TIME)
+                break;
+            std::shared_ptr<const CBlock> pthisBlock = pindexConnect == pindexMostWork ? pblock : nullptr;
+            if (!pthisBlock) {
+                std::shared_ptr<CBlock> pblockNew = std::make_shared<CBlock>();
+                if (!ReadBlockFromDisk(*pblockNew, pindexConnect, chainparams.GetConsensus()))
+                    return AbortNode(state, "Failed to read block");
+                pthisBlock = pblockNew;
+            }
+            vBlocks.push_back(pthisBlock);
+            vStatsDelta.emplace_back();
+            // A block that fails half-way must not leave its changes in view.
+            CCoinsViewCache viewBlock(&view);
+            CValidationState stateConnect;
+            if (!ConnectBlock(*pthisBlock, stateConnect, pindexConnect, viewBlock, chainparams, false, pcoinstatsindex ? &vStatsDelta.back() : nullptr, &pipeline)) {
+                if (!stateConnect.IsInvalid()) {
+                    state = stateConnect;
+                    return false;
+                }
+                // Leave this block to ConnectTip, which reports it and marks
+                // it invalid; the blocks before it can still be applied.
+                break;
+            }
+            bool flushed = viewBlock.Flush();
+            assert(flushed);
+            nValid++;
+        }
+        if (!pipeline.control.Wait()) {
+            LogPrintf("%s: script verification failed between heights %d and %d, connecting the blocks one at a time\n", __func__,
+                vpindexToConnect.back()->nHeight, vpindexToConnect.back()->nHeight + (int)vBlocks.size() - 1);
+            return true;
+        }
+        vUndo.swap(pipeline.vUndo);
+        vMoneySupply.swap(pipeline.vMoneySupply);
+    }
+    assert(vUndo.size() == nValid && vMoneySupply.size() == nValid);
+    for (size_t i = 0; i < nValid; i++) {
+        CBlockIndex *pindexNew = vpindexToConnect[vpindexToConnect.size() - 1 - i];
+        if (!WriteBlockMoneySupply(pindexNew, vMoneySupply[i]))
+            return AbortNode(state, "Failed to write block index for moneysupply");
+        if (!WriteUndoDataForBlock(vUndo[i], state, pindexNew, chainparams))
+            return false;
+    }
+    bool flushed = view.Flush();
+    assert(flushed);
+
+    for (size_t i = 0; i < nValid; i++) {
+        CBlockIndex *pindexNew = vpindexToConnect[vpindexToConnect.size() - 1 - i];
+        const CBlock& blockConnected = *vBlocks[i];
+        if (!pindexNew->IsValid(BLOCK_VALID_SCRIPTS)) {
+            pindexNew->RaiseValidity(BLOCK_VALID_SCRIPTS);
+            setDirtyBlockIndex.insert(pindexNew);
+        }
+        CValidationState stateValid;
+        GetMainSignals().BlockChecked(blockConnected, stateValid);
+        if (pcoinstatsindex)
+            pcoinstatsindex->BlockConnected(pindexNew, vStatsDelta[i]);
+        // Remove conflicting transactions from the mempool.
+        mempool.removeForBlock(blockConnected.vtx, pindexNew->nHeight);
+        disconnectpool.removeForBlock(blockConnected.vtx);
+        // Update chainActive & related variables.
+        {
+            LOCK(cs_blockindex);
+            chainActive.SetTip(pindexNew);
+        }
+        UpdateTip(pindexNew, chainparams);
+        connectTrace.BlockConnected(pindexNew, std::move(vBlocks[i]));
+        nConnected++;
+    }
+    LogPrint(BCLog::BENCH, "- Connect %u blocks pipelined: %.2fms\n", (unsigned)nValid, (GetTimeMicros() - nTimeStart) * MILLI);
 
-    connectTrace.BlockConnected(pindexNew, std::move(pthisBlock));
-    return true;
+    // Write the chain state to disk, if necessary.
+    return FlushStateToDisk(chainparams, state, FLUSH_STATE_IF_NEEDED);
 }
 
 /**
@@ -2600,8 +3490,8 @@ bool CChainState::ActivateBestChainStep(CValidationState& state, const CChainPar
     // Disconnect active blocks which are no longer in the best chain.
     bool fBlocksDisconnected = false;
     DisconnectedBlockTransactions disconnectpool;
-    while (chainActive.Tip() && chainActive.Tip() != pindexFork) {
-        if (!DisconnectTip(state, chainparams, &disconnectpool)) {
+    if (chainActive.Tip() && chainActive.Tip() != pindexFork) {
+        if (!DisconnectTips(state, chainparams, pindexFork, disconnectpool)) {
             // This is likely a fatal error, but keep the mempool consistent,
             // just in case. Only remove from the mempool in this case.
             UpdateMempoolForReorg(disconnectpool, false);
@@ -2627,8 +3517,29 @@ bool CChainState::ActivateBestChainStep(CValidationState& state, const CChainPar
         }
         nHeight = nTargetHeight;
 
+        // When catching up with a run of blocks (initial block download,
+        // reindex, or after being offline), overlap the script checks of the
+        // blocks with connecting the ones after them.
+        if (fPipelineScriptChecks && nScriptCheckThreads && vpindexToConnect.size() > 1) {
+            size_t nConnected = 0;
+            if (!ConnectTipsPipelined(state, chainparams, vpindexToConnect, pindexMostWork, pblock, connectTrace, disconnectpool, nConnected)) {
+                UpdateMempoolForReorg(disconnectpool, false);
+                return false;
+            }
+            if (nConnected > 0) {
+                PruneBlockIndexCandidates();
+                if (!pindexOldTip || chainActive.Tip()->nChainWork > pindexOldTip->nChainWork) {
+                    // We're in a better position than we were. Return temporarily to release the lock.
+                    fContinue = false;
+                    break;
+                }
+            }
+        }
+
         // Connect new blocks.
         for (CBlockIndex *pindexConnect : reverse_iterate(vpindexToConnect)) {
+            if (chainActive.Contains(pindexConnect))
+                continue; // Already connected by ConnectTipsPipelined
             if (!ConnectTip(state, chainparams, pindexConnect, pindexConnect == pindexMostWork ? pblock : std::shared_ptr<const CBlock>(), connectTrace, disconnectpool)) {
                 if (state.IsInvalid()) {
                     // The block violates a consensus rule.
@@ -2946,8 +3857,6 @@ CBlockIndex* CChainState::AddToBlockIndex(const CBlockHeader& block)
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
     pindexNew->nSequenceId = 0;
-    BlockMap::iterator mi = mapBlockIndex.insert(std::make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
     BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
@@ -2957,9 +3866,17 @@ CBlockIndex* CChainState::AddToBlockIndex(const CBlockHeader& block)
     }
     pindexNew->nTimeMax = (pindexNew->pprev ? std::max(pindexNew->pprev->nTimeMax, pindexNew->nTime) : pindexNew->nTime);
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
+    {
+        // Only publish the entry once the fields readers of cs_blockindex use are set
+        LOCK(cs_blockindex);
+        BlockMap::iterator mi = mapBlockIndex.insert(std::make_pair(hash, pindexNew)).first;
+        pindexNew->phashBlock = &((*mi).first);
+    }
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
-    if (pindexBestHeader == nullptr || pindexBestHeader->nChainWork < pindexNew->nChainWork)
+    if (pindexBestHeader == nullptr || pindexBestHeader->nChainWork < pindexNew->nChainWork) {
         pindexBestHeader = pindexNew;
+        nBestHeaderHeight = pindexNew->nHeight;
+    }
 
     setDirtyBlockIndex.insert(pindexNew);
 
@@ -2969,7 +3886,10 @@ CBlockIndex* CChainState::AddToBlockIndex(const CBlockHeader& block)
 /** Mark a block as having its data received and checked (up to BLOCK_VALID_TRANSACTIONS). */
 bool CChainState::ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBlockIndex *pindexNew, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
 {
-    pindexNew->nTx = block.vtx.size();
+    {
+        LOCK(cs_blockindex);
+        pindexNew->nTx = block.vtx.size();
+    }
     pindexNew->nChainTx = 0;
     pindexNew->nFile = pos.nFile;
     pindexNew->nDataPos = pos.nPos;
@@ -3111,6 +4031,41 @@ static bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state,
     return true;
 }
 
+/**
+ * Run CheckTransaction on the transactions of a block and count their legacy
+ * sigops on the block check threads. Returns false if there are no block
+ * check threads, the whole block is being checked as a block check itself
+ * (see LoadExternalBlockFile), the block is too small to be worth splitting
+ * up, or any transaction failed.
+ */
+static bool CheckBlockTransactionsParallel(const CBlock& block, unsigned int& nSigOps)
+{
+    if (!nBlockCheckThreads || fInBlockCheck || block.vtx.size() < 2 * BLOCK_CHECK_TXS_PER_CHECK)
+        return false;
+
+    std::atomic<unsigned int> nSigOpsTotal{0};
+    std::vector<CBlockCheck> vChecks;
+    vChecks.reserve(block.vtx.size() / BLOCK_CHECK_TXS_PER_CHECK + 1);
+    for (size_t nBegin = 0; nBegin < block.vtx.size(); nBegin += BLOCK_CHECK_TXS_PER_CHECK) {
+        size_t nEnd = std::min(block.vtx.size(), nBegin + BLOCK_CHECK_TXS_PER_CHECK);
+        vChecks.emplace_back([&block, &nSigOpsTotal, nBegin, nEnd]() {
+            CValidationState state;
+            unsigned int nSigOpsRange = 0;
+            for (size_t i = nBegin; i < nEnd; i++) {
+                if (!CheckTransaction(*block.vtx[i], state, true))
+                    return false;
+                nSigOpsRange += GetLegacySigOpCount(*block.vtx[i]);
+            }
+            nSigOpsTotal += nSigOpsRange;
+            return true;
+        });
+    }
+    if (!RunBlockChecks(vChecks))
+        return false;
+    nSigOps = nSigOpsTotal;
+    return true;
+}
+
 bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW, bool fCheckMerkleRoot)
 {
     // These are checks that are independent of context.
@@ -3154,16 +4109,21 @@ bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::P
         if (block.vtx[i]->IsCoinBase())
             return state.DoS(100, false, REJECT_INVALID, "bad-cb-multiple", false, "more than one coinbase");
 
-    // Check transactions
-    for (const auto& tx : block.vtx)
-        if (!CheckTransaction(*tx, state, true))
-            return state.Invalid(false, state.GetRejectCode(), state.GetRejectReason(),
-                                 strprintf("Transaction check failed (tx hash %s) %s", tx->GetHash().ToString(), state.GetDebugMessage()));
-
+    // Check transactions. Large blocks are checked on the block check
+    // threads first; if that finds a problem, the serial checks below
+    // find it again and report it.
     unsigned int nSigOps = 0;
-    for (const auto& tx : block.vtx)
-    {
-        nSigOps += GetLegacySigOpCount(*tx);
+    if (!CheckBlockTransactionsParallel(block, nSigOps)) {
+        for (const auto& tx : block.vtx)
+            if (!CheckTransaction(*tx, state, true))
+                return state.Invalid(false, state.GetRejectCode(), state.GetRejectReason(),
+                                     strprintf("Transaction check failed (tx hash %s) %s", tx->GetHash().ToString(), state.GetDebugMessage()));
+
+        nSigOps = 0;
+        for (const auto& tx : block.vtx)
+        {
+            nSigOps += GetLegacySigOpCount(*tx);
+        }
     }
     if (nSigOps * WITNESS_SCALE_FACTOR > MAX_BLOCK_SIGOPS_COST)
         return state.DoS(100, false, REJECT_INVALID, "bad-blk-sigops", false, "out-of-bounds SigOpCount");
@@ -3378,7 +4338,7 @@ static bool ContextualCheckBlock(const CBlock& block, CValidationState& state, c
     return true;
 }
 
-bool CChainState::AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex)
+bool CChainState::AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fCheckedPoW)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -3397,7 +4357,7 @@ bool CChainState::AcceptBlockHeader(const CBlockHeader& block, CValidationState&
             return true;
         }
 
-        if (!CheckBlockHeader(block, state, chainparams.GetConsensus()))
+        if (!CheckBlockHeader(block, state, chainparams.GetConsensus(), !fCheckedPoW))
             return error("%s: Consensus::CheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
 
         // Get prev block index
@@ -3474,11 +4434,46 @@ bool CChainState::AcceptBlockHeader(const CBlockHeader& block, CValidationState&
 bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, CValidationState& state, const CChainParams& chainparams, const CBlockIndex** ppindex, CBlockHeader *first_invalid)
 {
     if (first_invalid != nullptr) first_invalid->SetNull();
+
+    // The proof of work is the expensive part of checking a header and needs
+    // no context, so check it for the headers we do not know yet on the block
+    // check threads before taking cs_main. Headers that fail are checked again
+    // below, which reports the failure. They are checked a few at a time, and
+    // the rest are left unchecked once one fails: the headers are accepted in
+    // order up to the first bad one, so bad headers cost at most one batch of
+    // checks.
+    std::vector<char> vCheckedPoW(headers.size(), false);
+    {
+        std::vector<size_t> vUnknown;
+        {
+            LOCK(cs_main);
+            for (size_t i = 0; i < headers.size(); i++) {
+                if (!mapBlockIndex.count(headers[i].GetHash()))
+                    vUnknown.push_back(i);
+            }
+        }
+        for (size_t nBegin = 0; nBegin < vUnknown.size(); nBegin += HEADERS_POW_CHECK_BATCH) {
+            const size_t nEnd = std::min(vUnknown.size(), nBegin + HEADERS_POW_CHECK_BATCH);
+            std::vector<CBlockCheck> vChecks;
+            vChecks.reserve(nEnd - nBegin);
+            for (size_t n = nBegin; n < nEnd; n++) {
+                const size_t i = vUnknown[n];
+                vChecks.emplace_back([&headers, &vCheckedPoW, &chainparams, i]() {
+                    vCheckedPoW[i] = CheckProofOfWork(headers[i], chainparams.GetConsensus());
+                    return (bool)vCheckedPoW[i];
+                });
+            }
+            if (!RunBlockChecks(vChecks))
+                break;
+        }
+    }
+
     {
         LOCK(cs_main);
-        for (const CBlockHeader& header : headers) {
+        for (size_t i = 0; i < headers.size(); i++) {
+            const CBlockHeader& header = headers[i];
             CBlockIndex *pindex = nullptr; // Use a temp pindex instead of ppindex to avoid a const_cast
-            if (!g_chainstate.AcceptBlockHeader(header, state, chainparams, &pindex)) {
+            if (!g_chainstate.AcceptBlockHeader(header, state, chainparams, &pindex, vCheckedPoW[i])) {
                 if (first_invalid) *first_invalid = header;
                 return false;
             }
@@ -3521,7 +4516,8 @@ bool CChainState::AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CVali
     CBlockIndex *pindexDummy = nullptr;
     CBlockIndex *&pindex = ppindex ? *ppindex : pindexDummy;
 
-    if (!AcceptBlockHeader(block, state, chainparams, &pindex))
+    // A block that passed CheckBlock had its proof of work checked already.
+    if (!AcceptBlockHeader(block, state, chainparams, &pindex, block.fChecked))
         return false;
 
     // Try to process all requested blocks that we don't have, but only
@@ -3696,6 +4692,8 @@ void PruneOneBlockFile(const int fileNumber)
 
     vinfoBlockFile[fileNumber].SetNull();
     setDirtyFileInfo.insert(fileNumber);
+    // Reopening a pruned file to truncate it would create it anew.
+    setPendingTruncation.erase(fileNumber);
 }
 
 
@@ -3703,6 +4701,8 @@ void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune)
 {
     for (std::set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        g_blockfile_mappings.Forget(GetBlockPosFilename(pos, "blk"));
+        g_blockfile_mappings.Forget(GetBlockPosFilename(pos, "rev"));
         fs::remove(GetBlockPosFilename(pos, "blk"));
         fs::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -3724,6 +4724,8 @@ static void FindFilesToPruneManual(std::set<int>& setFilesToPrune, int nManualPr
     for (int fileNumber = 0; fileNumber < nLastBlockFile; fileNumber++) {
         if (vinfoBlockFile[fileNumber].nSize == 0 || vinfoBlockFile[fileNumber].nHeightLast > nLastBlockWeCanPrune)
             continue;
+        if (BlockFileInUse(fileNumber))
+            continue;
         PruneOneBlockFile(fileNumber);
         setFilesToPrune.insert(fileNumber);
         count++;
@@ -3787,6 +4789,10 @@ static void FindFilesToPrune(std::set<int>& setFilesToPrune, uint64_t nPruneAfte
             if (vinfoBlockFile[fileNumber].nHeightLast > nLastBlockWeCanPrune)
                 continue;
 
+            // don't prune files a reader still has mapped; they go in a later round
+            if (BlockFileInUse(fileNumber))
+                continue;
+
             PruneOneBlockFile(fileNumber);
             // Queue up the files for removal
             setFilesToPrune.insert(fileNumber);
@@ -3861,6 +4867,7 @@ CBlockIndex * CChainState::InsertBlockIndex(const uint256& hash)
 
     // Create new
     CBlockIndex* pindexNew = new CBlockIndex();
+    LOCK(cs_blockindex);
     mi = mapBlockIndex.insert(std::make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
@@ -3912,8 +4919,10 @@ bool CChainState::LoadBlockIndex(const Consensus::Params& consensus_params, CBlo
             pindexBestInvalid = pindex;
         if (pindex->pprev)
             pindex->BuildSkip();
-        if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == nullptr || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
+        if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == nullptr || CBlockIndexWorkComparator()(pindexBestHeader, pindex))) {
             pindexBestHeader = pindex;
+            nBestHeaderHeight = pindex->nHeight;
+        }
     }
 
     return true;
@@ -3969,10 +4978,6 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
     pblocktree->ReadReindexing(fReindexing);
     if(fReindexing) fReindex = true;
 
-    // Check whether we have a transaction index
-    pblocktree->ReadFlag("txindex", fTxIndex);
-    LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
-
     return true;
 }
 
@@ -3994,7 +4999,11 @@ bool LoadChainTip(const CChainParams& chainparams)
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
         return false;
-    chainActive.SetTip(it->second);
+    {
+        LOCK(cs_blockindex);
+        chainActive.SetTip(it->second);
+    }
+    PublishChainTipSnapshot(chainparams);
 
     g_chainstate.PruneBlockIndexCandidates();
 
@@ -4015,6 +5024,106 @@ CVerifyDB::~CVerifyDB()
     uiInterface.ShowProgress("", 100, false);
 }
 
+/** Number of blocks VerifyDB reads and checks on the block check threads ahead of those it is disconnecting or reconnecting */
+static const size_t VERIFYDB_BATCH_SIZE = 64;
+
+namespace {
+
+/** A block of the chain read and checked by VerifyDB */
+struct VerifyDBBlock
+{
+    CBlockIndex* pindex;
+    CDiskBlockPos pos;
+    CDiskBlockPos undoPos;
+    //! The block, if it passed the checks of its check level
+    std::shared_ptr<CBlock> block;
+    //! Its undo data, if read at level 2, for the disconnect of level 3
+    std::shared_ptr<CBlockUndo> undo;
+    //! Why it did not
+    std::string strError;
+
+    VerifyDBBlock(CBlockIndex* pindexIn, const CDiskBlockPos& posIn) : pindex(pindexIn), pos(posIn), undoPos(pindexIn->GetUndoPos()) {}
+};
+
+} // namespace
+
+/**
+ * Queue the checks of levels 0 to 2 of a batch of blocks for VerifyDB, or run
+ * them right away if there are no block check threads. They don't take
+ * cs_main, which VerifyDB holds throughout.
+ */
+static void QueueVerifyDBChecks(CCheckQueueControl<CBlockCheck>& control, const CChainParams& chainparams, int nCheckLevel, std::vector<VerifyDBBlock>& batch)
+{
+    std::vector<CBlockCheck> vChecks;
+    vChecks.reserve(batch.size());
+    for (VerifyDBBlock& entry : batch) {
+        vChecks.emplace_back([&entry, &chainparams, nCheckLevel]() {
+            std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+            // check level 0: read from disk
+            if (!ReadBlockFromDisk(*pblock, entry.pos, chainparams.GetConsensus()) || pblock->GetHash() != entry.pindex->GetBlockHash()) {
+                entry.strError = strprintf("ReadBlockFromDisk failed at %d, hash=%s", entry.pindex->nHeight, entry.pindex->GetBlockHash().ToString());
+                return true;
+            }
+            // check level 1: verify block validity
+            CValidationState state;
+            if (nCheckLevel >= 1 && !CheckBlock(*pblock, state, chainparams.GetConsensus())) {
+                entry.strError = strprintf("found bad block at %d, hash=%s (%s)", entry.pindex->nHeight, entry.pindex->GetBlockHash().ToString(), FormatStateMessage(state));
+                return true;
+            }
+            // check level 2: verify undo validity
+            if (nCheckLevel >= 2 && !entry.undoPos.IsNull()) {
+                std::shared_ptr<CBlockUndo> undo = std::make_shared<CBlockUndo>();
+                if (!UndoReadFromDisk(*undo, entry.undoPos, entry.pindex)) {
+                    entry.strError = strprintf("found bad undo data at %d, hash=%s", entry.pindex->nHeight, entry.pindex->GetBlockHash().ToString());
+                    return true;
+                }
+                entry.undo = std::move(undo);
+            }
+            entry.block = std::move(pblock);
+            return true;
+        });
+    }
+    if (nBlockCheckThreads) {
+        control.Add(vChecks);
+    } else {
+        for (CBlockCheck& check : vChecks)
+            check();
+    }
+}
+
+/**
+ * Check the blocks that fill adds to a batch, a batch at a time, on the block
+ * check threads, while process handles the blocks of the batch before in
+ * order. Stops once fill adds no more blocks or process returns false.
+ * process must not start block checks itself; blocks that pass level 1 are
+ * marked as checked, so ConnectBlock doesn't.
+ */
+template<typename Fill, typename Process>
+static void VerifyDBPipeline(const CChainParams& chainparams, int nCheckLevel, Fill fill, Process process)
+{
+    std::vector<VerifyDBBlock> batch, batchNext;
+    fill(batch);
+    {
+        CCheckQueueControl<CBlockCheck> control(nBlockCheckThreads ? &blockcheckqueue : nullptr);
+        QueueVerifyDBChecks(control, chainparams, nCheckLevel, batch);
+        control.Wait();
+    }
+    while (!batch.empty()) {
+        fill(batchNext);
+        CCheckQueueControl<CBlockCheck> control(nBlockCheckThreads ? &blockcheckqueue : nullptr);
+        QueueVerifyDBChecks(control, chainparams, nCheckLevel, batchNext);
+        for (VerifyDBBlock& entry : batch) {
+            if (!process(entry))
+                return;
+            entry.block.reset();
+            entry.undo.reset();
+        }
+        control.Wait();
+        batch.clear();
+        batch.swap(batchNext);
+    }
+}
+
 bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview, int nCheckLevel, int nCheckDepth)
 {
     LOCK(cs_main);
@@ -4032,47 +5141,49 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
     int nGoodTransactions = 0;
     CValidationState state;
     int reportDone = 0;
-    LogPrintf("[0%%]...");
-    for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev; pindex = pindex->pprev)
-    {
+    bool fOk = true;
+    bool fShutdown = false;
+
+    // Levels 0 to 2 are checked on the block check threads, a batch of
+    // blocks ahead of the memory-only disconnect of level 3.
+    CBlockIndex* pindexNext = chainActive.Tip();
+    auto fillDown = [&](std::vector<VerifyDBBlock>& batch) {
+        while (pindexNext && pindexNext->pprev && batch.size() < VERIFYDB_BATCH_SIZE) {
+            if (pindexNext->nHeight < chainActive.Height()-nCheckDepth)
+                break;
+            if (fPruneMode && !(pindexNext->nStatus & BLOCK_HAVE_DATA)) {
+                // If pruning, only go back as far as we have data.
+                LogPrintf("VerifyDB(): block verification stopping at height %d (pruning, no data)\n", pindexNext->nHeight);
+                pindexNext = nullptr;
+                break;
+            }
+            batch.emplace_back(pindexNext, pindexNext->GetBlockPos());
+            pindexNext = pindexNext->pprev;
+        }
+    };
+    VerifyDBPipeline(chainparams, nCheckLevel, fillDown, [&](VerifyDBBlock& entry) {
         boost::this_thread::interruption_point();
+        CBlockIndex* pindex = entry.pindex;
         int percentageDone = std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100))));
         if (reportDone < percentageDone/10) {
             // report every 10% step
-            LogPrintf("[%d%%]...", percentageDone);
             reportDone = percentageDone/10;
+            uiInterface.InitMessage(strprintf("%s %d%%", _("Verifying blocks..."), percentageDone));
         }
         uiInterface.ShowProgress(_("Verifying blocks..."), percentageDone, false);
-        if (pindex->nHeight < chainActive.Height()-nCheckDepth)
-            break;
-        if (fPruneMode && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
-            // If pruning, only go back as far as we have data.
-            LogPrintf("VerifyDB(): block verification stopping at height %d (pruning, no data)\n", pindex->nHeight);
-            break;
-        }
-        CBlock block;
-        // check level 0: read from disk
-        if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
-            return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
-        // check level 1: verify block validity
-        if (nCheckLevel >= 1 && !CheckBlock(block, state, chainparams.GetConsensus()))
-            return error("%s: *** found bad block at %d, hash=%s (%s)\n", __func__,
-                         pindex->nHeight, pindex->GetBlockHash().ToString(), FormatStateMessage(state));
-        // check level 2: verify undo validity
-        if (nCheckLevel >= 2 && pindex) {
-            CBlockUndo undo;
-            if (!pindex->GetUndoPos().IsNull()) {
-                if (!UndoReadFromDisk(undo, pindex)) {
-                    return error("VerifyDB(): *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-                }
-            }
+        if (!entry.block) {
+            fOk = error("VerifyDB(): *** %s", entry.strError);
+            return false;
         }
+        const CBlock& block = *entry.block;
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
         if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             assert(coins.GetBestBlock() == pindex->GetBlockHash());
-            DisconnectResult res = g_chainstate.DisconnectBlock(block, pindex, coins);
+            // Use the undo data read at level 2 rather than reading it again
+            DisconnectResult res = entry.undo ? g_chainstate.DisconnectBlock(block, *entry.undo, pindex, coins) : g_chainstate.DisconnectBlock(block, pindex, coins);
             if (res == DISCONNECT_FAILED) {
-                return error("VerifyDB(): *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+                fOk = error("VerifyDB(): *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+                return false;
             }
             pindexState = pindex->pprev;
             if (res == DISCONNECT_UNCLEAN) {
@@ -4082,28 +5193,47 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
                 nGoodTransactions += block.vtx.size();
             }
         }
-        if (ShutdownRequested())
-            return true;
-    }
+        if (ShutdownRequested()) {
+            fShutdown = true;
+            return false;
+        }
+        return true;
+    });
+    if (!fOk)
+        return false;
+    if (fShutdown)
+        return true;
     if (pindexFailure)
         return error("VerifyDB(): *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", chainActive.Height() - pindexFailure->nHeight + 1, nGoodTransactions);
 
-    // check level 4: try reconnecting blocks
+    // check level 4: try reconnecting blocks, reading them a batch ahead
     if (nCheckLevel >= 4) {
-        CBlockIndex *pindex = pindexState;
-        while (pindex != chainActive.Tip()) {
+        CBlockIndex* pindexRead = pindexState;
+        auto fillUp = [&](std::vector<VerifyDBBlock>& batch) {
+            while (pindexRead != chainActive.Tip() && batch.size() < VERIFYDB_BATCH_SIZE) {
+                pindexRead = chainActive.Next(pindexRead);
+                batch.emplace_back(pindexRead, pindexRead->GetBlockPos());
+            }
+        };
+        // Level 1 checks are run again, so ConnectBlock finds the blocks checked
+        VerifyDBPipeline(chainparams, 1, fillUp, [&](VerifyDBBlock& entry) {
             boost::this_thread::interruption_point();
+            CBlockIndex* pindex = entry.pindex;
             uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, 100 - (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * 50))), false);
-            pindex = chainActive.Next(pindex);
-            CBlock block;
-            if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
-                return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
-            if (!g_chainstate.ConnectBlock(block, state, pindex, coins, chainparams))
-                return error("VerifyDB(): *** found unconnectable block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
-        }
+            if (!entry.block) {
+                fOk = error("VerifyDB(): *** %s", entry.strError);
+                return false;
+            }
+            if (!g_chainstate.ConnectBlock(*entry.block, state, pindex, coins, chainparams)) {
+                fOk = error("VerifyDB(): *** found unconnectable block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+                return false;
+            }
+            return true;
+        });
+        if (!fOk)
+            return false;
     }
 
-    LogPrintf("[DONE].\n");
     LogPrintf("No coin database inconsistencies in last %i blocks (%i transactions)\n", chainActive.Height() - pindexState->nHeight, nGoodTransactions);
 
     return true;
@@ -4254,7 +5384,10 @@ bool CChainState::RewindBlockIndex(const CChainParams& params)
             pindexIter->nDataPos = 0;
             pindexIter->nUndoPos = 0;
             // Remove various other things
-            pindexIter->nTx = 0;
+            {
+                LOCK(cs_blockindex);
+                pindexIter->nTx = 0;
+            }
             pindexIter->nChainTx = 0;
             pindexIter->nSequenceId = 0;
             // Make sure it gets written.
@@ -4315,24 +5448,33 @@ void CChainState::UnloadBlockIndex() {
 void UnloadBlockIndex()
 {
     LOCK(cs_main);
-    chainActive.SetTip(nullptr);
+    {
+        LOCK(cs_blockindex);
+        chainActive.SetTip(nullptr);
+    }
+    PublishChainTipSnapshot(Params());
     pindexBestInvalid = nullptr;
     pindexBestHeader = nullptr;
+    nBestHeaderHeight = -1;
     mempool.clear();
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
     nLastBlockFile = 0;
     setDirtyBlockIndex.clear();
     setDirtyFileInfo.clear();
+    setPendingTruncation.clear();
     versionbitscache.Clear();
     for (int b = 0; b < VERSIONBITS_NUM_BITS; b++) {
         warningcache[b].clear();
     }
 
-    for (BlockMap::value_type& entry : mapBlockIndex) {
-        delete entry.second;
+    {
+        LOCK(cs_blockindex);
+        for (BlockMap::value_type& entry : mapBlockIndex) {
+            delete entry.second;
+        }
+        mapBlockIndex.clear();
     }
-    mapBlockIndex.clear();
     fHavePruned = false;
 
     g_chainstate.UnloadBlockIndex();
@@ -4356,9 +5498,6 @@ bool LoadBlockIndex(const CChainParams& chainparams)
         // needs_init.
 
         LogPrintf("Initializing databases...\n");
-        // Use the provided setting for -txindex in the new database
-        fTxIndex = gArgs.GetBoolArg("-txindex", DEFAULT_TXINDEX);
-        pblocktree->WriteFlag("txindex", fTxIndex);
     }
     return true;
 }
@@ -4395,118 +5534,401 @@ bool LoadGenesisBlock(const CChainParams& chainparams)
     return g_chainstate.LoadGenesisBlock(chainparams);
 }
 
+/** Maximum number of blocks in a batch that LoadExternalBlockFile checks in parallel */
+static const size_t BLOCK_IMPORT_BATCH_SIZE = 128;
+/** Maximum total size of the blocks of such a batch */
+static const size_t BLOCK_IMPORT_BATCH_BYTES = 32 * 1024 * 1024;
+/** Number of batches LoadExternalBlockFile reads ahead of the one being checked and accepted */
+static const size_t BLOCK_IMPORT_READ_AHEAD = 2;
+/** Maximum total size of the blocks with unknown parent kept in memory during reindex; further ones are read again from disk */
+static const size_t BLOCK_IMPORT_MAX_BUFFERED_ORPHAN_BYTES = 32 * 1024 * 1024;
+
+namespace {
+
+/** A block record read from a block file by LoadExternalBlockFile */
+struct ImportedBlock
+{
+    //! The serialized block
+    std::vector<unsigned char> data;
+    //! Size of the serialized block
+    size_t nSize = 0;
+    //! Position of the block in its file (only used for reindex)
+    CDiskBlockPos pos;
+    //! Where to look for the next block if this one cannot be deserialized: one byte past its message start
+    uint64_t nRescanPos = 0;
+    //! The block, once deserialized; null if it could not be
+    std::shared_ptr<CBlock> block;
+};
+
+/** A block with unknown parent kept in memory during reindex */
+struct BufferedOrphan
+{
+    std::shared_ptr<CBlock> block;
+    CDiskBlockPos pos;
+    size_t nSize;
+};
+
+/**
+ * Reads the block records of a file for LoadExternalBlockFile on a thread of
+ * its own, up to BLOCK_IMPORT_READ_AHEAD batches ahead of the one that is
+ * being checked and accepted, so that the disk is kept busy meanwhile.
+ */
+class BlockImportReader
+{
+public:
+    /** Takes over fileIn, and calls fclose() on it when destroyed */
+    BlockImportReader(FILE* fileIn, const CChainParams& chainparams, const CDiskBlockPos* dbp);
+    ~BlockImportReader();
+
+    /**
+     * Wait for the next batch. Returns false once the end of the file is
+     * reached and all batches were taken. Throws std::runtime_error if the
+     * file could not be read.
+     */
+    bool Next(std::vector<ImportedBlock>& batch);
+    /** Drop the batches read ahead, and read on from file position nPos. */
+    void Rescan(uint64_t nPos);
+
+private:
+    void ThreadRead();
+    bool ReadBatch(uint64_t& nRewind, std::vector<ImportedBlock>& batch);
+
+    CBufferedFile blkdat;
+    const CChainParams& chainparams;
+    const CDiskBlockPos* const dbp;
+
+    CWaitableCriticalSection cs;
+    CConditionVariable cond;
+    std::deque<std::vector<ImportedBlock>> queue; //!< Batches read ahead, in file order
+    uint64_t nRescanPos = 0;
+    uint64_t nGeneration = 0; //!< Incremented by every rescan; batches read before it are dropped
+    bool fEnd = false; //!< Whether the end of the file was reached
+    std::string strError;
+    std::atomic<bool> fStop{false};
+
+    std::thread thread;
+};
+
+BlockImportReader::BlockImportReader(FILE* fileIn, const CChainParams& chainparamsIn, const CDiskBlockPos* dbpIn) :
+    blkdat(fileIn, 2*MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE+8, SER_DISK, CLIENT_VERSION),
+    chainparams(chainparamsIn), dbp(dbpIn)
+{
+    thread = std::thread(&BlockImportReader::ThreadRead, this);
+}
+
+BlockImportReader::~BlockImportReader()
+{
+    {
+        WaitableLock lock(cs);
+        fStop = true;
+    }
+    cond.notify_all();
+    thread.join();
+}
+
+bool BlockImportReader::Next(std::vector<ImportedBlock>& batch)
+{
+    WaitableLock lock(cs);
+    cond.wait(lock, [this] { return !queue.empty() || fEnd; });
+    if (queue.empty()) {
+        if (!strError.empty())
+            throw std::runtime_error(strError);
+        return false;
+    }
+    batch = std::move(queue.front());
+    queue.pop_front();
+    cond.notify_all();
+    return true;
+}
+
+void BlockImportReader::Rescan(uint64_t nPos)
+{
+    WaitableLock lock(cs);
+    if (!strError.empty())
+        return;
+    queue.clear();
+    fEnd = false;
+    nRescanPos = nPos;
+    nGeneration++;
+    cond.notify_all();
+}
+
+void BlockImportReader::ThreadRead()
+{
+    RenameThread("bitcoin-loadblkread");
+    try {
+        uint64_t nRewind = blkdat.GetPos();
+        uint64_t nReadGeneration = 0;
+        while (true) {
+            bool fSeek = false;
+            {
+                WaitableLock lock(cs);
+                cond.wait(lock, [this, nReadGeneration] {
+                    return fStop || nGeneration != nReadGeneration || (!fEnd && queue.size() < BLOCK_IMPORT_READ_AHEAD);
+                });
+                if (fStop)
+                    return;
+                if (nGeneration != nReadGeneration) {
+                    nReadGeneration = nGeneration;
+                    nRewind = nRescanPos;
+                    fSeek = true;
+                }
+            }
+            // What was read ahead is past the rescan position, and no longer in the buffer
+            if (fSeek && !blkdat.Seek(nRewind))
+                throw std::runtime_error("LoadExternalBlockFile: seek in block file failed");
+
+            std::vector<ImportedBlock> batch;
+            const bool fMore = ReadBatch(nRewind, batch);
+            WaitableLock lock(cs);
+            if (nGeneration != nReadGeneration)
+                continue;
+            if (!batch.empty())
+                queue.push_back(std::move(batch));
+            fEnd = !fMore;
+            cond.notify_all();
+        }
+    } catch (const std::exception& e) {
+        WaitableLock lock(cs);
+        strError = e.what();
+        fEnd = true;
+        cond.notify_all();
+    }
+}
+
+/**
+ * Read the next block records from the file, up to the batch limits.
+ * Returns false once the end of the file is reached, in which case blocks
+ * read before may still be in batch.
+ */
+bool BlockImportReader::ReadBatch(uint64_t& nRewind, std::vector<ImportedBlock>& batch)
+{
+    size_t nBatchBytes = 0;
+    while (batch.size() < BLOCK_IMPORT_BATCH_SIZE && nBatchBytes < BLOCK_IMPORT_BATCH_BYTES) {
+        if (blkdat.eof() || fStop)
+            return false;
+
+        blkdat.SetPos(nRewind);
+        nRewind++; // start one byte further next time, in case of failure
+        blkdat.SetLimit(); // remove former limit
+        unsigned int nSize = 0;
+        try {
+            // locate a header
+            unsigned char buf[CMessageHeader::MESSAGE_START_SIZE];
+            blkdat.FindByte(chainparams.MessageStart()[0]);
+            nRewind = blkdat.GetPos()+1;
+            blkdat >> FLATDATA(buf);
+            if (memcmp(buf, chainparams.MessageStart(), CMessageHeader::MESSAGE_START_SIZE))
+                continue;
+            // read size
+            blkdat >> nSize;
+            if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
+                continue;
+        } catch (const std::exception&) {
+            // no valid block header found; don't complain
+            return false;
+        }
+        try {
+            // read block
+            uint64_t nBlockPos = blkdat.GetPos();
+            blkdat.SetLimit(nBlockPos + nSize);
+            ImportedBlock record;
+            if (dbp) {
+                record.pos = *dbp;
+                record.pos.nPos = nBlockPos;
+            }
+            record.nRescanPos = nRewind;
+            record.nSize = nSize;
+            record.data.resize(nSize);
+            blkdat.read((char*)record.data.data(), nSize);
+            nRewind = blkdat.GetPos();
+            nBatchBytes += nSize;
+            batch.push_back(std::move(record));
+        } catch (const std::exception& e) {
+            LogPrintf("LoadExternalBlockFile: Deserialize or I/O error - %s\n", e.what());
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+/**
+ * Queue the deserialization and context-free checks (CheckBlock, including
+ * the proof of work of any algorithm) of a batch of imported blocks, or run
+ * them right away if there are no block check threads. Blocks that pass are
+ * marked as checked, so AcceptBlock doesn't check them again; AcceptBlock
+ * repeats the checks of those that don't, to record why they failed.
+ */
+static void QueueBlockImportChecks(CCheckQueueControl<CBlockCheck>& control, const CChainParams& chainparams, std::vector<ImportedBlock>& batch)
+{
+    std::vector<CBlockCheck> vChecks;
+    vChecks.reserve(batch.size());
+    for (ImportedBlock& record : batch) {
+        vChecks.emplace_back([&record, &chainparams]() {
+            std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+            try {
+                SpanReader(SER_DISK, CLIENT_VERSION, record.data.data(), record.data.size()) >> *pblock;
+            } catch (const std::exception& e) {
+                LogPrintf("LoadExternalBlockFile: Deserialize or I/O error - %s\n", e.what());
+                return true;
+            }
+            std::vector<unsigned char>().swap(record.data);
+            CValidationState state;
+            CheckBlock(*pblock, state, chainparams.GetConsensus());
+            record.block = std::move(pblock);
+            return true;
+        });
+    }
+    if (nBlockCheckThreads) {
+        control.Add(vChecks);
+    } else {
+        for (CBlockCheck& check : vChecks)
+            check();
+    }
+}
+
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
 {
     // Map of disk positions for blocks with unknown parent (only used for reindex)
     static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+    // Blocks with unknown parent that are still in memory (only used for reindex).
+    // They are kept until the end of the file; any left then are read again
+    // from disk once their parent shows up, like the ones beyond the bound.
+    std::multimap<uint256, BufferedOrphan> mapBlocksUnknownParentBuffered;
+    size_t nBufferedBytes = 0;
     int64_t nStart = GetTimeMillis();
 
     int nLoaded = 0;
     try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
-            boost::this_thread::interruption_point();
-
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[CMessageHeader::MESSAGE_START_SIZE];
-                blkdat.FindByte(chainparams.MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, chainparams.MessageStart(), CMessageHeader::MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
-                break;
+        // The reader thread reads batches of blocks ahead. The blocks of a
+        // batch are deserialized and checked on the block check threads,
+        // then accepted in file order.
+        BlockImportReader reader(fileIn, chainparams, dbp);
+        std::vector<ImportedBlock> batch;
+        bool fError = false;
+        while (!fError && reader.Next(batch)) {
+            {
+                CCheckQueueControl<CBlockCheck> control(nBlockCheckThreads ? &blockcheckqueue : nullptr);
+                QueueBlockImportChecks(control, chainparams, batch);
+                control.Wait();
             }
-            try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
-                CBlock& block = *pblock;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint(BCLog::REINDEX, "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                            block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
-                }
 
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                    LOCK(cs_main);
-                    CValidationState state;
-                    if (g_chainstate.AcceptBlock(pblock, state, chainparams, nullptr, true, dbp, nullptr))
-                        nLoaded++;
-                    if (state.IsError())
+            for (ImportedBlock& record : batch) {
+                boost::this_thread::interruption_point();
+                try {
+                    if (!record.block) {
+                        // Look for the next block from one byte past the
+                        // message start of this one, as its size may be
+                        // wrong. The blocks read after it are read again.
+                        reader.Rescan(record.nRescanPos);
                         break;
-                } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrint(BCLog::REINDEX, "Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
-                }
+                    }
+                    std::shared_ptr<CBlock> pblock = std::move(record.block);
+                    CBlock& block = *pblock;
+                    CDiskBlockPos* pos = dbp ? &record.pos : nullptr;
+
+                    // detect out of order blocks, and store them for later
+                    uint256 hash = block.GetHash();
+                    if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+                        LogPrint(BCLog::REINDEX, "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                                block.hashPrevBlock.ToString());
+                        if (dbp) {
+                            if (nBufferedBytes + record.nSize <= BLOCK_IMPORT_MAX_BUFFERED_ORPHAN_BYTES) {
+                                mapBlocksUnknownParentBuffered.emplace(block.hashPrevBlock, BufferedOrphan{pblock, record.pos, record.nSize});
+                                nBufferedBytes += record.nSize;
+                            } else {
+                                mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, record.pos));
+                            }
+                        }
+                        continue;
+                    }
 
-                // Activate the genesis block so normal node progress can continue
-                if (hash == chainparams.GetConsensus().hashGenesisBlock) {
-                    CValidationState state;
-                    if (!ActivateBestChain(state, chainparams)) {
-                        break;
+                    // process in case the block isn't known yet
+                    if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+                        LOCK(cs_main);
+                        CValidationState state;
+                        if (g_chainstate.AcceptBlock(pblock, state, chainparams, nullptr, true, pos, nullptr))
+                            nLoaded++;
+                        if (state.IsError()) {
+                            fError = true;
+                            break;
+                        }
+                    } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+                        LogPrint(BCLog::REINDEX, "Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
                     }
-                }
 
-                NotifyHeaderTip();
-
-                // Recursively process earlier encountered successors of this block
-                std::deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        std::shared_ptr<CBlock> pblockrecursive = std::make_shared<CBlock>();
-                        if (ReadBlockFromDisk(*pblockrecursive, it->second, chainparams.GetConsensus()))
-                        {
+                    // Activate the genesis block so normal node progress can continue
+                    if (hash == chainparams.GetConsensus().hashGenesisBlock) {
+                        CValidationState state;
+                        if (!ActivateBestChain(state, chainparams)) {
+                            fError = true;
+                            break;
+                        }
+                    }
+
+                    NotifyHeaderTip();
+
+                    // Recursively process earlier encountered successors of this block
+                    std::deque<uint256> queue;
+                    queue.push_back(hash);
+                    while (!queue.empty()) {
+                        uint256 head = queue.front();
+                        queue.pop_front();
+                        // Successors still in memory were checked already and need not be read again
+                        auto rangeBuffered = mapBlocksUnknownParentBuffered.equal_range(head);
+                        while (rangeBuffered.first != rangeBuffered.second) {
+                            auto it = rangeBuffered.first;
+                            std::shared_ptr<CBlock> pblockrecursive = it->second.block;
                             LogPrint(BCLog::REINDEX, "%s: Processing out of order child %s of %s\n", __func__, pblockrecursive->GetHash().ToString(),
                                     head.ToString());
-                            LOCK(cs_main);
-                            CValidationState dummy;
-                            if (g_chainstate.AcceptBlock(pblockrecursive, dummy, chainparams, nullptr, true, &it->second, nullptr))
                             {
-                                nLoaded++;
-                                queue.push_back(pblockrecursive->GetHash());
+                                LOCK(cs_main);
+                                CValidationState dummy;
+                                if (g_chainstate.AcceptBlock(pblockrecursive, dummy, chainparams, nullptr, true, &it->second.pos, nullptr))
+                                {
+                                    nLoaded++;
+                                    queue.push_back(pblockrecursive->GetHash());
+                                }
+                            }
+                            rangeBuffered.first++;
+                            nBufferedBytes -= it->second.nSize;
+                            mapBlocksUnknownParentBuffered.erase(it);
+                            NotifyHeaderTip();
+                        }
+                        std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+                        while (range.first != range.second) {
+                            std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+                            std::shared_ptr<CBlock> pblockrecursive = std::make_shared<CBlock>();
+                            if (ReadBlockFromDisk(*pblockrecursive, it->second, chainparams.GetConsensus()))
+                            {
+                                LogPrint(BCLog::REINDEX, "%s: Processing out of order child %s of %s\n", __func__, pblockrecursive->GetHash().ToString(),
+                                        head.ToString());
+                                LOCK(cs_main);
+                                CValidationState dummy;
+                                if (g_chainstate.AcceptBlock(pblockrecursive, dummy, chainparams, nullptr, true, &it->second, nullptr))
+                                {
+                                    nLoaded++;
+                                    queue.push_back(pblockrecursive->GetHash());
+                                }
                             }
+                            range.first++;
+                            mapBlocksUnknownParent.erase(it);
+                            NotifyHeaderTip();
                         }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                        NotifyHeaderTip();
                     }
+                } catch (const std::exception& e) {
+                    LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
                 }
-            } catch (const std::exception& e) {
-                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
             }
         }
     } catch (const std::runtime_error& e) {
         AbortNode(std::string("System error: ") + e.what());
     }
+    // The parents of the blocks still in memory may be in a later file
+    for (const auto& item : mapBlocksUnknownParentBuffered) {
+        mapBlocksUnknownParent.insert(std::make_pair(item.first, item.second.pos));
+    }
     if (nLoaded > 0)
         LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
     return nLoaded > 0;
@@ -4727,6 +6149,8 @@ int VersionBitsTipStateSinceHeight(const Consensus::Params& params, Consensus::D
 }
 
 static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+//! Transactions from mempool.dat that are accepted together, with their scripts verified in parallel
+static const size_t MEMPOOL_LOAD_BATCH_SIZE = 1000;
 
 bool LoadMempool(void)
 {
@@ -4753,39 +6177,52 @@ bool LoadMempool(void)
         }
         uint64_t num;
         file >> num;
-        while (num--) {
+        // The transactions were dumped parents first, so a batch only
+        // spends outputs of the chain, the batches before it and itself.
+        std::vector<CTransactionRef> vBatch;
+        std::vector<int64_t> vBatchTime;
+        while (num) {
             CTransactionRef tx;
             int64_t nTime;
             int64_t nFeeDelta;
             file >> tx;
             file >> nTime;
             file >> nFeeDelta;
+            --num;
 
             CAmount amountdelta = nFeeDelta;
             if (amountdelta) {
                 mempool.PrioritiseTransaction(tx->GetHash(), amountdelta);
             }
-            CValidationState state;
             if (nTime + nExpiryTimeout > nNow) {
-                LOCK(cs_main);
-                AcceptToMemoryPoolWithTime(chainparams, mempool, state, tx, nullptr /* pfMissingInputs */, nTime,
-                                           nullptr /* plTxnReplaced */, false /* bypass_limits */, 0 /* nAbsurdFee */);
-                if (state.IsValid()) {
+                vBatch.push_back(std::move(tx));
+                vBatchTime.push_back(nTime);
+            } else {
+                ++expired;
+            }
+            if (vBatch.size() < MEMPOOL_LOAD_BATCH_SIZE && num > 0)
+                continue;
+
+            std::vector<CValidationState> states;
+            std::vector<bool> vAccepted, vMissingInputs;
+            AcceptToMemoryPoolBatchWithTime(chainparams, mempool, vBatch, vBatchTime, states, vAccepted, vMissingInputs, 0 /* nAbsurdFee */, false /* bypass_limits */);
+            for (size_t i = 0; i < vBatch.size(); i++) {
+                if (vAccepted[i]) {
                     ++count;
                 } else {
                     // mempool may contain the transaction already, e.g. from
                     // wallet(s) having loaded it while we were processing
                     // mempool transactions; consider these as valid, instead of
                     // failed, but mark them as 'already there'
-                    if (mempool.exists(tx->GetHash())) {
+                    if (mempool.exists(vBatch[i]->GetHash())) {
                         ++already_there;
                     } else {
                         ++failed;
                     }
                 }
-            } else {
-                ++expired;
             }
+            vBatch.clear();
+            vBatchTime.clear();
             if (ShutdownRequested())
                 return false;
         }
@@ -4816,6 +6253,8 @@ bool DumpMempool(void)
         for (const auto &i : mempool.mapDeltas) {
             mapDeltas[i.first] = i.second;
         }
+        // Sorted by ancestor count, so parents come before their children,
+        // which LoadMempool relies on to accept them in batches.
         vinfo = mempool.infoAll();
     }
 
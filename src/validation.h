@@ -11,10 +11,12 @@
 #endif
 
 #include <amount.h>
+#include <arith_uint256.h>
 #include <coins.h>
 #include <fs.h>
 #include <protocol.h> // For CMessageHeader::MessageStartChars
 #include <policy/feerate.h>
+#include <primitives/pureheader.h>
 #include <script/script_error.h>
 #include <sync.h>
 #include <versionbits.h>
@@ -23,6 +25,7 @@
 #include <exception>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <stdint.h>
 #include <string>
@@ -33,10 +36,12 @@
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CBlockUndo;
 class CChainParams;
 class CCoinsViewDB;
 class CInv;
 class CConnman;
+class CMappedSpan;
 class CScriptCheck;
 class CBlockPolicyEstimator;
 class CTxMemPool;
@@ -66,6 +71,8 @@ static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
 static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
 /** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
 static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -limitclustercount, max number of transactions in a cluster of connected in-mempool transactions */
+static const unsigned int DEFAULT_CLUSTER_LIMIT = 100;
 /** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
 static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 336;
 /** Maximum kilobytes for transactions to store for processing during reorg */
@@ -76,11 +83,19 @@ static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** Number of block and undo file mappings kept open for reading */
+static const unsigned int MAX_BLOCKFILE_MAPPINGS = 16;
 
 /** Maximum number of script-checking threads allowed */
-static const int MAX_SCRIPTCHECK_THREADS = 16;
+static const int MAX_SCRIPTCHECK_THREADS = 256;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Maximum number of threads doing context-free block and header checks */
+static const int MAX_BLOCKCHECK_THREADS = 4;
+/** Default for -pipelinescriptchecks */
+static const bool DEFAULT_PIPELINE_SCRIPT_CHECKS = true;
+/** Time in microseconds after which no more blocks are added to a pipelined run, bounding how long it holds cs_main */
+static const int64_t MAX_PIPELINE_CONNECT_TIME = 500 * 1000;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -156,6 +171,7 @@ static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 8;
 static const int MAX_UNCONNECTING_HEADERS = 10;
 
 static const bool DEFAULT_PEERBLOOMFILTERS = true;
+static const bool DEFAULT_PEERBLOCKFILTERS = false;
 
 /** Default for -stopatheight */
 static const int DEFAULT_STOPATHEIGHT = 0;
@@ -167,12 +183,19 @@ struct BlockHasher
 
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
+/**
+ * Taken after cs_main by code that adds entries to mapBlockIndex, sets a
+ * block's nTx or moves chainActive's tip. Holding it without cs_main is
+ * enough to look blocks up in mapBlockIndex and chainActive and to read their
+ * header fields, nChainWork and nTx, and it is not held while blocks connect.
+ */
+extern CCriticalSection cs_blockindex;
 extern CBlockPolicyEstimator feeEstimator;
 extern CTxMemPool mempool;
 typedef std::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
 extern BlockMap& mapBlockIndex;
-extern uint64_t nLastBlockTx;
-extern uint64_t nLastBlockWeight;
+extern std::atomic<uint64_t> nLastBlockTx;
+extern std::atomic<uint64_t> nLastBlockWeight;
 extern const std::string strMessageMagic;
 extern CWaitableCriticalSection csBestBlock;
 extern CConditionVariable cvBlockChange;
@@ -180,7 +203,9 @@ extern uint256 hashBestBlock;
 extern std::atomic_bool fImporting;
 extern std::atomic_bool fReindex;
 extern int nScriptCheckThreads;
-extern bool fTxIndex;
+extern int nBlockCheckThreads;
+/** Whether the script checks of one block may overlap with connecting the next when catching up with a run of blocks */
+extern bool fPipelineScriptChecks;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern bool fCheckBlockIndex;
@@ -202,6 +227,8 @@ extern arith_uint256 nMinimumChainWork;
 
 /** Best header we've seen so far (used for getheaders queries' starting points). */
 extern CBlockIndex *pindexBestHeader;
+/** Height of pindexBestHeader, or -1 if there is none, for reading without cs_main. */
+extern std::atomic<int> nBestHeaderHeight;
 
 /** Minimum disk space required - used in CheckDiskSpace() */
 static const uint64_t nMinDiskSpace = 52428800;
@@ -284,6 +311,8 @@ bool LoadChainTip(const CChainParams& chainparams);
 void UnloadBlockIndex();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the block checking thread */
+void ThreadBlockCheck();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
@@ -291,6 +320,10 @@ bool GetTransaction(const uint256& hash, CTransactionRef& tx, const Consensus::P
 /** Find the best known block, and make it the tip of the block chain */
 bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams, std::shared_ptr<const CBlock> pblock = std::shared_ptr<const CBlock>());
 CAmount GetBlockSubsidy(int nHeight, int nBits, const Consensus::Params& consensusParams);
+/** The subsidy of a block at nHeight on top of pindexPrev, rather than on top of chainActive's tip */
+CAmount GetBlockSubsidy(int nHeight, int nBits, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
+/** The subsidy of a block on top of pindexPrev, given the money supply after pindexPrev when its index entry does not have it yet */
+CAmount GetBlockSubsidy(int nHeight, int nBits, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev, CAmount nMoneySupply);
 
 /** Guess verification progress (as a fraction between 0.0=genesis and 1.0=current tip). */
 double GuessVerificationProgress(const ChainTxData& data, const CBlockIndex* pindex);
@@ -298,6 +331,63 @@ double GuessVerificationProgress(const ChainTxData& data, const CBlockIndex* pin
 /** Calculate the amount of disk space the block & undo files currently use */
 uint64_t CalculateCurrentUsage();
 
+/** Number of blocks the network hash rate of a chain tip snapshot is averaged over */
+static const int TIP_SNAPSHOT_HASHPS_BLOCKS = 120;
+
+/**
+ * The state of chainActive's tip, published whenever the tip changes so it can
+ * be read without cs_main. Never changed once published.
+ *
+ * The network hash rate and the statistics of started deployments take a walk
+ * over many blocks each, so they are computed when first asked for rather than
+ * for every block connected, which would slow down IBD.
+ */
+struct CChainTipSnapshot
+{
+    int nHeight;
+    uint256 hashBlock;
+    arith_uint256 nChainWork;
+    int64_t nTime;
+    int64_t nMedianTimePast;
+    CAmount nMoneySupply;
+    double dVerificationProgress;
+    bool fInitialBlockDownload;
+    //! nBits of the last block of each algo, or of the proof of work limit if there is none
+    unsigned int nBitsByAlgo[NUM_ALGOS];
+
+    struct DeploymentState
+    {
+        ThresholdState state;
+        int nSinceHeight;
+    };
+    DeploymentState deployments[Consensus::MAX_VERSION_BITS_DEPLOYMENTS];
+
+    //! The tip. The fields that the statistics read never change once the
+    //! entry is in the index, so it can be used without cs_main. Entries are
+    //! freed by UnloadBlockIndex, which withdraws the published snapshot
+    //! first; a snapshot already taken must not be kept across it.
+    const CBlockIndex* pindex;
+
+    /** Average network hash rate over the last TIP_SNAPSHOT_HASHPS_BLOCKS blocks */
+    double GetNetworkHashPS() const { return GetStatistics().dNetworkHashPS; }
+    /** Statistics of a deployment, only set while it is started */
+    const BIP9Stats& GetDeploymentStats(Consensus::DeploymentPos pos) const { return GetStatistics().deploymentStats[pos]; }
+
+private:
+    struct Statistics
+    {
+        double dNetworkHashPS = 0;
+        BIP9Stats deploymentStats[Consensus::MAX_VERSION_BITS_DEPLOYMENTS];
+    };
+    mutable std::once_flag m_statistics_once;
+    mutable Statistics m_statistics;
+
+    const Statistics& GetStatistics() const;
+};
+
+/** The last published snapshot of chainActive's tip, or nullptr if there is no tip yet */
+std::shared_ptr<const CChainTipSnapshot> GetChainTipSnapshot();
+
 /**
  *  Mark one block file as pruned.
  */
@@ -321,11 +411,21 @@ void PruneAndFlush();
 void PruneBlockFilesManual(int nManualPruneHeight);
 
 /** (try to) add transaction to memory pool
- * plTxnReplaced will be appended to with all transactions replaced from mempool **/
+ * plTxnReplaced will be appended to with all transactions replaced from mempool
+ * Takes cs_main itself; a caller that does not hold it lets other threads use
+ * the chainstate and the mempool while the transaction's scripts are verified. **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransactionRef &tx,
                         bool* pfMissingInputs, std::list<CTransactionRef>* plTxnReplaced,
                         bool bypass_limits, const CAmount nAbsurdFee);
 
+/** (try to) add a batch of transactions to memory pool, parents before their
+ * children in whatever order they are given. The scripts of transactions that
+ * don't spend each other's outputs are verified in parallel. Fills in, for
+ * every transaction, its state, whether it was accepted and whether it had
+ * missing inputs. **/
+void AcceptToMemoryPoolBatch(CTxMemPool& pool, const std::vector<CTransactionRef>& txs, std::vector<CValidationState>& states,
+                             std::vector<bool>& vAccepted, std::vector<bool>& vMissingInputs, const CAmount nAbsurdFee);
+
 /** Convert CValidationState to a human-readable message for logging */
 std::string FormatStateMessage(const CValidationState &state);
 
@@ -414,6 +514,17 @@ void InitScriptExecutionCache();
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
 bool ReadBlockHeaderFromDisk(CBlockHeader& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex* pindex);
+/**
+ * Get the serialized bytes of a block straight from a mapping of its block
+ * file, for relaying it without deserializing and reserializing it. They are
+ * the block's serialization with witness data, and their header is checked
+ * against pindex like ReadBlockFromDisk does. Returns false if the block file
+ * cannot be mapped or the check fails; callers then use ReadBlockFromDisk.
+ */
+bool ReadRawBlockFromDisk(CMappedSpan& block_data, const CBlockIndex* pindex);
+/** ReadRawBlockFromDisk for a position copied under cs_main, checked against the hash of the block */
+bool ReadRawBlockFromDisk(CMappedSpan& block_data, const CDiskBlockPos& pos, const uint256& hash);
 
 /** Functions for validating blocks and updating the block tree */
 